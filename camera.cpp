@@ -0,0 +1,217 @@
+#include <math.h>
+#include <algorithm>
+#include "camera.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+CameraFrame makeCameraFrame(const Camera &camera, unsigned int width, unsigned int height)
+{
+    CameraFrame frame;
+    frame.origin = camera.position;
+    frame.widthScale = (float)(width - 1);
+    frame.heightScale = (float)(height - 1);
+
+    if (camera.type == CAMERA_PINHOLE)
+    {
+        Vector3 position = camera.position;
+        Vector3 target = camera.target;
+        Vector3 up = camera.up;
+        Vector3 forward = (target - position).normalize();
+        Vector3 right = up.cross(forward).normalize();
+        Vector3 trueUp = forward.cross(right);
+        float halfHeight = tanf(camera.fov * (float)M_PI / 360.f);
+        float halfWidth = halfHeight * (float)width / (float)height;
+        frame.center = forward;
+        frame.axisX = halfWidth * right;
+        frame.axisY = halfHeight * trueUp;
+        frame.pixelSize = 2.f * halfWidth / frame.widthScale;
+    }
+    else
+    {
+        // スクリーンはz=0の平面上の[-1,1]×[-1,1]
+        frame.center = Vector3(-camera.position.x, -camera.position.y, -camera.position.z);
+        frame.axisX = Vector3(1, 0, 0);
+        frame.axisY = Vector3(0, 1, 0);
+        frame.pixelSize = 2.f / frame.widthScale;
+    }
+    return frame;
+}
+
+// スクリーン座標(x,y)への方向
+static inline Vector3 frameDirection(const CameraFrame &frame, float x, float y)
+{
+    float lx = 2 * x / frame.widthScale - 1.f;
+    float ly = -2 * y / frame.heightScale + 1.f;
+    return Vector3(
+        lx * frame.axisX.x + (ly * frame.axisY.x + frame.center.x),
+        lx * frame.axisX.y + (ly * frame.axisY.y + frame.center.y),
+        lx * frame.axisX.z + (ly * frame.axisY.z + frame.center.z));
+}
+
+// 方向からRayを作る
+static inline void setRay(const CameraFrame &frame, Vector3 direction, Ray *ray)
+{
+    *ray = Ray();
+    ray->startPoint = frame.origin;
+    ray->direction = direction;
+    // スクリーン上の1ピクセルの大きさを視点からの距離で割る
+    ray->spread = frame.pixelSize / direction.magnitude();
+}
+
+Ray cameraFrameRay(const CameraFrame &frame, float x, float y)
+{
+    Ray ray;
+    setRay(frame, frameDirection(frame, x, y), &ray);
+    return ray;
+}
+
+void generateRays(const CameraFrame &frame, const float *x, const float *y, size_t count, Ray *rays)
+{
+    size_t k = 0;
+#ifdef __SSE2__
+    const __m128 two = _mm_set1_ps(2.f);
+    const __m128 minusTwo = _mm_set1_ps(-2.f);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 widthScale = _mm_set1_ps(frame.widthScale);
+    const __m128 heightScale = _mm_set1_ps(frame.heightScale);
+    const __m128 axisX[3] = {
+        _mm_set1_ps(frame.axisX.x), _mm_set1_ps(frame.axisX.y), _mm_set1_ps(frame.axisX.z)};
+    const __m128 axisY[3] = {
+        _mm_set1_ps(frame.axisY.x), _mm_set1_ps(frame.axisY.y), _mm_set1_ps(frame.axisY.z)};
+    const __m128 center[3] = {
+        _mm_set1_ps(frame.center.x), _mm_set1_ps(frame.center.y), _mm_set1_ps(frame.center.z)};
+    for (; k + 4 <= count; k += 4)
+    {
+        // frameDirectionと同じ順序で計算する
+        __m128 lx = _mm_sub_ps(_mm_div_ps(_mm_mul_ps(two, _mm_loadu_ps(x + k)), widthScale), one);
+        __m128 ly =
+            _mm_add_ps(_mm_div_ps(_mm_mul_ps(minusTwo, _mm_loadu_ps(y + k)), heightScale), one);
+        float direction[3][4];
+        for (int c = 0; c < 3; c++)
+            _mm_storeu_ps(
+                direction[c],
+                _mm_add_ps(
+                    _mm_mul_ps(lx, axisX[c]),
+                    _mm_add_ps(_mm_mul_ps(ly, axisY[c]), center[c])));
+        for (int i = 0; i < 4; i++)
+            setRay(
+                frame, Vector3(direction[0][i], direction[1][i], direction[2][i]), &rays[k + i]);
+    }
+#endif
+    for (; k < count; k++)
+        setRay(frame, frameDirection(frame, x[k], y[k]), &rays[k]);
+}
+
+// generatePixelCenterRaysで1回にgenerateRaysへ渡す画素数
+#define PIXEL_CENTER_RAY_BATCH 64
+
+void generatePixelCenterRays(
+    const CameraFrame &frame, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    Ray *rays)
+{
+    // 行をPIXEL_CENTER_RAY_BATCH画素ずつに分けてgenerateRaysに渡す(ヒープは使わない)
+    float px[PIXEL_CENTER_RAY_BATCH], py[PIXEL_CENTER_RAY_BATCH];
+    for (unsigned int j = 0; j < h; j++)
+    {
+        for (unsigned int i0 = 0; i0 < w; i0 += PIXEL_CENTER_RAY_BATCH)
+        {
+            unsigned int count = std::min(w - i0, (unsigned int)PIXEL_CENTER_RAY_BATCH);
+            for (unsigned int k = 0; k < count; k++)
+            {
+                px[k] = float(x + i0 + k) + 0.5f;
+                py[k] = float(y + j) + 0.5f;
+            }
+            generateRays(frame, px, py, count, rays + (size_t)j * w + i0);
+        }
+    }
+}
+
+bool projectToScreen(const CameraFrame &frame, Vector3 p, float *x, float *y)
+{
+    // (p-origin) = t*(lx*axisX + ly*axisY + center)を解く
+    // 行列(axisX axisY center)の逆行列の各行は外積で求まる
+    Vector3 a = frame.axisX, b = frame.axisY, c = frame.center;
+    Vector3 rowX = b.cross(c);
+    Vector3 rowY = c.cross(a);
+    Vector3 rowT = a.cross(b);
+    float det = a.dot(rowX);
+    if (det == 0.f)
+        return false;
+    Vector3 d = p - frame.origin;
+    float t = d.dot(rowT) / det;
+    if (!(t > 0.f))
+        return false;
+    float lx = d.dot(rowX) / det / t;
+    float ly = d.dot(rowY) / det / t;
+    // frameDirectionの逆変換
+    *x = (lx + 1.f) * frame.widthScale / 2.f;
+    *y = (1.f - ly) * frame.heightScale / 2.f;
+    return true;
+}
+
+void makeStereoCameras(const Camera &center, float eyeSeparation, Camera *left, Camera *right)
+{
+    Vector3 offset(eyeSeparation / 2.f, 0, 0);
+    if (center.type == CAMERA_PINHOLE)
+    {
+        // カメラの右方向にずらす(大きさは画像サイズによらない)
+        CameraFrame frame = makeCameraFrame(center, 2, 2);
+        offset = (eyeSeparation / 2.f) * frame.axisX.normalize();
+    }
+    *left = center;
+    *right = center;
+    left->position = left->position - offset;
+    right->position = right->position + offset;
+    if (center.type == CAMERA_PINHOLE)
+    {
+        left->target = left->target - offset;
+        right->target = right->target + offset;
+    }
+}
+
+void makeCubeMapCameras(Vector3 position, Camera cameras[6])
+{
+    const Vector3 directions[6] = {
+        Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0),
+        Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1)};
+    const Vector3 ups[6] = {
+        Vector3(0, 1, 0), Vector3(0, 1, 0), Vector3(0, 0, -1),
+        Vector3(0, 0, 1), Vector3(0, 1, 0), Vector3(0, 1, 0)};
+    for (int face = 0; face < 6; face++)
+    {
+        cameras[face] = Camera();
+        cameras[face].type = CAMERA_PINHOLE;
+        cameras[face].position = position;
+        cameras[face].target = position + directions[face];
+        cameras[face].up = ups[face];
+        cameras[face].fov = 90.f;
+    }
+}
+
+void makeCameraArray(
+    const Camera &center, unsigned int columns, unsigned int rows, float spacing, Camera *cameras)
+{
+    Vector3 right(1, 0, 0), up(0, 1, 0);
+    if (center.type == CAMERA_PINHOLE)
+    {
+        CameraFrame frame = makeCameraFrame(center, 2, 2);
+        right = frame.axisX.normalize();
+        up = frame.axisY.normalize();
+    }
+    for (unsigned int r = 0; r < rows; r++)
+    {
+        for (unsigned int c = 0; c < columns; c++)
+        {
+            // 中心からのずれ(上の行から並べる)
+            float dx = ((float)c - (float)(columns - 1) / 2.f) * spacing;
+            float dy = ((float)(rows - 1) / 2.f - (float)r) * spacing;
+            Vector3 offset = dx * right + dy * up;
+            Camera *camera = &cameras[r * columns + c];
+            *camera = center;
+            camera->position = camera->position + offset;
+            if (center.type == CAMERA_PINHOLE)
+                camera->target = camera->target + offset;
+        }
+    }
+}
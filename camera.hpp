@@ -0,0 +1,50 @@
+/* カメラの基底の前計算と1次レイのまとめての生成 */
+#pragma once
+#include "raytracing_lib.hpp"
+
+// 画像サイズを決めたカメラの基底
+// スクリーン座標(x,y)の1次レイの方向は
+//   lx = 2x/(width-1) - 1, ly = -2y/(height-1) + 1
+//   direction = lx*axisX + (ly*axisY + center)
+// (CAMERA_SCREEN_PLANEではscreenToWorld(x,y) - positionと同じ値になる)
+struct CameraFrame
+{
+    Vector3 origin;    // 視点
+    Vector3 center;    // 視点からスクリーンの中心へのベクトル
+    Vector3 axisX;     // スクリーンの右半分の幅(lx=1の方向)
+    Vector3 axisY;     // スクリーンの上半分の高さ(ly=1の方向)
+    float widthScale;  // width-1
+    float heightScale; // height-1
+    float pixelSize;   // スクリーン上の1ピクセルの大きさ(centerの長さ1あたり)
+};
+
+// カメラの基底を求める
+CameraFrame makeCameraFrame(const Camera &camera, unsigned int width, unsigned int height);
+
+// 基底からスクリーン座標(x,y)へのRayを生成する(createRayと同じ値)
+Ray cameraFrameRay(const CameraFrame &frame, float x, float y);
+
+// スクリーン座標(x[k],y[k])へのRayをcount本まとめて生成する
+// 方向はSSEで4本ずつ求める(結果はcameraFrameRayと同じ)
+void generateRays(const CameraFrame &frame, const float *x, const float *y, size_t count, Ray *rays);
+
+// 画素の中心(x+i+0.5, y+j+0.5)へのRayをw×h本生成する(rays[j*w+i])
+// 行ごとにgenerateRaysでまとめて生成する
+void generatePixelCenterRays(
+    const CameraFrame &frame, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    Ray *rays);
+
+// スクリーン座標を求める(点が視点の後ろならfalse)
+bool projectToScreen(const CameraFrame &frame, Vector3 p, float *x, float *y);
+
+// ステレオペア: 視点を左右にeyeSeparation/2ずつずらす
+// CAMERA_SCREEN_PLANEではスクリーンを共有するのでスクリーン(z=0)で視差が0になる
+// CAMERA_PINHOLEでは注視点も同じだけずらして平行に並べる
+void makeStereoCameras(const Camera &center, float eyeSeparation, Camera *left, Camera *right);
+
+// キューブマップ: positionから+x,-x,+y,-y,+z,-zを画角90度で見る6台(正方形の画像で使う)
+void makeCubeMapCameras(Vector3 position, Camera cameras[6]);
+
+// カメラアレイ: centerを中心に右・上方向へspacing間隔でcolumns×rows台並べる(cameras[r*columns+c])
+void makeCameraArray(
+    const Camera &center, unsigned int columns, unsigned int rows, float spacing, Camera *cameras);
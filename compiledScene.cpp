@@ -0,0 +1,604 @@
+#include "compiledScene.hpp"
+#include "lightCache.hpp"
+#include "lightTree.hpp"
+#include "uniformGrid.hpp"
+
+// 展開したシーンのおおよそのバイト数(構築後は配列の大きさが変わらない)
+static size_t compiledSceneBytes(CompiledScene *compiled)
+{
+    return sizeof(CompiledScene) +
+           compiled->shapes.capacity() * sizeof(CompiledShape) +
+           compiled->spheres.capacity() * sizeof(CompiledSphere) +
+           compiled->planes.capacity() * sizeof(CompiledPlane) +
+           compiled->otherShapes.capacity() * sizeof(int) +
+           compiled->pointLights.capacity() * sizeof(CompiledPointLight) +
+           compiled->directionalLights.capacity() * sizeof(CompiledDirectionalLight) +
+           compiled->otherLights.capacity() * sizeof(int) +
+           compiled->pointLightSlots.capacity() * sizeof(int);
+}
+
+CompiledScene *compileScene(Scene *scene)
+{
+    CompiledScene *compiled = new CompiledScene();
+    compiled->scene = scene;
+
+    // ジオメトリを種類ごとに分け，マテリアルのフラグからカーネルを決める
+    for (int idx = 0; idx < scene->geometryNum; idx++)
+    {
+        Shape *shape = scene->geometry[idx];
+        CompiledShape info;
+        info.shape = shape;
+
+        Sphere *sphere = dynamic_cast<Sphere *>(shape);
+        Plane *plane = dynamic_cast<Plane *>(shape);
+        if (sphere != nullptr)
+        {
+            info.type = COMPILED_SPHERE;
+            info.slot = (int)compiled->spheres.size();
+            compiled->spheres.push_back({sphere->center, sphere->radius, idx});
+        }
+        else if (plane != nullptr)
+        {
+            info.type = COMPILED_PLANE;
+            info.slot = (int)compiled->planes.size();
+            compiled->planes.push_back({plane->normal, plane->position, idx});
+        }
+        else
+        {
+            info.type = COMPILED_OTHER;
+            info.slot = (int)compiled->otherShapes.size();
+            compiled->otherShapes.push_back(idx);
+        }
+
+        bool useReflection = shape->material.useReflection;
+        bool useRefraction = shape->material.useRefraction;
+        if (useReflection && useRefraction)
+            info.kernel = KERNEL_REFLECT_REFRACT;
+        else if (useReflection)
+            info.kernel = KERNEL_REFLECT;
+        else if (useRefraction)
+            info.kernel = KERNEL_REFRACT;
+        else
+            info.kernel = KERNEL_DIFFUSE;
+        info.textured = shape->material.diffuseTexture != nullptr;
+
+        compiled->shapes.push_back(info);
+    }
+
+    // 光源を種類ごとに分ける
+    compiled->pointLightSlots.assign(scene->lightNum, -1);
+    for (int idx = 0; idx < scene->lightNum; idx++)
+    {
+        PointLight *point = dynamic_cast<PointLight *>(scene->light[idx]);
+        DirectionalLight *directional = dynamic_cast<DirectionalLight *>(scene->light[idx]);
+        if (point != nullptr)
+        {
+            compiled->pointLightSlots[idx] = (int)compiled->pointLights.size();
+            compiled->pointLights.push_back({point->position, point->intensity, idx});
+        }
+        else if (directional != nullptr)
+        {
+            // 光源方向はどの交点でも同じなので先に計算しておく
+            Vector3 toLight = ((-1) * directional->direction).normalize();
+            compiled->directionalLights.push_back({toLight, directional->intensity, idx});
+        }
+        else
+        {
+            compiled->otherLights.push_back(idx);
+        }
+    }
+
+    recordMemoryAllocation(MEMORY_SCENE, compiledSceneBytes(compiled));
+    return compiled;
+}
+
+void freeCompiledScene(CompiledScene *compiled)
+{
+    recordMemoryRelease(MEMORY_SCENE, compiledSceneBytes(compiled));
+    if (compiled->grid != nullptr)
+        freeUniformGrid(compiled->grid);
+    delete compiled;
+}
+
+void copyCompiledScene(Scene *scene, CompiledScene *compiled)
+{
+    if (scene->compiledScene == nullptr)
+        return;
+    *compiled = *scene->compiledScene;
+    compiled->scene = scene;
+    scene->compiledScene = compiled;
+}
+
+// 球とレイの交点(Sphere::isIntersectionRayと同じ計算をメモリ確保なしで行う)
+static inline bool intersectSphere(CompiledSphere *sphere, Ray *ray, Vector3 *position)
+{
+    float a = ray->direction.dot(ray->direction);
+    float b = 2 * ray->direction.dot(ray->startPoint - sphere->center);
+    Vector3 tmp = ray->startPoint - sphere->center;
+    float c = tmp.dot(tmp) - myPow(sphere->radius, 2);
+
+    float d = calcDiscriminant(a, b, c);
+    if (d < 0)
+        return false;
+
+    float t1 = calcQuadraticFormula(a, b, c, FIRST_SOLUTION);
+    float t2 = calcQuadraticFormula(a, b, c, SECOND_SOLUTION);
+    if (!(t1 > 0 || t2 > 0))
+        return false;
+
+    *position = (t1 < t2) ? ray->startPoint + t1 * ray->direction
+                          : ray->startPoint + t2 * ray->direction;
+    return true;
+}
+
+// 平面とレイの交点(Plane::isIntersectionRayと同じ計算)
+static inline bool intersectPlane(CompiledPlane *plane, Ray *ray, Vector3 *position)
+{
+    float dn = ray->direction.dot(plane->normal);
+    if (dn == 0)
+        return false;
+
+    float t = (plane->position - ray->startPoint).dot(plane->normal) / dn;
+    if (!(t > 0))
+        return false;
+
+    *position = ray->startPoint + t * ray->direction;
+    return true;
+}
+
+// 球・平面以外のジオメトリとレイの交点
+static bool intersectOther(Shape *shape, Ray *ray, Vector3 *position, Vector3 *normal)
+{
+    IntersectionPoint *point = shape->isIntersectionRay(ray);
+    if (point == nullptr)
+        return false;
+    *position = point->position;
+    *normal = point->normal;
+    delete point;
+    return true;
+}
+
+// 交点候補が今までの最近点より近いか(同じ距離ならジオメトリ番号が小さい方)
+// intersectionWithAllをジオメトリ順に回した場合と同じ交点を選ぶ
+static inline bool isCloser(float distance, int shapeIndex, float minDistance, int minIndex)
+{
+    return distance < minDistance || (distance == minDistance && shapeIndex < minIndex);
+}
+
+// 球1つを最近点の候補として試す
+static inline void closestSphere(
+    CompiledSphere *sphere, Ray *ray, float *minDistance, int *minIndex, Vector3 *minPosition)
+{
+    Vector3 position;
+    if (!intersectSphere(sphere, ray, &position))
+        return;
+    float distance = (position - ray->startPoint).magnitude();
+    if (isCloser(distance, sphere->shapeIndex, *minDistance, *minIndex))
+    {
+        *minDistance = distance;
+        *minIndex = sphere->shapeIndex;
+        *minPosition = position;
+    }
+}
+
+// 格子を使って最も近い球を求める
+// 交点はその点を含むセルで必ず見つかるので，セルを出る距離より近い交点が見つかれば打ち切る
+// (始点を含む球はt<0側の交点を返すことがあるが，始点のセルに登録されているので最初に試す)
+static void gridClosestSphere(
+    CompiledScene *compiled, Ray *ray, float *minDistance, int *minIndex, Vector3 *minPosition)
+{
+    UniformGrid *grid = compiled->grid;
+    for (int slot : grid->largeSpheres)
+        closestSphere(&compiled->spheres[slot], ray, minDistance, minIndex, minPosition);
+
+    UniformGridWalk walk;
+    if (!beginUniformGridWalk(grid, ray, &walk))
+        return;
+    const int *items;
+    uint32_t count;
+    float entryDistance, exitDistance;
+    while (nextUniformGridCell(grid, &walk, &items, &count, &entryDistance, &exitDistance))
+    {
+        for (uint32_t k = 0; k < count; k++)
+            closestSphere(&compiled->spheres[items[k]], ray, minDistance, minIndex, minPosition);
+        // セル境界の丸め誤差の分だけ余裕を持たせる
+        if (*minDistance < exitDistance * (1.f - 1e-4f))
+            break;
+    }
+}
+
+bool compiledClosestHit(
+    CompiledScene *compiled, Ray *ray, IntersectionPoint *point, int *shapeIndex)
+{
+    float minDistance = FLT_MAX;
+    int minIndex = -1;
+    Vector3 position;
+    Vector3 otherNormal;
+
+    if (compiled->grid != nullptr)
+        gridClosestSphere(compiled, ray, &minDistance, &minIndex, &point->position);
+    else
+    {
+        for (auto &sphere : compiled->spheres)
+            closestSphere(&sphere, ray, &minDistance, &minIndex, &point->position);
+    }
+    for (auto &plane : compiled->planes)
+    {
+        if (!intersectPlane(&plane, ray, &position))
+            continue;
+        float distance = (position - ray->startPoint).magnitude();
+        if (isCloser(distance, plane.shapeIndex, minDistance, minIndex))
+        {
+            minDistance = distance;
+            minIndex = plane.shapeIndex;
+            point->position = position;
+        }
+    }
+    for (int idx : compiled->otherShapes)
+    {
+        Vector3 normal;
+        if (!intersectOther(compiled->scene->geometry[idx], ray, &position, &normal))
+            continue;
+        float distance = (position - ray->startPoint).magnitude();
+        if (isCloser(distance, idx, minDistance, minIndex))
+        {
+            minDistance = distance;
+            minIndex = idx;
+            point->position = position;
+            otherNormal = normal;
+        }
+    }
+
+    if (minIndex == -1)
+        return false;
+
+    // 法線は最も近い交点だけで計算する
+    point->normal = compiledShapeNormal(compiled, minIndex, point->position, otherNormal);
+    *shapeIndex = minIndex;
+    return true;
+}
+
+bool compiledIntersectShape(
+    CompiledScene *compiled, int shapeIndex, Ray *ray, Vector3 *position, Vector3 *otherNormal)
+{
+    CompiledShape *shape = &compiled->shapes[shapeIndex];
+    if (shape->type == COMPILED_SPHERE)
+        return intersectSphere(&compiled->spheres[shape->slot], ray, position);
+    if (shape->type == COMPILED_PLANE)
+        return intersectPlane(&compiled->planes[shape->slot], ray, position);
+    return intersectOther(shape->shape, ray, position, otherNormal);
+}
+
+Vector3 compiledShapeNormal(
+    CompiledScene *compiled, int shapeIndex, Vector3 position, Vector3 otherNormal)
+{
+    CompiledShape *shape = &compiled->shapes[shapeIndex];
+    if (shape->type == COMPILED_SPHERE)
+        return (position - compiled->spheres[shape->slot].center).normalize();
+    if (shape->type == COMPILED_PLANE)
+        return compiled->planes[shape->slot].normal;
+    return otherNormal;
+}
+
+// ジオメトリidxが始点からmaxDistance以内でレイを遮るか
+static inline bool occludedBy(CompiledScene *compiled, int idx, Ray *ray, float maxDistance)
+{
+    CompiledShape *shape = &compiled->shapes[idx];
+    Vector3 position;
+    Vector3 normal;
+    bool found;
+    if (shape->type == COMPILED_SPHERE)
+        found = intersectSphere(&compiled->spheres[shape->slot], ray, &position);
+    else if (shape->type == COMPILED_PLANE)
+        found = intersectPlane(&compiled->planes[shape->slot], ray, &position);
+    else
+        found = intersectOther(shape->shape, ray, &position, &normal);
+    return found && (position - ray->startPoint).magnitude() <= maxDistance;
+}
+
+// 格子を使ってmaxDistance以内でレイを遮る球を探す(なければ-1)
+// 始点に近いセルから順に試し，セルに入る距離がmaxDistanceを超えたら打ち切る
+static int gridOccludingSphere(CompiledScene *compiled, Ray *ray, float maxDistance)
+{
+    UniformGrid *grid = compiled->grid;
+    Vector3 position;
+    for (int slot : grid->largeSpheres)
+    {
+        CompiledSphere *sphere = &compiled->spheres[slot];
+        if (intersectSphere(sphere, ray, &position) &&
+            (position - ray->startPoint).magnitude() <= maxDistance)
+            return sphere->shapeIndex;
+    }
+
+    UniformGridWalk walk;
+    if (!beginUniformGridWalk(grid, ray, &walk))
+        return -1;
+    const int *items;
+    uint32_t count;
+    float entryDistance, exitDistance;
+    while (nextUniformGridCell(grid, &walk, &items, &count, &entryDistance, &exitDistance))
+    {
+        if (entryDistance > maxDistance * (1.f + 1e-4f))
+            break;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            CompiledSphere *sphere = &compiled->spheres[items[k]];
+            if (intersectSphere(sphere, ray, &position) &&
+                (position - ray->startPoint).magnitude() <= maxDistance)
+                return sphere->shapeIndex;
+        }
+    }
+    return -1;
+}
+
+int compiledFindOccluder(CompiledScene *compiled, Ray *ray, float maxDistance)
+{
+    Vector3 position;
+    Vector3 normal;
+    if (compiled->grid != nullptr)
+    {
+        int occluder = gridOccludingSphere(compiled, ray, maxDistance);
+        if (occluder != -1)
+            return occluder;
+    }
+    else
+    {
+        for (auto &sphere : compiled->spheres)
+        {
+            if (intersectSphere(&sphere, ray, &position) &&
+                (position - ray->startPoint).magnitude() <= maxDistance)
+                return sphere.shapeIndex;
+        }
+    }
+    for (auto &plane : compiled->planes)
+    {
+        if (intersectPlane(&plane, ray, &position) &&
+            (position - ray->startPoint).magnitude() <= maxDistance)
+            return plane.shapeIndex;
+    }
+    for (int idx : compiled->otherShapes)
+    {
+        if (intersectOther(compiled->scene->geometry[idx], ray, &position, &normal) &&
+            (position - ray->startPoint).magnitude() <= maxDistance)
+            return idx;
+    }
+    return -1;
+}
+
+// 点光源による照明
+static inline void pointLighting(CompiledPointLight *light, Vector3 p, Lighting *lighting)
+{
+    lighting->distance = (light->position - p).magnitude();
+    lighting->direction = (light->position - p).normalize();
+    lighting->intensity = light->intensity;
+}
+
+// 平行光源による照明
+static inline void directionalLighting(CompiledDirectionalLight *light, Lighting *lighting)
+{
+    lighting->distance = FLT_MAX;
+    lighting->direction = light->toLight;
+    lighting->intensity = light->intensity;
+}
+
+// 1つの光源による直接光(影ならfalseを返す)．directLightingと同じ結果になる
+static bool compiledDirectLighting(
+    CompiledScene *compiled, Ray *ray, IntersectionPoint *point, Material *material,
+    Lighting *lighting, int lightIndex, FColor *luminance)
+{
+    recordLightDependency(lightIndex);
+    Vector3 incident = lighting->direction;
+
+    // シャドウレイ
+    Ray shadowRay;
+    shadowRay.startPoint = point->position + EPSILON * incident.normalize();
+    shadowRay.direction = incident.normalize();
+
+    // 前回この光源を遮った物体を先に試す
+    OccluderCache *cache = threadOccluderCache(compiled->scene);
+    int occluder = cache->occluders[lightIndex];
+    if (occluder != -1)
+    {
+        cache->stats.lookups++;
+        if (occludedBy(compiled, occluder, &shadowRay, lighting->distance))
+        {
+            cache->stats.hits++;
+            recordShapeDependency(occluder);
+            return false;
+        }
+    }
+
+    occluder = compiledFindOccluder(compiled, &shadowRay, lighting->distance);
+    if (occluder != -1)
+    {
+        cache->occluders[lightIndex] = occluder;
+        recordShapeDependency(occluder);
+        return false;
+    }
+
+    *luminance = phongShading(point, ray, lighting, material);
+    return true;
+}
+
+// 直接光を求める(shadowingからキャッシュを除いたものと同じ結果になる)
+static void evaluateCompiledShadowing(
+    CompiledScene *compiled, Ray *ray, IntersectionResult *hit, FColor *luminance)
+{
+    Scene *scene = compiled->scene;
+    IntersectionPoint *point = hit->intersectionPoint;
+
+    // テクスチャがなければマテリアルをコピーせずに使う
+    Material texturedMaterial;
+    Material *material = &hit->shape->material;
+    if (compiled->shapes[hit->shapeIndex].textured)
+    {
+        texturedMaterial = surfaceMaterial(ray, hit);
+        material = &texturedMaterial;
+    }
+
+    Lighting lighting;
+    FColor phong;
+    LightTree *tree = scene->lightTree;
+    bool sampleLights = tree != nullptr && ray->sampler != nullptr && scene->lightSampleNum != 0 &&
+                        tree->pointLightNum > scene->exhaustiveLightNum;
+
+    // 平行光源
+    bool lastLightVisible = false;
+    for (auto &light : compiled->directionalLights)
+    {
+        directionalLighting(&light, &lighting);
+        if (compiledDirectLighting(
+                compiled, ray, point, material, &lighting, light.lightIndex, &phong))
+        {
+            *luminance = *luminance + phong;
+            lastLightVisible |= light.lightIndex == scene->lightNum - 1;
+        }
+    }
+
+    // その他の光源
+    for (int idx : compiled->otherLights)
+    {
+        lighting = scene->light[idx]->lightingAt(point->position);
+        if (compiledDirectLighting(compiled, ray, point, material, &lighting, idx, &phong))
+        {
+            *luminance = *luminance + phong;
+            lastLightVisible |= idx == scene->lightNum - 1;
+        }
+    }
+
+    // 点光源
+    if (sampleLights)
+    {
+        // lightTreeから選んだ光源を選ばれる確率で割って足す
+        recordLightTreeDependency();
+        for (unsigned int s = 0; s < scene->lightSampleNum; s++)
+        {
+            float pdf;
+            int idx = sampleLightTree(tree, point->position, point->normal, ray->sampler, &pdf);
+            if (idx == -1)
+                break;
+
+            CompiledPointLight *light = &compiled->pointLights[compiled->pointLightSlots[idx]];
+            pointLighting(light, point->position, &lighting);
+            if (compiledDirectLighting(compiled, ray, point, material, &lighting, idx, &phong))
+            {
+                float weight = 1.f / (pdf * (float)scene->lightSampleNum);
+                luminance->r += weight * phong.r;
+                luminance->g += weight * phong.g;
+                luminance->b += weight * phong.b;
+            }
+        }
+        *luminance = *luminance + material->ambient * scene->ambientIntensity;
+        return;
+    }
+
+    for (auto &light : compiled->pointLights)
+    {
+        pointLighting(&light, point->position, &lighting);
+        if (compiledDirectLighting(
+                compiled, ray, point, material, &lighting, light.lightIndex, &phong))
+        {
+            *luminance = *luminance + phong;
+            lastLightVisible |= light.lightIndex == scene->lightNum - 1;
+        }
+    }
+
+    // 最後の光源が見えていれば環境光成分を加える
+    if (lastLightVisible)
+        *luminance = *luminance + material->ambient * scene->ambientIntensity;
+}
+
+// 影生成(shadowingと同じ結果になる)
+static void compiledShadowing(
+    CompiledScene *compiled, Ray *ray, IntersectionResult *hit, FColor *luminance)
+{
+    DirectLightCache *cache = compiled->scene->directLightCache;
+    Material *material = &hit->shape->material;
+    if (cache == nullptr || !directLightCacheable(material))
+    {
+        evaluateCompiledShadowing(compiled, ray, hit, luminance);
+        return;
+    }
+
+    recordDirectLightCacheDependency();
+    FColor direct;
+    if (!lookupDirectLight(cache, hit->intersectionPoint, ray, hit->shapeIndex, material, &direct))
+    {
+        evaluateCompiledShadowing(compiled, ray, hit, &direct);
+        insertDirectLight(cache, hit->intersectionPoint, ray, hit->shapeIndex, material, direct);
+    }
+    *luminance = *luminance + direct;
+}
+
+// マテリアルの種類ごとのシェーディング
+template <bool REFLECT, bool REFRACT>
+static FColor shadeKernel(
+    CompiledScene *compiled, Ray *ray, IntersectionResult *hit, unsigned int recursiveLevel)
+{
+    FColor luminance = FColor(0, 0, 0);
+
+    // 完全鏡面反射+屈折の物体ではシャドウイングしない
+    if (!REFLECT || !REFRACT)
+        compiledShadowing(compiled, ray, hit, &luminance);
+    if (REFLECT)
+        reflection(compiled->scene, ray, hit, &luminance, recursiveLevel);
+    if (REFRACT)
+        refraction(compiled->scene, ray, hit, &luminance, recursiveLevel);
+
+    return luminance;
+}
+
+FColor compiledShade(
+    CompiledScene *compiled, Ray *ray, IntersectionPoint *point, int shapeIndex,
+    unsigned int recursiveLevel)
+{
+    recordShapeDependency(shapeIndex);
+    IntersectionResult hit;
+    hit.intersectionPoint = point;
+    hit.shape = compiled->shapes[shapeIndex].shape;
+    hit.shapeIndex = shapeIndex;
+
+    FColor luminance;
+    switch (compiled->shapes[shapeIndex].kernel)
+    {
+    case KERNEL_DIFFUSE:
+        luminance = shadeKernel<false, false>(compiled, ray, &hit, recursiveLevel);
+        break;
+    case KERNEL_REFLECT:
+        luminance = shadeKernel<true, false>(compiled, ray, &hit, recursiveLevel);
+        break;
+    case KERNEL_REFRACT:
+        luminance = shadeKernel<false, true>(compiled, ray, &hit, recursiveLevel);
+        break;
+    default:
+        luminance = shadeKernel<true, true>(compiled, ray, &hit, recursiveLevel);
+        break;
+    }
+
+    // 交点は呼び出し側のものなのでIntersectionResultに解放させない
+    hit.intersectionPoint = nullptr;
+
+    if (compiled->scene->clampLuminance)
+        luminance.normalize();
+
+    return luminance;
+}
+
+FColor traceCompiledScene(CompiledScene *compiled, Ray *ray, unsigned int recursiveLevel)
+{
+    Scene *scene = compiled->scene;
+    if (recursiveLevel > scene->maxRecursiveLevel)
+        return FColor(0, 0, 0);
+
+    rayCount++;
+
+    IntersectionPoint point;
+    int shapeIndex;
+    if (!compiledClosestHit(compiled, ray, &point, &shapeIndex))
+    {
+        recordBackgroundDependency();
+        return scene->backgroundColor;
+    }
+
+    return compiledShade(compiled, ray, &point, shapeIndex, recursiveLevel);
+}
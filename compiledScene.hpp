@@ -0,0 +1,117 @@
+/* 光源・ジオメトリ・マテリアルを型ごとに展開した描画経路 */
+#pragma once
+#include <vector>
+#include "raytracing_lib.hpp"
+
+struct UniformGrid;
+
+// 点光源
+struct CompiledPointLight
+{
+    Vector3 position;
+    FColor intensity;
+    int lightIndex; // Scene::lightの添字
+};
+
+// 平行光源
+struct CompiledDirectionalLight
+{
+    Vector3 toLight; // 光源へ向かう単位ベクトル(-directionを正規化したもの)
+    FColor intensity;
+    int lightIndex;
+};
+
+// 球
+struct CompiledSphere
+{
+    Vector3 center;
+    float radius;
+    int shapeIndex; // Scene::geometryの添字
+};
+
+// 平面
+struct CompiledPlane
+{
+    Vector3 normal;
+    Vector3 position;
+    int shapeIndex;
+};
+
+// ジオメトリの種類
+enum COMPILED_SHAPE_TYPE
+{
+    COMPILED_SPHERE,
+    COMPILED_PLANE,
+    COMPILED_OTHER, // 仮想関数で交差判定する
+};
+
+// マテリアルのフラグから決めたシェーディングカーネル
+enum SHADING_KERNEL
+{
+    KERNEL_DIFFUSE,         // 反射・屈折なし
+    KERNEL_REFLECT,         // 完全鏡面反射
+    KERNEL_REFRACT,         // 屈折
+    KERNEL_REFLECT_REFRACT, // 完全鏡面反射+屈折(シャドウイングなし)
+};
+
+// ジオメトリごとの情報(Scene::geometryと同じ順番)
+struct CompiledShape
+{
+    Shape *shape;
+    int type;     // COMPILED_SHAPE_TYPE
+    int slot;     // 種類ごとの配列の添字
+    int kernel;   // SHADING_KERNEL
+    bool textured; // テクスチャがあるか(なければマテリアルをコピーせずに使う)
+};
+
+// 型ごとに展開したシーン
+// compileSceneの後にジオメトリ・光源・マテリアルを変更したら作り直すこと
+struct CompiledScene
+{
+    Scene *scene;
+    std::vector<CompiledShape> shapes;
+    std::vector<CompiledSphere> spheres;
+    std::vector<CompiledPlane> planes;
+    std::vector<int> otherShapes; // 球・平面以外のジオメトリ番号
+    std::vector<CompiledPointLight> pointLights;
+    std::vector<CompiledDirectionalLight> directionalLights;
+    std::vector<int> otherLights;     // 点光源・平行光源以外の光源番号
+    std::vector<int> pointLightSlots; // 光源番号からpointLightsの添字(点光源でなければ-1)
+    UniformGrid *grid = nullptr;      // 球の一様格子(nullptrなら球をすべて判定する)
+};
+
+// シーンを型ごとに展開する
+CompiledScene *compileScene(Scene *scene);
+
+// 展開したシーンを解放する(格子があれば格子も解放する)
+void freeCompiledScene(CompiledScene *compiled);
+
+// 展開したシーンは描画設定とカメラをsceneから読むので，
+// 描画設定・カメラを差し替えたsceneのコピーには展開したシーンのコピー(compiled)を指させる
+// (配列は複製し，格子は共有する．scene->compiledScene == nullptrなら何もしない)
+void copyCompiledScene(Scene *scene, CompiledScene *compiled);
+
+// レイの始点に最も近い交点を求める(交点がなければfalse)
+bool compiledClosestHit(
+    CompiledScene *compiled, Ray *ray, IntersectionPoint *point, int *shapeIndex);
+
+// 始点からmaxDistance以内にレイを遮るジオメトリがあればその番号，なければ-1
+// 格子を使う場合は最初に見つかった球を返す(線形に探す場合と番号が違うことがある)
+int compiledFindOccluder(CompiledScene *compiled, Ray *ray, float maxDistance);
+
+// ジオメトリ1つとレイの交点を求める(compiledClosestHitと同じ計算)
+// otherNormalは球・平面以外のジオメトリの場合だけ設定する
+bool compiledIntersectShape(
+    CompiledScene *compiled, int shapeIndex, Ray *ray, Vector3 *position, Vector3 *otherNormal);
+
+// compiledIntersectShapeで求めた交点の法線
+Vector3 compiledShapeNormal(
+    CompiledScene *compiled, int shapeIndex, Vector3 position, Vector3 otherNormal);
+
+// 交点をジオメトリのカーネルでシェーディングする(反射・屈折は再帰的に追跡する)
+FColor compiledShade(
+    CompiledScene *compiled, Ray *ray, IntersectionPoint *point, int shapeIndex,
+    unsigned int recursiveLevel);
+
+// 展開したシーンでのレイトレーシング(RayTraceRecursiveと同じ結果になる)
+FColor traceCompiledScene(CompiledScene *compiled, Ray *ray, unsigned int recursiveLevel);
@@ -0,0 +1,370 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "camera.hpp"
+#include "denoise.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ALBEDO_EPSILON 1e-3f // これ未満のアルベドでは割らない
+
+int FeatureBuffers::allocation()
+{
+    size_t count = (size_t)width * height;
+    albedo = (float *)calloc(count * 3, sizeof(float));
+    normal = (float *)calloc(count * 3, sizeof(float));
+    depth = (float *)calloc(count, sizeof(float));
+    shapeId = (int *)calloc(count, sizeof(int));
+    if (albedo == NULL || normal == NULL || depth == NULL || shapeId == NULL)
+    {
+        printf("calloc error\n");
+        freeFeatureBuffers(this);
+        return -1;
+    }
+
+    return 0; // 成功
+}
+
+int freeFeatureBuffers(FeatureBuffers *features)
+{
+    free(features->albedo);
+    free(features->normal);
+    free(features->depth);
+    free(features->shapeId);
+    features->albedo = nullptr;
+    features->normal = nullptr;
+    features->depth = nullptr;
+    features->shapeId = nullptr;
+    return 0;
+}
+
+void renderFeatureTile(
+    Scene *scene, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    FeatureBuffers *features)
+{
+    float scale = 1.f / (float)scene->samplingNum;
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+    std::vector<Ray> centers((size_t)w * h);
+    generatePixelCenterRays(frame, x, y, w, h, centers.data());
+    for (unsigned int j = 0; j < h; j++)
+    {
+        for (unsigned int i = 0; i < w; i++)
+        {
+            size_t pixel = (size_t)(y + j) * features->width + (x + i);
+            FColor albedo(0, 0, 0);
+            Vector3 normal(0, 0, 0);
+            float depth = 0.f;
+
+            for (unsigned int s = 0; s < scene->samplingNum; s++)
+            {
+                Sampler sampler(pixelSeed(x + i, y + j, s));
+                float u = (float(x + i) + sampler.next());
+                float v = (float(y + j) + sampler.next());
+                Ray ray = cameraFrameRay(frame, u, v);
+                IntersectionResult *result =
+                    intersectionWithAll(scene->geometry, scene->geometryNum, &ray);
+                if (result->intersectionPoint != nullptr)
+                {
+                    Material material = surfaceMaterial(&ray, result);
+                    IntersectionPoint *point = result->intersectionPoint;
+                    albedo = albedo + material.diffuse;
+                    normal = normal + point->normal;
+                    depth += (point->position - ray.startPoint).magnitude();
+                }
+                delete result;
+            }
+
+            features->albedo[pixel * 3 + 0] = albedo.r * scale;
+            features->albedo[pixel * 3 + 1] = albedo.g * scale;
+            features->albedo[pixel * 3 + 2] = albedo.b * scale;
+            features->normal[pixel * 3 + 0] = normal.x * scale;
+            features->normal[pixel * 3 + 1] = normal.y * scale;
+            features->normal[pixel * 3 + 2] = normal.z * scale;
+            features->depth[pixel] = depth * scale;
+
+            // ジオメトリ番号は平均できないので画素の中心だけで求める
+            IntersectionResult *result = intersectionWithAll(
+                scene->geometry, scene->geometryNum, &centers[(size_t)j * w + i]);
+            features->shapeId[pixel] = result->shapeIndex;
+            delete result;
+        }
+    }
+}
+
+// ノイズ除去に使う平面(1成分ずつ並べたもの)
+struct DenoisePlanes
+{
+    unsigned int width;
+    unsigned int height;
+    std::vector<float> color[2][3];   // 色(段ごとに入れ替える)
+    std::vector<float> normal[3];      // 法線
+    std::vector<float> albedo[3];      // アルベド
+    std::vector<float> depth;          // 深度
+    std::vector<float> demodulate[3];  // 色を割ったアルベド(割らない場合は1)
+};
+
+// 1段分の設定
+struct AtrousPass
+{
+    int step;            // タップの間隔
+    float invColorPhi;   // 1/colorPhi
+    float invNormalPhi;  // 1/normalPhi
+    float invDepthPhi;   // 1/(depthPhi*step^2)
+    float invAlbedoPhi;  // 1/albedoPhi
+    int src;             // 読み込む色の番号
+};
+
+// B3スプラインの5タップの係数
+static const float atrousKernel[5] = {1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+
+// exp(x)の近似(x<=0．2^xの整数部を指数に入れ，小数部を3次式で近似する)
+static inline float fastExp(float x)
+{
+    float t = fmaxf(x, -80.f) * 1.44269504f;
+    float fi = floorf(t);
+    float f = t - fi;
+    float p = 1.f + f * (0.6960656f + f * (0.2244667f + f * 0.0794209f));
+    int32_t bits = ((int32_t)fi + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+// 1画素分のà-trousフィルタ(画像の端ではみ出すタップは使わない)
+static void atrousPixel(DenoisePlanes *planes, const AtrousPass &pass, int x, int y)
+{
+    int width = (int)planes->width;
+    int height = (int)planes->height;
+    const std::vector<float> *color = planes->color[pass.src];
+    std::vector<float> *out = planes->color[pass.src ^ 1];
+    size_t p = (size_t)y * width + x;
+
+    float cr = color[0][p], cg = color[1][p], cb = color[2][p];
+    float nx = planes->normal[0][p], ny = planes->normal[1][p], nz = planes->normal[2][p];
+    float ar = planes->albedo[0][p], ag = planes->albedo[1][p], ab = planes->albedo[2][p];
+    float z = planes->depth[p];
+    float invDepth = pass.invDepthPhi / (z * z + 1e-6f);
+
+    float sumW = 0.f, sumR = 0.f, sumG = 0.f, sumB = 0.f;
+    for (int ky = 0; ky < 5; ky++)
+    {
+        int qy = y + (ky - 2) * pass.step;
+        if (qy < 0 || qy >= height)
+            continue;
+        for (int kx = 0; kx < 5; kx++)
+        {
+            int qx = x + (kx - 2) * pass.step;
+            if (qx < 0 || qx >= width)
+                continue;
+            size_t q = (size_t)qy * width + qx;
+
+            float dr = color[0][q] - cr, dg = color[1][q] - cg, db = color[2][q] - cb;
+            float dnx = planes->normal[0][q] - nx, dny = planes->normal[1][q] - ny,
+                  dnz = planes->normal[2][q] - nz;
+            float dar = planes->albedo[0][q] - ar, dag = planes->albedo[1][q] - ag,
+                  dab = planes->albedo[2][q] - ab;
+            float dz = planes->depth[q] - z;
+            float e = (dr * dr + dg * dg + db * db) * pass.invColorPhi +
+                      (dnx * dnx + dny * dny + dnz * dnz) * pass.invNormalPhi +
+                      dz * dz * invDepth +
+                      (dar * dar + dag * dag + dab * dab) * pass.invAlbedoPhi;
+            float w = atrousKernel[kx] * atrousKernel[ky] * fastExp(-e);
+
+            sumW += w;
+            sumR += w * color[0][q];
+            sumG += w * color[1][q];
+            sumB += w * color[2][q];
+        }
+    }
+    // 中心のタップの重みは0にならない
+    out[0][p] = sumR / sumW;
+    out[1][p] = sumG / sumW;
+    out[2][p] = sumB / sumW;
+}
+
+#ifdef __SSE2__
+// fastExpの4画素版(同じ計算なので結果も同じ)
+static inline __m128 fastExp4(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.f)), _mm_set1_ps(1.44269504f));
+    // SSE2にfloorはないので切り捨ててから負の場合を直す
+    __m128 fi = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    fi = _mm_sub_ps(fi, _mm_and_ps(_mm_cmpgt_ps(fi, t), one));
+    __m128 f = _mm_sub_ps(t, fi);
+    __m128 p = _mm_add_ps(_mm_set1_ps(0.2244667f), _mm_mul_ps(f, _mm_set1_ps(0.0794209f)));
+    p = _mm_add_ps(_mm_set1_ps(0.6960656f), _mm_mul_ps(f, p));
+    p = _mm_add_ps(one, _mm_mul_ps(f, p));
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fi), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+// 差の2乗
+static inline __m128 squaredDiff4(const float *plane, size_t q, __m128 center)
+{
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(plane + q), center);
+    return _mm_mul_ps(d, d);
+}
+
+// 横に並んだ4画素分のà-trousフィルタ
+// 左右のタップがすべて画像内にある範囲だけで使う
+static void atrousPixel4(DenoisePlanes *planes, const AtrousPass &pass, int x, int y)
+{
+    int width = (int)planes->width;
+    int height = (int)planes->height;
+    const std::vector<float> *color = planes->color[pass.src];
+    std::vector<float> *out = planes->color[pass.src ^ 1];
+    size_t p = (size_t)y * width + x;
+
+    __m128 c[3], n[3], a[3];
+    for (int k = 0; k < 3; k++)
+    {
+        c[k] = _mm_loadu_ps(color[k].data() + p);
+        n[k] = _mm_loadu_ps(planes->normal[k].data() + p);
+        a[k] = _mm_loadu_ps(planes->albedo[k].data() + p);
+    }
+    __m128 z = _mm_loadu_ps(planes->depth.data() + p);
+    __m128 invDepth = _mm_div_ps(
+        _mm_set1_ps(pass.invDepthPhi), _mm_add_ps(_mm_mul_ps(z, z), _mm_set1_ps(1e-6f)));
+    __m128 invColorPhi = _mm_set1_ps(pass.invColorPhi);
+    __m128 invNormalPhi = _mm_set1_ps(pass.invNormalPhi);
+    __m128 invAlbedoPhi = _mm_set1_ps(pass.invAlbedoPhi);
+
+    __m128 sumW = _mm_setzero_ps();
+    __m128 sum[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+    for (int ky = 0; ky < 5; ky++)
+    {
+        int qy = y + (ky - 2) * pass.step;
+        if (qy < 0 || qy >= height)
+            continue;
+        for (int kx = 0; kx < 5; kx++)
+        {
+            size_t q = (size_t)qy * width + x + (kx - 2) * pass.step;
+
+            __m128 dc = _mm_add_ps(
+                _mm_add_ps(squaredDiff4(color[0].data(), q, c[0]),
+                           squaredDiff4(color[1].data(), q, c[1])),
+                squaredDiff4(color[2].data(), q, c[2]));
+            __m128 dn = _mm_add_ps(
+                _mm_add_ps(squaredDiff4(planes->normal[0].data(), q, n[0]),
+                           squaredDiff4(planes->normal[1].data(), q, n[1])),
+                squaredDiff4(planes->normal[2].data(), q, n[2]));
+            __m128 dz = squaredDiff4(planes->depth.data(), q, z);
+            __m128 da = _mm_add_ps(
+                _mm_add_ps(squaredDiff4(planes->albedo[0].data(), q, a[0]),
+                           squaredDiff4(planes->albedo[1].data(), q, a[1])),
+                squaredDiff4(planes->albedo[2].data(), q, a[2]));
+            __m128 e = _mm_add_ps(
+                _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(dc, invColorPhi), _mm_mul_ps(dn, invNormalPhi)),
+                    _mm_mul_ps(dz, invDepth)),
+                _mm_mul_ps(da, invAlbedoPhi));
+            __m128 w = _mm_mul_ps(
+                _mm_set1_ps(atrousKernel[kx] * atrousKernel[ky]),
+                fastExp4(_mm_sub_ps(_mm_setzero_ps(), e)));
+
+            sumW = _mm_add_ps(sumW, w);
+            for (int k = 0; k < 3; k++)
+                sum[k] = _mm_add_ps(sum[k], _mm_mul_ps(w, _mm_loadu_ps(color[k].data() + q)));
+        }
+    }
+    for (int k = 0; k < 3; k++)
+        _mm_storeu_ps(out[k].data() + p, _mm_div_ps(sum[k], sumW));
+}
+#endif
+
+// rowBegin〜rowEnd-1行にà-trousフィルタを1段かける
+static void atrousRows(DenoisePlanes *planes, const AtrousPass &pass, int rowBegin, int rowEnd)
+{
+    int width = (int)planes->width;
+    for (int y = rowBegin; y < rowEnd; y++)
+    {
+        int x = 0;
+#ifdef __SSE2__
+        // 左右のタップが画像内に収まる範囲は4画素ずつ処理する
+        int margin = 2 * pass.step;
+        for (; x < margin && x < width; x++)
+            atrousPixel(planes, pass, x, y);
+        for (; x + 4 + margin <= width; x += 4)
+            atrousPixel4(planes, pass, x, y);
+#endif
+        for (; x < width; x++)
+            atrousPixel(planes, pass, x, y);
+    }
+}
+
+int denoiseFloatBitmap(
+    FloatBitMapData *src, FeatureBuffers *features, FloatBitMapData *dst,
+    const DenoiseOption &option)
+{
+    if (src->width != features->width || src->height != features->height ||
+        src->width != dst->width || src->height != dst->height)
+    {
+        printf("denoise size error\n");
+        return -1;
+    }
+
+    // 成分ごとの平面に分ける
+    DenoisePlanes planes;
+    planes.width = src->width;
+    planes.height = src->height;
+    size_t count = (size_t)src->width * src->height;
+    for (int k = 0; k < 3; k++)
+    {
+        planes.color[0][k].resize(count);
+        planes.color[1][k].resize(count);
+        planes.normal[k].resize(count);
+        planes.albedo[k].resize(count);
+        planes.demodulate[k].resize(count);
+    }
+    planes.depth.assign(features->depth, features->depth + count);
+    for (size_t p = 0; p < count; p++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            float albedo = features->albedo[p * 3 + k];
+            float demodulate =
+                (option.demodulateAlbedo && albedo >= ALBEDO_EPSILON) ? albedo : 1.f;
+            planes.demodulate[k][p] = demodulate;
+            planes.color[0][k][p] = src->pixelsData[p * 3 + k] / demodulate;
+            planes.normal[k][p] = features->normal[p * 3 + k];
+            planes.albedo[k][p] = albedo;
+        }
+    }
+
+    unsigned int workerNum = option.workerNum > 0 ? option.workerNum : 1;
+    int current = 0;
+    for (unsigned int i = 0; i < option.iterations; i++)
+    {
+        AtrousPass pass;
+        pass.step = 1 << i;
+        pass.invColorPhi = (float)(1 << i) / option.colorPhi;
+        pass.invNormalPhi = 1.f / option.normalPhi;
+        pass.invDepthPhi = 1.f / (option.depthPhi * (float)(pass.step * pass.step));
+        pass.invAlbedoPhi = 1.f / option.albedoPhi;
+        pass.src = current;
+
+        // 行を均等に分けて各スレッドで処理する
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < workerNum; t++)
+        {
+            int rowBegin = (int)((size_t)planes.height * t / workerNum);
+            int rowEnd = (int)((size_t)planes.height * (t + 1) / workerNum);
+            threads.emplace_back(atrousRows, &planes, pass, rowBegin, rowEnd);
+        }
+        for (auto &t : threads)
+            t.join();
+        current ^= 1;
+    }
+
+    // アルベドを掛け直して書き込む
+    for (size_t p = 0; p < count; p++)
+        for (int k = 0; k < 3; k++)
+            dst->pixelsData[p * 3 + k] = planes.color[current][k][p] * planes.demodulate[k][p];
+
+    return 0;
+}
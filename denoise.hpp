@@ -0,0 +1,49 @@
+/* 特徴量バッファとエッジを保存するノイズ除去 */
+#pragma once
+#include "raytracing_lib.hpp"
+
+// 1次レイの交点の特徴量(ピクセルごとのサンプル平均)
+struct FeatureBuffers
+{
+    unsigned int width;      // 幅
+    unsigned int height;     // 高さ
+    float *albedo = nullptr; // 拡散反射係数(RGB，テクスチャを掛けたもの．背景は0)
+    float *normal = nullptr; // 法線(xyz．平均なので単位ベクトルとは限らない．背景は0)
+    float *depth = nullptr;  // 視点から交点までの距離(背景は0)
+    int *shapeId = nullptr;  // 画素の中心に見えるジオメトリ番号(背景は-1)
+
+    FeatureBuffers() {}
+    FeatureBuffers(unsigned int w, unsigned int h)
+        : width(w), height(h) {}
+
+    // バッファ確保(0で初期化)
+    int allocation();
+};
+
+int freeFeatureBuffers(FeatureBuffers *);
+
+// タイル(x,y)〜(x+w-1,y+h-1)の特徴量を1次レイだけ追跡して求める
+// サンプル位置はrenderTileSortedと同じ(pixelSeedで決めたジッタ)
+void renderFeatureTile(
+    Scene *scene, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    FeatureBuffers *features);
+
+// ノイズ除去の設定
+// 重みは exp(-(色の差^2/colorPhi + 法線の差^2/normalPhi + 相対深度の差^2/depthPhi
+//              + アルベドの差^2/albedoPhi))
+struct DenoiseOption
+{
+    unsigned int iterations = 5; // à-trousの段数(段ごとにタップの間隔を2倍にする)
+    float colorPhi = 1.f;        // 色の重みの幅(段ごとに半分にする)
+    float normalPhi = 0.05f;     // 法線の重みの幅
+    float depthPhi = 0.001f;     // 相対深度の重みの幅(タップの間隔の2乗を掛ける)
+    float albedoPhi = 0.02f;     // アルベドの重みの幅
+    bool demodulateAlbedo = true; // アルベドで割ってからぼかし，最後に掛け直すか
+    unsigned int workerNum = 1;   // スレッド数
+};
+
+// 特徴量でエッジを保存しながらsrcのノイズを除去してdstに書き込む(à-trousウェーブレット)
+// src・dst・featuresは同じ大きさであること．srcとdstは同じでもよい
+int denoiseFloatBitmap(
+    FloatBitMapData *src, FeatureBuffers *features, FloatBitMapData *dst,
+    const DenoiseOption &option = DenoiseOption());
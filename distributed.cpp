@@ -0,0 +1,430 @@
+#include "distributed.hpp"
+#include "socketUtil.hpp"
+#include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// 受信の途中で相手が止まった場合に待つ時間(メッセージの途中で止まったワーカーは切断する)
+#define MESSAGE_RECEIVE_TIMEOUT 30.0
+// ワーカーがコーディネータの起動を待つ時間
+#define WORKER_CONNECT_RETRY 100
+
+// メッセージの種類
+enum MESSAGE_TYPE
+{
+    MESSAGE_HELLO = 1, // ワーカー -> コーディネータ: シーンのハッシュ
+    MESSAGE_TILE,      // コーディネータ -> ワーカー: 描画するタイル
+    MESSAGE_RESULT,    // ワーカー -> コーディネータ: 描画結果(後ろにfloatのRGBが続く)
+    MESSAGE_DONE,      // コーディネータ -> ワーカー: 終了
+};
+
+// メッセージのヘッダ
+struct MessageHeader
+{
+    uint32_t type;
+    uint32_t tileId;
+    uint32_t x, y, w, h;
+    uint64_t sceneHash;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// 描画中のタイル
+struct TileInFlight
+{
+    unsigned int tileId;
+    Clock::time_point sentTime;
+};
+
+// 接続中のワーカー
+struct WorkerConnection
+{
+    int fd;
+    bool ready; // HELLOを受け取ってシーンを確認済み
+    std::deque<TileInFlight> tiles;
+    std::vector<char> received;     // 受信したがまだ処理していないバイト列
+    Clock::time_point lastReceive;  // 最後に受信した時刻
+};
+
+// タイル番号から位置と大きさを求める
+static void tileRect(
+    FloatBitMapData *bitmap, unsigned int tileSize, unsigned int tileId,
+    unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h)
+{
+    unsigned int tileCountX = (bitmap->width + tileSize - 1) / tileSize;
+    *x = (tileId % tileCountX) * tileSize;
+    *y = (tileId / tileCountX) * tileSize;
+    *w = (*x + tileSize > bitmap->width) ? bitmap->width - *x : tileSize;
+    *h = (*y + tileSize > bitmap->height) ? bitmap->height - *y : tileSize;
+}
+
+// ローカルワーカーを起動する
+static pid_t spawnLocalWorker(const DistributedOption &option)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(option.workerCommand, option.workerCommand, "worker",
+              option.sceneFilename, option.address, (char *)nullptr);
+        printf("%sを起動できません\n", option.workerCommand);
+        _exit(1);
+    }
+    return pid;
+}
+
+// ワーカーとの接続を切り，描画中だったタイルを未処理に戻す
+static void failWorker(
+    WorkerConnection *worker, std::deque<unsigned int> *pending,
+    std::vector<bool> *done, DistributedStats *stats)
+{
+    for (auto &tile : worker->tiles)
+    {
+        if (!(*done)[tile.tileId])
+        {
+            pending->push_front(tile.tileId);
+            stats->reassignedTiles++;
+        }
+    }
+    worker->tiles.clear();
+    close(worker->fd);
+    worker->fd = -1;
+    stats->failedWorkers++;
+}
+
+// 受信済みのバイト列から揃ったメッセージを取り出して処理する(不正なメッセージなら-1)
+// RESULTは後ろのタイルまで揃うまで処理しない
+static int receiveMessages(
+    WorkerConnection *worker, SceneFile *sceneFile, FloatBitMapData *bitmap,
+    unsigned int tileSize, std::vector<bool> *done, unsigned int *doneNum)
+{
+    size_t offset = 0;
+    int result = 0;
+    while (worker->received.size() - offset >= sizeof(MessageHeader))
+    {
+        MessageHeader header;
+        memcpy(&header, worker->received.data() + offset, sizeof(header));
+
+        if (header.type == MESSAGE_HELLO)
+        {
+            // 違うシーンを読み込んだワーカーは使わない
+            if (header.sceneHash != sceneFile->hash)
+            {
+                printf("シーンが異なるワーカーを切断しました\n");
+                result = -1;
+                break;
+            }
+            worker->ready = true;
+            offset += sizeof(header);
+        }
+        else if (header.type == MESSAGE_RESULT)
+        {
+            unsigned int x, y, w, h;
+            if (header.tileId >= done->size())
+            {
+                result = -1;
+                break;
+            }
+            tileRect(bitmap, tileSize, header.tileId, &x, &y, &w, &h);
+            if (header.w != w || header.h != h)
+            {
+                result = -1;
+                break;
+            }
+            size_t payload = sizeof(float) * w * h * 3;
+            if (worker->received.size() - offset < sizeof(header) + payload)
+                break; // タイルの残りを待つ
+            const char *tile = worker->received.data() + offset + sizeof(header);
+            offset += sizeof(header) + payload;
+
+            // 再割り当てで2回届いたタイルは最初の結果を使う
+            if (!(*done)[header.tileId])
+            {
+                for (unsigned int row = 0; row < h; row++)
+                    memcpy(bitmap->getPixel(x, y + row), tile + sizeof(float) * row * w * 3,
+                           sizeof(float) * w * 3);
+                (*done)[header.tileId] = true;
+                (*doneNum)++;
+            }
+            for (auto it = worker->tiles.begin(); it != worker->tiles.end(); ++it)
+            {
+                if (it->tileId == header.tileId)
+                {
+                    worker->tiles.erase(it);
+                    break;
+                }
+            }
+        }
+        else
+        {
+            result = -1;
+            break;
+        }
+    }
+    worker->received.erase(worker->received.begin(), worker->received.begin() + offset);
+    return result;
+}
+
+int runCoordinator(
+    SceneFile *sceneFile, FloatBitMapData *bitmap,
+    const DistributedOption &option, DistributedStats *stats)
+{
+    int listenFd = listenAddress(option.address);
+    if (listenFd == -1)
+        return -1;
+
+    unsigned int tileSize = option.tileSize;
+    unsigned int tileCountX = (bitmap->width + tileSize - 1) / tileSize;
+    unsigned int tileCountY = (bitmap->height + tileSize - 1) / tileSize;
+    unsigned int tileNum = tileCountX * tileCountY;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->tileNum = tileNum;
+
+    std::deque<unsigned int> pending;
+    for (unsigned int i = 0; i < tileNum; i++)
+        pending.push_back(i);
+    std::vector<bool> done(tileNum, false);
+    unsigned int doneNum = 0;
+
+    std::vector<WorkerConnection> workers;
+    std::vector<pid_t> children;
+    for (unsigned int i = 0; i < option.localWorkerNum; i++)
+        children.push_back(spawnLocalWorker(option));
+    // 落ちたローカルワーカーを起動し直す回数の上限
+    unsigned int respawnLimit = option.localWorkerNum * 4;
+
+    int result = 0;
+    Clock::time_point idleSince = Clock::now(); // ワーカーがいなくなった時刻
+
+    while (doneNum < tileNum)
+    {
+        // 待ち受けソケットと各ワーカーを監視する
+        std::vector<struct pollfd> fds;
+        fds.push_back({listenFd, POLLIN, 0});
+        for (auto &worker : workers)
+            fds.push_back({worker.fd, POLLIN, 0});
+        poll(fds.data(), fds.size(), 100);
+
+        // 新しいワーカー
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd != -1)
+            {
+                WorkerConnection worker;
+                worker.fd = fd;
+                worker.ready = false;
+                worker.lastReceive = Clock::now();
+                workers.push_back(worker);
+                stats->connectedWorkers++;
+            }
+        }
+
+        // 受信(届いた分だけ読み，揃ったメッセージを処理する．1つのワーカーを待たない)
+        Clock::time_point now = Clock::now();
+        for (size_t i = 1; i < fds.size(); i++)
+        {
+            WorkerConnection &worker = workers[i - 1];
+            if (fds[i].revents != 0)
+            {
+                if (readAvailable(worker.fd, &worker.received) == -1 ||
+                    receiveMessages(&worker, sceneFile, bitmap, tileSize, &done, &doneNum) == -1)
+                {
+                    failWorker(&worker, &pending, &done, stats);
+                    continue;
+                }
+                worker.lastReceive = now;
+            }
+            if (!worker.received.empty() &&
+                std::chrono::duration<double>(now - worker.lastReceive).count() >
+                    MESSAGE_RECEIVE_TIMEOUT)
+            {
+                printf("受信の途中で止まったワーカーを切断しました\n");
+                failWorker(&worker, &pending, &done, stats);
+            }
+        }
+
+        // 制限時間を超えたワーカーは失敗とみなす
+        if (option.tileTimeout > 0.0)
+        {
+            for (auto &worker : workers)
+            {
+                if (worker.fd != -1 && !worker.tiles.empty() &&
+                    std::chrono::duration<double>(now - worker.tiles.front().sentTime).count() >
+                        option.tileTimeout)
+                {
+                    printf("時間切れのワーカーを切断しました\n");
+                    failWorker(&worker, &pending, &done, stats);
+                }
+            }
+        }
+
+        // 切断したワーカーを取り除く
+        for (size_t i = 0; i < workers.size();)
+        {
+            if (workers[i].fd == -1)
+                workers.erase(workers.begin() + i);
+            else
+                i++;
+        }
+
+        // 終了したローカルワーカーを起動し直す
+        for (auto &child : children)
+        {
+            if (child > 0 && waitpid(child, nullptr, WNOHANG) == child)
+            {
+                child = -1;
+                if (respawnLimit > 0 && doneNum < tileNum)
+                {
+                    respawnLimit--;
+                    child = spawnLocalWorker(option);
+                }
+            }
+        }
+
+        // ワーカーがいなくなったまま回復しなければ失敗とする
+        bool childAlive = false;
+        for (auto child : children)
+            childAlive = childAlive || child > 0;
+        if (!workers.empty() || childAlive)
+        {
+            idleSince = Clock::now();
+        }
+        else if (option.localWorkerNum > 0 && respawnLimit == 0)
+        {
+            printf("ローカルワーカーを起動し直せなくなりました\n");
+            result = -1;
+            break;
+        }
+        else if (option.workerWaitTimeout > 0.0 &&
+                 std::chrono::duration<double>(Clock::now() - idleSince).count() >
+                     option.workerWaitTimeout)
+        {
+            printf("%.0f秒待ってもワーカーが接続しません\n", option.workerWaitTimeout);
+            result = -1;
+            break;
+        }
+
+        // 完了済みのタイルを未処理から除く(再割り当て後に元のワーカーが返した場合)
+        while (!pending.empty() && done[pending.front()])
+            pending.pop_front();
+
+        // タイルを配る
+        for (auto &worker : workers)
+        {
+            while (worker.ready && worker.tiles.size() < DISTRIBUTED_TILES_IN_FLIGHT &&
+                   !pending.empty())
+            {
+                unsigned int tileId = pending.front();
+                pending.pop_front();
+                if (done[tileId])
+                    continue;
+
+                MessageHeader header;
+                memset(&header, 0, sizeof(header));
+                header.type = MESSAGE_TILE;
+                header.tileId = tileId;
+                tileRect(bitmap, tileSize, tileId, &header.x, &header.y, &header.w, &header.h);
+                if (writeFull(worker.fd, &header, sizeof(header)) == -1)
+                {
+                    pending.push_front(tileId);
+                    failWorker(&worker, &pending, &done, stats);
+                    break;
+                }
+                worker.tiles.push_back({tileId, Clock::now()});
+            }
+        }
+        for (size_t i = 0; i < workers.size();)
+        {
+            if (workers[i].fd == -1)
+                workers.erase(workers.begin() + i);
+            else
+                i++;
+        }
+    }
+
+    // ワーカーに終了を伝える
+    for (auto &worker : workers)
+    {
+        MessageHeader header;
+        memset(&header, 0, sizeof(header));
+        header.type = MESSAGE_DONE;
+        writeFull(worker.fd, &header, sizeof(header));
+        close(worker.fd);
+    }
+    close(listenFd);
+    if (strncmp(option.address, "unix:", 5) == 0)
+        unlink(option.address + 5);
+
+    for (auto child : children)
+    {
+        if (child > 0)
+            waitpid(child, nullptr, 0);
+    }
+
+    return result;
+}
+
+int runWorker(SceneFile *sceneFile, const char *address)
+{
+    // コーディネータの待ち受けが始まるまで再試行する
+    int fd = -1;
+    for (int i = 0; i < WORKER_CONNECT_RETRY && fd == -1; i++)
+    {
+        fd = connectAddress(address);
+        if (fd == -1)
+            usleep(100 * 1000);
+    }
+    if (fd == -1)
+    {
+        printf("%sに接続できません\n", address);
+        return -1;
+    }
+
+    MessageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.type = MESSAGE_HELLO;
+    header.sceneHash = sceneFile->hash;
+    if (writeFull(fd, &header, sizeof(header)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    std::vector<float> tile;
+    int result = 0;
+    while (true)
+    {
+        if (readFull(fd, &header, sizeof(header)) == -1)
+        {
+            result = -1; // コーディネータが終了した
+            break;
+        }
+        if (header.type == MESSAGE_DONE)
+            break;
+        if (header.type != MESSAGE_TILE)
+        {
+            result = -1;
+            break;
+        }
+
+        tile.resize((size_t)header.w * header.h * 3);
+        renderTile(&sceneFile->scene, header.x, header.y, header.w, header.h,
+                   tile.data(), (size_t)header.w * 3);
+
+        header.type = MESSAGE_RESULT;
+        if (writeFull(fd, &header, sizeof(header)) == -1 ||
+            writeFull(fd, tile.data(), sizeof(float) * tile.size()) == -1)
+        {
+            result = -1;
+            break;
+        }
+    }
+
+    close(fd);
+    return result;
+}
@@ -0,0 +1,40 @@
+/* 複数プロセス・複数マシンでのタイル分散レンダリング */
+#pragma once
+#include "sceneFile.hpp"
+
+#define DISTRIBUTED_TILE_SIZE 32
+#define DISTRIBUTED_TILES_IN_FLIGHT 2 // 1ワーカーに同時に渡すタイル数(通信待ちを隠す)
+
+// 分散レンダリングの設定
+struct DistributedOption
+{
+    const char *address = nullptr;        // "unix:パス" または "tcp:ホスト:ポート"
+    unsigned int tileSize = DISTRIBUTED_TILE_SIZE;
+    unsigned int localWorkerNum = 0;      // コーディネータが起動するローカルワーカー数
+    const char *workerCommand = nullptr;  // ローカルワーカーの実行ファイル
+    const char *sceneFilename = nullptr;  // ローカルワーカーに渡すシーンファイル
+    double tileTimeout = 0.0;             // 1タイルの制限時間[秒](0なら無制限)
+    double workerWaitTimeout = 60.0;      // ローカルワーカーが動いておらず，接続中のワーカーも
+                                          // ない状態の制限時間[秒](0なら無制限)
+};
+
+// 分散レンダリングの統計
+struct DistributedStats
+{
+    unsigned int tileNum;          // タイル数
+    unsigned int reassignedTiles;  // 再割り当てしたタイル数
+    unsigned int failedWorkers;    // 失敗したワーカー数
+    unsigned int connectedWorkers; // 接続したワーカー数(延べ)
+};
+
+// コーディネータ
+// タイルを接続してきたワーカーに配り，返ってきたfloatのタイルをbitmapに統合する
+// 失敗(切断・時間切れ)したワーカーのタイルは他のワーカーに割り当て直す
+// ローカルワーカーを起動し直せなくなるか，ワーカーがいない状態がworkerWaitTimeoutを超えたら-1
+int runCoordinator(
+    SceneFile *sceneFile, FloatBitMapData *bitmap,
+    const DistributedOption &option, DistributedStats *stats);
+
+// ワーカー
+// コーディネータに接続し，受け取ったタイルを描画して返す
+int runWorker(SceneFile *sceneFile, const char *address);
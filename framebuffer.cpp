@@ -0,0 +1,662 @@
+#include "framebuffer.hpp"
+#include "memory.hpp"
+#include <math.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+int FloatBitMapData::allocation()
+{
+    pixelsData = (float *)calloc((size_t)width * height * channel, sizeof(float));
+    if (pixelsData == NULL)
+    {
+        printf("calloc error\n");
+        return -1;
+    }
+    recordMemoryAllocation(MEMORY_FRAMEBUFFER, (size_t)width * height * channel * sizeof(float));
+
+    return 0; // 成功
+}
+
+int freeFloatBitmapData(FloatBitMapData *bitmap)
+{
+    if (bitmap->pixelsData != nullptr)
+    {
+        free(bitmap->pixelsData);
+        bitmap->pixelsData = nullptr;
+        recordMemoryRelease(
+            MEMORY_FRAMEBUFFER,
+            (size_t)bitmap->width * bitmap->height * bitmap->channel * sizeof(float));
+    }
+    return 0;
+}
+
+int accumulateFloatBitmapData(
+    FloatBitMapData *dst, FloatBitMapData *src, unsigned int x, unsigned int y)
+{
+    if (x + src->width > dst->width || y + src->height > dst->height)
+    {
+        printf("accumulate size error\n");
+        return -1;
+    }
+
+    for (unsigned int row = 0; row < src->height; row++)
+    {
+        float *d = dst->getPixel(x, y + row);
+        float *s = src->getPixel(0, row);
+        for (unsigned int i = 0; i < src->width * src->channel; i++)
+            d[i] += s[i];
+    }
+
+    return 0;
+}
+
+void scaleFloatBitmapData(FloatBitMapData *bitmap, float scale)
+{
+    size_t count = (size_t)bitmap->width * bitmap->height * bitmap->channel;
+    for (size_t i = 0; i < count; i++)
+        bitmap->pixelsData[i] *= scale;
+}
+
+int pfmFileRead(FloatBitMapData *bitmap, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    char magic[3] = {0};
+    unsigned int width, height;
+    float scale;
+    if (fscanf(file, "%2s %u %u %f", magic, &width, &height, &scale) != 4 ||
+        strcmp(magic, "PF") != 0)
+    {
+        printf("%sはRGBのPFMではありません\n", filename);
+        fclose(file);
+        return -1;
+    }
+    // ヘッダ末尾の改行1文字を読み飛ばす
+    fgetc(file);
+
+    // 負のスケールはリトルエンディアン
+    if (scale > 0.f)
+    {
+        printf("ビッグエンディアンのPFMには未対応です\n");
+        fclose(file);
+        return -1;
+    }
+
+    bitmap->width = width;
+    bitmap->height = height;
+    if (bitmap->allocation() == -1)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    // PFMは下の行から格納されている
+    for (unsigned int y = 0; y < height; y++)
+    {
+        float *row = bitmap->getPixel(0, height - 1 - y);
+        if (fread(row, sizeof(float), (size_t)width * 3, file) != (size_t)width * 3)
+        {
+            printf("%sの読み込みに失敗しました\n", filename);
+            freeFloatBitmapData(bitmap);
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int pfmFileWrite(FloatBitMapData *bitmap, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    // スケールが負ならリトルエンディアン
+    fprintf(file, "PF\n%u %u\n-1.0\n", bitmap->width, bitmap->height);
+
+    // 下の行から書き込む
+    for (unsigned int y = 0; y < bitmap->height; y++)
+    {
+        float *row = bitmap->getPixel(0, bitmap->height - 1 - y);
+        fwrite(row, sizeof(float), (size_t)bitmap->width * 3, file);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+unsigned short floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x007fffff;
+
+    // NaN, 無限大
+    if (((bits >> 23) & 0xff) == 0xff)
+        return (unsigned short)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+
+    // halfで表せない大きな値は無限大
+    if (exponent >= 31)
+        return (unsigned short)(sign | 0x7c00);
+
+    // 非正規化数
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return (unsigned short)sign;
+        mantissa |= 0x00800000;
+        uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        // 最近接丸め
+        if ((mantissa >> (shift - 1)) & 1)
+            half++;
+        return (unsigned short)(sign | half);
+    }
+
+    uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+    // 最近接丸め(繰り上がりで指数部が増えるのはそのまま正しい)
+    if (mantissa & 0x1000)
+        half++;
+    return (unsigned short)half;
+}
+
+// EXRヘッダの属性を書き込む
+static void writeExrAttribute(
+    FILE *file, const char *name, const char *type, const void *value, int32_t size)
+{
+    fwrite(name, 1, strlen(name) + 1, file);
+    fwrite(type, 1, strlen(type) + 1, file);
+    fwrite(&size, sizeof(size), 1, file);
+    fwrite(value, 1, size, file);
+}
+
+// OpenEXRのRLE圧縮(バイト並び替え + 差分予測 + ランレングス)
+// 圧縮後のサイズを返す
+static int exrRleCompress(const unsigned char *in, int inSize, unsigned char *tmp, signed char *out)
+{
+    const int MIN_RUN_LENGTH = 3;
+    const int MAX_RUN_LENGTH = 127;
+
+    // 偶数バイトを前半に，奇数バイトを後半に並び替える
+    unsigned char *t1 = tmp;
+    unsigned char *t2 = tmp + (inSize + 1) / 2;
+    for (int i = 0; i < inSize; i++)
+    {
+        if (i % 2 == 0)
+            *(t1++) = in[i];
+        else
+            *(t2++) = in[i];
+    }
+
+    // 差分予測
+    int p = tmp[0];
+    for (int i = 1; i < inSize; i++)
+    {
+        int d = int(tmp[i]) - p + (128 + 256);
+        p = tmp[i];
+        tmp[i] = (unsigned char)d;
+    }
+
+    // ランレングス符号化
+    const char *inEnd = (const char *)tmp + inSize;
+    const char *runStart = (const char *)tmp;
+    const char *runEnd = runStart + 1;
+    signed char *outWrite = out;
+
+    while (runStart < inEnd)
+    {
+        while (runEnd < inEnd && *runStart == *runEnd &&
+               runEnd - runStart - 1 < MAX_RUN_LENGTH)
+            ++runEnd;
+
+        if (runEnd - runStart >= MIN_RUN_LENGTH)
+        {
+            // 同じ値の連続
+            *outWrite++ = (signed char)((runEnd - runStart) - 1);
+            *outWrite++ = *(const signed char *)runStart;
+            runStart = runEnd;
+        }
+        else
+        {
+            // 圧縮できない並び
+            while (runEnd < inEnd &&
+                   ((runEnd + 1 >= inEnd || *runEnd != *(runEnd + 1)) ||
+                    (runEnd + 2 >= inEnd || *(runEnd + 1) != *(runEnd + 2))) &&
+                   runEnd - runStart < MAX_RUN_LENGTH)
+                ++runEnd;
+
+            *outWrite++ = (signed char)(runStart - runEnd);
+            while (runStart < runEnd)
+                *outWrite++ = *(const signed char *)(runStart++);
+        }
+        ++runEnd;
+    }
+
+    return (int)(outWrite - out);
+}
+
+int exrFileWrite(
+    FloatBitMapData *bitmap, const char *filename,
+    EXR_COMPRESSION compression, EXR_PIXELTYPE pixelType)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    int32_t width = bitmap->width;
+    int32_t height = bitmap->height;
+    int32_t pixelSize = (pixelType == EXR_PIXEL_HALF) ? 2 : 4;
+
+    // マジックナンバーとバージョン(シングルパート, スキャンライン)
+    const unsigned char magic[4] = {0x76, 0x2f, 0x31, 0x01};
+    const unsigned char version[4] = {2, 0, 0, 0};
+    fwrite(magic, 1, 4, file);
+    fwrite(version, 1, 4, file);
+
+    // チャネルリスト(名前のアルファベット順に並べる必要がある)
+    unsigned char chlist[3 * 18 + 1];
+    int32_t chlistSize = 0;
+    const char *names[3] = {"B", "G", "R"};
+    for (int c = 0; c < 3; c++)
+    {
+        int32_t type = pixelType;
+        int32_t sampling = 1;
+        chlist[chlistSize++] = names[c][0];
+        chlist[chlistSize++] = '\0';
+        memcpy(chlist + chlistSize, &type, 4);
+        chlistSize += 4;
+        memset(chlist + chlistSize, 0, 4); // pLinear + 予約
+        chlistSize += 4;
+        memcpy(chlist + chlistSize, &sampling, 4);
+        chlistSize += 4;
+        memcpy(chlist + chlistSize, &sampling, 4);
+        chlistSize += 4;
+    }
+    chlist[chlistSize++] = '\0';
+    writeExrAttribute(file, "channels", "chlist", chlist, chlistSize);
+
+    unsigned char comp = (unsigned char)compression;
+    writeExrAttribute(file, "compression", "compression", &comp, 1);
+
+    int32_t window[4] = {0, 0, width - 1, height - 1};
+    writeExrAttribute(file, "dataWindow", "box2i", window, sizeof(window));
+    writeExrAttribute(file, "displayWindow", "box2i", window, sizeof(window));
+
+    unsigned char lineOrder = 0; // 上から順
+    writeExrAttribute(file, "lineOrder", "lineOrder", &lineOrder, 1);
+
+    float aspect = 1.f;
+    writeExrAttribute(file, "pixelAspectRatio", "float", &aspect, sizeof(aspect));
+    float center[2] = {0.f, 0.f};
+    writeExrAttribute(file, "screenWindowCenter", "v2f", center, sizeof(center));
+    float windowWidth = 1.f;
+    writeExrAttribute(file, "screenWindowWidth", "float", &windowWidth, sizeof(windowWidth));
+
+    // ヘッダ終端
+    fputc('\0', file);
+
+    // オフセットテーブル(1行1チャンク)は後で書き込む
+    long tablePosition = ftell(file);
+    uint64_t *offsets = (uint64_t *)calloc(height, sizeof(uint64_t));
+    int32_t lineSize = width * 3 * pixelSize;
+    unsigned char *line = (unsigned char *)malloc(lineSize);
+    unsigned char *tmp = (unsigned char *)malloc(lineSize);
+    // RLEは最悪で(1 + 1/127)倍程度に膨らむ
+    signed char *packed = (signed char *)malloc(lineSize * 2 + 2);
+    if (offsets == nullptr || line == nullptr || tmp == nullptr || packed == nullptr)
+    {
+        printf("malloc error\n");
+        free(offsets);
+        free(line);
+        free(tmp);
+        free(packed);
+        fclose(file);
+        return -1;
+    }
+    size_t bufferBytes = height * sizeof(uint64_t) + lineSize * 4 + 2;
+    recordMemoryAllocation(MEMORY_IMAGE_IO, bufferBytes);
+    fwrite(offsets, sizeof(uint64_t), height, file);
+
+    for (int32_t y = 0; y < height; y++)
+    {
+        // チャネルごとに1行分並べる(B, G, R)
+        float *row = bitmap->getPixel(0, y);
+        for (int c = 0; c < 3; c++)
+        {
+            int src = 2 - c;
+            unsigned char *dst = line + c * width * pixelSize;
+            for (int32_t x = 0; x < width; x++)
+            {
+                float value = row[x * 3 + src];
+                if (pixelType == EXR_PIXEL_HALF)
+                {
+                    unsigned short half = floatToHalf(value);
+                    memcpy(dst + x * 2, &half, 2);
+                }
+                else
+                {
+                    memcpy(dst + x * 4, &value, 4);
+                }
+            }
+        }
+
+        const void *data = line;
+        int32_t dataSize = lineSize;
+        if (compression == EXR_COMPRESSION_RLE)
+        {
+            int packedSize = exrRleCompress(line, lineSize, tmp, packed);
+            // 圧縮で小さくならない場合は無圧縮のまま格納する
+            if (packedSize < lineSize)
+            {
+                data = packed;
+                dataSize = packedSize;
+            }
+        }
+
+        offsets[y] = (uint64_t)ftell(file);
+        fwrite(&y, sizeof(y), 1, file);
+        fwrite(&dataSize, sizeof(dataSize), 1, file);
+        fwrite(data, 1, dataSize, file);
+    }
+
+    // オフセットテーブルを書き込む
+    fseek(file, tablePosition, SEEK_SET);
+    fwrite(offsets, sizeof(uint64_t), height, file);
+
+    free(offsets);
+    free(line);
+    free(tmp);
+    free(packed);
+    recordMemoryRelease(MEMORY_IMAGE_IO, bufferBytes);
+    fclose(file);
+    return 0;
+}
+
+// 4x4の組織的ディザ行列
+static const float BAYER_MATRIX[4][4] = {
+    {0.f, 8.f, 2.f, 10.f},
+    {12.f, 4.f, 14.f, 6.f},
+    {3.f, 11.f, 1.f, 9.f},
+    {15.f, 7.f, 13.f, 5.f},
+};
+
+// 切り捨て前に加える閾値(ディザなしなら0.5で四捨五入)
+static inline float ditherThreshold(unsigned int x, unsigned int y, bool useDithering)
+{
+    if (!useDithering)
+        return 0.5f;
+    return (BAYER_MATRIX[y & 3][x & 3] + 0.5f) / 16.f;
+}
+
+// 線形 -> sRGB
+// powの代わりに平方根の組み合わせで近似する(誤差は8bitで1未満)
+static inline float linearToSRGB(float value)
+{
+    if (value <= 0.0031308f)
+        return 12.92f * value;
+    float s1 = sqrtf(value);
+    float s2 = sqrtf(s1);
+    float s3 = sqrtf(s2);
+    return 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * value;
+}
+
+// 1成分を8bitに量子化
+template <bool REINHARD, bool SRGB>
+static inline unsigned char quantize(float value, float exposure, float threshold)
+{
+    value *= exposure;
+    if (REINHARD)
+        value = value / (1.f + value);
+    // NaNも0にする
+    if (!(value > 0.f))
+        value = 0.f;
+    if (value > 1.f)
+        value = 1.f;
+    if (SRGB)
+    {
+        value = linearToSRGB(value);
+        if (value > 1.f)
+            value = 1.f;
+    }
+    return (unsigned char)(value * 255.f + threshold);
+}
+
+#ifdef __SSE2__
+static inline __m128 linearToSRGB4(__m128 value)
+{
+    __m128 s1 = _mm_sqrt_ps(value);
+    __m128 s2 = _mm_sqrt_ps(s1);
+    __m128 s3 = _mm_sqrt_ps(s2);
+    __m128 curve = _mm_mul_ps(_mm_set1_ps(0.662002687f), s1);
+    curve = _mm_add_ps(curve, _mm_mul_ps(_mm_set1_ps(0.684122060f), s2));
+    curve = _mm_sub_ps(curve, _mm_mul_ps(_mm_set1_ps(0.323583601f), s3));
+    curve = _mm_sub_ps(curve, _mm_mul_ps(_mm_set1_ps(0.0225411470f), value));
+    __m128 linear = _mm_mul_ps(_mm_set1_ps(12.92f), value);
+    // 分岐の代わりにマスクで選択
+    __m128 mask = _mm_cmple_ps(value, _mm_set1_ps(0.0031308f));
+    return _mm_or_ps(_mm_and_ps(mask, linear), _mm_andnot_ps(mask, curve));
+}
+
+// 4成分をまとめて量子化(結果は32bit整数)
+template <bool REINHARD, bool SRGB>
+static inline __m128i quantize4(__m128 value, __m128 exposure, __m128 threshold)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+
+    value = _mm_mul_ps(value, exposure);
+    if (REINHARD)
+        value = _mm_div_ps(value, _mm_add_ps(one, value));
+    // 第1引数がNaNなら第2引数が返る
+    value = _mm_max_ps(value, zero);
+    value = _mm_min_ps(value, one);
+    if (SRGB)
+        value = _mm_min_ps(linearToSRGB4(value), one);
+    value = _mm_add_ps(_mm_mul_ps(value, _mm_set1_ps(255.f)), threshold);
+    return _mm_cvttps_epi32(value);
+}
+
+static inline void storeBlock(unsigned char *out, __m128i value, bool useStreamingStore)
+{
+    if (useStreamingStore)
+        _mm_stream_si128((__m128i *)out, value);
+    else
+        _mm_storeu_si128((__m128i *)out, value);
+}
+#endif
+
+// RGB8への書き込み
+// RGBは成分が同じ並びなので連続した配列として変換できる
+template <bool REINHARD, bool SRGB>
+static void writeSpanRGB(
+    unsigned char *out, const float *in, unsigned int x, unsigned int y,
+    unsigned int count, const SpanWriteOption &option)
+{
+    size_t elementNum = (size_t)count * 3;
+    size_t i = 0;
+#ifdef __SSE2__
+    bool useStreamingStore = option.useStreamingStore;
+    // ストリーミングストアは16バイト境界が必要なので先頭はスカラーで処理
+    size_t head = useStreamingStore ? ((16 - ((uintptr_t)out & 15)) & 15) : 0;
+    if (head > elementNum)
+        head = elementNum;
+    for (; i < head; i++)
+        out[i] = quantize<REINHARD, SRGB>(
+            in[i], option.exposure, ditherThreshold(x + i / 3, y, option.useDithering));
+
+    // 閾値のパターン(48要素 = 16ピクセルで一巡)
+    alignas(16) float pattern[48];
+    for (size_t m = 0; m < 48; m++)
+        pattern[m] = ditherThreshold(x + (head + m) / 3, y, option.useDithering);
+
+    __m128 scale = _mm_set1_ps(option.exposure);
+    size_t phase = 0;
+    for (; i + 16 <= elementNum; i += 16)
+    {
+        const float *t = pattern + phase;
+        __m128i q0 = quantize4<REINHARD, SRGB>(_mm_loadu_ps(in + i + 0), scale, _mm_load_ps(t + 0));
+        __m128i q1 = quantize4<REINHARD, SRGB>(_mm_loadu_ps(in + i + 4), scale, _mm_load_ps(t + 4));
+        __m128i q2 = quantize4<REINHARD, SRGB>(_mm_loadu_ps(in + i + 8), scale, _mm_load_ps(t + 8));
+        __m128i q3 = quantize4<REINHARD, SRGB>(_mm_loadu_ps(in + i + 12), scale, _mm_load_ps(t + 12));
+        // 32bit -> 16bit -> 8bit に詰める
+        __m128i q01 = _mm_packs_epi32(q0, q1);
+        __m128i q23 = _mm_packs_epi32(q2, q3);
+        storeBlock(out + i, _mm_packus_epi16(q01, q23), useStreamingStore);
+
+        phase += 16;
+        if (phase == 48)
+            phase = 0;
+    }
+#endif
+    for (; i < elementNum; i++)
+        out[i] = quantize<REINHARD, SRGB>(
+            in[i], option.exposure, ditherThreshold(x + i / 3, y, option.useDithering));
+}
+
+// RGBA8への書き込み(アルファは0xff)
+template <bool REINHARD, bool SRGB>
+static void writeSpanRGBA(
+    unsigned char *out, const float *in, unsigned int x, unsigned int y,
+    unsigned int count, const SpanWriteOption &option)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    // 4バイト境界にない場合は16バイト境界に揃えられない
+    bool useStreamingStore = option.useStreamingStore && ((uintptr_t)out & 3) == 0;
+    unsigned int head = useStreamingStore ? ((16 - ((uintptr_t)out & 15)) & 15) / 4 : 0;
+    if (head > count)
+        head = count;
+    for (; i < head; i++)
+    {
+        float threshold = ditherThreshold(x + i, y, option.useDithering);
+        out[i * 4 + 0] = quantize<REINHARD, SRGB>(in[i * 3 + 0], option.exposure, threshold);
+        out[i * 4 + 1] = quantize<REINHARD, SRGB>(in[i * 3 + 1], option.exposure, threshold);
+        out[i * 4 + 2] = quantize<REINHARD, SRGB>(in[i * 3 + 2], option.exposure, threshold);
+        out[i * 4 + 3] = 0xff;
+    }
+
+    // 4ピクセルずつ処理するので閾値は行の中で変わらない
+    __m128 t[4];
+    for (unsigned int k = 0; k < 4; k++)
+        t[k] = _mm_set1_ps(ditherThreshold(x + i + k, y, option.useDithering));
+
+    __m128 scale = _mm_set1_ps(option.exposure);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    for (; i + 4 <= count; i += 4)
+    {
+        // r0g0b0r1 g1b1r2g2 b2r3g3b3 -> ピクセルごとに並び替え
+        const float *p = in + i * 3;
+        __m128 v0 = _mm_loadu_ps(p + 0);
+        __m128 v1 = _mm_loadu_ps(p + 4);
+        __m128 v2 = _mm_loadu_ps(p + 8);
+        __m128 p0 = v0;
+        __m128 p1 = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 0, 3, 3));
+        p1 = _mm_shuffle_ps(p1, p1, _MM_SHUFFLE(0, 3, 2, 1));
+        __m128 p2 = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(0, 0, 3, 2));
+        __m128 p3 = _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 2, 1));
+
+        __m128i q0 = quantize4<REINHARD, SRGB>(p0, scale, t[0]);
+        __m128i q1 = quantize4<REINHARD, SRGB>(p1, scale, t[1]);
+        __m128i q2 = quantize4<REINHARD, SRGB>(p2, scale, t[2]);
+        __m128i q3 = quantize4<REINHARD, SRGB>(p3, scale, t[3]);
+        __m128i q01 = _mm_packs_epi32(q0, q1);
+        __m128i q23 = _mm_packs_epi32(q2, q3);
+        // 各ピクセルの4バイト目をアルファで上書き
+        __m128i packed = _mm_or_si128(_mm_packus_epi16(q01, q23), alpha);
+        storeBlock(out + i * 4, packed, useStreamingStore);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float threshold = ditherThreshold(x + i, y, option.useDithering);
+        out[i * 4 + 0] = quantize<REINHARD, SRGB>(in[i * 3 + 0], option.exposure, threshold);
+        out[i * 4 + 1] = quantize<REINHARD, SRGB>(in[i * 3 + 1], option.exposure, threshold);
+        out[i * 4 + 2] = quantize<REINHARD, SRGB>(in[i * 3 + 2], option.exposure, threshold);
+        out[i * 4 + 3] = 0xff;
+    }
+}
+
+typedef void (*SpanWriter)(
+    unsigned char *, const float *, unsigned int, unsigned int,
+    unsigned int, const SpanWriteOption &);
+
+// チャネル数とオプションから変換関数を1度だけ選ぶ
+// (ピクセルごとの分岐をなくす)
+static SpanWriter selectSpanWriter(unsigned char channel, const SpanWriteOption &option)
+{
+    bool reinhard = option.op == TONEMAP_REINHARD;
+    if (channel == COLOR_RGBA)
+    {
+        if (reinhard)
+            return option.useSRGB ? writeSpanRGBA<true, true> : writeSpanRGBA<true, false>;
+        return option.useSRGB ? writeSpanRGBA<false, true> : writeSpanRGBA<false, false>;
+    }
+    if (reinhard)
+        return option.useSRGB ? writeSpanRGB<true, true> : writeSpanRGB<true, false>;
+    return option.useSRGB ? writeSpanRGB<false, true> : writeSpanRGB<false, false>;
+}
+
+void writeSpan(
+    BitMapData *bitmap, unsigned int x, unsigned int y,
+    const float *rgb, unsigned int count, const SpanWriteOption &option)
+{
+    if (bitmap->channel != COLOR_RGB && bitmap->channel != COLOR_RGBA)
+        return;
+
+    unsigned char *out = bitmap->pixelsData + ((size_t)y * bitmap->width + x) * bitmap->channel;
+    selectSpanWriter(bitmap->channel, option)(out, rgb, x, y, count, option);
+
+#ifdef __SSE2__
+    // ストリーミングストアを他のスレッドから見えるようにする
+    if (option.useStreamingStore)
+        _mm_sfence();
+#endif
+}
+
+void writeTile(
+    BitMapData *bitmap, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    const float *rgb, size_t stride, const SpanWriteOption &option)
+{
+    if (bitmap->channel != COLOR_RGB && bitmap->channel != COLOR_RGBA)
+        return;
+
+    SpanWriter writer = selectSpanWriter(bitmap->channel, option);
+    for (unsigned int row = 0; row < h; row++)
+    {
+        unsigned char *out =
+            bitmap->pixelsData + ((size_t)(y + row) * bitmap->width + x) * bitmap->channel;
+        writer(out, rgb + row * stride, x, y + row, w, option);
+    }
+
+#ifdef __SSE2__
+    if (option.useStreamingStore)
+        _mm_sfence();
+#endif
+}
+
+void toneMapping(
+    FloatBitMapData *src, BitMapData *dst, float exposure, TONEMAP_OPERATOR op)
+{
+    SpanWriteOption option;
+    option.exposure = exposure;
+    option.op = op;
+    writeTile(dst, 0, 0, src->width, src->height, src->pixelsData, (size_t)src->width * 3, option);
+}
@@ -0,0 +1,110 @@
+/* 浮動小数点フレームバッファ(HDR)のヘッダ */
+#pragma once
+#include "myPng.hpp"
+
+// EXRの圧縮形式
+enum EXR_COMPRESSION
+{
+    EXR_COMPRESSION_NONE = 0, // 無圧縮
+    EXR_COMPRESSION_RLE = 1,  // ランレングス圧縮
+};
+
+// EXRのピクセル形式
+enum EXR_PIXELTYPE
+{
+    EXR_PIXEL_HALF = 1,  // 16bit浮動小数点
+    EXR_PIXEL_FLOAT = 2, // 32bit浮動小数点
+};
+
+// トーンマッピングの方式
+enum TONEMAP_OPERATOR
+{
+    TONEMAP_CLAMP,    // 0〜1にクランプ(従来の描画結果と同じ)
+    TONEMAP_REINHARD, // x / (1 + x)
+};
+
+// float成分のビットマップデータ(RGB)
+// 放射輝度をクランプせずに保持する
+struct FloatBitMapData
+{
+    unsigned int width;          // 幅
+    unsigned int height;         // 高さ
+    float *pixelsData = nullptr; // ピクセルデータ(RGBの順)
+    unsigned char channel = 3;   // チャネル
+
+    FloatBitMapData() {}
+    FloatBitMapData(unsigned int w, unsigned int h)
+        : width(w), height(h) {}
+
+    // ピクセルデータ確保(0で初期化)
+    int allocation();
+
+    float *getPixel(unsigned int x, unsigned int y)
+    {
+        return pixelsData + ((size_t)y * width + x) * channel;
+    }
+
+    void setPixel(unsigned int x, unsigned int y, float r, float g, float b)
+    {
+        float *pixel = getPixel(x, y);
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+    }
+
+    // 複数パスの結果を蓄積する
+    void addPixel(unsigned int x, unsigned int y, float r, float g, float b)
+    {
+        float *pixel = getPixel(x, y);
+        pixel[0] += r;
+        pixel[1] += g;
+        pixel[2] += b;
+    }
+};
+
+int freeFloatBitmapData(FloatBitMapData *);
+
+// srcをdstの(x, y)の位置に加算する(タイル・パスの統合用)
+int accumulateFloatBitmapData(
+    FloatBitMapData *dst, FloatBitMapData *src, unsigned int x, unsigned int y);
+
+// 全ピクセルをscale倍する
+void scaleFloatBitmapData(FloatBitMapData *, float scale);
+
+// PFM(Portable Float Map)の読み書き
+int pfmFileRead(FloatBitMapData *, const char *);
+int pfmFileWrite(FloatBitMapData *, const char *);
+
+// OpenEXR(スキャンライン, 無圧縮 or RLE)の書き込み
+int exrFileWrite(
+    FloatBitMapData *, const char *, EXR_COMPRESSION compression, EXR_PIXELTYPE pixelType);
+
+// float -> half(16bit浮動小数点)変換
+unsigned short floatToHalf(float);
+
+// 行・タイル単位で8bitに書き込む際の設定
+struct SpanWriteOption
+{
+    float exposure = 1.f;                // 露出(変換前に掛ける)
+    TONEMAP_OPERATOR op = TONEMAP_CLAMP; // トーンマッピングの方式
+    bool useSRGB = false;                // sRGBのガンマをかけるか
+    bool useDithering = false;           // 4x4の組織的ディザをかけるか
+    bool useStreamingStore = true;       // キャッシュを経由せずに書き込むか
+};
+
+// float RGBのcount画素分を(x, y)から右方向に書き込む
+// 1画素だけならdrawDotを使う
+void writeSpan(
+    BitMapData *bitmap, unsigned int x, unsigned int y,
+    const float *rgb, unsigned int count, const SpanWriteOption &option = SpanWriteOption());
+
+// 幅w×高さhのタイルを(x, y)に書き込む(strideは1行のfloat数)
+void writeTile(
+    BitMapData *bitmap, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    const float *rgb, size_t stride, const SpanWriteOption &option = SpanWriteOption());
+
+// トーンマッピングと8bit量子化
+// exposureを掛けてから変換する
+void toneMapping(
+    FloatBitMapData *src, BitMapData *dst, float exposure = 1.f,
+    TONEMAP_OPERATOR op = TONEMAP_CLAMP);
@@ -0,0 +1,236 @@
+#include <atomic>
+#include <thread>
+#include <typeinfo>
+#include "incremental.hpp"
+#include "lightCache.hpp"
+
+static bool sameVector(Vector3 a, Vector3 b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static bool sameCamera(Camera *a, Camera *b)
+{
+    if (!sameVector(a->position, b->position) || a->type != b->type)
+        return false;
+    return a->type != CAMERA_PINHOLE ||
+           (sameVector(a->target, b->target) && sameVector(a->up, b->up) && a->fov == b->fov);
+}
+
+static bool sameColor(FColor a, FColor b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+// マテリアルが同じか(テクスチャはキャッシュ内の番号で比べる)
+static bool sameMaterial(Material *a, Material *b)
+{
+    if ((a->diffuseTexture == nullptr) != (b->diffuseTexture == nullptr))
+        return false;
+    if (a->diffuseTexture != nullptr &&
+        (a->diffuseTexture->id != b->diffuseTexture->id || a->textureScale != b->textureScale))
+        return false;
+    return sameColor(a->ambient, b->ambient) && sameColor(a->diffuse, b->diffuse) &&
+           sameColor(a->specular, b->specular) && sameColor(a->reflection, b->reflection) &&
+           a->shininess == b->shininess && a->refractionIndex == b->refractionIndex &&
+           a->useReflection == b->useReflection && a->useRefraction == b->useRefraction;
+}
+
+// ジオメトリの形が同じか
+static bool sameShape(Shape *a, Shape *b)
+{
+    if (typeid(*a) != typeid(*b))
+        return false;
+    if (Sphere *sa = dynamic_cast<Sphere *>(a))
+    {
+        Sphere *sb = (Sphere *)b;
+        return sameVector(sa->center, sb->center) && sa->radius == sb->radius;
+    }
+    if (Plane *pa = dynamic_cast<Plane *>(a))
+    {
+        Plane *pb = (Plane *)b;
+        return sameVector(pa->normal, pb->normal) && sameVector(pa->position, pb->position);
+    }
+    return a == b;
+}
+
+// 光源が同じか
+static bool sameLight(Light *a, Light *b)
+{
+    if (typeid(*a) != typeid(*b))
+        return false;
+    if (PointLight *pa = dynamic_cast<PointLight *>(a))
+    {
+        PointLight *pb = (PointLight *)b;
+        return sameVector(pa->position, pb->position) && sameColor(pa->intensity, pb->intensity);
+    }
+    if (DirectionalLight *da = dynamic_cast<DirectionalLight *>(a))
+    {
+        DirectionalLight *db = (DirectionalLight *)b;
+        return sameVector(da->direction, db->direction) &&
+               sameColor(da->intensity, db->intensity);
+    }
+    return a == b;
+}
+
+void diffScenes(Scene *before, Scene *after, std::vector<SceneEdit> *edits)
+{
+    edits->clear();
+
+    // 画素すべてに影響する設定
+    if (before->bitmap->width != after->bitmap->width ||
+        before->bitmap->height != after->bitmap->height ||
+        !sameCamera(before->camera, after->camera) ||
+        before->samplingNum != after->samplingNum ||
+        before->geometryNum != after->geometryNum || before->lightNum != after->lightNum ||
+        before->globalRefractionIndex != after->globalRefractionIndex ||
+        before->clampLuminance != after->clampLuminance ||
+        before->maxRecursiveLevel != after->maxRecursiveLevel ||
+        before->contributionCutoff != after->contributionCutoff ||
+        before->russianRouletteLevel != after->russianRouletteLevel ||
+        before->russianRouletteThreshold != after->russianRouletteThreshold ||
+        (before->lightTree == nullptr) != (after->lightTree == nullptr) ||
+        before->lightSampleNum != after->lightSampleNum ||
+        before->exhaustiveLightNum != after->exhaustiveLightNum ||
+        (before->compiledScene != nullptr && before->sortedShading) !=
+            (after->compiledScene != nullptr && after->sortedShading) ||
+        before->deferSecondaryRays != after->deferSecondaryRays ||
+        before->rasterizePrimary != after->rasterizePrimary ||
+        (before->directLightCache == nullptr) != (after->directLightCache == nullptr))
+    {
+        edits->push_back({SCENE_EDIT_ALL, -1});
+        return;
+    }
+
+    for (int idx = 0; idx < before->geometryNum; idx++)
+    {
+        // 形が変わると新しく遮る・映り込む画素は分からない
+        if (!sameShape(before->geometry[idx], after->geometry[idx]))
+        {
+            edits->clear();
+            edits->push_back({SCENE_EDIT_ALL, -1});
+            return;
+        }
+        if (!sameMaterial(&before->geometry[idx]->material, &after->geometry[idx]->material))
+            edits->push_back({SCENE_EDIT_MATERIAL, idx});
+    }
+    for (int idx = 0; idx < before->lightNum; idx++)
+    {
+        if (!sameLight(before->light[idx], after->light[idx]))
+            edits->push_back({SCENE_EDIT_LIGHT, idx});
+    }
+    if (!sameColor(before->backgroundColor, after->backgroundColor))
+        edits->push_back({SCENE_EDIT_BACKGROUND, -1});
+    if (!sameColor(before->ambientIntensity, after->ambientIntensity))
+        edits->push_back({SCENE_EDIT_AMBIENT, -1});
+}
+
+// タイルが変更の影響を受けるか
+static bool isInvalidated(TileDependencies *tile, const std::vector<SceneEdit> &edits)
+{
+    for (auto &edit : edits)
+    {
+        switch (edit.type)
+        {
+        case SCENE_EDIT_MATERIAL:
+            if (tile->hasShape(edit.index) || tile->directLightCache)
+                return true;
+            break;
+        case SCENE_EDIT_LIGHT:
+            if (tile->hasLight(edit.index) || tile->lightTree || tile->directLightCache)
+                return true;
+            break;
+        case SCENE_EDIT_BACKGROUND:
+            if (tile->background)
+                return true;
+            break;
+        case SCENE_EDIT_AMBIENT:
+            if (tile->hasAnyShape())
+                return true;
+            break;
+        default:
+            return true;
+        }
+    }
+    return false;
+}
+
+int renderIncremental(
+    Scene *scene, FloatBitMapData *hdrBitmap, IncrementalState *state,
+    const std::vector<SceneEdit> &edits, unsigned int workerNum, IncrementalStats *stats)
+{
+    if (hdrBitmap->width != scene->bitmap->width || hdrBitmap->height != scene->bitmap->height)
+    {
+        printf("incremental size error\n");
+        return -1;
+    }
+
+    // 初回・大きさが変わった場合は全タイルを描画する
+    bool renderAll = state->tiles.empty() || state->width != hdrBitmap->width ||
+                     state->height != hdrBitmap->height;
+    if (renderAll)
+    {
+        state->width = hdrBitmap->width;
+        state->height = hdrBitmap->height;
+        state->tileCountX = (state->width + INCREMENTAL_TILE_SIZE - 1) / INCREMENTAL_TILE_SIZE;
+        state->tileCountY = (state->height + INCREMENTAL_TILE_SIZE - 1) / INCREMENTAL_TILE_SIZE;
+        state->tiles.assign(state->tileCountX * state->tileCountY, TileDependencies());
+    }
+
+    // 直接光キャッシュの値は光源・ジオメトリ・マテリアル・環境光の変更で古くなるので空にする
+    // (キャッシュを引いたタイルはすべて描き直すので，全体を描き直した場合と同じ順番で格納される)
+    if (scene->directLightCache != nullptr)
+    {
+        for (auto &edit : edits)
+        {
+            if (edit.type != SCENE_EDIT_BACKGROUND)
+            {
+                clearDirectLightCache(scene->directLightCache);
+                break;
+            }
+        }
+    }
+
+    // 描き直すタイル
+    std::vector<unsigned int> dirtyTiles;
+    for (unsigned int idx = 0; idx < state->tiles.size(); idx++)
+    {
+        if (renderAll || isInvalidated(&state->tiles[idx], edits))
+            dirtyTiles.push_back(idx);
+    }
+    stats->invalidatedTiles = (unsigned int)dirtyTiles.size();
+    stats->reusedTiles = (unsigned int)(state->tiles.size() - dirtyTiles.size());
+
+    // 各スレッドは描き直すタイルを1つずつ取り出して描画し，依存関係を記録し直す
+    std::atomic<unsigned int> next(0);
+    auto worker = [&]()
+    {
+        unsigned int i;
+        while ((i = next.fetch_add(1)) < dirtyTiles.size())
+        {
+            unsigned int idx = dirtyTiles[i];
+            unsigned int x = (idx % state->tileCountX) * INCREMENTAL_TILE_SIZE;
+            unsigned int y = (idx / state->tileCountX) * INCREMENTAL_TILE_SIZE;
+            unsigned int w = (x + INCREMENTAL_TILE_SIZE > state->width)
+                                 ? state->width - x : INCREMENTAL_TILE_SIZE;
+            unsigned int h = (y + INCREMENTAL_TILE_SIZE > state->height)
+                                 ? state->height - y : INCREMENTAL_TILE_SIZE;
+
+            TileDependencies *tile = &state->tiles[idx];
+            tile->reset(scene->geometryNum, scene->lightNum);
+            setTileDependencies(tile);
+            renderTile(scene, x, y, w, h, hdrBitmap->getPixel(x, y), (size_t)hdrBitmap->width * 3);
+            setTileDependencies(nullptr);
+        }
+    };
+
+    if (workerNum == 0)
+        workerNum = 1;
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    return 0;
+}
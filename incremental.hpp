@@ -0,0 +1,52 @@
+/* シーン変更後の差分再描画 */
+#pragma once
+#include <vector>
+#include "raytracing_lib.hpp"
+
+#define INCREMENTAL_TILE_SIZE 32 // 依存関係を記録するタイルの大きさ
+
+// シーンの変更の種類
+enum SCENE_EDIT_TYPE
+{
+    SCENE_EDIT_MATERIAL,   // ジオメトリindexのマテリアル
+    SCENE_EDIT_LIGHT,      // 光源index(位置・向き・強さ・種類)
+    SCENE_EDIT_BACKGROUND, // 背景色
+    SCENE_EDIT_AMBIENT,    // 環境光
+    SCENE_EDIT_ALL,        // ジオメトリの形・数，カメラ，描画設定など(全タイルを描き直す)
+};
+
+// シーンの変更
+struct SceneEdit
+{
+    SCENE_EDIT_TYPE type;
+    int index; // ジオメトリ番号か光源番号(それ以外は-1)
+};
+
+// 差分再描画の状態(タイルごとの依存関係)
+struct IncrementalState
+{
+    unsigned int width = 0;      // 画像の幅
+    unsigned int height = 0;     // 画像の高さ
+    unsigned int tileCountX = 0; // 横方向のタイル数
+    unsigned int tileCountY = 0; // 縦方向のタイル数
+    std::vector<TileDependencies> tiles;
+};
+
+// 差分再描画の統計
+struct IncrementalStats
+{
+    unsigned int invalidatedTiles; // 描き直したタイル数
+    unsigned int reusedTiles;      // 前の結果を使ったタイル数
+};
+
+// 2つのシーンを比べて変更を列挙する
+// 球・平面・点光源・平行光源以外は比べられないので変更があったものとして扱う
+void diffScenes(Scene *before, Scene *after, std::vector<SceneEdit> *edits);
+
+// 変更の影響を受けるタイルだけ描画し直してhdrBitmapに上書きし，依存関係を記録し直す
+// stateが空(初回)か画像の大きさが違えば全タイルを描画する
+// 光源・マテリアルを変えた場合はlightTree・compiledSceneを作り直してから呼ぶこと
+// 背景色以外の変更があればscene->directLightCacheを空にする
+int renderIncremental(
+    Scene *scene, FloatBitMapData *hdrBitmap, IncrementalState *state,
+    const std::vector<SceneEdit> &edits, unsigned int workerNum, IncrementalStats *stats);
@@ -0,0 +1,266 @@
+#include <atomic>
+#include <math.h>
+#include "lightCache.hpp"
+
+// 1セル(keyが0なら空き)
+// 値は複数のスレッドから足すので，読み出しは足している途中の値になることがある
+struct DirectLightCacheEntry
+{
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> count;
+    std::atomic<float> sum[3];
+    std::atomic<float> sumSquares;       // サンプルの輝度((r+g+b)/3)の2乗和(誤差の見積もり用)
+};
+
+struct DirectLightCache
+{
+    DirectLightCacheOption option;
+    float inverseCellSize;
+    size_t mask; // セル数-1
+    DirectLightCacheEntry *entries;
+};
+
+static thread_local DirectLightCacheStats directLightCacheStats = {};
+
+// std::atomic<float>への加算(CASで更新する)
+static inline void atomicAdd(std::atomic<float> *target, float value)
+{
+    float old = target->load(std::memory_order_relaxed);
+    while (!target->compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+        ;
+}
+
+// セルの平均を使ってよいか
+// サンプル数が足りていて，平均の標準誤差(輝度の分散/サンプル数の平方根)が誤差の上限以下
+// 影の境界など場所によって値が変わるセルや，光源を選ぶ場合にサンプルが少ないセルは使わない
+static bool entryUsable(DirectLightCacheEntry *entry, uint32_t count, float errorBound)
+{
+    if (count < DIRECT_LIGHT_CACHE_MIN_SAMPLES)
+        return false;
+    float inverse = 1.f / (float)count;
+    float sum = (entry->sum[0].load(std::memory_order_relaxed) +
+                 entry->sum[1].load(std::memory_order_relaxed) +
+                 entry->sum[2].load(std::memory_order_relaxed)) / 3.f;
+    float mean = sum * inverse;
+    float variance = entry->sumSquares.load(std::memory_order_relaxed) * inverse - mean * mean;
+    return variance * inverse <= errorBound * errorBound;
+}
+
+DirectLightCache *createDirectLightCache(const DirectLightCacheOption &option)
+{
+    if (option.cellSize <= 0.f || option.tableBits == 0 || option.tableBits > 30)
+    {
+        printf("直接光キャッシュの設定が不正です\n");
+        return nullptr;
+    }
+    DirectLightCache *cache = new DirectLightCache();
+    cache->option = option;
+    cache->inverseCellSize = 1.f / option.cellSize;
+    size_t entryNum = (size_t)1 << option.tableBits;
+    cache->mask = entryNum - 1;
+    cache->entries = new DirectLightCacheEntry[entryNum];
+    recordMemoryAllocation(MEMORY_SCENE, entryNum * sizeof(DirectLightCacheEntry));
+    clearDirectLightCache(cache);
+    return cache;
+}
+
+void freeDirectLightCache(DirectLightCache *cache)
+{
+    recordMemoryRelease(MEMORY_SCENE, (cache->mask + 1) * sizeof(DirectLightCacheEntry));
+    delete[] cache->entries;
+    delete cache;
+}
+
+void clearDirectLightCache(DirectLightCache *cache)
+{
+    for (size_t i = 0; i <= cache->mask; i++)
+    {
+        DirectLightCacheEntry *entry = &cache->entries[i];
+        entry->key.store(0, std::memory_order_relaxed);
+        entry->count.store(0, std::memory_order_relaxed);
+        for (int c = 0; c < 3; c++)
+            entry->sum[c].store(0.f, std::memory_order_relaxed);
+        entry->sumSquares.store(0.f, std::memory_order_relaxed);
+    }
+}
+
+bool directLightCacheable(Material *material)
+{
+    return !material->useReflection && !material->useRefraction &&
+           material->diffuseTexture == nullptr;
+}
+
+// 絶対値が最大の成分とその符号で6方向に分ける
+static inline unsigned int directionBin(Vector3 v)
+{
+    float ax = fabsf(v.x), ay = fabsf(v.y), az = fabsf(v.z);
+    if (ax >= ay && ax >= az)
+        return v.x >= 0.f ? 0 : 1;
+    if (ay >= az)
+        return v.y >= 0.f ? 2 : 3;
+    return v.z >= 0.f ? 4 : 5;
+}
+
+static inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// セルのキー(0は空きを表すので使わない)
+// ジオメトリ番号は下位24bitを使う．64bitのハッシュの衝突は無視する
+static inline uint64_t cellKey(int ix, int iy, int iz, unsigned int bins, int shapeIndex)
+{
+    uint64_t h = mix64(((uint64_t)(uint32_t)ix << 32) | (uint32_t)iy);
+    uint64_t rest =
+        ((uint64_t)(uint32_t)iz << 32) | ((uint64_t)bins << 24) | (uint32_t)shapeIndex;
+    h = mix64(h ^ rest);
+    return h == 0 ? 1 : h;
+}
+
+// キーのセルを探す(createなら空きセルを確保する．なければnullptr)
+static DirectLightCacheEntry *findEntry(DirectLightCache *cache, uint64_t key, bool create)
+{
+    size_t idx = (size_t)key & cache->mask;
+    for (int probe = 0; probe < DIRECT_LIGHT_CACHE_MAX_PROBE; probe++)
+    {
+        DirectLightCacheEntry *entry = &cache->entries[(idx + probe) & cache->mask];
+        uint64_t current = entry->key.load(std::memory_order_acquire);
+        if (current == key)
+            return entry;
+        if (current == 0)
+        {
+            if (!create)
+                return nullptr;
+            // 空きセルを確保する(他のスレッドが先に確保したらそのキーを確かめる)
+            if (entry->key.compare_exchange_strong(current, key, std::memory_order_acq_rel) ||
+                current == key)
+                return entry;
+        }
+    }
+    return nullptr;
+}
+
+// 法線・視線の向きをまとめた値(視線によらないマテリアルは視線を6にする)
+static inline unsigned int pointBins(IntersectionPoint *point, Ray *ray, Material *material)
+{
+    bool viewDependent =
+        material->specular.r != 0.f || material->specular.g != 0.f || material->specular.b != 0.f;
+    unsigned int viewBin = viewDependent ? directionBin(ray->direction) : 6;
+    return directionBin(point->normal) * 8 + viewBin;
+}
+
+bool lookupDirectLight(
+    DirectLightCache *cache, IntersectionPoint *point, Ray *ray, int shapeIndex,
+    Material *material, FColor *luminance)
+{
+    DirectLightCacheStats *stats = &directLightCacheStats;
+    stats->lookups++;
+    unsigned int bins = pointBins(point, ray, material);
+    float errorBound = cache->option.errorBound;
+
+    // 交点を含むセルが使えなければ計算し直す
+    float px = point->position.x * cache->inverseCellSize;
+    float py = point->position.y * cache->inverseCellSize;
+    float pz = point->position.z * cache->inverseCellSize;
+    int cx = (int)floorf(px), cy = (int)floorf(py), cz = (int)floorf(pz);
+    DirectLightCacheEntry *center =
+        findEntry(cache, cellKey(cx, cy, cz, bins, shapeIndex), false);
+    if (center == nullptr)
+        return false;
+    uint32_t count = center->count.load(std::memory_order_acquire);
+    if (count < DIRECT_LIGHT_CACHE_MIN_SAMPLES)
+        return false;
+    if (!entryUsable(center, count, errorBound))
+    {
+        stats->rejected++;
+        return false;
+    }
+
+    if (!cache->option.interpolate)
+    {
+        float inverse = 1.f / (float)count;
+        luminance->r = center->sum[0].load(std::memory_order_relaxed) * inverse;
+        luminance->g = center->sum[1].load(std::memory_order_relaxed) * inverse;
+        luminance->b = center->sum[2].load(std::memory_order_relaxed) * inverse;
+        stats->hits++;
+        return true;
+    }
+
+    // セルの中心を格子点とみなして周りの8セルから三重線形補間する
+    // 使えないセルは除いて重みを正規化する
+    float gx = px - 0.5f, gy = py - 0.5f, gz = pz - 0.5f;
+    int bx = (int)floorf(gx), by = (int)floorf(gy), bz = (int)floorf(gz);
+    float fx = gx - (float)bx, fy = gy - (float)by, fz = gz - (float)bz;
+    float r = 0.f, g = 0.f, b = 0.f, weightSum = 0.f;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+        float weight = (dx ? fx : 1.f - fx) * (dy ? fy : 1.f - fy) * (dz ? fz : 1.f - fz);
+        if (weight <= 0.f)
+            continue;
+        int ix = bx + dx, iy = by + dy, iz = bz + dz;
+        DirectLightCacheEntry *entry =
+            (ix == cx && iy == cy && iz == cz)
+                ? center
+                : findEntry(cache, cellKey(ix, iy, iz, bins, shapeIndex), false);
+        if (entry == nullptr)
+            continue;
+        uint32_t n = entry->count.load(std::memory_order_acquire);
+        if (!entryUsable(entry, n, errorBound))
+            continue;
+        float scale = weight / (float)n;
+        r += scale * entry->sum[0].load(std::memory_order_relaxed);
+        g += scale * entry->sum[1].load(std::memory_order_relaxed);
+        b += scale * entry->sum[2].load(std::memory_order_relaxed);
+        weightSum += weight;
+    }
+    if (weightSum <= 0.f)
+        return false;
+    float inverse = 1.f / weightSum;
+    *luminance = FColor(r * inverse, g * inverse, b * inverse);
+    stats->hits++;
+    return true;
+}
+
+void insertDirectLight(
+    DirectLightCache *cache, IntersectionPoint *point, Ray *ray, int shapeIndex,
+    Material *material, FColor luminance)
+{
+    DirectLightCacheStats *stats = &directLightCacheStats;
+    int cx = (int)floorf(point->position.x * cache->inverseCellSize);
+    int cy = (int)floorf(point->position.y * cache->inverseCellSize);
+    int cz = (int)floorf(point->position.z * cache->inverseCellSize);
+    uint64_t key = cellKey(cx, cy, cz, pointBins(point, ray, material), shapeIndex);
+    DirectLightCacheEntry *entry = findEntry(cache, key, true);
+    if (entry == nullptr)
+    {
+        stats->overflows++;
+        return;
+    }
+    if (entry->count.load(std::memory_order_relaxed) >= DIRECT_LIGHT_CACHE_MAX_SAMPLES)
+        return;
+
+    float value = (luminance.r + luminance.g + luminance.b) / 3.f;
+    atomicAdd(&entry->sumSquares, value * value);
+    atomicAdd(&entry->sum[0], luminance.r);
+    atomicAdd(&entry->sum[1], luminance.g);
+    atomicAdd(&entry->sum[2], luminance.b);
+    // 和を足してから数を増やす(読み出し側が数だけ増えた値を見ないように)
+    entry->count.fetch_add(1, std::memory_order_release);
+    stats->inserts++;
+}
+
+DirectLightCacheStats getDirectLightCacheStats()
+{
+    return directLightCacheStats;
+}
+
+void resetDirectLightCacheStats()
+{
+    directLightCacheStats = {};
+}
@@ -0,0 +1,53 @@
+/* 拡散面の直接光キャッシュ(位置と法線で引くハッシュ格子) */
+#pragma once
+#include <stdint.h>
+#include "raytracing_lib.hpp"
+
+#define DIRECT_LIGHT_CACHE_MIN_SAMPLES 8  // セルを使い始めるまでに集めるサンプル数
+#define DIRECT_LIGHT_CACHE_MAX_SAMPLES 64 // セルに足すサンプル数の上限
+#define DIRECT_LIGHT_CACHE_MAX_PROBE 16   // 空きセルを探す最大の距離(超えたら格納しない)
+
+struct DirectLightCacheOption
+{
+    float cellSize = 0.05f;   // 格子の1辺の長さ(ワールド座標)
+    float errorBound = 0.02f; // セルの平均の標準誤差(輝度)がこれを超えたらそのセルは使わない
+    bool interpolate = true;  // 周りの8セルから三重線形補間するか(falseなら交点を含むセルだけ)
+    unsigned int tableBits = 18; // セルの数は2^tableBits
+};
+
+// キャッシュの統計(スレッドごと)
+struct DirectLightCacheStats
+{
+    unsigned long long lookups;  // キャッシュを引いた回数
+    unsigned long long hits;     // キャッシュの値を使った回数
+    unsigned long long rejected; // サンプルは足りているが誤差の上限を超えていて使わなかった回数
+    unsigned long long inserts;  // 計算した直接光を格納した回数
+    unsigned long long overflows; // 表が埋まっていて格納できなかった回数
+};
+
+struct DirectLightCache;
+
+// キャッシュを作る/解放する
+DirectLightCache *createDirectLightCache(const DirectLightCacheOption &option);
+void freeDirectLightCache(DirectLightCache *cache);
+
+// すべてのセルを空にする(ジオメトリ・光源を変更したら呼ぶ．描画中に呼ばないこと)
+void clearDirectLightCache(DirectLightCache *cache);
+
+// キャッシュしてよいマテリアルか(完全鏡面反射・屈折・テクスチャを使わないもの)
+bool directLightCacheable(Material *material);
+
+// 交点の直接光(shadowingの結果)をキャッシュから求める(なければfalse)
+// セルは位置・法線の向き・ジオメトリ番号(鏡面反射係数があれば視線の向きも)で分ける
+bool lookupDirectLight(
+    DirectLightCache *cache, IntersectionPoint *point, Ray *ray, int shapeIndex,
+    Material *material, FColor *luminance);
+
+// 計算した直接光をキャッシュに足す(複数のスレッドから同時に呼んでよい．ロックは使わない)
+void insertDirectLight(
+    DirectLightCache *cache, IntersectionPoint *point, Ray *ray, int shapeIndex,
+    Material *material, FColor luminance);
+
+// 現在のスレッドの統計を取得する/0に戻す
+DirectLightCacheStats getDirectLightCacheStats();
+void resetDirectLightCacheStats();
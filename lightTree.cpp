@@ -0,0 +1,179 @@
+#include <algorithm>
+#include "lightTree.hpp"
+
+// 木を作るときの点光源
+struct LightTreeItem
+{
+    Vector3 position;
+    float power;
+    int lightIndex;
+};
+
+static float axisOf(Vector3 v, int axis)
+{
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+}
+
+// items[begin, end)を含むノードを作って番号を返す
+static int buildNode(LightTree *tree, std::vector<LightTreeItem> &items, size_t begin, size_t end)
+{
+    LightTreeNode node;
+    node.boundsMin = items[begin].position;
+    node.boundsMax = items[begin].position;
+    node.power = 0.f;
+    node.left = -1;
+    node.right = -1;
+    node.lightIndex = -1;
+    for (size_t i = begin; i < end; i++)
+    {
+        Vector3 p = items[i].position;
+        node.boundsMin = Vector3(
+            std::min(node.boundsMin.x, p.x), std::min(node.boundsMin.y, p.y),
+            std::min(node.boundsMin.z, p.z));
+        node.boundsMax = Vector3(
+            std::max(node.boundsMax.x, p.x), std::max(node.boundsMax.y, p.y),
+            std::max(node.boundsMax.z, p.z));
+        node.power += items[i].power;
+    }
+
+    int idx = (int)tree->nodes.size();
+    tree->nodes.push_back(node);
+    if (end - begin == 1)
+    {
+        tree->nodes[idx].lightIndex = items[begin].lightIndex;
+        return idx;
+    }
+
+    // 最も長い軸の中央値で分割する
+    Vector3 extent = node.boundsMax - node.boundsMin;
+    int axis = 0;
+    if (extent.y > axisOf(extent, axis))
+        axis = 1;
+    if (extent.z > axisOf(extent, axis))
+        axis = 2;
+    size_t middle = (begin + end) / 2;
+    std::nth_element(
+        items.begin() + begin, items.begin() + middle, items.begin() + end,
+        [axis](const LightTreeItem &a, const LightTreeItem &b)
+        { return axisOf(a.position, axis) < axisOf(b.position, axis); });
+
+    int left = buildNode(tree, items, begin, middle);
+    int right = buildNode(tree, items, middle, end);
+    tree->nodes[idx].left = left;
+    tree->nodes[idx].right = right;
+    return idx;
+}
+
+// 光源の木のおおよそのバイト数(構築後は配列の大きさが変わらない)
+static size_t lightTreeBytes(LightTree *tree)
+{
+    return sizeof(LightTree) + tree->nodes.capacity() * sizeof(LightTreeNode) +
+           tree->otherLights.capacity() * sizeof(int);
+}
+
+LightTree *buildLightTree(Light **lights, int lightNum)
+{
+    LightTree *tree = new LightTree();
+    std::vector<LightTreeItem> items;
+    for (int i = 0; i < lightNum; i++)
+    {
+        PointLight *point = dynamic_cast<PointLight *>(lights[i]);
+        if (point == nullptr)
+        {
+            tree->otherLights.push_back(i);
+            continue;
+        }
+        LightTreeItem item;
+        item.position = point->position;
+        item.power = (point->intensity.r + point->intensity.g + point->intensity.b) / 3.f;
+        item.lightIndex = i;
+        // 強さ0の光源は選ばない
+        if (item.power > 0.f)
+            items.push_back(item);
+    }
+
+    tree->pointLightNum = (unsigned int)items.size();
+    if (!items.empty())
+        buildNode(tree, items, 0, items.size());
+    recordMemoryAllocation(MEMORY_SCENE, lightTreeBytes(tree));
+    return tree;
+}
+
+void freeLightTree(LightTree *tree)
+{
+    recordMemoryRelease(MEMORY_SCENE, lightTreeBytes(tree));
+    delete tree;
+}
+
+// 交点から見たノードの重要度
+// PointLightは距離で減衰しないので，強さと入射角のcosの上限で重みを付ける
+static float nodeImportance(LightTreeNode *node, Vector3 position, Vector3 normal)
+{
+    // 範囲の角のうち最も法線側にあるもの
+    float maxHeight = -FLT_MAX;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3 c(
+            (corner & 1) ? node->boundsMax.x : node->boundsMin.x,
+            (corner & 2) ? node->boundsMax.y : node->boundsMin.y,
+            (corner & 4) ? node->boundsMax.z : node->boundsMin.z);
+        maxHeight = std::max(maxHeight, normal.dot(c - position));
+    }
+    // 範囲がすべて法線の裏側なら寄与しない
+    if (maxHeight < 0.f)
+        return 0.f;
+
+    // 交点から範囲までの最短距離
+    Vector3 nearest(
+        std::min(std::max(position.x, node->boundsMin.x), node->boundsMax.x),
+        std::min(std::max(position.y, node->boundsMin.y), node->boundsMax.y),
+        std::min(std::max(position.z, node->boundsMin.z), node->boundsMax.z));
+    Vector3 toNearest = nearest - position;
+    float distance = mySqrt(toNearest.dot(toNearest));
+
+    // cosの上限(範囲内のどの光源のcosもこれを超えない)
+    float cosBound = 1.f;
+    if (distance > 1e-4f)
+        cosBound = std::min(1.f, maxHeight / distance);
+    // 寄与が0に近くても選ばれる確率を0にはしない
+    cosBound = std::max(cosBound, 1e-3f);
+    return node->power * cosBound;
+}
+
+int sampleLightTree(
+    LightTree *tree, Vector3 position, Vector3 normal, Sampler *sampler, float *pdf)
+{
+    *pdf = 0.f;
+    if (tree->nodes.empty())
+        return -1;
+
+    float probability = 1.f;
+    int idx = 0;
+    if (nodeImportance(&tree->nodes[0], position, normal) == 0.f)
+        return -1;
+
+    while (tree->nodes[idx].lightIndex == -1)
+    {
+        LightTreeNode *node = &tree->nodes[idx];
+        float left = nodeImportance(&tree->nodes[node->left], position, normal);
+        float right = nodeImportance(&tree->nodes[node->right], position, normal);
+        float total = left + right;
+        if (total <= 0.f)
+            return -1;
+
+        float p = left / total;
+        if (sampler->next() < p)
+        {
+            probability *= p;
+            idx = node->left;
+        }
+        else
+        {
+            probability *= 1.f - p;
+            idx = node->right;
+        }
+    }
+
+    *pdf = probability;
+    return tree->nodes[idx].lightIndex;
+}
@@ -0,0 +1,36 @@
+/* 多数の光源から確率的に光源を選ぶための階層構造 */
+#pragma once
+#include <vector>
+#include "raytracing_lib.hpp"
+
+// 光源の木のノード
+struct LightTreeNode
+{
+    Vector3 boundsMin; // 含まれる点光源の位置の範囲
+    Vector3 boundsMax;
+    float power;       // 含まれる点光源の強さ(RGBの平均)の合計
+    int left;          // 子ノード(葉なら-1)
+    int right;
+    int lightIndex;    // 葉の光源番号(Scene::lightの添字)
+};
+
+// 点光源のBVH
+// 交点から見た重要度(強さ×入射角のcosの上限)で子ノードを選びながら降りて光源を1つ選ぶ
+struct LightTree
+{
+    std::vector<LightTreeNode> nodes; // nodes[0]が根
+    std::vector<int> otherLights;     // 木に入れない光源(平行光源など)．毎回すべて評価する
+    unsigned int pointLightNum;       // 木に入れた点光源の数
+};
+
+// 光源の木を作る
+LightTree *buildLightTree(Light **lights, int lightNum);
+
+// 光源の木を解放する
+void freeLightTree(LightTree *tree);
+
+// 交点positionに寄与する点光源を1つ選ぶ
+// 選んだ光源番号を返し，選ばれる確率をpdfに入れる
+// 法線の裏側にしかない光源は選ばない(寄与が0なので不偏性は保たれる)．選べる光源がなければ-1
+int sampleLightTree(
+    LightTree *tree, Vector3 position, Vector3 normal, Sampler *sampler, float *pdf);
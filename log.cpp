@@ -1,9 +1,282 @@
 #include "log.hpp"
 #include <stdarg.h>
+#include <ctype.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define LOG_BATCH_BYTES (64 * 1024) // 書き込み用のスレッドが1度に書き込む量
+#define LOG_IDLE_SLEEP_US 1000       // 積まれたレコードがないときに待つ時間
+
+// レコードの種類
+enum LOG_RECORD_KIND
+{
+    LOG_RECORD_FORMAT, // 書式番号と引数
+    LOG_RECORD_TEXT,   // 書式化済みの文字列(続くスロットに本文が入る)
+};
+
+// リングバッファの1スロット(キャッシュライン1本分)
+struct LogSlot
+{
+    unsigned short formatId;
+    unsigned char kind;        // LOG_RECORD_KIND
+    unsigned char argNum;
+    unsigned short argTypes;   // 引数ごとに2bitのLOG_ARG_TYPE
+    unsigned short textLength; // LOG_RECORD_TEXTの本文の長さ
+    unsigned long long args[LOG_MAX_ARGS];
+};
+static_assert(sizeof(LogSlot) == 64, "LogSlot must be 64 bytes");
+
+// スレッドごとのリングバッファ(書き込むスレッドと書き込み用のスレッドの1対1)
+struct LogRing
+{
+    LogSlot slots[LOG_RING_SLOTS];
+    alignas(64) std::atomic<unsigned long long> head; // 次に書くスロット(積むスレッドだけが進める)
+    alignas(64) std::atomic<unsigned long long> tail; // 次に読むスロット(書き込み用のスレッドだけが進める)
+    std::atomic<unsigned long long> dropped;          // いっぱいで捨てたレコード数
+    LogRing *next;                                    // 全スレッドのリングの連結リスト
+};
 
 static FILE *logFile;
+static LOG_MODE logMode = LOG_MODE_TEXT;
+
+// バイナリモードの状態
+static std::atomic<LogRing *> logRings(nullptr);
+static std::atomic<unsigned int> logGeneration(0); // initLogFileのたびに増やす
+static std::atomic<bool> logStop(false);
+static std::atomic<unsigned long long> retiredDropCount(0); // 解放したリングで捨てた数
+static std::thread logWriter;
+static thread_local LogRing *threadRing = nullptr;
+static thread_local unsigned int threadRingGeneration = 0;
+
+// 登録した書式
+static const char *logFormats[LOG_MAX_FORMATS];
+static std::atomic<int> logFormatNum(0);
+
+// 書式と引数を書式化してoutの末尾に足す
+// 長さ修飾子は引数の型に合わせて付け直す
+static void formatRecord(
+    const char *format, const unsigned long long *args, unsigned int argTypes, int argNum,
+    std::vector<char> *out)
+{
+    char spec[32];
+    char text[LOG_MAX_LINE];
+    int argIndex = 0;
+    const char *p = format;
+    while (*p != '\0')
+    {
+        if (*p != '%')
+        {
+            out->push_back(*p++);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out->push_back('%');
+            p += 2;
+            continue;
+        }
+
+        // フラグ・幅・精度
+        const char *start = p++;
+        while (*p != '\0' && strchr("-+ #0", *p) != nullptr)
+            p++;
+        while (isdigit((unsigned char)*p))
+            p++;
+        if (*p == '.')
+        {
+            p++;
+            while (isdigit((unsigned char)*p))
+                p++;
+        }
+        size_t flagsLength = p - start;
+        while (*p != '\0' && strchr("hlLqjzt", *p) != nullptr)
+            p++;
+        char conversion = *p;
+        if (conversion == '\0' || flagsLength > sizeof(spec) - 4)
+            break;
+        p++;
+
+        if (argIndex >= argNum)
+        {
+            out->insert(out->end(), start, p);
+            continue;
+        }
+        unsigned long long bits = args[argIndex];
+        int type = (argTypes >> (2 * argIndex)) & 3;
+        argIndex++;
+
+        memcpy(spec, start, flagsLength);
+        char *tail = spec + flagsLength;
+        int length;
+        if (strchr("di", conversion) != nullptr)
+        {
+            long long value;
+            if (type == LOG_ARG_DOUBLE)
+            {
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                value = (long long)d;
+            }
+            else
+                value = (long long)bits;
+            sprintf(tail, "ll%c", conversion);
+            length = snprintf(text, sizeof(text), spec, value);
+        }
+        else if (strchr("uoxXc", conversion) != nullptr)
+        {
+            unsigned long long value = bits;
+            if (type == LOG_ARG_DOUBLE)
+            {
+                double d;
+                memcpy(&d, &bits, sizeof(d));
+                value = (unsigned long long)d;
+            }
+            if (conversion == 'c')
+            {
+                sprintf(tail, "c");
+                length = snprintf(text, sizeof(text), spec, (int)value);
+            }
+            else
+            {
+                sprintf(tail, "ll%c", conversion);
+                length = snprintf(text, sizeof(text), spec, value);
+            }
+        }
+        else if (strchr("eEfFgGaA", conversion) != nullptr)
+        {
+            double value;
+            if (type == LOG_ARG_DOUBLE)
+                memcpy(&value, &bits, sizeof(value));
+            else if (type == LOG_ARG_INT)
+                value = (double)(long long)bits;
+            else
+                value = (double)bits;
+            sprintf(tail, "%c", conversion);
+            length = snprintf(text, sizeof(text), spec, value);
+        }
+        else if (conversion == 's' && type == LOG_ARG_POINTER)
+        {
+            sprintf(tail, "s");
+            const char *value = (const char *)(size_t)bits;
+            length = snprintf(text, sizeof(text), spec, value != nullptr ? value : "(null)");
+        }
+        else
+        {
+            sprintf(tail, "p");
+            length = snprintf(text, sizeof(text), spec, (void *)(size_t)bits);
+        }
+
+        if (length > (int)sizeof(text) - 1)
+            length = sizeof(text) - 1;
+        if (length > 0)
+            out->insert(out->end(), text, text + length);
+    }
+}
+
+// 現在のスレッドのリングバッファ(なければ作って連結リストに加える)
+static LogRing *currentRing()
+{
+    unsigned int generation = logGeneration.load(std::memory_order_acquire);
+    if (threadRing != nullptr && threadRingGeneration == generation)
+        return threadRing;
+
+    LogRing *ring = new LogRing();
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    ring->next = logRings.load(std::memory_order_relaxed);
+    while (!logRings.compare_exchange_weak(
+        ring->next, ring, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    threadRing = ring;
+    threadRingGeneration = generation;
+    return ring;
+}
+
+// リングバッファにslotNum個のスロットを確保する(空きがなければ捨てて数え，nullptrを返す)
+static LogRing *reserveSlots(unsigned int slotNum, unsigned long long *head)
+{
+    LogRing *ring = currentRing();
+    *head = ring->head.load(std::memory_order_relaxed);
+    unsigned long long tail = ring->tail.load(std::memory_order_acquire);
+    if (*head + slotNum - tail > LOG_RING_SLOTS)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return ring;
+}
+
+// 1つのリングバッファのレコードを書式化してbatchに足す．読んだレコード数を返す
+static size_t drainRing(LogRing *ring, std::vector<char> *batch)
+{
+    unsigned long long tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned long long head = ring->head.load(std::memory_order_acquire);
+    size_t count = 0;
+    while (tail < head)
+    {
+        LogSlot *slot = &ring->slots[tail % LOG_RING_SLOTS];
+        unsigned long long slotNum = 1;
+        if (slot->kind == LOG_RECORD_TEXT)
+        {
+            // 本文は続くスロットに64バイトずつ入っている
+            size_t length = slot->textLength;
+            slotNum += (length + sizeof(LogSlot) - 1) / sizeof(LogSlot);
+            for (unsigned long long k = 1; k < slotNum; k++)
+            {
+                const char *text = (const char *)&ring->slots[(tail + k) % LOG_RING_SLOTS];
+                size_t n = length < sizeof(LogSlot) ? length : sizeof(LogSlot);
+                batch->insert(batch->end(), text, text + n);
+                length -= n;
+            }
+        }
+        else
+            formatRecord(
+                logFormats[slot->formatId], slot->args, slot->argTypes, slot->argNum, batch);
+        tail += slotNum;
+        count++;
+    }
+    // 書式化し終わってからスロットを返す
+    ring->tail.store(tail, std::memory_order_release);
+    return count;
+}
+
+// 書き込み用のスレッド
+// 各スレッドのリングバッファからレコードを取り出し，まとめて書式化して書き込む
+static void logWriterMain()
+{
+    std::vector<char> batch;
+    batch.reserve(LOG_BATCH_BYTES * 2);
+    while (true)
+    {
+        bool stop = logStop.load(std::memory_order_acquire);
+        size_t count = 0;
+        for (LogRing *ring = logRings.load(std::memory_order_acquire); ring != nullptr;
+             ring = ring->next)
+        {
+            count += drainRing(ring, &batch);
+            if (batch.size() >= LOG_BATCH_BYTES)
+            {
+                fwrite(batch.data(), 1, batch.size(), logFile);
+                batch.clear();
+            }
+        }
 
-int initLogFile(const char *filename)
+        // 終了の指示の後に空になったら終わる
+        if (count == 0)
+        {
+            if (stop)
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(LOG_IDLE_SLEEP_US));
+        }
+    }
+    fwrite(batch.data(), 1, batch.size(), logFile);
+}
+
+int initLogFile(const char *filename, LOG_MODE mode)
 {
     logFile = fopen(filename, "w");
     if (logFile == NULL)
@@ -12,20 +285,141 @@ int initLogFile(const char *filename)
         return -1;
     }
 
+    logMode = mode;
+    if (mode == LOG_MODE_BINARY)
+    {
+        // 前回のリングバッファは使わない
+        logGeneration.fetch_add(1, std::memory_order_release);
+        logStop.store(false, std::memory_order_relaxed);
+        logWriter = std::thread(logWriterMain);
+    }
+
     return 0;
 }
 
+int registerLogFormat(const char *format)
+{
+    int id = logFormatNum.fetch_add(1);
+    if (id >= LOG_MAX_FORMATS)
+    {
+        printf("ログの書式は%d個までしか登録できません\n", LOG_MAX_FORMATS);
+        return -1;
+    }
+    logFormats[id] = format;
+    return id;
+}
+
+void pushLogRecord(int formatId, const LogArg *args, int argNum)
+{
+    if (logFile == NULL || formatId < 0 || formatId >= logFormatNum.load() ||
+        argNum > LOG_MAX_ARGS)
+        return;
+
+    unsigned long long bits[LOG_MAX_ARGS];
+    unsigned int argTypes = 0;
+    for (int i = 0; i < argNum; i++)
+    {
+        bits[i] = args[i].bits;
+        argTypes |= (unsigned int)args[i].type << (2 * i);
+    }
+
+    // テキストモードではその場で書式化する
+    if (logMode == LOG_MODE_TEXT)
+    {
+        std::vector<char> text;
+        formatRecord(logFormats[formatId], bits, argTypes, argNum, &text);
+        fwrite(text.data(), 1, text.size(), logFile);
+        return;
+    }
+
+    unsigned long long head;
+    LogRing *ring = reserveSlots(1, &head);
+    if (ring == nullptr)
+        return;
+    LogSlot *slot = &ring->slots[head % LOG_RING_SLOTS];
+    slot->formatId = (unsigned short)formatId;
+    slot->kind = LOG_RECORD_FORMAT;
+    slot->argNum = (unsigned char)argNum;
+    slot->argTypes = (unsigned short)argTypes;
+    memcpy(slot->args, bits, sizeof(unsigned long long) * argNum);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
 void recordLine(const char *format, ...)
 {
     va_list va;
     va_start(va, format);
-    vfprintf(logFile, format, va);
+    if (logMode == LOG_MODE_TEXT)
+    {
+        vfprintf(logFile, format, va);
+        va_end(va);
+        return;
+    }
+
+    // バイナリモードでは書式化だけしてリングバッファに積む
+    char text[LOG_MAX_LINE];
+    int length = vsnprintf(text, sizeof(text), format, va);
     va_end(va);
+    if (length < 0)
+        return;
+    if (length > (int)sizeof(text) - 1)
+        length = sizeof(text) - 1;
+
+    unsigned int bodySlots = (length + sizeof(LogSlot) - 1) / sizeof(LogSlot);
+    unsigned long long head;
+    LogRing *ring = reserveSlots(1 + bodySlots, &head);
+    if (ring == nullptr)
+        return;
+    LogSlot *slot = &ring->slots[head % LOG_RING_SLOTS];
+    slot->kind = LOG_RECORD_TEXT;
+    slot->textLength = (unsigned short)length;
+    for (unsigned int k = 0; k < bodySlots; k++)
+    {
+        size_t offset = (size_t)k * sizeof(LogSlot);
+        size_t n = length - offset < sizeof(LogSlot) ? length - offset : sizeof(LogSlot);
+        memcpy(&ring->slots[(head + 1 + k) % LOG_RING_SLOTS], text + offset, n);
+    }
+    ring->head.store(head + 1 + bodySlots, std::memory_order_release);
+}
+
+unsigned long long getLogDropCount()
+{
+    unsigned long long count = retiredDropCount.load();
+    for (LogRing *ring = logRings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next)
+        count += ring->dropped.load(std::memory_order_relaxed);
+    return count;
 }
 
 int finalLogFile()
 {
+    if (logMode == LOG_MODE_BINARY)
+    {
+        // 書き込み用のスレッドに残りを書かせて止める
+        logStop.store(true, std::memory_order_release);
+        logWriter.join();
+
+        unsigned long long dropped = getLogDropCount();
+        if (dropped > 0)
+        {
+            fprintf(logFile, "# リングバッファがいっぱいで%llu件のログを捨てました\n", dropped);
+            printf("リングバッファがいっぱいで%llu件のログを捨てました\n", dropped);
+        }
+
+        // リングバッファを解放する(各スレッドは次のinitLogFileの後に作り直す)
+        LogRing *ring = logRings.exchange(nullptr);
+        while (ring != nullptr)
+        {
+            LogRing *next = ring->next;
+            delete ring;
+            ring = next;
+        }
+        retiredDropCount.store(dropped);
+        logMode = LOG_MODE_TEXT;
+    }
+
     int result = fclose(logFile);
+    logFile = NULL;
     if (result == EOF)
     {
         printf("ログファイルのクローズに失敗しました\n");
@@ -33,4 +427,4 @@ int finalLogFile()
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,83 @@
 /* デバッグ用ログファイル出力 */
+#pragma once
 #include <stdio.h>
+#include <string.h>
+
+// ログの書き込み方式
+enum LOG_MODE
+{
+    LOG_MODE_TEXT,   // 呼び出したスレッドでその場で書式化して書き込む
+    LOG_MODE_BINARY, // 書式番号と引数をスレッドごとのリングバッファに積み，
+                     // 書き込み用のスレッドがまとめて書式化して書き込む
+};
+
+#define LOG_MAX_ARGS 7         // バイナリログの1レコードの引数の最大数
+#define LOG_MAX_FORMATS 1024   // 登録できる書式の数
+#define LOG_RING_SLOTS 4096    // スレッドごとのリングバッファのスロット数(1スロット64バイト)
+#define LOG_MAX_LINE 512       // recordLineの1行の最大長(バイナリモード)
 
 // ログファイル生成
-int initLogFile(const char*);
+// バイナリモードでは書き込み用のスレッドを起動する
+int initLogFile(const char*, LOG_MODE mode = LOG_MODE_TEXT);
 
 // ログファイルに記録
+// バイナリモードでは書式化した文字列をリングバッファに積む
 void recordLine(const char* format,...);
 
 // ログファイルを閉じる
-int finalLogFile();
\ No newline at end of file
+// バイナリモードではリングバッファに残ったレコードを書き込み，捨てたレコード数を末尾に記録する
+int finalLogFile();
+
+// バイナリログの引数の型
+enum LOG_ARG_TYPE
+{
+    LOG_ARG_INT,     // 符号付き整数
+    LOG_ARG_UINT,    // 符号なし整数
+    LOG_ARG_DOUBLE,  // 浮動小数点数
+    LOG_ARG_POINTER, // ポインタ(%sなら文字列)
+};
+
+// バイナリログの引数(型と64bitの値)
+struct LogArg
+{
+    unsigned char type; // LOG_ARG_TYPE
+    unsigned long long bits;
+};
+
+inline LogArg logArg(int value) { return {LOG_ARG_INT, (unsigned long long)(long long)value}; }
+inline LogArg logArg(long value) { return {LOG_ARG_INT, (unsigned long long)(long long)value}; }
+inline LogArg logArg(long long value) { return {LOG_ARG_INT, (unsigned long long)value}; }
+inline LogArg logArg(unsigned int value) { return {LOG_ARG_UINT, value}; }
+inline LogArg logArg(unsigned long value) { return {LOG_ARG_UINT, value}; }
+inline LogArg logArg(unsigned long long value) { return {LOG_ARG_UINT, value}; }
+inline LogArg logArg(double value)
+{
+    LogArg arg = {LOG_ARG_DOUBLE, 0};
+    memcpy(&arg.bits, &value, sizeof(value));
+    return arg;
+}
+inline LogArg logArg(const void *value)
+{
+    return {LOG_ARG_POINTER, (unsigned long long)(size_t)value};
+}
+
+// バイナリログの書式を登録して番号を返す(登録できなければ-1)
+// 書式は書き込みが終わるまで有効な文字列(文字列リテラルなど)であること
+// %の変換指定は1つの引数に対応するもの(幅・精度の*は使えない)
+int registerLogFormat(const char *format);
+
+// 書式番号と引数をリングバッファに積む(リングバッファがいっぱいなら捨てて数える)
+// %sの引数は書き込みが終わるまで有効な文字列であること
+void pushLogRecord(int formatId, const LogArg *args, int argNum);
+
+// 書式番号と引数で記録する(テキストモードではその場で書式化して書き込む)
+template <typename... Args>
+void recordBinary(int formatId, Args... args)
+{
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+    LogArg packed[sizeof...(Args) + 1] = {logArg(args)...};
+    pushLogRecord(formatId, packed, (int)sizeof...(Args));
+}
+
+// 捨てたレコード数(全スレッドの累計)
+unsigned long long getLogDropCount();
@@ -0,0 +1,152 @@
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "memory.hpp"
+
+#define SCRATCH_ALIGNMENT 16
+
+static std::atomic<unsigned long long> currentBytes[MEMORY_SUBSYSTEM_NUM];
+static std::atomic<unsigned long long> peakBytes[MEMORY_SUBSYSTEM_NUM];
+static std::atomic<unsigned long long> allocationCounts[MEMORY_SUBSYSTEM_NUM];
+
+void recordMemoryAllocation(int subsystem, size_t bytes)
+{
+    unsigned long long current =
+        currentBytes[subsystem].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    allocationCounts[subsystem].fetch_add(1, std::memory_order_relaxed);
+    unsigned long long peak = peakBytes[subsystem].load(std::memory_order_relaxed);
+    while (current > peak &&
+           !peakBytes[subsystem].compare_exchange_weak(peak, current, std::memory_order_relaxed))
+        ;
+}
+
+void recordMemoryRelease(int subsystem, size_t bytes)
+{
+    currentBytes[subsystem].fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+MemoryUsage getMemoryUsage(int subsystem)
+{
+    MemoryUsage usage;
+    usage.currentBytes = currentBytes[subsystem].load(std::memory_order_relaxed);
+    usage.peakBytes = peakBytes[subsystem].load(std::memory_order_relaxed);
+    usage.allocations = allocationCounts[subsystem].load(std::memory_order_relaxed);
+    return usage;
+}
+
+void resetMemoryPeaks()
+{
+    for (int i = 0; i < MEMORY_SUBSYSTEM_NUM; i++)
+    {
+        peakBytes[i] = currentBytes[i].load(std::memory_order_relaxed);
+        allocationCounts[i] = 0;
+    }
+}
+
+void printMemoryReport()
+{
+    const char *names[MEMORY_SUBSYSTEM_NUM] = {
+        "シーン", "フレームバッファ", "画像の入出力", "トレースの一時領域"};
+    printf("メモリ使用量(現在 / 最大 / 確保回数)\n");
+    for (int i = 0; i < MEMORY_SUBSYSTEM_NUM; i++)
+    {
+        MemoryUsage usage = getMemoryUsage(i);
+        printf("  %10.1fKB / %10.1fKB / %8llu回  %s\n", usage.currentBytes / 1024.0,
+               usage.peakBytes / 1024.0, usage.allocations, names[i]);
+    }
+}
+
+// スレッドごとのアリーナ
+// チャンクを順に使い，先頭に戻すときもチャンクは解放しない
+struct ScratchArena
+{
+    std::vector<char *> chunks;
+    size_t chunkIndex = 0; // 切り出し中のチャンク
+    size_t offset = 0;     // 切り出し中のチャンクの使用済みバイト数
+    bool active = false;
+
+    ~ScratchArena()
+    {
+        for (char *chunk : chunks)
+        {
+            free(chunk);
+            recordMemoryRelease(MEMORY_TRACING, SCRATCH_ARENA_CHUNK_BYTES);
+        }
+    }
+
+    bool contains(const void *pointer)
+    {
+        const char *p = (const char *)pointer;
+        for (char *chunk : chunks)
+        {
+            if (p >= chunk && p < chunk + SCRATCH_ARENA_CHUNK_BYTES)
+                return true;
+        }
+        return false;
+    }
+};
+
+static thread_local ScratchArena scratchArena;
+
+// mallocで確保する(アリーナを使わない場合・大きすぎる場合)
+static void *heapAllocate(size_t size)
+{
+    void *pointer = malloc(size);
+    if (pointer != nullptr)
+        recordMemoryAllocation(MEMORY_TRACING, size);
+    return pointer;
+}
+
+void *scratchAllocate(size_t size)
+{
+    ScratchArena *arena = &scratchArena;
+    size = (size + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+    if (!arena->active || size > SCRATCH_ARENA_CHUNK_BYTES)
+        return heapAllocate(size);
+
+    if (arena->offset + size > SCRATCH_ARENA_CHUNK_BYTES)
+    {
+        // 次のチャンクへ(なければ確保する)
+        arena->chunkIndex++;
+        arena->offset = 0;
+    }
+    if (arena->chunkIndex == arena->chunks.size())
+    {
+        char *chunk = (char *)malloc(SCRATCH_ARENA_CHUNK_BYTES);
+        if (chunk == nullptr)
+            return heapAllocate(size);
+        recordMemoryAllocation(MEMORY_TRACING, SCRATCH_ARENA_CHUNK_BYTES);
+        arena->chunks.push_back(chunk);
+    }
+    void *pointer = arena->chunks[arena->chunkIndex] + arena->offset;
+    arena->offset += size;
+    return pointer;
+}
+
+void scratchRelease(void *pointer, size_t size)
+{
+    if (pointer == nullptr || scratchArena.contains(pointer))
+        return;
+    size = (size + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+    free(pointer);
+    recordMemoryRelease(MEMORY_TRACING, size);
+}
+
+void beginScratchArena()
+{
+    scratchArena.active = true;
+    resetScratchArena();
+}
+
+void endScratchArena()
+{
+    resetScratchArena();
+    scratchArena.active = false;
+}
+
+void resetScratchArena()
+{
+    scratchArena.chunkIndex = 0;
+    scratchArena.offset = 0;
+}
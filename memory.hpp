@@ -0,0 +1,51 @@
+/* サブシステムごとのメモリ使用量の集計と，トレース中の一時オブジェクト用のアリーナ */
+#pragma once
+#include <stddef.h>
+
+// メモリを使うサブシステム
+enum MEMORY_SUBSYSTEM
+{
+    MEMORY_SCENE,       // ジオメトリ・光源・展開したシーン・光源の木・テクスチャのタイル・直接光キャッシュ
+    MEMORY_FRAMEBUFFER, // HDR・8bitのフレームバッファ
+    MEMORY_IMAGE_IO,    // PNG・EXRの入出力のバッファ
+    MEMORY_TRACING,     // トレース中の一時オブジェクト(交点など)とアリーナ
+    MEMORY_SUBSYSTEM_NUM,
+};
+
+// サブシステムのメモリ使用量
+struct MemoryUsage
+{
+    unsigned long long currentBytes; // 現在の使用量
+    unsigned long long peakBytes;    // 最大の使用量
+    unsigned long long allocations;  // 確保した回数
+};
+
+// 確保・解放したバイト数を記録する(スレッドセーフ)
+void recordMemoryAllocation(int subsystem, size_t bytes);
+void recordMemoryRelease(int subsystem, size_t bytes);
+
+MemoryUsage getMemoryUsage(int subsystem);
+
+// 最大の使用量を現在の使用量に戻す(描画の開始時に呼ぶ)
+void resetMemoryPeaks();
+
+// サブシステムごとの現在・最大の使用量を表示する
+void printMemoryReport();
+
+#define SCRATCH_ARENA_CHUNK_BYTES (64 * 1024) // アリーナが1回に確保する大きさ
+
+// トレース中の一時オブジェクトを確保する
+// beginScratchArenaからendScratchArenaの間はスレッドごとのアリーナから切り出し，
+// それ以外はmallocで確保する
+void *scratchAllocate(size_t size);
+
+// scratchAllocateで確保したものを解放する(アリーナから切り出したものは何もしない)
+void scratchRelease(void *pointer, size_t size);
+
+// このスレッドでアリーナを使い始める/使い終える
+// 使い終えるまでに確保したものはresetScratchArenaかendScratchArenaより前に解放すること
+void beginScratchArena();
+void endScratchArena();
+
+// アリーナを先頭に戻す(確保したチャンクは残すのでO(1))
+void resetScratchArena();
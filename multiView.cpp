@@ -0,0 +1,79 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "compiledScene.hpp"
+#include "multiView.hpp"
+
+int renderMultiView(
+    Scene *scene, const Camera *cameras, unsigned int viewNum, FloatBitMapData *outputs,
+    unsigned int workerNum, MultiViewStats *stats)
+{
+    unsigned int width = scene->bitmap->width;
+    unsigned int height = scene->bitmap->height;
+    for (unsigned int v = 0; v < viewNum; v++)
+    {
+        if (outputs[v].width != width || outputs[v].height != height ||
+            outputs[v].pixelsData == nullptr)
+        {
+            printf("視点%uの出力の大きさが画像サイズと違います\n", v);
+            return -1;
+        }
+    }
+    if (workerNum == 0)
+        workerNum = 1;
+
+    // 視点ごとのシーン(カメラだけ差し替え，ジオメトリ・光源の木などは共有する)
+    std::vector<Camera> viewCameras(cameras, cameras + viewNum);
+    std::vector<Scene> views(viewNum, *scene);
+    std::vector<CompiledScene> compiledViews(scene->compiledScene != nullptr ? viewNum : 0);
+    for (unsigned int v = 0; v < viewNum; v++)
+    {
+        views[v].camera = &viewCameras[v];
+        if (scene->compiledScene != nullptr)
+            copyCompiledScene(&views[v], &compiledViews[v]);
+    }
+
+    unsigned int tileCountX = (width + MULTI_VIEW_TILE_SIZE - 1) / MULTI_VIEW_TILE_SIZE;
+    unsigned int tileCountY = (height + MULTI_VIEW_TILE_SIZE - 1) / MULTI_VIEW_TILE_SIZE;
+    unsigned int tilesPerView = tileCountX * tileCountY;
+    unsigned int tileNum = tilesPerView * viewNum;
+    std::atomic<unsigned int> nextTile(0);
+    std::atomic<unsigned long long> totalRayCount(0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    // 各スレッドは全視点のタイルを順に1つずつ取り出して描画する
+    auto worker = [&]()
+    {
+        rayCount = 0;
+        unsigned int idx;
+        while ((idx = nextTile.fetch_add(1)) < tileNum)
+        {
+            unsigned int v = idx / tilesPerView;
+            unsigned int tile = idx % tilesPerView;
+            unsigned int x = (tile % tileCountX) * MULTI_VIEW_TILE_SIZE;
+            unsigned int y = (tile / tileCountX) * MULTI_VIEW_TILE_SIZE;
+            unsigned int w = (x + MULTI_VIEW_TILE_SIZE > width) ? width - x : MULTI_VIEW_TILE_SIZE;
+            unsigned int h = (y + MULTI_VIEW_TILE_SIZE > height) ? height - y : MULTI_VIEW_TILE_SIZE;
+            renderTile(&views[v], x, y, w, h, outputs[v].getPixel(x, y), (size_t)width * 3);
+        }
+        totalRayCount += rayCount;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    if (stats != nullptr)
+    {
+        stats->views = viewNum;
+        stats->tiles = tileNum;
+        stats->rays = totalRayCount.load();
+        stats->seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return 0;
+}
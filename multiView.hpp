@@ -0,0 +1,24 @@
+/* 複数のカメラからの描画(ステレオ・キューブマップ・カメラアレイ) */
+#pragma once
+#include "camera.hpp"
+#include "framebuffer.hpp"
+
+#define MULTI_VIEW_TILE_SIZE 32
+
+// 複数視点の描画の統計
+struct MultiViewStats
+{
+    unsigned int views;         // 視点の数
+    unsigned int tiles;         // 描画したタイル数(全視点の合計)
+    unsigned long long rays;    // 追跡したレイの数
+    double seconds;             // 描画時間
+};
+
+// scene(ジオメトリ・光源の木・展開したシーンは1回だけ準備したもの)をcameras[0..viewNum-1]から
+// 描画してoutputs[v]に書き込む
+// 全視点のタイルを1つの作業列にしてworkerNum個のスレッドで分け合うので，
+// 視点ごとに描画するよりスレッドが遊ばない
+// outputsは画像サイズ(scene->bitmapの幅・高さ)で確保しておくこと
+int renderMultiView(
+    Scene *scene, const Camera *cameras, unsigned int viewNum, FloatBitMapData *outputs,
+    unsigned int workerNum, MultiViewStats *stats);
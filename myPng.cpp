@@ -1,94 +1,134 @@
 #include "myPng.hpp"
 
-int pngFileReadDecode(BitMapData *bitmapData, const char *filename)
+int pngRowReaderOpen(PngRowReader *reader, const char *filename)
 {
-    FILE *file;
-    unsigned int width, height;
     unsigned int readSize;
-
-    png_structp png;
-    png_infop info;
-    png_bytepp datap; // 読みこんだ画像データ
-    png_byte type;    // 色の形式
-    png_byte signature[8];  // シグネチャ
+    png_byte type;         // 色の形式
+    png_byte signature[8]; // シグネチャ
 
     // シグネチャの読み込み
-    file = fopen(filename, "rb");
-    if (file == nullptr)
+    reader->file = fopen(filename, "rb");
+    if (reader->file == nullptr)
     {
         printf("%sは開けません\n", filename);
         return -1;
     }
-    readSize = fread(signature, 1, SIGNATURE_NUM, file);
+    readSize = fread(signature, 1, SIGNATURE_NUM, reader->file);
 
     // シグネチャからPNGファイルかどうかを判定
     if (png_sig_cmp(signature, 0, SIGNATURE_NUM))
     {
         printf("png_sig_cmp error!\n");
-        fclose(file);
+        pngRowReaderClose(reader);
         return -1;
     }
 
     // png_read構造体を生成
-    // 第一引数:libpngのバージョン
-    png = png_create_read_struct(
+    reader->png = png_create_read_struct(
         PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (png == NULL)
+    if (reader->png == NULL)
     {
         printf("png_create_read_struct error!\n");
-        fclose(file);
+        pngRowReaderClose(reader);
         return -1;
     }
 
     // png_info構造体を生成
-    info = png_create_info_struct(png);
-    if (info == NULL)
+    reader->info = png_create_info_struct(reader->png);
+    if (reader->info == NULL)
     {
         printf("png_create_info_struct error!\n");
-        png_destroy_read_struct(&png, NULL, NULL);
-        fclose(file);
+        pngRowReaderClose(reader);
         return -1;
     }
 
-    // PNGファイルとして読み込むファイルの設定
-    png_init_io(png, file);
-    // シグネチャサイズの設定
-    png_set_sig_bytes(png, readSize);
-    // PNGファイル読み込み
-    /*
-        PNG_TRANSFORM_PACKING：輝度値が1, 2, 4 ビットのデータの場合は 8 ビットのデータに変換する
-        PNG_TRANSFORM_STRIP_16：輝度値が 16 ビットのデータの場合は 8 ビットのデータに変換する
-    */
-    png_read_png(
-        png, info, PNG_TRANSFORM_PACKING | PNG_TRANSFORM_STRIP_16, NULL);
-
-    // PNGから画像データ情報取得
-    width = png_get_image_width(png, info);
-    height = png_get_image_height(png, info);
-    // PNGをBITMAPにデコードしたデータのアドレスを格納(ここでデコードが行われる)
-    // 各行のデータへのアドレスへのポインタ⇨ダブルポインタ使用
-    datap = png_get_rows(png, info);
-    type = png_get_color_type(png, info);
-
-    /* とりあえずRGBorRGBAだけ対応 */
-    if (type != PNG_COLOR_TYPE_RGB && type != PNG_COLOR_TYPE_RGB_ALPHA)
+    // libpngのエラーはここに戻ってくる
+    if (setjmp(png_jmpbuf(reader->png)))
     {
-        printf("color type is not RGB or RGBA\n");
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(file);
+        printf("%sのデコードに失敗しました\n", filename);
+        pngRowReaderClose(reader);
         return -1;
     }
 
-    bitmapData->width = width;
-    bitmapData->height = height;
-    if (type == PNG_COLOR_TYPE_RGB)
+    png_init_io(reader->png, reader->file);
+    png_set_sig_bytes(reader->png, readSize);
+    // ヘッダだけを読み込む(画素はまだデコードしない)
+    png_read_info(reader->png, reader->info);
+
+    if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE)
     {
-        bitmapData->channel = 3;
+        printf("インターレースPNGは1行ずつ読み込めません\n");
+        pngRowReaderClose(reader);
+        return -1;
     }
-    else if (type == PNG_COLOR_TYPE_RGBA)
+
+    // 1, 2, 4bit・16bit・パレット・グレースケールを8bitのRGB(A)に揃える
+    type = png_get_color_type(reader->png, reader->info);
+    png_set_packing(reader->png);
+    png_set_strip_16(reader->png);
+    if (type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(reader->png);
+    if (type == PNG_COLOR_TYPE_GRAY || type == PNG_COLOR_TYPE_GRAY_ALPHA)
     {
-        bitmapData->channel = 4;
+        png_set_expand_gray_1_2_4_to_8(reader->png);
+        png_set_gray_to_rgb(reader->png);
     }
+    if (png_get_valid(reader->png, reader->info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(reader->png);
+    png_read_update_info(reader->png, reader->info);
+
+    reader->width = png_get_image_width(reader->png, reader->info);
+    reader->height = png_get_image_height(reader->png, reader->info);
+    reader->channel = png_get_channels(reader->png, reader->info);
+    reader->nextRow = 0;
+
+    if (reader->channel != COLOR_RGB && reader->channel != COLOR_RGBA)
+    {
+        printf("color type is not RGB or RGBA\n");
+        pngRowReaderClose(reader);
+        return -1;
+    }
+
+    return 0;
+}
+
+int pngRowReaderRead(PngRowReader *reader, unsigned char *row)
+{
+    if (reader->nextRow >= reader->height)
+        return -1;
+
+    if (setjmp(png_jmpbuf(reader->png)))
+    {
+        printf("行%uのデコードに失敗しました\n", reader->nextRow);
+        return -1;
+    }
+
+    png_read_row(reader->png, row, NULL);
+    reader->nextRow++;
+    return 0;
+}
+
+void pngRowReaderClose(PngRowReader *reader)
+{
+    if (reader->png != nullptr)
+        png_destroy_read_struct(
+            &reader->png, reader->info != nullptr ? &reader->info : NULL, NULL);
+    reader->png = nullptr;
+    reader->info = nullptr;
+    if (reader->file != nullptr)
+        fclose(reader->file);
+    reader->file = nullptr;
+}
+
+int pngFileReadDecode(BitMapData *bitmapData, const char *filename)
+{
+    PngRowReader reader;
+    if (pngRowReaderOpen(&reader, filename) == -1)
+        return -1;
+
+    bitmapData->width = reader.width;
+    bitmapData->height = reader.height;
+    bitmapData->channel = reader.channel;
     printf("width = %d, height = %d, ch = %d\n",
            bitmapData->width, bitmapData->height, bitmapData->channel);
 
@@ -99,23 +139,26 @@ int pngFileReadDecode(BitMapData *bitmapData, const char *filename)
     if (bitmapData->pixelsData == nullptr)
     {
         printf("data malloc error\n");
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(file);
+        pngRowReaderClose(&reader);
         return -1;
     }
+    recordMemoryAllocation(
+        MEMORY_FRAMEBUFFER, (size_t)bitmapData->width * bitmapData->height * bitmapData->channel);
 
-    // 1行ずつデータコピー
+    // libpng側に画像全体を持たせず，1行ずつ直接デコードする
     for (int i = 0; i < bitmapData->height; i++)
     {
-        memcpy(
-            bitmapData->pixelsData +
-                i * bitmapData->width * bitmapData->channel, // 1行
-            datap[i], bitmapData->width * bitmapData->channel);
+        if (pngRowReaderRead(
+                &reader,
+                bitmapData->pixelsData + i * bitmapData->width * bitmapData->channel) == -1)
+        {
+            freeBitmapData(bitmapData);
+            pngRowReaderClose(&reader);
+            return -1;
+        }
     }
 
-    // 生成した構造体削除
-    png_destroy_read_struct(&png, &info, NULL);
-    fclose(file);
+    pngRowReaderClose(&reader);
 
     return 0;
 }
@@ -171,6 +214,9 @@ int pngFileEncodeWrite(BitMapData *bitmapData, const char *filename)
     // PNGにエンコードするBITMAPデータの設定
     // BITMAPデータ格納先のメモリ確保(行)
     datap = (png_bytepp)png_malloc(png, sizeof(png_bytep) * bitmapData->height);
+    size_t rowsBytes = sizeof(png_bytep) * bitmapData->height +
+                       (size_t)bitmapData->width * bitmapData->channel * bitmapData->height;
+    recordMemoryAllocation(MEMORY_IMAGE_IO, rowsBytes);
 
     png_set_rows(png, info, datap);
 
@@ -191,18 +237,138 @@ int pngFileEncodeWrite(BitMapData *bitmapData, const char *filename)
         png_free(png, datap[i]);
     }
     png_free(png, datap);
+    recordMemoryRelease(MEMORY_IMAGE_IO, rowsBytes);
 
     png_destroy_write_struct(&png, &info);
     fclose(file);
     return 0;
 }
 
+// libpngの出力先をstd::vectorにする(flushはNULLにするとFILE*として扱われるので空の関数を渡す)
+static void pngMemoryWrite(png_structp png, png_bytep data, png_size_t length)
+{
+    std::vector<unsigned char> *output = (std::vector<unsigned char> *)png_get_io_ptr(png);
+    output->insert(output->end(), data, data + length);
+}
+
+static void pngMemoryFlush(png_structp)
+{
+}
+
+int pngEncodeMemory(BitMapData *bitmapData, std::vector<unsigned char> *output)
+{
+    output->clear();
+    png_byte type;
+    if (bitmapData->channel == COLOR_RGB)
+    {
+        type = PNG_COLOR_TYPE_RGB;
+    }
+    else if (bitmapData->channel == COLOR_RGBA)
+    {
+        type = PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+    else
+    {
+        printf("channel num is invalid!\n");
+        return -1;
+    }
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    png_set_write_fn(png, output, pngMemoryWrite, pngMemoryFlush);
+
+    png_set_IHDR(
+        png, info, bitmapData->width, bitmapData->height, 8, type,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    // ピクセルデータの行をそのまま渡す(行ごとのコピーはしない)
+    for (unsigned int y = 0; y < bitmapData->height; y++)
+        png_write_row(
+            png, bitmapData->pixelsData + (size_t)y * bitmapData->width * bitmapData->channel);
+    png_write_end(png, info);
+
+    png_destroy_write_struct(&png, &info);
+    return 0;
+}
+
+int pngFileEncodeWriteStream(
+    const char *filename, unsigned int width, unsigned int height, unsigned char channel,
+    PngRowSource source, void *userData)
+{
+    FILE *file;
+
+    png_structp png;
+    png_infop info;
+    png_bytep row;
+    png_byte type;
+
+    if (channel == COLOR_RGB)
+    {
+        type = PNG_COLOR_TYPE_RGB;
+    }
+    else if (channel == COLOR_RGBA)
+    {
+        type = PNG_COLOR_TYPE_RGB_ALPHA;
+    }
+    else
+    {
+        printf("channel num is invalid!\n");
+        return -1;
+    }
+
+    file = fopen(filename, "wb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    png = png_create_write_struct(
+        PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    png_init_io(png, file);
+
+    png_set_IHDR(
+        png, info, width, height, 8, type,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    // 1行分のバッファだけを使い回す
+    row = (png_bytep)png_malloc(png, (size_t)width * channel);
+    recordMemoryAllocation(MEMORY_IMAGE_IO, (size_t)width * channel);
+
+    int result = 0;
+    for (unsigned int y = 0; y < height; y++)
+    {
+        if (source(y, row, userData) == -1)
+        {
+            printf("行%uの取得に失敗しました\n", y);
+            result = -1;
+            break;
+        }
+        png_write_row(png, row);
+    }
+    if (result == 0)
+        png_write_end(png, info);
+
+    png_free(png, row);
+    recordMemoryRelease(MEMORY_IMAGE_IO, (size_t)width * channel);
+    png_destroy_write_struct(&png, &info);
+    fclose(file);
+    return result;
+}
+
 int freeBitmapData(BitMapData *bitmap)
 {
     if (bitmap->pixelsData != nullptr)
     {
         free(bitmap->pixelsData);
         bitmap->pixelsData = nullptr;
+        recordMemoryRelease(
+            MEMORY_FRAMEBUFFER, (size_t)bitmap->width * bitmap->height * bitmap->channel);
     }
     return 0;
 }
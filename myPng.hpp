@@ -1,8 +1,11 @@
+#pragma once
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 #include "png.h"
+#include "memory.hpp"
 
 enum COLORTYPE
 {
@@ -54,6 +57,7 @@ struct BitMapData
             printf("malloc error\n");
             return -1;
         }
+        recordMemoryAllocation(MEMORY_FRAMEBUFFER, (size_t)width * height * channel);
 
         return 0; // 成功
     }
@@ -70,8 +74,35 @@ struct BitMapData
     }
 };
 
+// 1行ずつデコードするPNG読み込み器
+// グレースケール・パレットはRGB(A)に展開し，16bitは8bitに変換する
+struct PngRowReader
+{
+    FILE *file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+    unsigned int width;    // 幅
+    unsigned int height;   // 高さ
+    unsigned char channel; // チャネル(3 or 4)
+    unsigned int nextRow;  // 次に読む行
+};
+
+int pngRowReaderOpen(PngRowReader *, const char *);
+// 次の1行(width * channelバイト)をrowにデコードする
+int pngRowReaderRead(PngRowReader *, unsigned char *row);
+void pngRowReaderClose(PngRowReader *);
+
+// 1行分の画素を用意する関数(戻り値-1で中断)
+typedef int (*PngRowSource)(unsigned int y, unsigned char *row, void *userData);
+
 int pngFileReadDecode(BitMapData *, const char *);
 int pngFileEncodeWrite(BitMapData *, const char *);
+// PNGにエンコードしてoutputに格納する(ファイルには書き込まない．outputの領域は使い回す)
+int pngEncodeMemory(BitMapData *, std::vector<unsigned char> *output);
+// 1行ずつ受け取りながらPNGに書き込む(画像全体をメモリに置かない)
+int pngFileEncodeWriteStream(
+    const char *filename, unsigned int width, unsigned int height, unsigned char channel,
+    PngRowSource source, void *userData);
 int freeBitmapData(BitMapData *);
 void drawDot(
     BitMapData *bitmap, unsigned int x, unsigned int y, Color color);
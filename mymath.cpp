@@ -66,6 +66,17 @@ float myRand()
 
     return (float)r / (float)m;
 }
+
+unsigned long long pixelSeed(unsigned int x, unsigned int y, unsigned int pass)
+{
+    // splitmix64で座標をかき混ぜる
+    unsigned long long z =
+        ((unsigned long long)y << 32 | x) + (unsigned long long)pass * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 // 乗算
 Vector3 operator*(float n, Vector3 vec)
 {
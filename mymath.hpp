@@ -1,7 +1,9 @@
 /* 数学系処理のヘッダ */
+#pragma once
 
 // 演算子の個数を数える
-static unsigned long long operationCount = 0;
+// 複数スレッドで描画しても競合しないようにスレッドごとに数える
+static thread_local unsigned long long operationCount = 0;
 
 // 解の公式の解を指定する
 enum SOLUTION
@@ -28,6 +30,25 @@ float myAbsf(float);
 // [0〜1]の一様乱数生成
 float myRand();
 
+// 状態を持つ[0〜1)の一様乱数生成器
+// myRandと違いスレッド・ピクセルごとに独立した系列を作れる
+struct Sampler
+{
+    unsigned long long state;
+
+    Sampler(unsigned long long seed = 1) : state(seed) {}
+
+    float next()
+    {
+        // 64bit線形合同法の上位24bitを使う
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (float)(state >> 40) / (float)(1ULL << 24);
+    }
+};
+
+// ピクセル座標から乱数の種を作る
+unsigned long long pixelSeed(unsigned int x, unsigned int y, unsigned int pass = 0);
+
 // 3次元ベクトル
 struct Vector3
 {
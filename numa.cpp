@@ -0,0 +1,295 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include "compiledScene.hpp"
+#include "lightTree.hpp"
+#include "numa.hpp"
+
+// "0-3,8-11"の形式のCPU・ノードの一覧を読む
+static void parseIdList(const char *text, std::vector<int> *ids)
+{
+    const char *p = text;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long id = first; id <= last; id++)
+            ids->push_back((int)id);
+        if (*p == ',')
+            p++;
+    }
+}
+
+// sysfsのファイルから一覧を読む(読めなければ-1)
+static int readIdList(const char *path, std::vector<int> *ids)
+{
+    FILE *file = fopen(path, "r");
+    if (file == nullptr)
+        return -1;
+    char line[4096];
+    bool ok = fgets(line, sizeof(line), file) != nullptr;
+    fclose(file);
+    if (!ok)
+        return -1;
+    parseIdList(line, ids);
+    return 0;
+}
+
+int detectNumaTopology(NumaTopology *topology)
+{
+    topology->nodeIds.clear();
+    topology->nodeCpus.clear();
+
+    // このプロセスが使えるCPU
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        unsigned int cpuNum = std::thread::hardware_concurrency();
+        for (unsigned int cpu = 0; cpu < cpuNum && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+    }
+
+    std::vector<int> nodes;
+    if (readIdList(NUMA_SYSFS_NODE_PATH "/online", &nodes) == 0)
+    {
+        for (int node : nodes)
+        {
+            char path[256];
+            snprintf(path, sizeof(path), NUMA_SYSFS_NODE_PATH "/node%d/cpulist", node);
+            std::vector<int> cpus, usable;
+            if (readIdList(path, &cpus) == -1)
+                continue;
+            for (int cpu : cpus)
+            {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    usable.push_back(cpu);
+            }
+            // メモリだけのノードや使えないノードは除く
+            if (usable.empty())
+                continue;
+            topology->nodeIds.push_back(node);
+            topology->nodeCpus.push_back(usable);
+        }
+    }
+
+    // sysfsがない場合は1ノードとみなす
+    if (topology->nodeIds.empty())
+    {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        }
+        topology->nodeIds.push_back(0);
+        topology->nodeCpus.push_back(cpus);
+    }
+    return 0;
+}
+
+int pinCurrentThread(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0)
+    {
+        printf("スレッドをCPUに固定できません(%d)\n", error);
+        return -1;
+    }
+    return 0;
+}
+
+// ノードごとの描画の状態
+struct NumaNode
+{
+    unsigned int workers = 0;
+    unsigned int tileBegin = 0, tileEnd = 0; // このノードの帯のタイル(行優先の通し番号)
+    std::atomic<unsigned int> nextTile{0};
+
+    // このノードのスレッドが使うシーン(複製する場合はcompiled・lightTreeを指す)
+    Scene scene;
+    CompiledScene compiled;
+    LightTree lightTree;
+
+    std::atomic<unsigned int> tiles{0};
+    std::atomic<unsigned int> stolenTiles{0};
+    std::atomic<unsigned long long> rays{0};
+    double seconds = 0.0;
+};
+
+int renderNuma(
+    Scene *scene, FloatBitMapData *output, const NumaTopology &topology,
+    const NumaRenderOption &option, NumaRenderStats *stats)
+{
+    unsigned int width = scene->bitmap->width;
+    unsigned int height = scene->bitmap->height;
+    if (output->width != width || output->height != height || output->pixelsData == nullptr)
+    {
+        printf("出力の大きさが画像サイズと違います\n");
+        return -1;
+    }
+    unsigned int nodeNum = (unsigned int)topology.nodeIds.size();
+    if (nodeNum == 0)
+    {
+        printf("NUMAノードがありません\n");
+        return -1;
+    }
+    unsigned int workerNum = (option.workerNum == 0) ? 1 : option.workerNum;
+    bool multiNode = nodeNum > 1;
+
+    // スレッドをノードのCPU数の比で分ける(端数はCPUあたりのスレッドが少ないノードへ)
+    std::vector<NumaNode> nodes(nodeNum);
+    size_t cpuTotal = 0;
+    for (auto &cpus : topology.nodeCpus)
+        cpuTotal += cpus.size();
+    unsigned int assigned = 0;
+    for (unsigned int n = 0; n < nodeNum; n++)
+    {
+        nodes[n].workers = (unsigned int)(workerNum * topology.nodeCpus[n].size() / cpuTotal);
+        assigned += nodes[n].workers;
+    }
+    while (assigned < workerNum)
+    {
+        unsigned int best = 0;
+        for (unsigned int n = 1; n < nodeNum; n++)
+        {
+            // CPUあたりのスレッド数が最も少ないノード
+            if ((nodes[n].workers + 1) * topology.nodeCpus[best].size() <
+                (nodes[best].workers + 1) * topology.nodeCpus[n].size())
+                best = n;
+        }
+        nodes[best].workers++;
+        assigned++;
+    }
+
+    // タイルの行をスレッド数の比で帯に分ける
+    unsigned int tileCountX = (width + NUMA_TILE_SIZE - 1) / NUMA_TILE_SIZE;
+    unsigned int tileCountY = (height + NUMA_TILE_SIZE - 1) / NUMA_TILE_SIZE;
+    unsigned int workersBefore = 0;
+    for (unsigned int n = 0; n < nodeNum; n++)
+    {
+        unsigned int rowBegin = tileCountY * workersBefore / workerNum;
+        workersBefore += nodes[n].workers;
+        unsigned int rowEnd = tileCountY * workersBefore / workerNum;
+        nodes[n].tileBegin = rowBegin * tileCountX;
+        nodes[n].tileEnd = rowEnd * tileCountX;
+        nodes[n].nextTile = nodes[n].tileBegin;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // 準備: ノードごとに固定したスレッドでシーンを複製し，自分の帯のページに最初に触れる
+    // (Linuxはページに最初に書き込んだスレッドのノードにページを割り当てる)
+    auto prepare = [&](unsigned int n)
+    {
+        NumaNode *node = &nodes[n];
+        node->scene = *scene;
+        if (!multiNode)
+            return;
+        pinCurrentThread(topology.nodeCpus[n]);
+        if (option.replicateScene)
+        {
+            // ジオメトリ・光源のオブジェクトとテクスチャは共有する
+            copyCompiledScene(&node->scene, &node->compiled);
+            if (scene->lightTree != nullptr)
+            {
+                node->lightTree = *scene->lightTree;
+                node->scene.lightTree = &node->lightTree;
+            }
+        }
+        unsigned int rowBegin = node->tileBegin / tileCountX * NUMA_TILE_SIZE;
+        unsigned int rowEnd = node->tileEnd / tileCountX * NUMA_TILE_SIZE;
+        if (rowEnd > height)
+            rowEnd = height;
+        if (rowBegin < rowEnd)
+            memset(output->getPixel(0, rowBegin), 0,
+                   (size_t)(rowEnd - rowBegin) * width * 3 * sizeof(float));
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int n = 0; n < nodeNum; n++)
+    {
+        if (nodes[n].workers > 0)
+            threads.emplace_back(prepare, n);
+    }
+    for (auto &t : threads)
+        t.join();
+    threads.clear();
+
+    // 描画: 自分のノードの帯から取り，なくなったら他のノードの帯から取る
+    std::mutex statsMutex;
+    auto worker = [&](unsigned int n)
+    {
+        NumaNode *node = &nodes[n];
+        if (multiNode)
+            pinCurrentThread(topology.nodeCpus[n]);
+        rayCount = 0;
+        for (unsigned int k = 0; k < nodeNum; k++)
+        {
+            NumaNode *source = &nodes[(n + k) % nodeNum];
+            unsigned int idx;
+            while ((idx = source->nextTile.fetch_add(1)) < source->tileEnd)
+            {
+                unsigned int x = (idx % tileCountX) * NUMA_TILE_SIZE;
+                unsigned int y = (idx / tileCountX) * NUMA_TILE_SIZE;
+                unsigned int w = (x + NUMA_TILE_SIZE > width) ? width - x : NUMA_TILE_SIZE;
+                unsigned int h = (y + NUMA_TILE_SIZE > height) ? height - y : NUMA_TILE_SIZE;
+                renderTile(&node->scene, x, y, w, h, output->getPixel(x, y), (size_t)width * 3);
+                node->tiles++;
+                if (k != 0)
+                    node->stolenTiles++;
+            }
+        }
+        node->rays += rayCount;
+
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (seconds > node->seconds)
+            node->seconds = seconds;
+    };
+    for (unsigned int n = 0; n < nodeNum; n++)
+    {
+        for (unsigned int i = 0; i < nodes[n].workers; i++)
+            threads.emplace_back(worker, n);
+    }
+    for (auto &t : threads)
+        t.join();
+
+    if (stats != nullptr)
+    {
+        stats->nodes.clear();
+        stats->sceneCopies = 0;
+        for (unsigned int n = 0; n < nodeNum; n++)
+        {
+            if (multiNode && option.replicateScene && nodes[n].workers > 0)
+                stats->sceneCopies++;
+            NumaNodeStats nodeStats;
+            nodeStats.node = topology.nodeIds[n];
+            nodeStats.workers = nodes[n].workers;
+            nodeStats.tiles = nodes[n].tiles;
+            nodeStats.stolenTiles = nodes[n].stolenTiles;
+            nodeStats.rays = nodes[n].rays;
+            nodeStats.seconds = nodes[n].seconds;
+            stats->nodes.push_back(nodeStats);
+        }
+        stats->seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/* NUMAノードを意識した描画(スレッドの固定・フレームバッファのファーストタッチ・シーンの複製) */
+#pragma once
+#include <vector>
+#include "raytracing_lib.hpp"
+
+#define NUMA_TILE_SIZE 32
+#define NUMA_SYSFS_NODE_PATH "/sys/devices/system/node"
+
+// NUMAノードとそれに属するCPU(このプロセスが使えるCPUだけ)
+// sysfsがない・ノードが1つの場合はノード0に使えるCPUをすべて入れる
+struct NumaTopology
+{
+    std::vector<int> nodeIds;               // sysfsのノード番号
+    std::vector<std::vector<int>> nodeCpus; // ノードごとのCPU番号
+};
+
+// sysfsからNUMAノードの構成を読み込む
+int detectNumaTopology(NumaTopology *topology);
+
+// 現在のスレッドをcpusのいずれかで動くように固定する
+int pinCurrentThread(const std::vector<int> &cpus);
+
+struct NumaRenderOption
+{
+    unsigned int workerNum = 1; // 全ノードのスレッド数の合計(ノードのCPU数の比で分ける)
+    bool replicateScene = true; // 展開したシーン・光源の木をノードごとに複製するか
+};
+
+// ノードごとの描画の統計
+struct NumaNodeStats
+{
+    int node;                 // sysfsのノード番号
+    unsigned int workers;     // このノードに固定したスレッド数
+    unsigned int tiles;       // このノードのスレッドが描画したタイル数
+    unsigned int stolenTiles; // そのうち他のノードの帯から取ったタイル数
+    unsigned long long rays;  // 追跡したレイの数
+    double seconds;           // このノードの最後のスレッドが終わるまでの時間
+};
+
+struct NumaRenderStats
+{
+    std::vector<NumaNodeStats> nodes;
+    unsigned int sceneCopies; // シーンを複製したノードの数(0なら全スレッドで元のシーンを共有)
+    double seconds;           // 描画全体の時間
+};
+
+// sceneをoutputに描画する
+// 画像をノードのスレッド数の比で横長の帯に分け，各ノードのスレッドが自分の帯をファーストタッチしてから
+// その帯のタイルを描画する(自分の帯がなくなったら他のノードの帯から取る)
+// outputはallocation()で確保して描画前に書き込まないこと(ページがまだ割り当てられていないように)
+// ノードが1つならスレッドを固定せずシーンも複製しない
+int renderNuma(
+    Scene *scene, FloatBitMapData *output, const NumaTopology &topology,
+    const NumaRenderOption &option, NumaRenderStats *stats);
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include "camera.hpp"
+#include "primaryVisibility.hpp"
+
+#define SCREEN_BOUNDS_MARGIN 1.f // 投影した矩形に足す余白(ピクセル)
+
+static thread_local PrimaryVisibilityStats primaryVisibilityStats = {};
+
+PrimaryVisibilityStats getPrimaryVisibilityStats()
+{
+    return primaryVisibilityStats;
+}
+
+// スクリーン上の矩形(ピクセル座標)
+struct ScreenBounds
+{
+    float minX, minY, maxX, maxY;
+};
+
+// 球を覆うスクリーン上の矩形(投影できなければスクリーン全体としてfalse)
+static bool sphereScreenBounds(
+    CompiledSphere *sphere, const CameraFrame &frame, ScreenBounds *bounds)
+{
+    bounds->minX = bounds->minY = FLT_MAX;
+    bounds->maxX = bounds->maxY = -FLT_MAX;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        Vector3 p(
+            sphere->center.x + ((corner & 1) ? sphere->radius : -sphere->radius),
+            sphere->center.y + ((corner & 2) ? sphere->radius : -sphere->radius),
+            sphere->center.z + ((corner & 4) ? sphere->radius : -sphere->radius));
+        float px, py;
+        if (!projectToScreen(frame, p, &px, &py))
+            return false;
+        bounds->minX = std::min(bounds->minX, px);
+        bounds->minY = std::min(bounds->minY, py);
+        bounds->maxX = std::max(bounds->maxX, px);
+        bounds->maxY = std::max(bounds->maxY, py);
+    }
+    bounds->minX -= SCREEN_BOUNDS_MARGIN;
+    bounds->minY -= SCREEN_BOUNDS_MARGIN;
+    bounds->maxX += SCREEN_BOUNDS_MARGIN;
+    bounds->maxY += SCREEN_BOUNDS_MARGIN;
+    return true;
+}
+
+// 平面がピクセル座標の矩形(x0,y0)〜(x1,y1)の一部でも覆うか
+// レイの方向は画素の座標について線形なので，平面の前側(t>0)はスクリーン上の半平面になり，
+// 矩形の4隅のどれもその外なら覆わない
+static bool planeCoversRect(
+    CompiledPlane *plane, const CameraFrame &frame, float x0, float y0, float x1, float y1)
+{
+    float numerator = (plane->position - frame.origin).dot(plane->normal);
+    for (int corner = 0; corner < 4; corner++)
+    {
+        float px = (corner & 1) ? x1 : x0;
+        float py = (corner & 2) ? y1 : y0;
+        Ray ray = cameraFrameRay(frame, px, py);
+        if (numerator * ray.direction.dot(plane->normal) > 0.f)
+            return true;
+    }
+    return false;
+}
+
+// 矩形内のサンプルでジオメトリと交差判定し，近ければバッファを書き換える
+static void rasterizeShape(
+    CompiledScene *compiled, int shapeIndex, ScreenBounds *bounds, unsigned int x, unsigned int y,
+    unsigned int w, unsigned int h, unsigned int samplesPerPixel, Ray *rays,
+    const float *sampleU, const float *sampleV, VisibilityBuffer *buffer)
+{
+    // 矩形と重なる画素の範囲(サンプルは画素内でジッタするので画素単位で切り出す)
+    int i0 = 0, i1 = (int)w - 1, j0 = 0, j1 = (int)h - 1;
+    if (bounds != nullptr)
+    {
+        i0 = std::max(i0, (int)floorf(bounds->minX) - (int)x);
+        i1 = std::min(i1, (int)floorf(bounds->maxX) - (int)x);
+        j0 = std::max(j0, (int)floorf(bounds->minY) - (int)y);
+        j1 = std::min(j1, (int)floorf(bounds->maxY) - (int)y);
+        if (i0 > i1 || j0 > j1)
+            return;
+    }
+
+    for (int j = j0; j <= j1; j++)
+    {
+        for (int i = i0; i <= i1; i++)
+        {
+            size_t base = ((size_t)j * w + i) * samplesPerPixel;
+            for (unsigned int s = 0; s < samplesPerPixel; s++)
+            {
+                size_t idx = base + s;
+                if (bounds != nullptr &&
+                    (sampleU[idx] < bounds->minX || sampleU[idx] > bounds->maxX ||
+                     sampleV[idx] < bounds->minY || sampleV[idx] > bounds->maxY))
+                    continue;
+
+                primaryVisibilityStats.shapeTests++;
+                Ray *ray = &rays[idx];
+                Vector3 position;
+                Vector3 otherNormal;
+                if (!compiledIntersectShape(compiled, shapeIndex, ray, &position, &otherNormal))
+                    continue;
+
+                // 深度テスト(同じ距離ならジオメトリ番号が小さい方でcompiledClosestHitと合わせる)
+                float distance = (position - ray->startPoint).magnitude();
+                int current = buffer->shapeIndex[idx];
+                if (!(distance < buffer->depth[idx] ||
+                      (distance == buffer->depth[idx] && shapeIndex < current)))
+                    continue;
+                buffer->shapeIndex[idx] = shapeIndex;
+                buffer->depth[idx] = distance;
+                buffer->points[idx].position = position;
+                buffer->points[idx].normal = otherNormal; // 球・平面は最後に計算する
+            }
+        }
+    }
+}
+
+void rasterizePrimaryVisibility(
+    CompiledScene *compiled, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    unsigned int samplesPerPixel, Ray *rays, const float *sampleU, const float *sampleV,
+    VisibilityBuffer *buffer)
+{
+    Scene *scene = compiled->scene;
+    size_t count = (size_t)w * h * samplesPerPixel;
+    buffer->shapeIndex.assign(count, -1);
+    buffer->depth.assign(count, FLT_MAX);
+    buffer->points.assign(count, IntersectionPoint());
+    primaryVisibilityStats.samples += count;
+
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+
+    for (auto &sphere : compiled->spheres)
+    {
+        ScreenBounds bounds;
+        bool bounded = sphereScreenBounds(&sphere, frame, &bounds);
+        rasterizeShape(
+            compiled, sphere.shapeIndex, bounded ? &bounds : nullptr, x, y, w, h,
+            samplesPerPixel, rays, sampleU, sampleV, buffer);
+    }
+    // 平面は地平線より手前の半平面を覆うので，タイルに掛かるものはタイル全体で判定する
+    for (auto &plane : compiled->planes)
+    {
+        if (!planeCoversRect(
+                &plane, frame, (float)x - SCREEN_BOUNDS_MARGIN, (float)y - SCREEN_BOUNDS_MARGIN,
+                (float)(x + w) + SCREEN_BOUNDS_MARGIN, (float)(y + h) + SCREEN_BOUNDS_MARGIN))
+            continue;
+        rasterizeShape(
+            compiled, plane.shapeIndex, nullptr, x, y, w, h, samplesPerPixel, rays, sampleU,
+            sampleV, buffer);
+    }
+    for (int idx : compiled->otherShapes)
+        rasterizeShape(
+            compiled, idx, nullptr, x, y, w, h, samplesPerPixel, rays, sampleU, sampleV, buffer);
+
+    // 法線は最も近い交点だけで計算する
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        int shapeIndex = buffer->shapeIndex[idx];
+        if (shapeIndex == -1)
+            continue;
+        IntersectionPoint *point = &buffer->points[idx];
+        point->normal = compiledShapeNormal(compiled, shapeIndex, point->position, point->normal);
+    }
+}
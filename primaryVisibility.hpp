@@ -0,0 +1,34 @@
+/* 1次レイの可視性のラスタライズ */
+#pragma once
+#include <vector>
+#include "compiledScene.hpp"
+
+// 1次レイごとの最も近い交点(IDバッファ+深度バッファ)
+struct VisibilityBuffer
+{
+    std::vector<int> shapeIndex;           // 最も近いジオメトリ(-1なら交点なし)
+    std::vector<float> depth;              // 視点から交点までの距離
+    std::vector<IntersectionPoint> points; // 交点(位置と法線)
+};
+
+// ラスタライズの統計(スレッドごとの累計)
+struct PrimaryVisibilityStats
+{
+    unsigned long long samples;    // ラスタライズした1次レイの数
+    unsigned long long shapeTests; // 交差判定した回数(全探索ならsamples*ジオメトリ数)
+};
+
+// 画素(x,y)〜(x+w-1,y+h-1)の1次レイの最も近い交点を求める
+// 1次レイはすべて視点から出てスクリーン(z=0)を通るので，球はAABBの8頂点を投影した矩形，
+// 平面は前側の半平面がタイルに掛かればタイル全体，その他のジオメトリはタイル全体に広げ，
+// 覆うサンプルだけで交差判定する
+// rays[(j*w+i)*samplesPerPixel+s]はcreateRay(またはgenerateRays)で作った1次レイ，
+// sampleU・sampleVはそのスクリーン座標(createRayに渡したx,y)
+// 結果はcompiledClosestHitと同じになる
+void rasterizePrimaryVisibility(
+    CompiledScene *compiled, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    unsigned int samplesPerPixel, Ray *rays, const float *sampleU, const float *sampleV,
+    VisibilityBuffer *buffer);
+
+// 現在のスレッドの統計
+PrimaryVisibilityStats getPrimaryVisibilityStats();
@@ -0,0 +1,224 @@
+#include "progressive.hpp"
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define CHECKPOINT_VERSION 1
+
+// チェックポイントファイルの先頭
+struct CheckpointHeader
+{
+    char magic[4]; // "RTCK"
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t passNum;
+};
+
+int ProgressiveState::allocation()
+{
+    if (accumulation.allocation() == -1)
+        return -1;
+
+    size_t pixelNum = (size_t)width * height;
+    sampleCounts = (unsigned int *)calloc(pixelNum, sizeof(unsigned int));
+    samplerStates = (unsigned long long *)malloc(pixelNum * sizeof(unsigned long long));
+    if (sampleCounts == nullptr || samplerStates == nullptr)
+    {
+        printf("malloc error\n");
+        freeProgressiveState(this);
+        return -1;
+    }
+
+    // renderTileと同じ種にしておく
+    for (unsigned int y = 0; y < height; y++)
+    {
+        for (unsigned int x = 0; x < width; x++)
+            samplerStates[(size_t)y * width + x] = pixelSeed(x, y);
+    }
+
+    passNum = 0;
+    return 0;
+}
+
+int freeProgressiveState(ProgressiveState *state)
+{
+    freeFloatBitmapData(&state->accumulation);
+    free(state->sampleCounts);
+    free(state->samplerStates);
+    state->sampleCounts = nullptr;
+    state->samplerStates = nullptr;
+    return 0;
+}
+
+// 1行の全ピクセルに1サンプルずつ加える
+static void renderProgressiveRow(Scene *scene, ProgressiveState *state, unsigned int y)
+{
+    for (unsigned int x = 0; x < state->width; x++)
+    {
+        size_t idx = (size_t)y * state->width + x;
+        Sampler sampler(state->samplerStates[idx]);
+        FColor luminance = renderSample(scene, x, y, &sampler);
+        state->accumulation.addPixel(x, y, luminance.r, luminance.g, luminance.b);
+        state->sampleCounts[idx]++;
+        state->samplerStates[idx] = sampler.state;
+    }
+}
+
+int renderProgressive(Scene *scene, ProgressiveState *state, const ProgressiveOption &option)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point lastCheckpoint = start;
+    auto elapsed = [](Clock::time_point from)
+    {
+        return std::chrono::duration<double>(Clock::now() - from).count();
+    };
+
+    unsigned int target =
+        (option.targetSamplingNum != 0) ? option.targetSamplingNum : scene->samplingNum;
+    unsigned int workerNum = (option.workerNum != 0) ? option.workerNum : 1;
+    bool timeout = false;
+
+    while (state->passNum < target && !timeout)
+    {
+        // 中断した行が残っていてもピクセルごとにサンプル数を持つので問題ない
+        std::atomic<unsigned int> nextRow(0);
+        std::atomic<bool> stop(false);
+        auto worker = [&]()
+        {
+            unsigned int y;
+            while (!stop.load() && (y = nextRow.fetch_add(1)) < state->height)
+            {
+                // 途中から再開した場合は目標に達したピクセルを飛ばす
+                if (state->sampleCounts[(size_t)y * state->width] > state->passNum)
+                    continue;
+                renderProgressiveRow(scene, state, y);
+                if (option.timeBudget > 0.0 && elapsed(start) > option.timeBudget)
+                    stop = true;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 1; i < workerNum; i++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &t : threads)
+            t.join();
+
+        if (stop.load())
+            timeout = true;
+        else
+            state->passNum++;
+
+        // 一定時間ごと(と終了時)にチェックポイントを書き出す
+        bool finished = timeout || state->passNum >= target;
+        if (option.checkpointFile != nullptr &&
+            (finished || elapsed(lastCheckpoint) >= option.checkpointInterval))
+        {
+            if (progressiveCheckpointWrite(state, option.checkpointFile) == -1)
+                return -1;
+            lastCheckpoint = Clock::now();
+        }
+    }
+
+    return timeout ? 1 : 0;
+}
+
+void resolveProgressive(ProgressiveState *state, FloatBitMapData *out)
+{
+    for (unsigned int y = 0; y < state->height; y++)
+    {
+        for (unsigned int x = 0; x < state->width; x++)
+        {
+            unsigned int count = state->sampleCounts[(size_t)y * state->width + x];
+            float *sum = state->accumulation.getPixel(x, y);
+            if (count == 0)
+                out->setPixel(x, y, 0.f, 0.f, 0.f);
+            else
+                out->setPixel(
+                    x, y, sum[0] / (float)count, sum[1] / (float)count, sum[2] / (float)count);
+        }
+    }
+}
+
+int progressiveCheckpointWrite(ProgressiveState *state, const char *filename)
+{
+    // 書き込み途中で止まっても前のチェックポイントが壊れないように別名で書いてから置き換える
+    char tmpName[1024];
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", filename);
+
+    FILE *file = fopen(tmpName, "wb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", tmpName);
+        return -1;
+    }
+
+    CheckpointHeader header;
+    memcpy(header.magic, "RTCK", 4);
+    header.version = CHECKPOINT_VERSION;
+    header.width = state->width;
+    header.height = state->height;
+    header.passNum = state->passNum;
+
+    size_t pixelNum = (size_t)state->width * state->height;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(state->accumulation.pixelsData, sizeof(float), pixelNum * 3, file) ==
+                  pixelNum * 3 &&
+              fwrite(state->sampleCounts, sizeof(unsigned int), pixelNum, file) == pixelNum &&
+              fwrite(state->samplerStates, sizeof(unsigned long long), pixelNum, file) ==
+                  pixelNum;
+    if (fclose(file) == EOF)
+        ok = false;
+
+    if (!ok || rename(tmpName, filename) != 0)
+    {
+        printf("チェックポイント%sの書き込みに失敗しました\n", filename);
+        remove(tmpName);
+        return -1;
+    }
+
+    return 0;
+}
+
+int progressiveCheckpointRead(ProgressiveState *state, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == nullptr)
+        return -1;
+
+    CheckpointHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, "RTCK", 4) != 0 || header.version != CHECKPOINT_VERSION)
+    {
+        printf("%sはチェックポイントではありません\n", filename);
+        fclose(file);
+        return -1;
+    }
+    if (header.width != state->width || header.height != state->height)
+    {
+        printf("チェックポイントの画像サイズが一致しません\n");
+        fclose(file);
+        return -1;
+    }
+
+    size_t pixelNum = (size_t)state->width * state->height;
+    bool ok = fread(state->accumulation.pixelsData, sizeof(float), pixelNum * 3, file) ==
+                  pixelNum * 3 &&
+              fread(state->sampleCounts, sizeof(unsigned int), pixelNum, file) == pixelNum &&
+              fread(state->samplerStates, sizeof(unsigned long long), pixelNum, file) ==
+                  pixelNum;
+    fclose(file);
+
+    if (!ok)
+    {
+        printf("チェックポイント%sの読み込みに失敗しました\n", filename);
+        return -1;
+    }
+
+    state->passNum = header.passNum;
+    return 0;
+}
@@ -0,0 +1,46 @@
+/* プログレッシブレンダリングとチェックポイントのヘッダ */
+#pragma once
+#include "raytracing_lib.hpp"
+
+// プログレッシブレンダリングの状態
+// 1パスで全ピクセルに1サンプルずつ加えていく
+struct ProgressiveState
+{
+    unsigned int width;                  // 幅
+    unsigned int height;                 // 高さ
+    unsigned int passNum;                // 完了したパス数
+    FloatBitMapData accumulation;        // サンプルの合計(平均ではない)
+    unsigned int *sampleCounts = nullptr;       // ピクセルごとのサンプル数
+    unsigned long long *samplerStates = nullptr; // ピクセルごとの乱数の状態
+
+    ProgressiveState() {}
+    ProgressiveState(unsigned int w, unsigned int h)
+        : width(w), height(h), passNum(0), accumulation(w, h) {}
+
+    // 蓄積バッファ等の確保と乱数の初期化
+    int allocation();
+};
+
+int freeProgressiveState(ProgressiveState *);
+
+// プログレッシブレンダリングの設定
+struct ProgressiveOption
+{
+    double timeBudget = 0.0;              // 描画時間の上限[秒](0なら無制限)
+    unsigned int targetSamplingNum = 0;   // 目標サンプル数(0ならscene->samplingNum)
+    double checkpointInterval = 60.0;     // チェックポイントを書き出す間隔[秒]
+    const char *checkpointFile = nullptr; // チェックポイントの保存先(nullptrなら保存しない)
+    unsigned int workerNum = 1;           // スレッド数
+};
+
+// 時間切れか目標サンプル数に達するまでパスを繰り返す
+// 目標に達したら0，時間切れなら1，エラーなら-1を返す
+int renderProgressive(Scene *scene, ProgressiveState *state, const ProgressiveOption &option);
+
+// 蓄積バッファをサンプル数で割って平均を求める
+void resolveProgressive(ProgressiveState *state, FloatBitMapData *out);
+
+// チェックポイント(蓄積バッファ・サンプル数・乱数の状態)の保存と読み込み
+// 読み込んだ状態から再開すると中断しなかった場合とビット単位で同じ結果になる
+int progressiveCheckpointWrite(ProgressiveState *state, const char *filename);
+int progressiveCheckpointRead(ProgressiveState *state, const char *filename);
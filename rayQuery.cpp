@@ -0,0 +1,533 @@
+#include <atomic>
+#include <condition_variable>
+#include <float.h>
+#include <math.h>
+#include <mutex>
+#include <thread>
+#include "compiledScene.hpp"
+#include "rayQuery.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 処理の種類
+enum RAY_QUERY_JOB
+{
+    RAY_QUERY_CLOSEST,
+    RAY_QUERY_OCCLUSION,
+};
+
+struct RayQueryContext
+{
+    CompiledScene *compiled;
+    bool ownsCompiled; // 内部で展開した場合はtrue
+
+    // 球(中心・半径の2乗・ジオメトリ番号)
+    std::vector<float> sphereX, sphereY, sphereZ, sphereRadius2;
+    std::vector<int> sphereIndex;
+    // 平面(法線・法線と通る点の内積・ジオメトリ番号)
+    std::vector<float> planeX, planeY, planeZ, planeD;
+    std::vector<int> planeIndex;
+
+    // スレッド
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cond;     // 新しい処理・終了
+    std::condition_variable doneCond; // 全スレッドが処理を終えた
+    unsigned long long generation = 0;
+    unsigned int busyWorkers = 0;
+    bool stopping = false;
+
+    // 処理中の呼び出し
+    int job;
+    const RayQueryRays *rays;
+    RayQueryHits *hits;
+    unsigned char *occluded;
+    size_t chunkNum;
+    std::atomic<size_t> nextChunk;
+};
+
+// 球・平面以外のジオメトリとの交点のt(交点がなければfalse)
+static bool intersectOtherShape(
+    RayQueryContext *context, int idx, Vector3 origin, Vector3 direction, float *t,
+    Vector3 *normal)
+{
+    Ray ray;
+    ray.startPoint = origin;
+    ray.direction = direction;
+    Vector3 position;
+    if (!compiledIntersectShape(context->compiled, idx, &ray, &position, normal))
+        return false;
+    Vector3 offset = position - origin;
+    *t = offset.dot(direction) / direction.dot(direction);
+    return true;
+}
+
+// 交点の候補が今までの最近点より近いか(同じ距離ならジオメトリ番号が小さい方)
+static inline bool isCloser(float t, int idx, float bestT, int bestIndex)
+{
+    return t < bestT || (t == bestT && idx < bestIndex);
+}
+
+// 最も近い交点の法線
+static Vector3 hitNormal(
+    RayQueryContext *context, int idx, Vector3 origin, Vector3 direction, float t,
+    Vector3 otherNormal)
+{
+    CompiledShape *shape = &context->compiled->shapes[idx];
+    if (shape->type == COMPILED_SPHERE)
+    {
+        CompiledSphere *sphere = &context->compiled->spheres[shape->slot];
+        Vector3 p(
+            origin.x + t * direction.x, origin.y + t * direction.y, origin.z + t * direction.z);
+        return (p - sphere->center).normalize();
+    }
+    if (shape->type == COMPILED_PLANE)
+        return context->compiled->planes[shape->slot].normal;
+    return otherNormal;
+}
+
+// レイk本目の最も近い交点(1本ずつ)
+// 4本版と同じ順序で計算するので結果も同じになる
+static void closestScalar(RayQueryContext *context, const RayQueryRays &rays, RayQueryHits *hits, size_t k)
+{
+    float ox = rays.originX[k], oy = rays.originY[k], oz = rays.originZ[k];
+    float dx = rays.directionX[k], dy = rays.directionY[k], dz = rays.directionZ[k];
+    float tMax = rays.tMax[k];
+    float a = dx * dx + dy * dy + dz * dz;
+    float bestT = tMax;
+    int bestIndex = -1;
+
+    for (size_t i = 0; i < context->sphereIndex.size(); i++)
+    {
+        float cx = ox - context->sphereX[i], cy = oy - context->sphereY[i],
+              cz = oz - context->sphereZ[i];
+        float b = cx * dx + cy * dy + cz * dz;
+        float c = (cx * cx + cy * cy + cz * cz) - context->sphereRadius2[i];
+        float disc = b * b - a * c;
+        if (!(disc >= 0.f))
+            continue;
+        float s = sqrtf(disc);
+        float t1 = (-b - s) / a;
+        float t2 = (-b + s) / a;
+        float t = (t1 > 0.f) ? t1 : t2;
+        if (t > 0.f && t < tMax && isCloser(t, context->sphereIndex[i], bestT, bestIndex))
+        {
+            bestT = t;
+            bestIndex = context->sphereIndex[i];
+        }
+    }
+    for (size_t i = 0; i < context->planeIndex.size(); i++)
+    {
+        float dn = dx * context->planeX[i] + dy * context->planeY[i] + dz * context->planeZ[i];
+        float on = ox * context->planeX[i] + oy * context->planeY[i] + oz * context->planeZ[i];
+        float t = (context->planeD[i] - on) / dn;
+        if (dn != 0.f && t > 0.f && t < tMax &&
+            isCloser(t, context->planeIndex[i], bestT, bestIndex))
+        {
+            bestT = t;
+            bestIndex = context->planeIndex[i];
+        }
+    }
+
+    Vector3 origin(ox, oy, oz), direction(dx, dy, dz);
+    Vector3 otherNormal(0, 0, 0);
+    for (int idx : context->compiled->otherShapes)
+    {
+        float t;
+        Vector3 normal;
+        if (intersectOtherShape(context, idx, origin, direction, &t, &normal) && t > 0.f &&
+            t < tMax && isCloser(t, idx, bestT, bestIndex))
+        {
+            bestT = t;
+            bestIndex = idx;
+            otherNormal = normal;
+        }
+    }
+
+    hits->t[k] = bestT;
+    hits->shapeId[k] = bestIndex;
+    if (hits->normalX != nullptr)
+    {
+        Vector3 normal(0, 0, 0);
+        if (bestIndex != -1)
+            normal = hitNormal(context, bestIndex, origin, direction, bestT, otherNormal);
+        hits->normalX[k] = normal.x;
+        hits->normalY[k] = normal.y;
+        hits->normalZ[k] = normal.z;
+    }
+}
+
+// レイk本目が遮られるか(1本ずつ)
+static bool occludedScalar(RayQueryContext *context, const RayQueryRays &rays, size_t k)
+{
+    float ox = rays.originX[k], oy = rays.originY[k], oz = rays.originZ[k];
+    float dx = rays.directionX[k], dy = rays.directionY[k], dz = rays.directionZ[k];
+    float tMax = rays.tMax[k];
+    float a = dx * dx + dy * dy + dz * dz;
+
+    for (size_t i = 0; i < context->sphereIndex.size(); i++)
+    {
+        float cx = ox - context->sphereX[i], cy = oy - context->sphereY[i],
+              cz = oz - context->sphereZ[i];
+        float b = cx * dx + cy * dy + cz * dz;
+        float c = (cx * cx + cy * cy + cz * cz) - context->sphereRadius2[i];
+        float disc = b * b - a * c;
+        if (!(disc >= 0.f))
+            continue;
+        float s = sqrtf(disc);
+        float t1 = (-b - s) / a;
+        float t2 = (-b + s) / a;
+        float t = (t1 > 0.f) ? t1 : t2;
+        if (t > 0.f && t < tMax)
+            return true;
+    }
+    for (size_t i = 0; i < context->planeIndex.size(); i++)
+    {
+        float dn = dx * context->planeX[i] + dy * context->planeY[i] + dz * context->planeZ[i];
+        float on = ox * context->planeX[i] + oy * context->planeY[i] + oz * context->planeZ[i];
+        float t = (context->planeD[i] - on) / dn;
+        if (dn != 0.f && t > 0.f && t < tMax)
+            return true;
+    }
+    Vector3 origin(ox, oy, oz), direction(dx, dy, dz);
+    for (int idx : context->compiled->otherShapes)
+    {
+        float t;
+        Vector3 normal;
+        if (intersectOtherShape(context, idx, origin, direction, &t, &normal) && t > 0.f &&
+            t < tMax)
+            return true;
+    }
+    return false;
+}
+
+#ifdef __SSE2__
+// レイk〜k+3本目の最も近い交点
+static void closest4(RayQueryContext *context, const RayQueryRays &rays, RayQueryHits *hits, size_t k)
+{
+    const __m128 zero = _mm_setzero_ps();
+    __m128 ox = _mm_loadu_ps(rays.originX + k), oy = _mm_loadu_ps(rays.originY + k),
+           oz = _mm_loadu_ps(rays.originZ + k);
+    __m128 dx = _mm_loadu_ps(rays.directionX + k), dy = _mm_loadu_ps(rays.directionY + k),
+           dz = _mm_loadu_ps(rays.directionZ + k);
+    __m128 tMax = _mm_loadu_ps(rays.tMax + k);
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 bestT = tMax;
+    __m128i bestIndex = _mm_set1_epi32(-1);
+
+    for (size_t i = 0; i < context->sphereIndex.size(); i++)
+    {
+        __m128 cx = _mm_sub_ps(ox, _mm_set1_ps(context->sphereX[i]));
+        __m128 cy = _mm_sub_ps(oy, _mm_set1_ps(context->sphereY[i]));
+        __m128 cz = _mm_sub_ps(oz, _mm_set1_ps(context->sphereZ[i]));
+        __m128 b = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(cx, dx), _mm_mul_ps(cy, dy)), _mm_mul_ps(cz, dz));
+        __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz)),
+            _mm_set1_ps(context->sphereRadius2[i]));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+        __m128 valid = _mm_cmpge_ps(disc, zero);
+        if (_mm_movemask_ps(valid) == 0)
+            continue;
+        __m128 s = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 minusB = _mm_sub_ps(zero, b);
+        __m128 t1 = _mm_div_ps(_mm_sub_ps(minusB, s), a);
+        __m128 t2 = _mm_div_ps(_mm_add_ps(minusB, s), a);
+        __m128 near = _mm_cmpgt_ps(t1, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near, t1), _mm_andnot_ps(near, t2));
+        __m128i idx = _mm_set1_epi32(context->sphereIndex[i]);
+        __m128 closer = _mm_or_ps(
+            _mm_cmplt_ps(t, bestT),
+            _mm_and_ps(_mm_cmpeq_ps(t, bestT), _mm_castsi128_ps(_mm_cmplt_epi32(idx, bestIndex))));
+        valid = _mm_and_ps(
+            _mm_and_ps(valid, _mm_cmpgt_ps(t, zero)), _mm_and_ps(_mm_cmplt_ps(t, tMax), closer));
+        bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+        __m128i validInt = _mm_castps_si128(valid);
+        bestIndex = _mm_or_si128(_mm_and_si128(validInt, idx), _mm_andnot_si128(validInt, bestIndex));
+    }
+    for (size_t i = 0; i < context->planeIndex.size(); i++)
+    {
+        __m128 nx = _mm_set1_ps(context->planeX[i]), ny = _mm_set1_ps(context->planeY[i]),
+               nz = _mm_set1_ps(context->planeZ[i]);
+        __m128 dn = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz));
+        __m128 on = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(ox, nx), _mm_mul_ps(oy, ny)), _mm_mul_ps(oz, nz));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(context->planeD[i]), on), dn);
+        __m128i idx = _mm_set1_epi32(context->planeIndex[i]);
+        __m128 closer = _mm_or_ps(
+            _mm_cmplt_ps(t, bestT),
+            _mm_and_ps(_mm_cmpeq_ps(t, bestT), _mm_castsi128_ps(_mm_cmplt_epi32(idx, bestIndex))));
+        __m128 valid = _mm_and_ps(
+            _mm_and_ps(_mm_cmpneq_ps(dn, zero), _mm_cmpgt_ps(t, zero)),
+            _mm_and_ps(_mm_cmplt_ps(t, tMax), closer));
+        bestT = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, bestT));
+        __m128i validInt = _mm_castps_si128(valid);
+        bestIndex = _mm_or_si128(_mm_and_si128(validInt, idx), _mm_andnot_si128(validInt, bestIndex));
+    }
+
+    float laneT[4];
+    int laneIndex[4];
+    _mm_storeu_ps(laneT, bestT);
+    _mm_storeu_si128((__m128i *)laneIndex, bestIndex);
+    for (int lane = 0; lane < 4; lane++)
+    {
+        size_t r = k + lane;
+        Vector3 origin(rays.originX[r], rays.originY[r], rays.originZ[r]);
+        Vector3 direction(rays.directionX[r], rays.directionY[r], rays.directionZ[r]);
+        Vector3 otherNormal(0, 0, 0);
+        // 球・平面以外は1本ずつ判定する
+        for (int idx : context->compiled->otherShapes)
+        {
+            float t;
+            Vector3 normal;
+            if (intersectOtherShape(context, idx, origin, direction, &t, &normal) && t > 0.f &&
+                t < rays.tMax[r] && isCloser(t, idx, laneT[lane], laneIndex[lane]))
+            {
+                laneT[lane] = t;
+                laneIndex[lane] = idx;
+                otherNormal = normal;
+            }
+        }
+        hits->t[r] = laneT[lane];
+        hits->shapeId[r] = laneIndex[lane];
+        if (hits->normalX != nullptr)
+        {
+            Vector3 normal(0, 0, 0);
+            if (laneIndex[lane] != -1)
+                normal = hitNormal(
+                    context, laneIndex[lane], origin, direction, laneT[lane], otherNormal);
+            hits->normalX[r] = normal.x;
+            hits->normalY[r] = normal.y;
+            hits->normalZ[r] = normal.z;
+        }
+    }
+}
+
+// レイk〜k+3本目が遮られるか(4本とも遮られたら打ち切る)
+static void occluded4(
+    RayQueryContext *context, const RayQueryRays &rays, unsigned char *occluded, size_t k)
+{
+    const __m128 zero = _mm_setzero_ps();
+    __m128 ox = _mm_loadu_ps(rays.originX + k), oy = _mm_loadu_ps(rays.originY + k),
+           oz = _mm_loadu_ps(rays.originZ + k);
+    __m128 dx = _mm_loadu_ps(rays.directionX + k), dy = _mm_loadu_ps(rays.directionY + k),
+           dz = _mm_loadu_ps(rays.directionZ + k);
+    __m128 tMax = _mm_loadu_ps(rays.tMax + k);
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    __m128 hit = _mm_setzero_ps();
+
+    for (size_t i = 0; i < context->sphereIndex.size() && _mm_movemask_ps(hit) != 0xf; i++)
+    {
+        __m128 cx = _mm_sub_ps(ox, _mm_set1_ps(context->sphereX[i]));
+        __m128 cy = _mm_sub_ps(oy, _mm_set1_ps(context->sphereY[i]));
+        __m128 cz = _mm_sub_ps(oz, _mm_set1_ps(context->sphereZ[i]));
+        __m128 b = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(cx, dx), _mm_mul_ps(cy, dy)), _mm_mul_ps(cz, dz));
+        __m128 c = _mm_sub_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz)),
+            _mm_set1_ps(context->sphereRadius2[i]));
+        __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+        __m128 valid = _mm_cmpge_ps(disc, zero);
+        if (_mm_movemask_ps(valid) == 0)
+            continue;
+        __m128 s = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+        __m128 minusB = _mm_sub_ps(zero, b);
+        __m128 t1 = _mm_div_ps(_mm_sub_ps(minusB, s), a);
+        __m128 t2 = _mm_div_ps(_mm_add_ps(minusB, s), a);
+        __m128 near = _mm_cmpgt_ps(t1, zero);
+        __m128 t = _mm_or_ps(_mm_and_ps(near, t1), _mm_andnot_ps(near, t2));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tMax)));
+        hit = _mm_or_ps(hit, valid);
+    }
+    for (size_t i = 0; i < context->planeIndex.size() && _mm_movemask_ps(hit) != 0xf; i++)
+    {
+        __m128 nx = _mm_set1_ps(context->planeX[i]), ny = _mm_set1_ps(context->planeY[i]),
+               nz = _mm_set1_ps(context->planeZ[i]);
+        __m128 dn = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz));
+        __m128 on = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(ox, nx), _mm_mul_ps(oy, ny)), _mm_mul_ps(oz, nz));
+        __m128 t = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(context->planeD[i]), on), dn);
+        __m128 valid = _mm_and_ps(
+            _mm_cmpneq_ps(dn, zero), _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tMax)));
+        hit = _mm_or_ps(hit, valid);
+    }
+
+    int mask = _mm_movemask_ps(hit);
+    for (int lane = 0; lane < 4; lane++)
+    {
+        size_t r = k + lane;
+        bool blocked = (mask >> lane) & 1;
+        if (!blocked && !context->compiled->otherShapes.empty())
+        {
+            Vector3 origin(rays.originX[r], rays.originY[r], rays.originZ[r]);
+            Vector3 direction(rays.directionX[r], rays.directionY[r], rays.directionZ[r]);
+            for (int idx : context->compiled->otherShapes)
+            {
+                float t;
+                Vector3 normal;
+                if (intersectOtherShape(context, idx, origin, direction, &t, &normal) &&
+                    t > 0.f && t < rays.tMax[r])
+                {
+                    blocked = true;
+                    break;
+                }
+            }
+        }
+        occluded[r] = blocked ? 1 : 0;
+    }
+}
+#endif
+
+// チャンクを1つ処理する
+static void processChunk(RayQueryContext *context, size_t chunk)
+{
+    const RayQueryRays &rays = *context->rays;
+    size_t begin = chunk * RAY_QUERY_CHUNK_SIZE;
+    size_t end = begin + RAY_QUERY_CHUNK_SIZE;
+    if (end > rays.count)
+        end = rays.count;
+    size_t k = begin;
+    if (context->job == RAY_QUERY_CLOSEST)
+    {
+#ifdef __SSE2__
+        for (; k + 4 <= end; k += 4)
+            closest4(context, rays, context->hits, k);
+#endif
+        for (; k < end; k++)
+            closestScalar(context, rays, context->hits, k);
+    }
+    else
+    {
+#ifdef __SSE2__
+        for (; k + 4 <= end; k += 4)
+            occluded4(context, rays, context->occluded, k);
+#endif
+        for (; k < end; k++)
+            context->occluded[k] = occludedScalar(context, rays, k) ? 1 : 0;
+    }
+}
+
+// 残っているチャンクがなくなるまで処理する
+static void processChunks(RayQueryContext *context)
+{
+    size_t chunk;
+    while ((chunk = context->nextChunk.fetch_add(1)) < context->chunkNum)
+        processChunk(context, chunk);
+}
+
+static void rayQueryWorker(RayQueryContext *context)
+{
+    unsigned long long seen = 0;
+    std::unique_lock<std::mutex> lock(context->mutex);
+    while (true)
+    {
+        context->cond.wait(
+            lock, [&]() { return context->stopping || context->generation != seen; });
+        if (context->stopping)
+            break;
+        seen = context->generation;
+        lock.unlock();
+        processChunks(context);
+        lock.lock();
+        if (--context->busyWorkers == 0)
+            context->doneCond.notify_one();
+    }
+}
+
+// 呼び出したスレッドとワーカーで処理を分け合う
+static void runJob(RayQueryContext *context)
+{
+    context->chunkNum = (context->rays->count + RAY_QUERY_CHUNK_SIZE - 1) / RAY_QUERY_CHUNK_SIZE;
+    context->nextChunk = 0;
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        context->busyWorkers = (unsigned int)context->workers.size();
+        context->generation++;
+    }
+    context->cond.notify_all();
+    processChunks(context);
+    std::unique_lock<std::mutex> lock(context->mutex);
+    context->doneCond.wait(lock, [&]() { return context->busyWorkers == 0; });
+}
+
+RayQueryContext *createRayQueryContext(Scene *scene, unsigned int workerNum)
+{
+    RayQueryContext *context = new RayQueryContext();
+    context->compiled = scene->compiledScene;
+    context->ownsCompiled = false;
+    if (context->compiled == nullptr)
+    {
+        context->compiled = compileScene(scene);
+        context->ownsCompiled = true;
+    }
+
+    for (auto &sphere : context->compiled->spheres)
+    {
+        context->sphereX.push_back(sphere.center.x);
+        context->sphereY.push_back(sphere.center.y);
+        context->sphereZ.push_back(sphere.center.z);
+        context->sphereRadius2.push_back(sphere.radius * sphere.radius);
+        context->sphereIndex.push_back(sphere.shapeIndex);
+    }
+    for (auto &plane : context->compiled->planes)
+    {
+        context->planeX.push_back(plane.normal.x);
+        context->planeY.push_back(plane.normal.y);
+        context->planeZ.push_back(plane.normal.z);
+        context->planeD.push_back(
+            plane.normal.x * plane.position.x + plane.normal.y * plane.position.y +
+            plane.normal.z * plane.position.z);
+        context->planeIndex.push_back(plane.shapeIndex);
+    }
+
+    // 呼び出したスレッドも処理するので起動するのはworkerNum-1個
+    for (unsigned int i = 1; i < workerNum; i++)
+        context->workers.emplace_back(rayQueryWorker, context);
+    return context;
+}
+
+void freeRayQueryContext(RayQueryContext *context)
+{
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        context->stopping = true;
+    }
+    context->cond.notify_all();
+    for (auto &t : context->workers)
+        t.join();
+    if (context->ownsCompiled)
+        freeCompiledScene(context->compiled);
+    delete context;
+}
+
+int rayQueryClosest(RayQueryContext *context, const RayQueryRays &rays, RayQueryHits *hits)
+{
+    if (hits->t == nullptr || hits->shapeId == nullptr)
+    {
+        printf("交点の出力先がありません\n");
+        return -1;
+    }
+    context->job = RAY_QUERY_CLOSEST;
+    context->rays = &rays;
+    context->hits = hits;
+    runJob(context);
+    return 0;
+}
+
+int rayQueryOcclusion(
+    RayQueryContext *context, const RayQueryRays &rays, unsigned char *occluded)
+{
+    if (occluded == nullptr)
+    {
+        printf("遮蔽の出力先がありません\n");
+        return -1;
+    }
+    context->job = RAY_QUERY_OCCLUSION;
+    context->rays = &rays;
+    context->occluded = occluded;
+    runJob(context);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/* 外部から使うレイの交差判定のまとめ処理(SoA) */
+#pragma once
+#include <stddef.h>
+#include "raytracing_lib.hpp"
+
+#define RAY_QUERY_CHUNK_SIZE 1024 // スレッドが1回に取り出すレイの数
+
+// レイの配列(呼び出し側が確保する．長さはどれもcount)
+// 方向は正規化しなくてよい．交点はt(始点 + t*方向)が0 < t < tMaxのものだけ求める
+struct RayQueryRays
+{
+    size_t count;
+    const float *originX, *originY, *originZ;
+    const float *directionX, *directionY, *directionZ;
+    const float *tMax;
+};
+
+// 最も近い交点の出力(呼び出し側が確保する．長さはどれもcount)
+// 交点がなければshapeIdは-1，tはtMax，法線は0
+// normalX等はnullptrなら書き込まない
+struct RayQueryHits
+{
+    float *t;
+    int *shapeId; // Scene::geometryの添字
+    float *normalX, *normalY, *normalZ;
+};
+
+struct RayQueryContext;
+
+// 交差判定の準備をしてworkerNum個のスレッドを起動する(sceneは使い終わるまで変更しないこと)
+// scene->compiledSceneがなければ内部で展開する
+RayQueryContext *createRayQueryContext(Scene *scene, unsigned int workerNum);
+
+// スレッドを終了して解放する
+void freeRayQueryContext(RayQueryContext *context);
+
+// 各レイの最も近い交点を求める(同じ距離ならジオメトリ番号が小さい方)
+// 呼び出したスレッドも含めて並列に処理し，球・平面はSSEで4本ずつ判定する
+// 呼び出しごとのメモリ確保はしない．同じcontextを複数のスレッドから同時に使わないこと
+int rayQueryClosest(RayQueryContext *context, const RayQueryRays &rays, RayQueryHits *hits);
+
+// 各レイがtMaxより手前で遮られるか(occluded[k]に1か0を書き込む)
+int rayQueryOcclusion(
+    RayQueryContext *context, const RayQueryRays &rays, unsigned char *occluded);
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-clang++ $1.cpp raytracing_lib.cpp mymath.cpp myPng.cpp log.cpp -lpng -o $1 && ./$1
\ No newline at end of file
+clang++ $1.cpp raytracing_lib.cpp mymath.cpp myPng.cpp framebuffer.cpp tiledFramebuffer.cpp texture.cpp progressive.cpp lightTree.cpp lightCache.cpp uniformGrid.cpp compiledScene.cpp sortedShading.cpp denoise.cpp incremental.cpp primaryVisibility.cpp camera.cpp multiView.cpp temporal.cpp rayQuery.cpp memory.cpp numa.cpp sequence.cpp sceneFile.cpp socketUtil.cpp distributed.cpp renderService.cpp log.cpp -lpng -pthread -o $1 && ./$1
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include <math.h>
+#include "multiView.hpp"
+#include "sceneFile.hpp"
+#include "temporal.hpp"
+
+// カメラを1フレームごとに動かしながら前フレームを再投影して描画する
+// 毎フレーム全画素を描き直した場合と時間・差を比べる
+// 使い方: raytracing_animation シーン フレーム数 [スレッド数] [出力PNGの接頭辞] [移動量x y z]
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s シーン フレーム数 [スレッド数] [出力PNGの接頭辞] [移動量x y z]\n",
+               argv[0]);
+        return -1;
+    }
+    unsigned int frameNum = atoi(argv[2]);
+    TemporalOption option;
+    option.workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+    const char *prefix = (argc > 4) ? argv[4] : "raytracing_animation";
+    Vector3 step(0.02f, 0.f, 0.05f);
+    if (argc > 7)
+        step = Vector3((float)atof(argv[5]), (float)atof(argv[6]), (float)atof(argv[7]));
+
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    Scene *scene = &sceneFile.scene;
+    unsigned int width = sceneFile.bitmap.width;
+    unsigned int height = sceneFile.bitmap.height;
+
+    FloatBitMapData hdrBitmap(width, height);
+    FloatBitMapData fullBitmap(width, height);
+    BitMapData bitmap(width, height, 3);
+    if (hdrBitmap.allocation() == -1 || fullBitmap.allocation() == -1 ||
+        bitmap.allocation() == -1)
+        return -1;
+
+    TemporalHistory history;
+    double totalSeconds = 0.0, totalFullSeconds = 0.0;
+    unsigned long long totalReused = 0;
+    int result = 0;
+    for (unsigned int frame = 0; frame < frameNum && result == 0; frame++)
+    {
+        // 視点(ピンホールカメラなら注視点も)を平行移動する
+        if (frame > 0)
+        {
+            sceneFile.camera.position = sceneFile.camera.position + step;
+            sceneFile.camera.target = sceneFile.camera.target + step;
+        }
+
+        TemporalStats stats;
+        if (renderTemporalFrame(scene, &history, &hdrBitmap, option, &stats) == -1)
+            return -1;
+
+        // 全画素を描き直した結果
+        MultiViewStats fullStats;
+        renderMultiView(scene, scene->camera, 1, &fullBitmap, option.workerNum, &fullStats);
+
+        size_t count = (size_t)width * height * 3;
+        double sumDiff = 0.0;
+        float maxDiff = 0.f;
+        for (size_t i = 0; i < count; i++)
+        {
+            float diff = fabsf(hdrBitmap.pixelsData[i] - fullBitmap.pixelsData[i]);
+            sumDiff += diff;
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+        unsigned int pixelNum = width * height;
+        printf("フレーム%u: 再投影 %.1f%% (深度で棄却 %u, 材質で棄却 %u, 境界で棄却 %u) %.3f秒, "
+               "全描画 %.3f秒 (%.3f秒短縮), 差 平均%.4f 最大%.3f\n",
+               frame, 100.0 * stats.reusedPixels / pixelNum, stats.rejectedDepth,
+               stats.rejectedMaterial, stats.rejectedMixed, stats.seconds, fullStats.seconds,
+               fullStats.seconds - stats.seconds, sumDiff / count, maxDiff);
+        totalSeconds += stats.seconds;
+        totalFullSeconds += fullStats.seconds;
+        totalReused += stats.reusedPixels;
+
+        char filename[512];
+        snprintf(filename, sizeof(filename), "%s_%03u.png", prefix, frame);
+        toneMapping(&hdrBitmap, &bitmap);
+        result = pngFileEncodeWrite(&bitmap, filename);
+    }
+    printf("合計: 再投影 %.1f%%, %.3f秒 (全描画 %.3f秒)\n",
+           frameNum ? 100.0 * totalReused / ((double)width * height * frameNum) : 0.0,
+           totalSeconds, totalFullSeconds);
+
+    freeBitmapData(&bitmap);
+    freeFloatBitmapData(&hdrBitmap);
+    freeFloatBitmapData(&fullBitmap);
+    freeSceneFile(&sceneFile);
+    return result;
+}
@@ -0,0 +1,224 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "denoise.hpp"
+#include "primaryVisibility.hpp"
+#include "sceneFile.hpp"
+
+#define BENCHMARK_TILE_SIZE 32
+
+// シーンファイルを描画して時間とレイ数を表示する
+// ログファイルを指定するとタイルごとの描画時間とレイ数をバイナリモードで記録する
+// 使い方: raytracing_benchmark シーン [スレッド数] [出力PNG] [ログファイル]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s シーン [スレッド数] [出力PNG] [ログファイル]\n", argv[0]);
+        return -1;
+    }
+    unsigned int workerNum = (argc > 2) ? atoi(argv[2]) : 1;
+    const char *output = (argc > 3) ? argv[3] : "raytracing_benchmark.png";
+    const char *logFilename = (argc > 4) ? argv[4] : nullptr;
+    if (workerNum == 0)
+        workerNum = 1;
+
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    Scene *scene = &sceneFile.scene;
+
+    // HDRフレームバッファ
+    FloatBitMapData hdrBitmap(sceneFile.bitmap.width, sceneFile.bitmap.height);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
+    unsigned int tileCountX = (hdrBitmap.width + BENCHMARK_TILE_SIZE - 1) / BENCHMARK_TILE_SIZE;
+    unsigned int tileCountY = (hdrBitmap.height + BENCHMARK_TILE_SIZE - 1) / BENCHMARK_TILE_SIZE;
+    unsigned int tileNum = tileCountX * tileCountY;
+    std::atomic<unsigned int> nextTile(0);
+    std::atomic<unsigned long long> totalRayCount(0);
+    std::atomic<unsigned long long> occluderLookups(0);
+    std::atomic<unsigned long long> occluderHits(0);
+    std::mutex statsMutex;
+    SortedShadingStats sortedStats = {};
+    PrimaryVisibilityStats visibilityStats = {};
+    DirectLightCacheStats lightCacheStats = {};
+
+    int tileLogFormat = registerLogFormat("tile %u (%u, %u) %.3fms %llu rays\n");
+    if (logFilename != nullptr && initLogFile(logFilename, LOG_MODE_BINARY) == -1)
+        return -1;
+
+    // シーンの読み込みより後の最大使用量を測る
+    resetMemoryPeaks();
+    auto start = std::chrono::steady_clock::now();
+
+    // 各スレッドは未処理のタイルを1つずつ取り出して描画する
+    auto worker = [&]()
+    {
+        rayCount = 0;
+        unsigned int idx;
+        while ((idx = nextTile.fetch_add(1)) < tileNum)
+        {
+            unsigned int x = (idx % tileCountX) * BENCHMARK_TILE_SIZE;
+            unsigned int y = (idx / tileCountX) * BENCHMARK_TILE_SIZE;
+            unsigned int w = (x + BENCHMARK_TILE_SIZE > hdrBitmap.width)
+                                 ? hdrBitmap.width - x : BENCHMARK_TILE_SIZE;
+            unsigned int h = (y + BENCHMARK_TILE_SIZE > hdrBitmap.height)
+                                 ? hdrBitmap.height - y : BENCHMARK_TILE_SIZE;
+            auto tileStart = std::chrono::steady_clock::now();
+            unsigned long long tileRays = rayCount;
+            renderTile(scene, x, y, w, h, hdrBitmap.getPixel(x, y), (size_t)hdrBitmap.width * 3);
+            if (logFilename != nullptr)
+                recordBinary(
+                    tileLogFormat, idx, x, y,
+                    std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - tileStart).count(),
+                    rayCount - tileRays);
+        }
+        totalRayCount += rayCount;
+        OccluderCacheStats cacheStats = getOccluderCacheStats();
+        occluderLookups += cacheStats.lookups;
+        occluderHits += cacheStats.hits;
+
+        SortedShadingStats threadStats = getSortedShadingStats();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        sortedStats.hits += threadStats.hits;
+        sortedStats.batches += threadStats.batches;
+        sortedStats.kernelSwitchesUnsorted += threadStats.kernelSwitchesUnsorted;
+        sortedStats.kernelSwitchesSorted += threadStats.kernelSwitchesSorted;
+        sortedStats.materialSwitchesUnsorted += threadStats.materialSwitchesUnsorted;
+        sortedStats.materialSwitchesSorted += threadStats.materialSwitchesSorted;
+        sortedStats.secondaryRays += threadStats.secondaryRays;
+        sortedStats.secondaryWaves += threadStats.secondaryWaves;
+        sortedStats.directionCoherenceUnsorted += threadStats.directionCoherenceUnsorted;
+        sortedStats.directionCoherenceSorted += threadStats.directionCoherenceSorted;
+        sortedStats.originDistanceUnsorted += threadStats.originDistanceUnsorted;
+        sortedStats.originDistanceSorted += threadStats.originDistanceSorted;
+        PrimaryVisibilityStats threadVisibility = getPrimaryVisibilityStats();
+        visibilityStats.samples += threadVisibility.samples;
+        visibilityStats.shapeTests += threadVisibility.shapeTests;
+        DirectLightCacheStats threadLightCache = getDirectLightCacheStats();
+        lightCacheStats.lookups += threadLightCache.lookups;
+        lightCacheStats.hits += threadLightCache.hits;
+        lightCacheStats.rejected += threadLightCache.rejected;
+        lightCacheStats.inserts += threadLightCache.inserts;
+        lightCacheStats.overflows += threadLightCache.overflows;
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (logFilename != nullptr)
+        finalLogFile();
+    unsigned long long rays = totalRayCount.load();
+    printf("%s: %ux%u %usample %uスレッド\n",
+           argv[1], hdrBitmap.width, hdrBitmap.height, scene->samplingNum, workerNum);
+    printf("時間 %.3f秒, レイ %llu本 (%.2f本/サンプル, %.2fMレイ/秒)\n",
+           seconds, rays,
+           (double)rays / ((double)hdrBitmap.width * hdrBitmap.height * scene->samplingNum),
+           (double)rays / seconds / 1e6);
+    printf("遮蔽物キャッシュ %llu回中 %llu回ヒット (%.1f%%)\n",
+           occluderLookups.load(), occluderHits.load(),
+           occluderLookups.load() ? 100.0 * occluderHits.load() / occluderLookups.load() : 0.0);
+    if (lightCacheStats.lookups > 0)
+    {
+        printf("直接光キャッシュ %llu回中 %llu回ヒット (%.1f%%), 誤差で棄却 %llu回, "
+               "格納 %llu回, 表があふれた %llu回\n",
+               lightCacheStats.lookups, lightCacheStats.hits,
+               100.0 * lightCacheStats.hits / lightCacheStats.lookups, lightCacheStats.rejected,
+               lightCacheStats.inserts, lightCacheStats.overflows);
+    }
+    if (sortedStats.hits > 0)
+    {
+        printf("マテリアル別シェーディング: 交点 %llu, バッチ %llu\n",
+               sortedStats.hits, sortedStats.batches);
+        printf("  カーネルの切り替え %llu -> %llu, ジオメトリの切り替え %llu -> %llu\n",
+               sortedStats.kernelSwitchesUnsorted, sortedStats.kernelSwitchesSorted,
+               sortedStats.materialSwitchesUnsorted, sortedStats.materialSwitchesSorted);
+    }
+    if (sortedStats.secondaryRays > 0)
+    {
+        // 連続する2本の平均(1に近いほど方向がそろっている，距離が短いほど始点が近い)
+        double pairs = (double)(sortedStats.secondaryRays - sortedStats.secondaryWaves);
+        printf("2次レイの遅延追跡: %llu本, %llu回\n",
+               sortedStats.secondaryRays, sortedStats.secondaryWaves);
+        printf("  方向の内積 %.4f -> %.4f, 始点間の距離 %.4f -> %.4f\n",
+               sortedStats.directionCoherenceUnsorted / pairs,
+               sortedStats.directionCoherenceSorted / pairs,
+               sortedStats.originDistanceUnsorted / pairs,
+               sortedStats.originDistanceSorted / pairs);
+    }
+    if (visibilityStats.samples > 0)
+    {
+        double fullTests = (double)visibilityStats.samples * scene->geometryNum;
+        printf("1次レイのラスタライズ: %llu本, 交差判定 %llu回 (全探索の%.1f%%)\n",
+               visibilityStats.samples, visibilityStats.shapeTests,
+               fullTests > 0 ? 100.0 * visibilityStats.shapeTests / fullTests : 0.0);
+    }
+
+    // 特徴量バッファを作ってノイズ除去する(描画時間とは別に計る)
+    if (sceneFile.denoiseIterations > 0)
+    {
+        FeatureBuffers features(hdrBitmap.width, hdrBitmap.height);
+        if (features.allocation() == -1)
+            return -1;
+
+        auto featureStart = std::chrono::steady_clock::now();
+        nextTile = 0;
+        auto featureWorker = [&]()
+        {
+            unsigned int idx;
+            while ((idx = nextTile.fetch_add(1)) < tileNum)
+            {
+                unsigned int x = (idx % tileCountX) * BENCHMARK_TILE_SIZE;
+                unsigned int y = (idx / tileCountX) * BENCHMARK_TILE_SIZE;
+                unsigned int w = (x + BENCHMARK_TILE_SIZE > hdrBitmap.width)
+                                     ? hdrBitmap.width - x : BENCHMARK_TILE_SIZE;
+                unsigned int h = (y + BENCHMARK_TILE_SIZE > hdrBitmap.height)
+                                     ? hdrBitmap.height - y : BENCHMARK_TILE_SIZE;
+                renderFeatureTile(scene, x, y, w, h, &features);
+            }
+        };
+        threads.clear();
+        for (unsigned int i = 0; i < workerNum; i++)
+            threads.emplace_back(featureWorker);
+        for (auto &t : threads)
+            t.join();
+
+        auto denoiseStart = std::chrono::steady_clock::now();
+        DenoiseOption option;
+        option.iterations = sceneFile.denoiseIterations;
+        option.workerNum = workerNum;
+        if (denoiseFloatBitmap(&hdrBitmap, &features, &hdrBitmap, option) == -1)
+            return -1;
+        auto denoiseEnd = std::chrono::steady_clock::now();
+
+        printf("特徴量 %.3f秒, ノイズ除去(%u段) %.3f秒\n",
+               std::chrono::duration<double>(denoiseStart - featureStart).count(),
+               option.iterations,
+               std::chrono::duration<double>(denoiseEnd - denoiseStart).count());
+        freeFeatureBuffers(&features);
+    }
+
+    // ビットマップデータ
+    BitMapData bitmap(hdrBitmap.width, hdrBitmap.height, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // PNGに変換してファイル保存
+    int result = pngFileEncodeWrite(&bitmap, output);
+    printMemoryReport();
+
+    freeBitmapData(&bitmap);
+    freeFloatBitmapData(&hdrBitmap);
+    freeSceneFile(&sceneFile);
+    return result;
+}
@@ -0,0 +1,65 @@
+#include "distributed.hpp"
+
+// 分散レンダリング
+// 使い方:
+//   raytracing_distributed coordinator シーン アドレス ローカルワーカー数 出力PNG
+//   raytracing_distributed worker シーン アドレス
+// アドレスは unix:/tmp/raytracing.sock や tcp:0.0.0.0:5000 のように指定する
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("usage: %s coordinator シーン アドレス [ローカルワーカー数] [出力PNG]\n", argv[0]);
+        printf("       %s worker シーン アドレス\n", argv[0]);
+        return -1;
+    }
+
+    // ワーカーもコーディネータも同じシーンファイルを読み込む
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[2]) == -1)
+        return -1;
+
+    if (strcmp(argv[1], "worker") == 0)
+    {
+        int result = runWorker(&sceneFile, argv[3]);
+        freeSceneFile(&sceneFile);
+        return result;
+    }
+
+    DistributedOption option;
+    option.address = argv[3];
+    option.localWorkerNum = (argc > 4) ? atoi(argv[4]) : 0;
+    option.workerCommand = "/proc/self/exe";
+    option.sceneFilename = argv[2];
+    option.tileTimeout = 120.0;
+    const char *output = (argc > 5) ? argv[5] : "raytracing_distributed.png";
+
+    // HDRフレームバッファ
+    FloatBitMapData hdrBitmap(sceneFile.bitmap.width, sceneFile.bitmap.height);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
+    DistributedStats stats;
+    if (runCoordinator(&sceneFile, &hdrBitmap, option, &stats) == -1)
+    {
+        freeFloatBitmapData(&hdrBitmap);
+        freeSceneFile(&sceneFile);
+        return -1;
+    }
+    printf("タイル %u, 再割り当て %u, 失敗したワーカー %u, 接続したワーカー %u\n",
+           stats.tileNum, stats.reassignedTiles, stats.failedWorkers, stats.connectedWorkers);
+
+    // ビットマップデータ
+    BitMapData bitmap(hdrBitmap.width, hdrBitmap.height, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // PNGに変換してファイル保存
+    int result = pngFileEncodeWrite(&bitmap, output);
+
+    freeBitmapData(&bitmap);
+    freeFloatBitmapData(&hdrBitmap);
+    freeSceneFile(&sceneFile);
+    return result;
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include <thread>
+#include "compiledScene.hpp"
+#include "uniformGrid.hpp"
+
+#define BOX_SIZE 20.f // 球を置く立方体の1辺
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// ランダムなレイの始点・方向・遮蔽判定の距離
+struct TestRay
+{
+    Ray ray;
+    float maxDistance;
+};
+
+// 立方体内にランダムな球を置いたシーンで格子と線形探索の交差判定の速さを比べる
+static void benchmarkDensity(
+    int sphereNum, size_t rayNum, size_t referenceNum, const UniformGridOption &option)
+{
+    Sampler sampler(pixelSeed(sphereNum, 0));
+    std::vector<Shape *> geometry;
+    for (int i = 0; i < sphereNum; i++)
+    {
+        Vector3 center(BOX_SIZE * (sampler.next() - 0.5f), BOX_SIZE * (sampler.next() - 0.5f),
+                       BOX_SIZE * (sampler.next() - 0.5f));
+        geometry.push_back(new Sphere(center, 0.05f + 0.25f * sampler.next()));
+    }
+    Scene scene;
+    scene.geometry = geometry.data();
+    scene.geometryNum = sphereNum;
+    scene.light = nullptr;
+    scene.lightNum = 0;
+    CompiledScene *compiled = compileScene(&scene);
+
+    auto start = Clock::now();
+    UniformGrid *grid = buildUniformGrid(compiled, option);
+    double buildSeconds = secondsSince(start);
+    printf("球 %d個: 格子 %dx%dx%d, 空でないセル %zu, 大きい球 %zu個, %.1fKB, 構築 %.3f秒\n",
+           sphereNum, grid->resolution[0], grid->resolution[1], grid->resolution[2],
+           grid->occupiedCells, grid->largeSpheres.size(), uniformGridBytes(grid) / 1024.0,
+           buildSeconds);
+
+    // 始点は立方体内，方向は一様な単位ベクトル，遮蔽判定の距離は0〜BOX_SIZE/2
+    std::vector<TestRay> rays(rayNum);
+    for (auto &r : rays)
+    {
+        r.ray.startPoint = Vector3(BOX_SIZE * (sampler.next() - 0.5f),
+                                   BOX_SIZE * (sampler.next() - 0.5f),
+                                   BOX_SIZE * (sampler.next() - 0.5f));
+        float z = 2.f * sampler.next() - 1.f;
+        float phi = 2.f * (float)M_PI * sampler.next();
+        float s = sqrtf(fmaxf(0.f, 1.f - z * z));
+        r.ray.direction = Vector3(s * cosf(phi), s * sinf(phi), z);
+        r.maxDistance = 0.5f * BOX_SIZE * sampler.next();
+    }
+
+    std::vector<int> linearHit(rayNum), gridHit(rayNum);
+    std::vector<bool> linearOccluded(rayNum), gridOccluded(rayNum);
+    IntersectionPoint point;
+    int shapeIndex;
+
+    // intersectionWithAll(遅いので先頭のreferenceNum本だけ)
+    std::vector<int> referenceHit(referenceNum);
+    start = Clock::now();
+    for (size_t k = 0; k < referenceNum; k++)
+    {
+        IntersectionResult *result =
+            intersectionWithAll(scene.geometry, scene.geometryNum, &rays[k].ray);
+        referenceHit[k] = result->intersectionPoint != nullptr ? result->shapeIndex : -1;
+        delete result;
+    }
+    double referenceSeconds = secondsSince(start);
+
+    // 展開したシーンで線形に探す
+    compiled->grid = nullptr;
+    start = Clock::now();
+    for (size_t k = 0; k < rayNum; k++)
+        linearHit[k] =
+            compiledClosestHit(compiled, &rays[k].ray, &point, &shapeIndex) ? shapeIndex : -1;
+    double linearClosest = secondsSince(start);
+    start = Clock::now();
+    for (size_t k = 0; k < rayNum; k++)
+        linearOccluded[k] =
+            compiledFindOccluder(compiled, &rays[k].ray, rays[k].maxDistance) != -1;
+    double linearOcclusion = secondsSince(start);
+
+    // 格子を使う
+    compiled->grid = grid;
+    start = Clock::now();
+    for (size_t k = 0; k < rayNum; k++)
+        gridHit[k] =
+            compiledClosestHit(compiled, &rays[k].ray, &point, &shapeIndex) ? shapeIndex : -1;
+    double gridClosest = secondsSince(start);
+    start = Clock::now();
+    for (size_t k = 0; k < rayNum; k++)
+        gridOccluded[k] =
+            compiledFindOccluder(compiled, &rays[k].ray, rays[k].maxDistance) != -1;
+    double gridOcclusion = secondsSince(start);
+
+    size_t referenceMismatches = 0, closestMismatches = 0, occlusionMismatches = 0;
+    for (size_t k = 0; k < referenceNum; k++)
+        referenceMismatches += referenceHit[k] != gridHit[k];
+    for (size_t k = 0; k < rayNum; k++)
+    {
+        closestMismatches += linearHit[k] != gridHit[k];
+        occlusionMismatches += linearOccluded[k] != gridOccluded[k];
+    }
+
+    printf("  intersectionWithAll 最近交点 %.3fMレイ/秒 (%zu本, 格子との不一致 %zu本)\n",
+           referenceNum / referenceSeconds / 1e6, referenceNum, referenceMismatches);
+    printf("  線形 最近交点 %.3fMレイ/秒, 遮蔽 %.3fMレイ/秒\n", rayNum / linearClosest / 1e6,
+           rayNum / linearOcclusion / 1e6);
+    printf("  格子 最近交点 %.3fMレイ/秒 (%.1f倍), 遮蔽 %.3fMレイ/秒 (%.1f倍)\n",
+           rayNum / gridClosest / 1e6, linearClosest / gridClosest,
+           rayNum / gridOcclusion / 1e6, linearOcclusion / gridOcclusion);
+    printf("  線形との不一致 最近交点 %zu本, 遮蔽 %zu本\n", closestMismatches, occlusionMismatches);
+
+    freeCompiledScene(compiled);
+    for (auto g : geometry)
+        delete g;
+}
+
+// 球の数(密度)を変えて一様格子と線形探索を比べる
+// 使い方: raytracing_grid [最大の球の数] [レイの数] [構築スレッド数] [セル数/球]
+int main(int argc, char **argv)
+{
+    int maxSphereNum = (argc > 1) ? atoi(argv[1]) : 10000;
+    size_t rayNum = (argc > 2) ? (size_t)atoll(argv[2]) : 100000;
+    UniformGridOption option;
+    option.workerNum = (argc > 3) ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    if (argc > 4)
+        option.cellsPerSphere = atof(argv[4]);
+
+    for (int sphereNum = 10; sphereNum <= maxSphereNum; sphereNum *= 10)
+    {
+        // intersectionWithAllは遅いので球の数に応じて本数を減らす
+        size_t referenceNum = std::min(rayNum, (size_t)(20000000 / sphereNum));
+        benchmarkDensity(sphereNum, rayNum, referenceNum, option);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <chrono>
+#include <math.h>
+#include "incremental.hpp"
+#include "sceneFile.hpp"
+
+// 変更前のシーンを描画してから変更後のシーンとの差分だけ描き直す
+// 全体を描き直した結果と比べて差の最大値を表示する
+// 使い方: raytracing_incremental 変更前のシーン 変更後のシーン [スレッド数] [出力PNG]
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s 変更前のシーン 変更後のシーン [スレッド数] [出力PNG]\n", argv[0]);
+        return -1;
+    }
+    unsigned int workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+    const char *output = (argc > 4) ? argv[4] : "raytracing_incremental.png";
+
+    SceneFile before, after;
+    if (loadSceneFile(&before, argv[1]) == -1)
+        return -1;
+    if (loadSceneFile(&after, argv[2]) == -1)
+    {
+        freeSceneFile(&before);
+        return -1;
+    }
+
+    // HDRフレームバッファ(差分で更新するもの・全体を描き直すもの)
+    FloatBitMapData hdrBitmap(before.bitmap.width, before.bitmap.height);
+    FloatBitMapData fullBitmap(after.bitmap.width, after.bitmap.height);
+    if (hdrBitmap.allocation() == -1 || fullBitmap.allocation() == -1)
+        return -1;
+
+    // 変更前のシーンを描画して依存関係を記録する
+    IncrementalState state;
+    IncrementalStats stats;
+    std::vector<SceneEdit> edits;
+    auto start = std::chrono::steady_clock::now();
+    if (renderIncremental(&before.scene, &hdrBitmap, &state, edits, workerNum, &stats) == -1)
+    {
+        printf("描画に失敗しました\n");
+        return -1;
+    }
+    double firstSeconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("初回 %.3f秒, %uタイル\n", firstSeconds, stats.invalidatedTiles);
+
+    // 差分を描き直す
+    diffScenes(&before.scene, &after.scene, &edits);
+    const char *editNames[] = {"マテリアル", "光源", "背景", "環境光", "全体"};
+    for (auto &edit : edits)
+        printf("  変更: %s %d\n", editNames[edit.type], edit.index);
+    start = std::chrono::steady_clock::now();
+    if (renderIncremental(&after.scene, &hdrBitmap, &state, edits, workerNum, &stats) == -1)
+    {
+        printf("描画に失敗しました\n");
+        return -1;
+    }
+    double incrementalSeconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("差分 %.3f秒, 描き直し %uタイル, 再利用 %uタイル\n",
+           incrementalSeconds, stats.invalidatedTiles, stats.reusedTiles);
+
+    // 全体を描き直して比べる
+    IncrementalState fullState;
+    start = std::chrono::steady_clock::now();
+    if (renderIncremental(&after.scene, &fullBitmap, &fullState, edits, workerNum, &stats) == -1)
+    {
+        printf("描画に失敗しました\n");
+        return -1;
+    }
+    double fullSeconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    float maxDiff = 0.f;
+    size_t count = (size_t)fullBitmap.width * fullBitmap.height * 3;
+    if (fullBitmap.width == hdrBitmap.width && fullBitmap.height == hdrBitmap.height)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            float diff = fabsf(fullBitmap.pixelsData[i] - hdrBitmap.pixelsData[i]);
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+    }
+    printf("全体 %.3f秒, 差の最大値 %g\n", fullSeconds, maxDiff);
+
+    // ビットマップデータ
+    BitMapData bitmap(hdrBitmap.width, hdrBitmap.height, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // PNGに変換してファイル保存
+    int result = pngFileEncodeWrite(&bitmap, output);
+
+    freeBitmapData(&bitmap);
+    freeFloatBitmapData(&hdrBitmap);
+    freeFloatBitmapData(&fullBitmap);
+    freeSceneFile(&before);
+    freeSceneFile(&after);
+    return result;
+}
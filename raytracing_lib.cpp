@@ -1,4 +1,86 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
 #include "raytracing_lib.hpp"
+#include "camera.hpp"
+#include "lightCache.hpp"
+#include "lightTree.hpp"
+#include "compiledScene.hpp"
+#include "sortedShading.hpp"
+
+thread_local unsigned long long rayCount = 0;
+
+static thread_local OccluderCache occluderCache;
+static thread_local DeferredRayQueue *deferredRayQueue = nullptr;
+static thread_local TileDependencies *tileDependencies = nullptr;
+
+void setDeferredRayQueue(DeferredRayQueue *queue)
+{
+    deferredRayQueue = queue;
+}
+
+void setTileDependencies(TileDependencies *dependencies)
+{
+    tileDependencies = dependencies;
+}
+
+void recordShapeDependency(int shapeIndex)
+{
+    TileDependencies *dependencies = tileDependencies;
+    if (dependencies != nullptr)
+        dependencies->shapes[shapeIndex >> 6] |= 1ULL << (shapeIndex & 63);
+}
+
+void recordLightDependency(int lightIndex)
+{
+    TileDependencies *dependencies = tileDependencies;
+    if (dependencies != nullptr)
+        dependencies->lights[lightIndex >> 6] |= 1ULL << (lightIndex & 63);
+}
+
+void recordBackgroundDependency()
+{
+    if (tileDependencies != nullptr)
+        tileDependencies->background = true;
+}
+
+void recordLightTreeDependency()
+{
+    if (tileDependencies != nullptr)
+        tileDependencies->lightTree = true;
+}
+
+void recordDirectLightCacheDependency()
+{
+    if (tileDependencies != nullptr)
+        tileDependencies->directLightCache = true;
+}
+
+OccluderCache *threadOccluderCache(Scene *scene)
+{
+    // 別のシーンのキャッシュは使わない
+    OccluderCache *cache = &occluderCache;
+    if (cache->scene != scene || cache->geometry != scene->geometry ||
+        cache->occluders.size() != (size_t)scene->lightNum)
+    {
+        cache->scene = scene;
+        cache->geometry = scene->geometry;
+        cache->occluders.assign(scene->lightNum, -1);
+    }
+    return cache;
+}
+
+void resetOccluderCache()
+{
+    occluderCache.scene = nullptr;
+    occluderCache.geometry = nullptr;
+    occluderCache.occluders.clear();
+}
+
+OccluderCacheStats getOccluderCacheStats()
+{
+    return occluderCache.stats;
+}
 
 // スクリーン座標からワールド座標へ変換
 Vector3 screenToWorld(
@@ -11,14 +93,9 @@ Vector3 screenToWorld(
 }
 
 // 視点からスクリーン座標へのRayを生成
-Ray createRay(Camera camera, float x, float y, float width, float height)
+Ray createRay(const Camera &camera, float x, float y, float width, float height)
 {
-    Ray ray;
-    ray.startPoint = camera.position;
-    // 視点位置から点(x,y)に向かう半直線
-    ray.direction = screenToWorld(x, y, width, height) - ray.startPoint;
-
-    return ray;
+    return cameraFrameRay(makeCameraFrame(camera, width, height), x, y);
 }
 
 IntersectionPoint *Sphere::isIntersectionRay(Ray *ray)
@@ -86,6 +163,26 @@ IntersectionPoint *Plane::isIntersectionRay(Ray *ray)
     }
 }
 
+void Sphere::calcTextureCoordinate(IntersectionPoint *point)
+{
+    // 球面座標(経度・緯度)をテクスチャ座標にする
+    point->u = 0.5f + atan2f(point->normal.z, point->normal.x) / (2.f * (float)M_PI);
+    point->v = 0.5f - asinf(point->normal.y) / (float)M_PI;
+    point->uvScale = 1.f / ((float)M_PI * radius);
+}
+
+void Plane::calcTextureCoordinate(IntersectionPoint *point)
+{
+    // 平面上の直交する2軸への射影をテクスチャ座標にする
+    Vector3 axis = (myAbsf(normal.y) < 0.9f) ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+    Vector3 tangent = normal.cross(axis).normalize();
+    Vector3 bitangent = normal.cross(tangent);
+    Vector3 local = point->position - position;
+    point->u = local.dot(tangent) / material.textureScale;
+    point->v = local.dot(bitangent) / material.textureScale;
+    point->uvScale = 1.f / material.textureScale;
+}
+
 Vector3 Plane::calcNormal(Vector3 p1, Vector3 p2, Vector3 p3)
 {
     Vector3 ab = p2 - p1;
@@ -148,33 +245,39 @@ FColor phongShading(
 
 FColor phongShading(
     IntersectionPoint intersectionPoint, Ray ray, Lighting lighting, Material material)
+{
+    return phongShading(&intersectionPoint, &ray, &lighting, &material);
+}
+
+FColor phongShading(
+    IntersectionPoint *intersectionPoint, Ray *ray, Lighting *lighting, Material *material)
 {
     // 法線ベクトル
-    Vector3 normal = intersectionPoint.normal;
+    Vector3 normal = intersectionPoint->normal;
 
     // 入射ベクトル計算(光が当たる点からみた光源の位置であることに注意)
-    Vector3 incident = lighting.direction;
+    Vector3 incident = lighting->direction;
 
     // 正反射ベクトル計算 r = 2(n・l)n - l
     Vector3 specularReflection = 2.f * normal.dot(incident) * normal - incident;
 
     // ディフューズ(拡散反射光)
     FColor diffuse;
-    diffuse.r = lighting.intensity.r * material.diffuse.r * normal.dot(incident);
-    diffuse.g = lighting.intensity.g * material.diffuse.g * normal.dot(incident);
-    diffuse.b = lighting.intensity.b * material.diffuse.b * normal.dot(incident);
+    diffuse.r = lighting->intensity.r * material->diffuse.r * normal.dot(incident);
+    diffuse.g = lighting->intensity.g * material->diffuse.g * normal.dot(incident);
+    diffuse.b = lighting->intensity.b * material->diffuse.b * normal.dot(incident);
     diffuse.normalize();
 
     // スペキュラー
     // 鏡面反射係数 * 光源強度 * 視線逆ベクトル・入射光の正反射ベクトル
-    Vector3 inverseEyeDir = ((-1.f) * ray.direction).normalize();
+    Vector3 inverseEyeDir = ((-1.f) * ray->direction).normalize();
     // (cos)^aを計算
-    float cos_a = myPow(inverseEyeDir.dot(specularReflection), material.shininess);
+    float cos_a = myPow(inverseEyeDir.dot(specularReflection), material->shininess);
 
     FColor specular;
-    specular.r = lighting.intensity.r * material.specular.r * cos_a;
-    specular.g = lighting.intensity.g * material.specular.g * cos_a;
-    specular.b = lighting.intensity.b * material.specular.b * cos_a;
+    specular.r = lighting->intensity.r * material->specular.r * cos_a;
+    specular.g = lighting->intensity.g * material->specular.g * cos_a;
+    specular.b = lighting->intensity.b * material->specular.b * cos_a;
     specular.normalize();
 
     // 視線逆ベクトルと正反射ベクトルの内積もしくは，
@@ -224,7 +327,10 @@ IntersectionResult *intersectionWithAll(
 
         // 交差とみなす最大距離を超えた場合はスキップ
         if (distance > maxDistance)
+        {
+            delete point;
             continue;
+        }
 
         // 最小距離なら描画点に指定
         if (distance < minDistance)
@@ -234,6 +340,7 @@ IntersectionResult *intersectionWithAll(
 
             // 描画対象オブジェクトを更新
             result->shape = geometry[idx];
+            result->shapeIndex = (int)idx;
 
             // 先に交点が代入されていたらメモリ解放する
             if (result->intersectionPoint != nullptr)
@@ -245,13 +352,34 @@ IntersectionResult *intersectionWithAll(
             // 交点のメモリを確保してpointの中身をコピーする
             result->intersectionPoint = new IntersectionPoint();
             memmove(result->intersectionPoint, point, sizeof(IntersectionPoint));
-            delete point;
         }
+        delete point;
     }
 
     return result;
 }
 
+Material surfaceMaterial(Ray *ray, IntersectionResult *intersectionResult)
+{
+    Material material = intersectionResult->shape->material;
+    if (material.diffuseTexture == nullptr)
+        return material;
+
+    // テクスチャ座標はテクスチャを使う場合だけ計算する
+    IntersectionPoint *point = intersectionResult->intersectionPoint;
+    intersectionResult->shape->calcTextureCoordinate(point);
+
+    // 交点でのレイの広がりからテクスチャ座標上の範囲を求める
+    float distance = (point->position - ray->startPoint).magnitude();
+    float footprint = distance * ray->spread * point->uvScale;
+
+    // テクスチャを読み込めなければテクスチャなしの色を使う
+    float rgb[3];
+    if (sampleTexture(material.diffuseTexture, point->u, point->v, footprint, rgb) == 0)
+        material.diffuse = material.diffuse * FColor(rgb[0], rgb[1], rgb[2]);
+    return material;
+}
+
 FColor RayTrace(Scene *scene, Ray *ray)
 {
     FColor raytraceColor = RayTraceRecursive(scene, ray, 1);
@@ -259,107 +387,395 @@ FColor RayTrace(Scene *scene, Ray *ray)
     return raytraceColor;
 }
 
-FColor RayTraceRecursive(Scene *scene, Ray *ray, unsigned int recursiveLevel)
+// 前計算したカメラの基底で1サンプル描画する
+static FColor renderFrameSample(
+    Scene *scene, const CameraFrame &frame, unsigned int x, unsigned int y, Sampler *sampler)
+{
+    float u = (float(x) + sampler->next());
+    float v = (float(y) + sampler->next());
+    // レイを生成
+    Ray ray = cameraFrameRay(frame, u, v);
+    ray.sampler = sampler;
+    return RayTrace(scene, &ray);
+}
+
+FColor renderSample(Scene *scene, unsigned int x, unsigned int y, Sampler *sampler)
+{
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+    return renderFrameSample(scene, frame, x, y, sampler);
+}
+
+// 前計算したカメラの基底で1ピクセル分描画する
+static FColor renderFramePixel(
+    Scene *scene, const CameraFrame &frame, unsigned int x, unsigned int y, Sampler *sampler)
+{
+    FColor luminance = FColor(0, 0, 0);
+    for (unsigned int s = 0; s < scene->samplingNum; s++)
+        luminance = luminance + renderFrameSample(scene, frame, x, y, sampler);
+
+    return FColor(
+        luminance.r / (float)scene->samplingNum,
+        luminance.g / (float)scene->samplingNum,
+        luminance.b / (float)scene->samplingNum);
+}
+
+FColor renderPixel(Scene *scene, unsigned int x, unsigned int y, Sampler *sampler)
+{
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+    return renderFramePixel(scene, frame, x, y, sampler);
+}
+
+// renderTileで1次レイをまとめて生成するピクセル数
+#define RENDER_TILE_RAY_BATCH 64
+
+void renderTile(
+    Scene *scene, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    float *out, size_t stride)
 {
-    // 再起回数の上限に達していたら
-    if (recursiveLevel > MAX_RECURSIVE_LEVEL)
+    if (scene->compiledScene != nullptr && scene->sortedShading)
     {
-        return FColor(FLT_MAX, FLT_MAX, FLT_MAX);
+        renderTileSorted(scene->compiledScene, x, y, w, h, out, stride);
+        return;
     }
 
-    // 再帰回数の上限以内なら
-    else
+    // 前のタイル(別の場所・前のフレーム)の遮蔽物は使わない
+    resetOccluderCache();
+
+    // カメラの基底はタイルごとに1回だけ求める
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+    // 交点はアリーナから確保し，ピクセルごとにまとめて捨てる
+    // (1ピクセルの交点はピクセル内ですべて解放されるので，次のピクセルで同じ領域を使い回せる)
+    beginScratchArena();
+    Sampler samplers[RENDER_TILE_RAY_BATCH];
+    float u[RENDER_TILE_RAY_BATCH], v[RENDER_TILE_RAY_BATCH];
+    Ray rays[RENDER_TILE_RAY_BATCH];
+    for (unsigned int j = 0; j < h; j++)
     {
-        // 全物体との交差判定
-        IntersectionResult *intersectionResult =
-            intersectionWithAll(scene->geometry, scene->geometryNum, ray);
-
-        if (intersectionResult->intersectionPoint == nullptr)
+        float *row = out + j * stride;
+        for (unsigned int i0 = 0; i0 < w; i0 += RENDER_TILE_RAY_BATCH)
         {
-            delete intersectionResult;
-            return scene->backgroundColor;
+            unsigned int count = std::min(w - i0, (unsigned int)RENDER_TILE_RAY_BATCH);
+            // 各ピクセルの最初のサンプルの位置は新しい乱数列の最初の2つなので，
+            // 追跡より前にまとめて引いてレイをSIMDで生成しても乱数の順序は変わらない
+            // (2番目以降のサンプルの位置は追跡で引いた乱数の後になるので1本ずつ生成する)
+            for (unsigned int k = 0; k < count; k++)
+            {
+                samplers[k] = Sampler(pixelSeed(x + i0 + k, y + j));
+                u[k] = float(x + i0 + k) + samplers[k].next();
+                v[k] = float(y + j) + samplers[k].next();
+            }
+            generateRays(frame, u, v, count, rays);
+            for (unsigned int k = 0; k < count; k++)
+            {
+                rays[k].sampler = &samplers[k];
+                FColor luminance = RayTrace(scene, &rays[k]);
+                for (unsigned int s = 1; s < scene->samplingNum; s++)
+                    luminance = luminance +
+                                renderFrameSample(scene, frame, x + i0 + k, y + j, &samplers[k]);
+                float *pixel = row + (i0 + k) * 3;
+                pixel[0] = luminance.r / (float)scene->samplingNum;
+                pixel[1] = luminance.g / (float)scene->samplingNum;
+                pixel[2] = luminance.b / (float)scene->samplingNum;
+                resetScratchArena();
+            }
         }
+    }
+    endScratchArena();
+}
 
-        // 輝度値
-        FColor luminance = FColor(0, 0, 0);
-        bool useReflection = intersectionResult->shape->material.useReflection;
-        bool useRefraction = intersectionResult->shape->material.useRefraction;
+// 子レイを追跡するかどうか決める
+// 追跡する場合は子レイの輝度に掛ける重み(ロシアンルーレットの生存確率の逆数)，
+// 追跡しない場合は0を返す
+static float continuationWeight(Scene *scene, Ray *childRay, unsigned int childLevel)
+{
+    // 再帰回数の上限
+    if (childLevel > scene->maxRecursiveLevel)
+        return 0.f;
+
+    FColor throughput = childRay->throughput;
+    float contribution = throughput.r;
+    if (throughput.g > contribution)
+        contribution = throughput.g;
+    if (throughput.b > contribution)
+        contribution = throughput.b;
+
+    // 画素値に影響しないほど寄与が小さい
+    if (contribution < scene->contributionCutoff)
+        return 0.f;
+
+    // ロシアンルーレット
+    // 生き残ったレイの輝度を生存確率で割る
+    // 反射のたびにクランプすると割った分が切り詰められて暗くなるので，HDRで蓄積する場合だけ使う
+    if (!scene->clampLuminance && childRay->sampler != nullptr &&
+        childLevel >= scene->russianRouletteLevel &&
+        contribution < scene->russianRouletteThreshold)
+    {
+        float survival = contribution / scene->russianRouletteThreshold;
+        if (childRay->sampler->next() >= survival)
+            return 0.f;
+        float weight = 1.f / survival;
+        childRay->throughput = FColor(
+            throughput.r * weight, throughput.g * weight, throughput.b * weight);
+        return weight;
+    }
+    return 1.f;
+}
 
-        // シャドウイング
-        // 影(0,0,0) or フォンシェーディング
-        // 鏡面反射のバグを修正⇨屈折のバグも修正されるのでは
-        if (!useReflection || !useRefraction)
-            shadowing(scene, ray, intersectionResult, &luminance);
+// 親の乱数列の状態と子レイの方向から子レイの乱数列の種を作る(親の乱数列は進めない)
+static unsigned long long childSeed(Sampler *parent, Vector3 direction)
+{
+    unsigned int bits[3];
+    memcpy(&bits[0], &direction.x, sizeof(float));
+    memcpy(&bits[1], &direction.y, sizeof(float));
+    memcpy(&bits[2], &direction.z, sizeof(float));
+    unsigned long long z = parent->state;
+    for (int k = 0; k < 3; k++)
+    {
+        // splitmix64でかき混ぜる
+        z = (z ^ bits[k]) + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+    }
+    return z;
+}
 
-        // 鏡面反射
-        if (useReflection)
-        {
-            reflection(scene, ray, intersectionResult, &luminance, recursiveLevel);
-        }
+// 子レイを追跡してfactorを掛けた輝度をluminanceに足す
+// 遅延キューがあれば追跡せずにキューに積む
+// 遅延させられる場合(クランプしない場合)は子レイに自分の乱数列を使わせ，
+// すぐに追跡しても遅延させても親と子が使う乱数を同じにする
+static void traceChild(
+    Scene *scene, Ray *childRay, unsigned int childLevel, FColor factor, FColor *luminance)
+{
+    Sampler childSampler;
+    if (childRay->sampler != nullptr && !scene->clampLuminance)
+    {
+        childSampler = Sampler(childSeed(childRay->sampler, childRay->direction));
+        childRay->sampler = &childSampler;
+    }
 
-        // 光の屈折
-        if (useRefraction)
-        {
-            refraction(scene, ray, intersectionResult, &luminance, recursiveLevel);
-        }
+    DeferredRayQueue *queue = deferredRayQueue;
+    if (queue != nullptr)
+    {
+        DeferredRay deferred;
+        deferred.ray = *childRay;
+        deferred.sampler = childSampler;
+        deferred.weight = queue->currentWeight * factor;
+        deferred.recursiveLevel = childLevel;
+        deferred.pixel = queue->currentPixel;
+        queue->rays.push_back(deferred);
+        return;
+    }
+
+    FColor nextLuminance = RayTraceRecursive(scene, childRay, childLevel);
+    luminance->r += factor.r * nextLuminance.r;
+    luminance->g += factor.g * nextLuminance.g;
+    luminance->b += factor.b * nextLuminance.b;
+}
+
+FColor RayTraceRecursive(Scene *scene, Ray *ray, unsigned int recursiveLevel)
+{
+    // 型ごとに展開したシーンがあればそちらで描画する
+    if (scene->compiledScene != nullptr)
+        return traceCompiledScene(scene->compiledScene, ray, recursiveLevel);
+
+    // 再起回数の上限に達していたら(子レイは生成前に打ち切るので通常は来ない)
+    if (recursiveLevel > scene->maxRecursiveLevel)
+        return FColor(0, 0, 0);
 
-        if(intersectionResult != nullptr)
-            delete intersectionResult;
+    rayCount++;
 
-        // (0.f 〜 1.f)に正規化
-        // これをしないとピクセル値がオーバーフローする
+    // 全物体との交差判定
+    IntersectionResult *intersectionResult =
+        intersectionWithAll(scene->geometry, scene->geometryNum, ray);
+
+    if (intersectionResult->intersectionPoint == nullptr)
+    {
+        delete intersectionResult;
+        recordBackgroundDependency();
+        return scene->backgroundColor;
+    }
+    recordShapeDependency(intersectionResult->shapeIndex);
+
+    // 輝度値
+    FColor luminance = FColor(0, 0, 0);
+    bool useReflection = intersectionResult->shape->material.useReflection;
+    bool useRefraction = intersectionResult->shape->material.useRefraction;
+
+    // シャドウイング
+    // 影(0,0,0) or フォンシェーディング
+    // 鏡面反射のバグを修正⇨屈折のバグも修正されるのでは
+    if (!useReflection || !useRefraction)
+        shadowing(scene, ray, intersectionResult, &luminance);
+
+    // 鏡面反射
+    if (useReflection)
+    {
+        reflection(scene, ray, intersectionResult, &luminance, recursiveLevel);
+    }
+
+    // 光の屈折
+    if (useRefraction)
+    {
+        refraction(scene, ray, intersectionResult, &luminance, recursiveLevel);
+    }
+
+    if (intersectionResult != nullptr)
+        delete intersectionResult;
+
+    // (0.f 〜 1.f)に正規化
+    // HDRで蓄積する場合はクランプせずにフレームバッファ側でトーンマッピングする
+    if (scene->clampLuminance)
         luminance.normalize();
 
-        return luminance;
+    return luminance;
+}
+
+bool directLighting(
+    Scene *scene, Ray *ray, IntersectionPoint *intersectionPoint, Material *material,
+    int lightIndex, FColor *luminance)
+{
+    recordLightDependency(lightIndex);
+    Lighting lighting = scene->light[lightIndex]->lightingAt(intersectionPoint->position);
+
+    // 入射ベクトル 視点からみた光源
+    Vector3 incident = lighting.direction;
+
+    // シャドウレイ
+    Ray shadowRay;
+    // 交差点を始点とするとその物体自身と交差したと判定されるため，
+    // 入射ベクトル(単位ベクトル)側に少しだけずらす
+    shadowRay.startPoint = intersectionPoint->position + EPSILON * incident.normalize();
+    shadowRay.direction = incident.normalize();
+
+    // 光源までの距離
+    float lightDistance = lighting.distance;
+
+    // 前回この光源を遮った物体を先に試す
+    OccluderCache *cache = threadOccluderCache(scene);
+    int occluder = cache->occluders[lightIndex];
+    if (occluder != -1)
+    {
+        cache->stats.lookups++;
+        IntersectionPoint *point = scene->geometry[occluder]->isIntersectionRay(&shadowRay);
+        bool found =
+            point != nullptr &&
+            (point->position - shadowRay.startPoint).magnitude() <= lightDistance;
+        if (point != nullptr)
+            delete point;
+        if (found)
+        {
+            cache->stats.hits++;
+            recordShapeDependency(occluder);
+            return false;
+        }
+    }
+
+    // シャドウレイとオブジェクトとの交差判定
+    IntersectionResult *shadowResult =
+        intersectionWithAll(scene->geometry, scene->geometryNum, &shadowRay, lightDistance, true);
+    bool found = shadowResult->intersectionPoint != nullptr;
+    if (found)
+    {
+        cache->occluders[lightIndex] = shadowResult->shapeIndex;
+        recordShapeDependency(shadowResult->shapeIndex);
     }
+    delete shadowResult;
+    if (found)
+        return false;
+
+    // 光源との間に交点が存在しない場合(影でない)はフォンシェーディング
+    *luminance = phongShading(intersectionPoint, ray, &lighting, material);
+    return true;
 }
 
-void shadowing(
+// 直接光を求める(shadowingからキャッシュを除いたもの)
+static void evaluateShadowing(
     Scene *scene, Ray *ray, IntersectionResult *intersectionResult, FColor *luminance)
 {
     // シャドウレイによる交差判定
     IntersectionPoint *intersectionPoint = intersectionResult->intersectionPoint;
-    IntersectionResult *shadowResult = nullptr;
+    Material material = surfaceMaterial(ray, intersectionResult);
+    LightTree *tree = scene->lightTree;
 
-    for (size_t idx = 0; idx < scene->lightNum; idx++)
+    // 光源が少ない場合(または乱数がない場合)はすべての光源を評価する
+    if (tree == nullptr || ray->sampler == nullptr || scene->lightSampleNum == 0 ||
+        tree->pointLightNum <= scene->exhaustiveLightNum)
     {
-        Lighting lighting = scene->light[idx]->lightingAt(intersectionPoint->position);
+        for (size_t idx = 0; idx < scene->lightNum; idx++)
+        {
+            FColor phong;
+            if (directLighting(scene, ray, intersectionPoint, &material, (int)idx, &phong))
+            {
+                *luminance = *luminance + phong;
 
-        // 入射ベクトル 視点からみた光源
-        Vector3 incident = lighting.direction;
+                if (idx == scene->lightNum - 1)
+                {
+                    // 最後に環境光成分を加える
+                    *luminance = *luminance + material.ambient * scene->ambientIntensity;
+                }
+            }
+        }
+        return;
+    }
 
-        // シャドウレイ
-        Ray shadowRay;
-        // 交差点を始点とするとその物体自身と交差したと判定されるため，
-        // 入射ベクトル(単位ベクトル)側に少しだけずらす
-        shadowRay.startPoint = intersectionPoint->position + EPSILON * incident.normalize();
-        shadowRay.direction = incident.normalize();
+    // 平行光源など木に入っていない光源はすべて評価する
+    for (int idx : tree->otherLights)
+    {
+        FColor phong;
+        if (directLighting(scene, ray, intersectionPoint, &material, (int)idx, &phong))
+            *luminance = *luminance + phong;
+    }
 
-        // 光源までの距離
-        float lightDistance = lighting.distance;
+    // 点光源はlightSampleNum個選び，選ばれる確率で割って全光源の和の推定値にする
+    recordLightTreeDependency();
+    for (unsigned int s = 0; s < scene->lightSampleNum; s++)
+    {
+        float pdf;
+        int idx = sampleLightTree(
+            tree, intersectionPoint->position, intersectionPoint->normal, ray->sampler, &pdf);
+        if (idx == -1)
+            break; // 寄与する光源がない
+
+        FColor phong;
+        if (directLighting(scene, ray, intersectionPoint, &material, (int)idx, &phong))
+        {
+            float weight = 1.f / (pdf * (float)scene->lightSampleNum);
+            luminance->r += weight * phong.r;
+            luminance->g += weight * phong.g;
+            luminance->b += weight * phong.b;
+        }
+    }
 
-        // シャドウレイとオブジェクトとの交差判定
-        shadowResult =
-            intersectionWithAll(
-                scene->geometry, scene->geometryNum, &shadowRay, lightDistance, true);
+    // 光源を選ぶ場合は最後の光源の影に依らず環境光成分を加える
+    *luminance = *luminance + material.ambient * scene->ambientIntensity;
+}
 
-        // 光源との間に交点が存在しない場合(影でない)はフォンシェーディング
-        if (shadowResult->intersectionPoint == nullptr)
-        {
-            FColor phong = phongShading(
-                *intersectionPoint, *ray, lighting, intersectionResult->shape->material);
-            *luminance = *luminance + phong;
+void shadowing(
+    Scene *scene, Ray *ray, IntersectionResult *intersectionResult, FColor *luminance)
+{
+    DirectLightCache *cache = scene->directLightCache;
+    Material *material = &intersectionResult->shape->material;
+    if (cache == nullptr || !directLightCacheable(material))
+    {
+        evaluateShadowing(scene, ray, intersectionResult, luminance);
+        return;
+    }
 
-            if (idx == scene->lightNum - 1)
-            {
-                // 最後に環境光成分を加える
-                Material material = intersectionResult->shape->material;
-                *luminance = *luminance + material.ambient * scene->ambientIntensity;
-            }
-        }
-        if (shadowResult != nullptr)
-            delete shadowResult;
+    // キャッシュから取り出した値では光源・遮蔽物の参照を記録できないのでまとめて記録する
+    recordDirectLightCacheDependency();
+    IntersectionPoint *point = intersectionResult->intersectionPoint;
+    int shapeIndex = intersectionResult->shapeIndex;
+    FColor direct;
+    if (!lookupDirectLight(cache, point, ray, shapeIndex, material, &direct))
+    {
+        evaluateShadowing(scene, ray, intersectionResult, &direct);
+        insertDirectLight(cache, point, ray, shapeIndex, material, direct);
     }
+    *luminance = *luminance + direct;
 }
 
 bool isShadow(Scene *scene, Ray *ray, IntersectionResult *intersectionResult)
@@ -390,7 +806,9 @@ bool isShadow(Scene *scene, Ray *ray, IntersectionResult *intersectionResult)
                 scene->geometry, scene->geometryNum, &shadowRay, lightDistance, true);
 
         // 光源との間に交点が存在したら影にする
-        if (shadowResult->intersectionPoint != nullptr)
+        bool found = shadowResult->intersectionPoint != nullptr;
+        delete shadowResult;
+        if (found)
         {
             return true;
         }
@@ -424,22 +842,21 @@ void reflection(
         newRay.startPoint =
             intersectionResult->intersectionPoint->position + EPSILON * newDirection;
         newRay.direction = newDirection;
+        newRay.spread = ray->spread;
+        newRay.sampler = ray->sampler;
 
-        // 次の反射の輝度を取得
-        FColor nextLuminance = RayTraceRecursive(scene, &newRay, recursiveLevel + 1);
-        if (nextLuminance.r != FLT_MAX)
-        {
-            // 完全鏡面反射光計算
-            FColor reflection = intersectionResult->shape->material.reflection;
-            FColor reflectionLuminance;
-            reflectionLuminance.r = reflection.r * nextLuminance.r;
-            reflectionLuminance.g = reflection.g * nextLuminance.g;
-            reflectionLuminance.b = reflection.b * nextLuminance.b;
-
-            luminance->r += reflectionLuminance.r;
-            luminance->g += reflectionLuminance.g;
-            luminance->b += reflectionLuminance.b;
-        }
+        // 完全鏡面反射係数
+        FColor reflection = intersectionResult->shape->material.reflection;
+        newRay.throughput = ray->throughput * reflection;
+
+        // 寄与が小さい反射は追跡しない
+        float weight = continuationWeight(scene, &newRay, recursiveLevel + 1);
+        if (weight == 0.f)
+            return;
+
+        // 次の反射の輝度を取得し，完全鏡面反射光を加える
+        FColor factor(weight * reflection.r, weight * reflection.g, weight * reflection.b);
+        traceChild(scene, &newRay, recursiveLevel + 1, factor, luminance);
     }
 }
 
@@ -507,11 +924,13 @@ void refraction(
     Ray specularReflectionRay;
     specularReflectionRay.startPoint = intersectionPoint->position + EPSILON * specularReflection;
     specularReflectionRay.direction = specularReflection;
+    specularReflectionRay.spread = ray->spread;
 
     // 屈折方向のレイを生成
     Ray refractionRay;
     refractionRay.startPoint = intersectionPoint->position + EPSILON * refractionVec;
     refractionRay.direction = refractionVec;
+    refractionRay.spread = ray->spread;
 
     // 偏光反射率計算
     float polarized_p = (refractionIndexDiv * cos_1 - cos_2) / (refractionIndexDiv * cos_1 + cos_2);
@@ -523,39 +942,30 @@ void refraction(
 
     FColor reflection = intersectionResult->shape->material.reflection;
 
-    // 正反射方向の輝度を計算
-    // 次の反射の輝度を取得
-    FColor nextLuminance = RayTraceRecursive(scene, &specularReflectionRay, recursiveLevel + 1);
+    // 反射・屈折それぞれの寄与
+    // 片方の重み(cr, ct)が無視できるほど小さい場合はそちらを追跡しない
+    specularReflectionRay.sampler = ray->sampler;
+    specularReflectionRay.throughput = ray->throughput * reflection * FColor(cr, cr, cr);
+    refractionRay.sampler = ray->sampler;
+    refractionRay.throughput = ray->throughput * reflection * FColor(ct, ct, ct);
 
-    if (nextLuminance.r != FLT_MAX)
+    // 正反射方向の輝度を計算
+    float weight = continuationWeight(scene, &specularReflectionRay, recursiveLevel + 1);
+    if (weight != 0.f)
     {
-        // 完全鏡面反射輝度(正反射)計算
-        FColor reflectionLuminance;
-        reflectionLuminance.r = nextLuminance.r;
-        reflectionLuminance.g = nextLuminance.g;
-        reflectionLuminance.b = nextLuminance.b;
-
-        // 最終放射輝度に加算
-        luminance->r += reflection.r * cr * reflectionLuminance.r;
-        luminance->g += reflection.g * cr * reflectionLuminance.g;
-        luminance->b += reflection.b * cr * reflectionLuminance.b;
+        // 次の反射の輝度を取得し，最終放射輝度に加算
+        FColor factor(
+            weight * reflection.r * cr, weight * reflection.g * cr, weight * reflection.b * cr);
+        traceChild(scene, &specularReflectionRay, recursiveLevel + 1, factor, luminance);
     }
 
     // 屈折光の放射輝度計算
-    // 次の反射の輝度を取得
-    nextLuminance = RayTraceRecursive(scene, &refractionRay, recursiveLevel + 1);
-
-    if (nextLuminance.r != FLT_MAX)
+    weight = continuationWeight(scene, &refractionRay, recursiveLevel + 1);
+    if (weight != 0.f)
     {
-        // 屈折光の放射輝度計算
-        FColor refractionLuminance;
-        refractionLuminance.r = nextLuminance.r;
-        refractionLuminance.g = nextLuminance.g;
-        refractionLuminance.b = nextLuminance.b;
-
-        // 最終放射輝度に加算
-        luminance->r += reflection.r * ct * refractionLuminance.r;
-        luminance->g += reflection.g * ct * refractionLuminance.g;
-        luminance->b += reflection.b * ct * refractionLuminance.b;
+        // 次の屈折の輝度を取得し，最終放射輝度に加算
+        FColor factor(
+            weight * reflection.r * ct, weight * reflection.g * ct, weight * reflection.b * ct);
+        traceChild(scene, &refractionRay, recursiveLevel + 1, factor, luminance);
     }
-}
\ No newline at end of file
+}
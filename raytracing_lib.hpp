@@ -1,9 +1,14 @@
+#pragma once
 #include <memory.h>
 #include <stdio.h>
 #include <float.h>
+#include <vector>
 #include "myPng.hpp"
+#include "framebuffer.hpp"
+#include "texture.hpp"
 #include "mymath.hpp"
 #include "log.hpp"
+#include "memory.hpp"
 
 // 使用しない
 #define ZBUFFER_MAX 1
@@ -12,27 +17,8 @@
 #define MAX_RECURSIVE_LEVEL 5
 static float EPSILON = 1.f / 512.f;
 
-// レイ
-struct Ray
-{
-    Vector3 startPoint; // レイの始点
-    Vector3 direction;  // 方向ベクトル
-    Ray()
-        : startPoint(Vector3(0, 0, 0)), direction(Vector3(0, 0, 0))
-    {
-    }
-};
-
-// 交点
-struct IntersectionPoint
-{
-    Vector3 position; // 交点の位置
-    Vector3 normal;   // 交点における法線
-    IntersectionPoint()
-        : position(Vector3(0, 0, 0)), normal(Vector3(0, 0, 0))
-    {
-    }
-};
+// 追跡したレイの数(スレッドごと)
+extern thread_local unsigned long long rayCount;
 
 // float成分のカラー
 struct FColor
@@ -83,6 +69,37 @@ struct FColor
     }
 };
 
+// レイ
+struct Ray
+{
+    Vector3 startPoint; // レイの始点
+    Vector3 direction;  // 方向ベクトル
+    float spread;       // 単位距離あたりのレイの広がり(テクスチャのミップレベル選択用)
+    FColor throughput;  // 視点からこのレイまでに掛かった係数の積(最終的な輝度への寄与)
+    Sampler *sampler;   // ロシアンルーレット用の乱数(nullptrなら使わない)
+    Ray()
+        : startPoint(Vector3(0, 0, 0)), direction(Vector3(0, 0, 0)), spread(0.f),
+          throughput(FColor(1, 1, 1)), sampler(nullptr)
+    {
+    }
+};
+
+// 交点
+struct IntersectionPoint
+{
+    Vector3 position; // 交点の位置
+    Vector3 normal;   // 交点における法線
+    float u, v;       // テクスチャ座標
+    float uvScale;    // ワールド座標の単位長さあたりのテクスチャ座標の変化量
+    IntersectionPoint()
+        : position(Vector3(0, 0, 0)), normal(Vector3(0, 0, 0)), u(0.f), v(0.f), uvScale(0.f)
+    {
+    }
+    // 描画中はスレッドごとのアリーナから確保する
+    static void *operator new(size_t size) { return scratchAllocate(size); }
+    static void operator delete(void *pointer, size_t size) { scratchRelease(pointer, size); }
+};
+
 // マテリアル
 struct Material
 {
@@ -95,13 +112,16 @@ struct Material
 
     bool useReflection; // 完全鏡面反射を使うかどうか
     bool useRefraction; //
+
+    Texture *diffuseTexture; // 拡散反射係数に掛けるテクスチャ(nullptrなら使わない)
+    float textureScale;      // 平面でテクスチャ1枚が覆う長さ
     Material(FColor a = FColor(0.01f, 0.01f, 0.01f),
              FColor d = FColor(0.69f, 0.69f, 0.69f),
              FColor s = FColor(0.30f, 0.30f, 0.30f), float shi = 8.f,
              FColor f = FColor(0, 0, 0), bool uf = false,
              bool ur = false, float index = 1.f)
         : ambient(a), diffuse(d), specular(s), shininess(shi), reflection(f), useReflection(uf),
-          useRefraction(ur), refractionIndex(index)
+          useRefraction(ur), refractionIndex(index), diffuseTexture(nullptr), textureScale(1.f)
     {
     }
 };
@@ -111,10 +131,24 @@ struct Shape
 {
     // Rayとの交差判定
     virtual IntersectionPoint *isIntersectionRay(Ray *ray) = 0;
+    // 交点のテクスチャ座標を計算
+    virtual void calcTextureCoordinate(IntersectionPoint *) {}
     // マテリアル
     Material material;
 
     virtual ~Shape() {}
+
+    // シーンのメモリ使用量に数える
+    static void *operator new(size_t size)
+    {
+        recordMemoryAllocation(MEMORY_SCENE, size);
+        return ::operator new(size);
+    }
+    static void operator delete(void *pointer, size_t size)
+    {
+        recordMemoryRelease(MEMORY_SCENE, size);
+        ::operator delete(pointer);
+    }
 };
 
 // 球
@@ -126,6 +160,7 @@ struct Sphere : public Shape
     Vector3 center; // 中心座標
     float radius;   // 半径
     IntersectionPoint *isIntersectionRay(Ray *ray) override;
+    void calcTextureCoordinate(IntersectionPoint *point) override;
 };
 
 // 平面
@@ -136,16 +171,34 @@ struct Plane : public Shape
     Vector3 normal;   // 法線
     Vector3 position; // 平面が通る点
     IntersectionPoint *isIntersectionRay(Ray *ray) override;
+    void calcTextureCoordinate(IntersectionPoint *point) override;
     // 法線計算
     static Vector3 calcNormal(Vector3 p1, Vector3 p2, Vector3 p3);
 };
 
+// カメラの種類
+enum CAMERA_TYPE
+{
+    CAMERA_SCREEN_PLANE, // z=0の平面上の[-1,1]×[-1,1]をスクリーンとして視点から見る
+    CAMERA_PINHOLE,      // 注視点・上方向・画角で向きを決めるピンホールカメラ
+};
+
 // カメラ
 struct Camera
 {
     Vector3 position; // 視点
     float far;        // 最遠距離
     float near;       // 最近距離
+    int type;         // CAMERA_TYPE
+    // ピンホールカメラ(横の画角は縦の画角と画像の縦横比から決める)
+    Vector3 target;   // 注視点
+    Vector3 up;       // 上方向
+    float fov;        // 縦の画角[度]
+    Camera()
+        : position(Vector3(0, 0, 0)), far(0.f), near(0.f), type(CAMERA_SCREEN_PLANE),
+          target(Vector3(0, 0, 0)), up(Vector3(0, 1, 0)), fov(45.f)
+    {
+    }
 };
 
 struct Lighting
@@ -163,6 +216,18 @@ struct Light
 {
     virtual Lighting lightingAt(Vector3 p) = 0;
     virtual ~Light() {}
+
+    // シーンのメモリ使用量に数える
+    static void *operator new(size_t size)
+    {
+        recordMemoryAllocation(MEMORY_SCENE, size);
+        return ::operator new(size);
+    }
+    static void operator delete(void *pointer, size_t size)
+    {
+        recordMemoryRelease(MEMORY_SCENE, size);
+        ::operator delete(pointer);
+    }
 };
 
 // 点光源
@@ -209,6 +274,10 @@ struct DirectionalLight : Light
     }
 };
 
+struct LightTree;
+struct CompiledScene;
+struct DirectLightCache;
+
 struct Scene
 {
     BitMapData *bitmap;      // ビットマップ
@@ -222,14 +291,48 @@ struct Scene
     FColor backgroundColor;      // 背景色
     float globalRefractionIndex; // 大気中の絶対屈折率
     unsigned int samplingNum;    // サンプリング数
+    bool clampLuminance;         // 反射のたびに輝度を0〜1にクランプするか(falseでHDR)
+
+    // レイの打ち切り
+    unsigned int maxRecursiveLevel;     // 再帰回数の上限
+    float contributionCutoff;           // 寄与(throughputの最大成分)がこれ未満のレイは追跡しない
+    unsigned int russianRouletteLevel;  // この再帰回数からロシアンルーレットを使う(HDRの場合だけ)
+    float russianRouletteThreshold;     // 寄与がこれ未満のレイを寄与/閾値の確率で生き残らせる
+
+    // 多数の光源
+    LightTree *lightTree;           // 点光源の階層(nullptrなら全光源を評価)
+    unsigned int lightSampleNum;    // 1交点で選ぶ点光源の数
+    unsigned int exhaustiveLightNum; // 点光源がこれ以下なら選ばずに全光源を評価する
+
+    CompiledScene *compiledScene;   // 型ごとに展開したシーン(nullptrなら汎用の経路で描画する)
+    bool sortedShading;             // renderTileで交点をマテリアルごとにまとめてシェーディングする
+                                    // (compiledSceneがある場合だけ)
+    bool deferSecondaryRays;        // sortedShadingで反射・屈折レイをためて並べ替えてから追跡する
+                                    // (clampLuminanceがfalseの場合だけ)
+    bool rasterizePrimary;          // sortedShadingで1次レイの交点をラスタライズで求める
+    DirectLightCache *directLightCache; // 拡散面の直接光キャッシュ(nullptrなら毎回計算する)
     Scene()
     {
         globalRefractionIndex = 1.000293;
+        clampLuminance = true;
+        maxRecursiveLevel = MAX_RECURSIVE_LEVEL;
+        contributionCutoff = 1.f / 1024.f;
+        russianRouletteLevel = 3;
+        russianRouletteThreshold = 0.1f;
+        lightTree = nullptr;
+        lightSampleNum = 4;
+        exhaustiveLightNum = 8;
+        compiledScene = nullptr;
+        sortedShading = false;
+        deferSecondaryRays = false;
+        rasterizePrimary = false;
+        directLightCache = nullptr;
     }
 };
 
 // 視点からスクリーン座標へのRayを生成
-Ray createRay(Camera camera, float x, float y, float width, float height);
+// 同じカメラで多数のレイを作る場合はcamera.hppのCameraFrameを使う
+Ray createRay(const Camera &camera, float x, float y, float width, float height);
 
 // スクリーン座標からワールド座標へ変換
 Vector3 screenToWorld(float x, float y, unsigned int width, unsigned int height);
@@ -242,6 +345,10 @@ Color phongShading(
 FColor phongShading(
     IntersectionPoint intersectionPoint, Ray ray, Lighting lighting, Material material);
 
+// フォンシェーディング(値渡しのコピーをしない版)
+FColor phongShading(
+    IntersectionPoint *intersectionPoint, Ray *ray, Lighting *lighting, Material *material);
+
 // フォンシェーディング(マテリアル描画)
 FColor phongShading(
     IntersectionPoint intersectionPoint, Ray ray, PointLight pointLight, Material material);
@@ -251,7 +358,8 @@ struct IntersectionResult
 {
     IntersectionPoint *intersectionPoint = nullptr;
     Shape *shape = nullptr;
-    IntersectionResult() : intersectionPoint(nullptr), shape(nullptr)
+    int shapeIndex; // shapeのジオメトリ番号
+    IntersectionResult() : intersectionPoint(nullptr), shape(nullptr), shapeIndex(-1)
     {
     }
     ~IntersectionResult()
@@ -260,6 +368,9 @@ struct IntersectionResult
             delete intersectionPoint;
         intersectionPoint = nullptr;
     }
+    // 描画中はスレッドごとのアリーナから確保する
+    static void *operator new(size_t size) { return scratchAllocate(size); }
+    static void operator delete(void *pointer, size_t size) { scratchRelease(pointer, size); }
 };
 
 // すべてのオブジェクトと交差判定
@@ -269,19 +380,136 @@ IntersectionResult *intersectionWithAll(Shape **geometry, int geometryNum, Ray *
 IntersectionResult *intersectionWithAll(
     Shape **geometry, int geometryNum, Ray *ray, float maxDistance, bool exitOnceFound);
 
+// テクスチャを反映したマテリアルを求める
+Material surfaceMaterial(Ray *ray, IntersectionResult *intersectionResult);
+
 // レイトレーシング
 FColor RayTrace(Scene *scene, Ray *ray);
 
+// 1ピクセル内の1サンプル(位置をsamplerでずらす)
+FColor renderSample(Scene *scene, unsigned int x, unsigned int y, Sampler *sampler);
+
+// 1ピクセル分のサンプリング(samplingNum回)の平均
+// 画像サイズはscene->bitmapの幅・高さを使う
+FColor renderPixel(Scene *scene, unsigned int x, unsigned int y, Sampler *sampler);
+
+// 幅w×高さhのタイルを描画してoutに書き込む(strideは1行のfloat数)
+// ピクセルごとに乱数の種を決めるので描画順やスレッド数によらず同じ結果になる
+void renderTile(
+    Scene *scene, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    float *out, size_t stride);
+
 // レイトレーシングの再帰呼び出し
 FColor RayTraceRecursive(Scene *scene, Ray *ray, unsigned int recursiveLevel);
 
+// 1つの光源(scene->light[lightIndex])による直接光(影ならfalseを返す)
+// 遮蔽判定はまずスレッドごとの遮蔽物キャッシュを試す
+bool directLighting(
+    Scene *scene, Ray *ray, IntersectionPoint *intersectionPoint, Material *material,
+    int lightIndex, FColor *luminance);
+
+// 遮蔽物キャッシュの統計
+struct OccluderCacheStats
+{
+    unsigned long long lookups; // キャッシュを試した回数
+    unsigned long long hits;    // キャッシュした物体で影と判定できた回数
+};
+
+// 光源ごとに直前に影を作った物体を覚えておく(スレッドごと)
+// 近くの交点から同じ光源へのシャドウレイは同じ物体に遮られることが多いので先に試す
+struct OccluderCache
+{
+    Scene *scene = nullptr;      // キャッシュを作ったシーン
+    Shape **geometry = nullptr;  // 作ったときのジオメトリ配列
+    std::vector<int> occluders;  // 光源番号ごとの遮蔽物のジオメトリ番号(-1なら無し)
+    OccluderCacheStats stats = {0, 0};
+};
+
+// 現在のスレッドの遮蔽物キャッシュを取り出す(sceneが前回と違えば空にする)
+OccluderCache *threadOccluderCache(Scene *scene);
+
+// 現在のスレッドの遮蔽物キャッシュを空にする
+// renderTileはタイルごとに呼ぶ．ジオメトリを変更したフレームの開始時にも呼ぶこと
+void resetOccluderCache();
+
+// 現在のスレッドの遮蔽物キャッシュの統計(累計)
+OccluderCacheStats getOccluderCacheStats();
+
 // 影生成
+// 点光源が多い場合はlightTreeから選んだ光源だけを評価して重みを付ける
+// scene->directLightCacheがあれば拡散面の結果をキャッシュから補間する
 void shadowing(
     Scene *scene, Ray *ray, IntersectionResult *intersectionResult, FColor *luminance);
 
 // 影かどうか判定
 bool isShadow(Scene *scene, Ray *ray, IntersectionResult *intersectionResult);
 
+// 遅延させた2次レイ
+struct DeferredRay
+{
+    Ray ray;
+    Sampler sampler;             // rayの乱数列(ray.samplerがnullptrでなければ追跡前にこれを指させる)
+    FColor weight;               // このレイの輝度に掛けて画素に足す係数
+    unsigned int recursiveLevel; // このレイの再帰回数
+    unsigned int pixel;          // タイル内のピクセル番号
+};
+
+// 2次レイの遅延キュー
+// 設定されている間，reflection/refractionは子レイをすぐに追跡せずにキューに積む
+// (子レイの輝度は親の輝度に足されず，weightを掛けて直接画素に足される．
+//  親でクランプできないのでclampLuminanceの場合は使わないこと)
+struct DeferredRayQueue
+{
+    std::vector<DeferredRay> rays;
+    FColor currentWeight;       // シェーディング中のレイのweight
+    unsigned int currentPixel;  // シェーディング中のレイのピクセル番号
+};
+
+// 現在のスレッドの遅延キューを設定する(nullptrならすぐに追跡する)
+void setDeferredRayQueue(DeferredRayQueue *queue);
+
+// タイルの描画が参照したジオメトリ・光源(差分再描画用)
+// ジオメトリはシェーディングした交点と影を作った物体，光源は評価したものを記録する
+struct TileDependencies
+{
+    std::vector<unsigned long long> shapes; // ジオメトリ番号のビット集合
+    std::vector<unsigned long long> lights; // 光源番号のビット集合
+    bool background = false; // 背景色を使ったか
+    bool lightTree = false;  // lightTreeから点光源を選んだか(どの点光源の変更でも選ばれ方が変わる)
+    // 直接光キャッシュを引いたか(キャッシュの値はどの光源・ジオメトリ・マテリアルにも依存し，
+    // 格納する順番で他のタイルの結果も変わるので，外れて格納しただけでも記録する)
+    bool directLightCache = false;
+
+    // 空にする
+    void reset(int shapeNum, int lightNum)
+    {
+        shapes.assign((shapeNum + 63) / 64, 0);
+        lights.assign((lightNum + 63) / 64, 0);
+        background = false;
+        lightTree = false;
+        directLightCache = false;
+    }
+    bool hasShape(int idx) const { return (shapes[idx >> 6] >> (idx & 63)) & 1; }
+    bool hasLight(int idx) const { return (lights[idx >> 6] >> (idx & 63)) & 1; }
+    bool hasAnyShape() const
+    {
+        for (auto word : shapes)
+            if (word != 0)
+                return true;
+        return false;
+    }
+};
+
+// 現在のスレッドで参照を記録する先を設定する(nullptrなら記録しない)
+void setTileDependencies(TileDependencies *dependencies);
+
+// 参照したジオメトリ・光源・背景・lightTree・直接光キャッシュを記録する(記録先がなければ何もしない)
+void recordShapeDependency(int shapeIndex);
+void recordLightDependency(int lightIndex);
+void recordBackgroundDependency();
+void recordLightTreeDependency();
+void recordDirectLightCacheDependency();
+
 // 鏡面反射計算
 void reflection(
     Scene *scene, Ray *ray,
@@ -0,0 +1,156 @@
+#include <chrono>
+#include <math.h>
+#include "multiView.hpp"
+#include "sceneFile.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// 画像全体の1次レイをcreateRayとgenerateRaysで作って時間を比べる
+static void compareRayGeneration(Camera *camera, unsigned int width, unsigned int height)
+{
+    size_t count = (size_t)width * height;
+    std::vector<float> u(count), v(count);
+    Sampler sampler(pixelSeed(0, 0));
+    for (size_t k = 0; k < count; k++)
+    {
+        u[k] = (float)(k % width) + sampler.next();
+        v[k] = (float)(k / width) + sampler.next();
+    }
+    std::vector<Ray> single(count), batched(count);
+
+    auto start = Clock::now();
+    for (size_t k = 0; k < count; k++)
+        single[k] = createRay(*camera, u[k], v[k], width, height);
+    double singleSeconds = secondsSince(start);
+
+    start = Clock::now();
+    CameraFrame frame = makeCameraFrame(*camera, width, height);
+    generateRays(frame, u.data(), v.data(), count, batched.data());
+    double batchedSeconds = secondsSince(start);
+
+    size_t mismatches = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        if (memcmp(&single[k].direction, &batched[k].direction, sizeof(Vector3)) != 0 ||
+            single[k].spread != batched[k].spread)
+            mismatches++;
+    }
+    printf("1次レイ生成 %zu本: createRay %.3fms, generateRays %.3fms (不一致 %zu本)\n",
+           count, singleSeconds * 1e3, batchedSeconds * 1e3, mismatches);
+}
+
+// シーンを複数の視点から描画する
+// 1回の準備で全視点を描画した時間と，視点ごとにシーンを読み込んで描画した時間を比べる
+// 使い方: raytracing_multiview シーン stereo|cube|array [スレッド数] [出力PNGの接頭辞]
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s シーン stereo|cube|array [スレッド数] [出力PNGの接頭辞]\n", argv[0]);
+        return -1;
+    }
+    const char *mode = argv[2];
+    unsigned int workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+    const char *prefix = (argc > 4) ? argv[4] : "raytracing_multiview";
+
+    auto start = Clock::now();
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    double loadSeconds = secondsSince(start);
+    unsigned int width = sceneFile.bitmap.width;
+    unsigned int height = sceneFile.bitmap.height;
+
+    // 視点
+    std::vector<Camera> cameras;
+    if (strcmp(mode, "stereo") == 0)
+    {
+        cameras.resize(2);
+        makeStereoCameras(sceneFile.camera, 0.3f, &cameras[0], &cameras[1]);
+    }
+    else if (strcmp(mode, "cube") == 0)
+    {
+        cameras.resize(6);
+        makeCubeMapCameras(sceneFile.camera.position, cameras.data());
+    }
+    else if (strcmp(mode, "array") == 0)
+    {
+        cameras.resize(9);
+        makeCameraArray(sceneFile.camera, 3, 3, 0.5f, cameras.data());
+    }
+    else
+    {
+        printf("%sは使えません(stereo・cube・arrayのどれか)\n", mode);
+        return -1;
+    }
+    unsigned int viewNum = (unsigned int)cameras.size();
+
+    compareRayGeneration(&cameras[0], width, height);
+
+    std::vector<FloatBitMapData> outputs(viewNum, FloatBitMapData(width, height));
+    for (auto &output : outputs)
+    {
+        if (output.allocation() == -1)
+            return -1;
+    }
+
+    // 1回の準備で全視点を描画する
+    MultiViewStats stats;
+    if (renderMultiView(
+            &sceneFile.scene, cameras.data(), viewNum, outputs.data(), workerNum, &stats) == -1)
+        return -1;
+    printf("%s: %ux%u %u視点 %uスレッド\n", argv[1], width, height, viewNum, workerNum);
+    printf("まとめて描画: 準備 %.3f秒 + 描画 %.3f秒 (%uタイル, %.2fMレイ/秒)\n",
+           loadSeconds, stats.seconds, stats.tiles, (double)stats.rays / stats.seconds / 1e6);
+
+    // 視点ごとに読み込み直して描画する
+    double separateSeconds = 0.0;
+    float maxDiff = 0.f;
+    for (unsigned int v = 0; v < viewNum; v++)
+    {
+        start = Clock::now();
+        SceneFile single;
+        if (loadSceneFile(&single, argv[1]) == -1)
+            return -1;
+        FloatBitMapData bitmap(width, height);
+        if (bitmap.allocation() == -1)
+            return -1;
+        renderMultiView(&single.scene, &cameras[v], 1, &bitmap, workerNum, nullptr);
+        separateSeconds += secondsSince(start);
+
+        size_t count = (size_t)width * height * 3;
+        for (size_t i = 0; i < count; i++)
+        {
+            float diff = fabsf(bitmap.pixelsData[i] - outputs[v].pixelsData[i]);
+            if (diff > maxDiff)
+                maxDiff = diff;
+        }
+        freeFloatBitmapData(&bitmap);
+        freeSceneFile(&single);
+    }
+    printf("視点ごとに描画: %.3f秒, 差の最大値 %g\n", separateSeconds, maxDiff);
+
+    // 視点ごとにPNGに変換してファイル保存
+    BitMapData bitmap(width, height, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+    int result = 0;
+    for (unsigned int v = 0; v < viewNum && result == 0; v++)
+    {
+        char filename[512];
+        snprintf(filename, sizeof(filename), "%s_%u.png", prefix, v);
+        toneMapping(&outputs[v], &bitmap);
+        result = pngFileEncodeWrite(&bitmap, filename);
+    }
+
+    freeBitmapData(&bitmap);
+    for (auto &output : outputs)
+        freeFloatBitmapData(&output);
+    freeSceneFile(&sceneFile);
+    return result;
+}
@@ -0,0 +1,67 @@
+#include "numa.hpp"
+#include "sceneFile.hpp"
+
+// NUMAノードごとにスレッドを固定してシーンを描画し，ノードごとの処理量を表示する
+// 使い方: raytracing_numa シーン [スレッド数] [シーンを複製するか(0/1)] [出力PNG]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s シーン [スレッド数] [シーンを複製するか(0/1)] [出力PNG]\n", argv[0]);
+        return -1;
+    }
+    NumaRenderOption option;
+    option.workerNum = (argc > 2) ? atoi(argv[2]) : 1;
+    option.replicateScene = (argc > 3) ? atoi(argv[3]) != 0 : true;
+    const char *output = (argc > 4) ? argv[4] : "raytracing_numa.png";
+
+    NumaTopology topology;
+    detectNumaTopology(&topology);
+    for (size_t n = 0; n < topology.nodeIds.size(); n++)
+        printf("ノード%d: CPU %zu個\n", topology.nodeIds[n], topology.nodeCpus[n].size());
+    if (topology.nodeIds.size() == 1)
+        printf("ノードが1つなのでスレッドの固定・シーンの複製はしません\n");
+
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    Scene *scene = &sceneFile.scene;
+
+    // 描画前にページに触れないようにここでは確保だけする
+    FloatBitMapData hdrBitmap(sceneFile.bitmap.width, sceneFile.bitmap.height);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
+    NumaRenderStats stats;
+    if (renderNuma(scene, &hdrBitmap, topology, option, &stats) == -1)
+        return -1;
+
+    printf("%s: %dx%d %dsample %uスレッド, ", argv[1], hdrBitmap.width, hdrBitmap.height,
+           scene->samplingNum, option.workerNum);
+    if (stats.sceneCopies > 0)
+        printf("シーンの複製 %u個\n", stats.sceneCopies);
+    else
+        printf("シーンの複製なし\n");
+    unsigned long long totalRays = 0;
+    for (auto &node : stats.nodes)
+    {
+        printf("ノード%d: %uスレッド, タイル %u枚(他のノードから %u枚), レイ %llu本, "
+               "%.3f秒 (%.2fMレイ/秒)\n",
+               node.node, node.workers, node.tiles, node.stolenTiles, node.rays, node.seconds,
+               node.seconds > 0.0 ? node.rays / node.seconds / 1e6 : 0.0);
+        totalRays += node.rays;
+    }
+    printf("時間 %.3f秒, レイ %llu本 (%.2fMレイ/秒)\n",
+           stats.seconds, totalRays, totalRays / stats.seconds / 1e6);
+
+    BitMapData bitmap(hdrBitmap.width, hdrBitmap.height, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+    toneMapping(&hdrBitmap, &bitmap);
+    int result = pngFileEncodeWrite(&bitmap, output);
+
+    freeBitmapData(&bitmap);
+    freeFloatBitmapData(&hdrBitmap);
+    freeSceneFile(&sceneFile);
+    return result;
+}
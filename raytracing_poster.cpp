@@ -0,0 +1,102 @@
+#include <thread>
+#include "tiledFramebuffer.hpp"
+
+#define GEOMETRY_NUM 7
+#define LIGHT_NUM 1
+#define DEFAULT_SCALE 8192
+
+// ポスターサイズの描画
+// 使い方: raytracing_poster [一辺のピクセル数] [スレッド数]
+int main(int argc, char **argv)
+{
+    unsigned int scale = (argc > 1) ? atoi(argv[1]) : DEFAULT_SCALE;
+    unsigned int workerNum = (argc > 2) ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    // 画像サイズだけを持つビットマップ
+    // ピクセルはタイルフレームバッファに置くのでallocationしない
+    BitMapData bitmap(scale, scale, 3);
+
+    // タイルフレームバッファ(ファイルに退避)
+    TiledFloatBitMapData tiledBitmap(scale, scale);
+    if (tiledBitmap.allocation("raytracing_poster.tiles") == -1)
+        return -1;
+
+    // 描画オブジェクト
+    Shape *geometry[GEOMETRY_NUM];
+
+    // 球
+    geometry[0] = new Sphere(Vector3(-0.4, -0.65, 3), 0.35f);
+    geometry[0]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[0]->material.useReflection = true;
+    geometry[0]->material.reflection = FColor(1.f, 1.f, 1.f);
+    geometry[1] = new Sphere(Vector3(0.5, -0.65, 2), 0.35f);
+    geometry[1]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[1]->material.useReflection = true;
+    geometry[1]->material.reflection = FColor(1.f, 1.f, 1.f);
+
+    // 平面
+    geometry[2] = new Plane(Vector3(0, 1, 0), Vector3(0, -1, 0)); // 白い床
+    geometry[3] = new Plane(Vector3(0, -1, 0), Vector3(0, 1, 0)); // 白い天井
+    geometry[4] = new Plane(Vector3(1, 0, 0), Vector3(-1, 0, 0)); // 赤い壁
+    geometry[5] = new Plane(Vector3(-1, 0, 0), Vector3(1, 0, 0)); // 青の壁
+    geometry[6] = new Plane(Vector3(0, 0, -1), Vector3(0, 0, 5)); // 白い壁
+
+    // マテリアルセット
+    geometry[2]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[3]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[4]->material.diffuse = FColor(1.f, 0.4f, 0.4f);
+    geometry[5]->material.diffuse = FColor(0.4f, 0.4f, 1.f);
+    geometry[6]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+
+    // 視点の位置を決める
+    Camera camera;
+    camera.position = Vector3(0, 0, -5);
+
+    // 点光源の位置を決める
+    PointLight *pointLight = new PointLight();
+    pointLight->position = Vector3(0, 0.9, 2.5);
+    pointLight->intensity = FColor(1.f, 1.f, 1.f);
+
+    Light *lights[LIGHT_NUM];
+
+    lights[0] = pointLight;
+
+    // シーン作成
+    Scene scene;
+    scene.bitmap = &bitmap;
+    scene.camera = &camera;
+    scene.geometry = geometry;
+    scene.geometryNum = GEOMETRY_NUM;
+    scene.backgroundColor = FColor(100.f / 255.f, 149.f / 255.f, 237.f / 255.f);
+    scene.light = lights;
+    scene.lightNum = LIGHT_NUM;
+    scene.ambientIntensity = FColor(0.1, 0.1, 0.1);
+    scene.samplingNum = 4;
+
+    // タイル単位で並列に描画
+    renderTiledFramebuffer(&scene, &tiledBitmap, workerNum);
+
+    // 1タイル行ずつPNGに変換してファイル保存
+    if (tiledPngFileEncodeWrite(&tiledBitmap, "raytracing_poster.png") == -1)
+    {
+        freeTiledFloatBitmapData(&tiledBitmap);
+        return -1;
+    }
+
+    freeTiledFloatBitmapData(&tiledBitmap);
+    remove("raytracing_poster.tiles");
+
+    for (auto o : geometry)
+    {
+        delete o;
+    }
+
+    for (auto l : lights)
+    {
+        delete l;
+    }
+
+    return 0;
+}
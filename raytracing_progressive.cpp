@@ -0,0 +1,124 @@
+#include <thread>
+#include "progressive.hpp"
+
+#define GEOMETRY_NUM 7
+#define LIGHT_NUM 1
+#define EVALUATE_NUM 10
+#define SCALE 512
+
+// 使い方: raytracing_progressive [制限時間(秒)] [目標サンプル数] [チェックポイント]
+// チェックポイントがあれば続きから描画する
+int main(int argc, char **argv)
+{
+    ProgressiveOption option;
+    option.timeBudget = (argc > 1) ? atof(argv[1]) : 0.0;
+    option.targetSamplingNum = (argc > 2) ? atoi(argv[2]) : 0;
+    option.checkpointFile = (argc > 3) ? argv[3] : "raytracing_progressive.ckpt";
+    option.checkpointInterval = 30.0;
+    option.workerNum = std::thread::hardware_concurrency();
+
+    // ビットマップデータ
+    BitMapData bitmap(SCALE, SCALE, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+
+    // HDRフレームバッファ
+    FloatBitMapData hdrBitmap(SCALE, SCALE);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
+    // 蓄積バッファ
+    ProgressiveState state(SCALE, SCALE);
+    if (state.allocation() == -1)
+        return -1;
+    if (progressiveCheckpointRead(&state, option.checkpointFile) == 0)
+        printf("%sの%dパス目から再開します\n", option.checkpointFile, state.passNum);
+
+    // 描画オブジェクト
+    Shape *geometry[GEOMETRY_NUM];
+
+    // 球
+    geometry[0] = new Sphere(Vector3(-0.4, -0.65, 3), 0.35f);
+    geometry[0]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[0]->material.useReflection = true;
+    geometry[0]->material.reflection = FColor(1.f, 1.f, 1.f);
+    geometry[1] = new Sphere(Vector3(0.5, -0.65, 2), 0.35f);
+    geometry[1]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[1]->material.useReflection = true;
+    geometry[1]->material.reflection = FColor(1.f, 1.f, 1.f);
+
+    // 平面
+    geometry[2] = new Plane(Vector3(0, 1, 0), Vector3(0, -1, 0)); // 白い床
+    geometry[3] = new Plane(Vector3(0, -1, 0), Vector3(0, 1, 0)); // 白い天井
+    geometry[4] = new Plane(Vector3(1, 0, 0), Vector3(-1, 0, 0)); // 赤い壁
+    geometry[5] = new Plane(Vector3(-1, 0, 0), Vector3(1, 0, 0)); // 青の壁
+    geometry[6] = new Plane(Vector3(0, 0, -1), Vector3(0, 0, 5)); // 白い壁
+
+    // マテリアルセット
+    geometry[2]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[3]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[4]->material.diffuse = FColor(1.f, 0.4f, 0.4f);
+    geometry[5]->material.diffuse = FColor(0.4f, 0.4f, 1.f);
+    geometry[6]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+
+    // 視点の位置を決める
+    Camera camera;
+    camera.position = Vector3(0, 0, -5);
+
+    // 点光源の位置を決める
+    PointLight *pointLight = new PointLight();
+    pointLight->position = Vector3(0, 0.9, 2.5);
+    pointLight->intensity = FColor(1.f, 1.f, 1.f);
+
+    Light *lights[LIGHT_NUM];
+
+    lights[0] = pointLight;
+
+    // シーン作成
+    Scene scene;
+    scene.bitmap = &bitmap;
+    scene.camera = &camera;
+    scene.geometry = geometry;
+    scene.geometryNum = GEOMETRY_NUM;
+    scene.backgroundColor = FColor(100.f / 255.f, 149.f / 255.f, 237.f / 255.f);
+    scene.light = lights;
+    scene.lightNum = LIGHT_NUM;
+    scene.ambientIntensity = FColor(0.1, 0.1, 0.1);
+    scene.samplingNum = 20;
+
+    // 1パスずつ描画
+    int result = renderProgressive(&scene, &state, option);
+    if (result == -1)
+        return -1;
+    printf("%s: %dパス\n", (result == 0) ? "完了" : "時間切れ", state.passNum);
+    resolveProgressive(&state, &hdrBitmap);
+    freeProgressiveState(&state);
+
+    // 8bitに量子化
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // HDRのまま保存
+    exrFileWrite(&hdrBitmap, "raytracing_progressive.exr", EXR_COMPRESSION_RLE, EXR_PIXEL_HALF);
+    freeFloatBitmapData(&hdrBitmap);
+
+    // PNGに変換してファイル保存
+    if (pngFileEncodeWrite(&bitmap, "raytracing_progressive.png") == -1)
+    {
+        freeBitmapData(&bitmap);
+        return -1;
+    }
+
+    for (auto o : geometry)
+    {
+        delete o;
+    }
+
+    for (auto l : lights)
+    {
+        delete l;
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include "rayQuery.hpp"
+#include "sceneFile.hpp"
+
+#define REFERENCE_RAY_NUM 100000 // intersectionWithAllと比べるレイの数
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// ランダムなレイでまとめ処理の交差判定の速さを測る
+// 始点は[-1,1]^3の立方体内，方向は一様な単位ベクトル，tMaxは半分が無限・半分が0〜4
+// 先頭のREFERENCE_RAY_NUM本はintersectionWithAllで1本ずつ求めた結果と比べる
+// 使い方: raytracing_rayquery シーン [レイの数] [スレッド数]
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s シーン [レイの数] [スレッド数]\n", argv[0]);
+        return -1;
+    }
+    size_t count = (argc > 2) ? (size_t)atoll(argv[2]) : 4000000;
+    unsigned int workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    Scene *scene = &sceneFile.scene;
+
+    // 呼び出し側が持つSoAの配列
+    std::vector<float> ox(count), oy(count), oz(count), dx(count), dy(count), dz(count);
+    std::vector<float> tMax(count), t(count), nx(count), ny(count), nz(count);
+    std::vector<int> shapeId(count);
+    std::vector<unsigned char> occluded(count);
+    Sampler sampler(pixelSeed(0, 0));
+    for (size_t k = 0; k < count; k++)
+    {
+        ox[k] = 2.f * sampler.next() - 1.f;
+        oy[k] = 2.f * sampler.next() - 1.f;
+        oz[k] = 2.f * sampler.next() - 1.f;
+        float z = 2.f * sampler.next() - 1.f;
+        float phi = 2.f * (float)M_PI * sampler.next();
+        float r = sqrtf(fmaxf(0.f, 1.f - z * z));
+        dx[k] = r * cosf(phi);
+        dy[k] = r * sinf(phi);
+        dz[k] = z;
+        tMax[k] = (k & 1) ? 4.f * sampler.next() : FLT_MAX;
+    }
+    RayQueryRays rays = {
+        count, ox.data(), oy.data(), oz.data(), dx.data(), dy.data(), dz.data(), tMax.data()};
+    RayQueryHits hits = {t.data(), shapeId.data(), nx.data(), ny.data(), nz.data()};
+
+    RayQueryContext *context = createRayQueryContext(scene, workerNum);
+
+    auto start = Clock::now();
+    rayQueryClosest(context, rays, &hits);
+    double closestSeconds = secondsSince(start);
+    start = Clock::now();
+    rayQueryOcclusion(context, rays, occluded.data());
+    double occlusionSeconds = secondsSince(start);
+
+    size_t hitNum = 0, occludedNum = 0, inconsistent = 0;
+    for (size_t k = 0; k < count; k++)
+    {
+        hitNum += shapeId[k] != -1;
+        occludedNum += occluded[k];
+        inconsistent += (shapeId[k] != -1) != (occluded[k] != 0);
+    }
+    printf("%s: %zu本 %uスレッド\n", argv[1], count, workerNum);
+    printf("最近交点 %.3f秒 (%.2fMレイ/秒), 交差 %zu本\n",
+           closestSeconds, count / closestSeconds / 1e6, hitNum);
+    printf("遮蔽のみ %.3f秒 (%.2fMレイ/秒), 遮蔽 %zu本, 最近交点と食い違い %zu本\n",
+           occlusionSeconds, count / occlusionSeconds / 1e6, occludedNum, inconsistent);
+
+    // intersectionWithAllで1本ずつ求めた結果と比べる
+    size_t referenceNum = count < REFERENCE_RAY_NUM ? count : REFERENCE_RAY_NUM;
+    size_t mismatches = 0;
+    float maxError = 0.f;
+    start = Clock::now();
+    for (size_t k = 0; k < referenceNum; k++)
+    {
+        Ray ray;
+        ray.startPoint = Vector3(ox[k], oy[k], oz[k]);
+        ray.direction = Vector3(dx[k], dy[k], dz[k]);
+        IntersectionResult *result =
+            intersectionWithAll(scene->geometry, scene->geometryNum, &ray);
+        int referenceId = -1;
+        float referenceT = tMax[k];
+        if (result->intersectionPoint != nullptr)
+        {
+            // 方向は単位ベクトルなのでtは距離
+            float distance = (result->intersectionPoint->position - ray.startPoint).magnitude();
+            if (distance < tMax[k])
+            {
+                referenceId = result->shapeIndex;
+                referenceT = distance;
+            }
+        }
+        delete result;
+        if (referenceId != shapeId[k])
+            mismatches++;
+        else if (referenceId != -1)
+            maxError = fmaxf(maxError, fabsf(referenceT - t[k]));
+    }
+    double referenceSeconds = secondsSince(start);
+    printf("intersectionWithAll %zu本 %.3f秒 (%.2fMレイ/秒), 交差したジオメトリの不一致 %zu本, "
+           "距離の差の最大値 %g\n",
+           referenceNum, referenceSeconds, referenceNum / referenceSeconds / 1e6, mismatches,
+           maxError);
+
+    freeRayQueryContext(context);
+    freeSceneFile(&sceneFile);
+    return 0;
+}
@@ -16,6 +16,11 @@ int main(int argc, char **argv)
     if (bitmap.allocation() == -1)
         return -1;
 
+    // HDRフレームバッファ
+    FloatBitMapData hdrBitmap(SCALE, SCALE);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
     // 描画オブジェクト
     Shape *geometry[GEOMETRY_NUM];
 
@@ -85,14 +90,22 @@ int main(int argc, char **argv)
                 Ray ray = createRay(camera, u, v, bitmap.width, bitmap.height);
                 luminance = luminance + RayTrace(&scene, &ray);
             }
-            Color color;
-            color.r = luminance.r / (float)scene.samplingNum * 0xff;
-            color.g = luminance.g / (float)scene.samplingNum * 0xff;
-            color.b = luminance.b / (float)scene.samplingNum * 0xff;
-            drawDot(&bitmap, x, y, color);
+            hdrBitmap.setPixel(
+                x, y,
+                luminance.r / (float)scene.samplingNum,
+                luminance.g / (float)scene.samplingNum,
+                luminance.b / (float)scene.samplingNum);
         }
     }
 
+    // 8bitに量子化
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // HDRのまま保存
+    pfmFileWrite(&hdrBitmap, "raytracing_sample1.pfm");
+    exrFileWrite(&hdrBitmap, "raytracing_sample1.exr", EXR_COMPRESSION_RLE, EXR_PIXEL_HALF);
+    freeFloatBitmapData(&hdrBitmap);
+
     // PNGに変換してファイル保存
     if (pngFileEncodeWrite(&bitmap, "raytracing_sample1.png") == -1)
     {
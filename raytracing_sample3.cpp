@@ -0,0 +1,141 @@
+#include "raytracing_lib.hpp"
+
+#define GEOMETRY_NUM 7
+#define LIGHT_NUM 1
+#define EVALUATE_NUM 10
+#define SCALE 512
+
+int main(int argc, char **argv)
+{
+    // ビットマップデータ
+    BitMapData bitmap(SCALE, SCALE, 3);
+    if (bitmap.allocation() == -1)
+        return -1;
+
+    // テクスチャキャッシュ(タイルは合計256KBまで保持)
+    TextureCache *textureCache = createTextureCache(256 * 1024);
+    Texture *texture = loadTexture(textureCache, "raytracing_result.png");
+    if (texture == nullptr)
+        return -1;
+
+    // HDRフレームバッファ
+    FloatBitMapData hdrBitmap(SCALE, SCALE);
+    if (hdrBitmap.allocation() == -1)
+        return -1;
+
+    // 描画オブジェクト
+    Shape *geometry[GEOMETRY_NUM];
+
+    // 球
+    geometry[0] = new Sphere(Vector3(-0.4, -0.65, 3), 0.35f);
+    geometry[0]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[0]->material.useReflection = true;
+    geometry[0]->material.reflection = FColor(1.f, 1.f, 1.f);
+    geometry[1] = new Sphere(Vector3(0.5, -0.65, 2), 0.35f);
+    geometry[1]->material =
+        Material(FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), FColor(0.f, 0.f, 0.f), 0.f);
+    geometry[1]->material.useReflection = true;
+    geometry[1]->material.reflection = FColor(1.f, 1.f, 1.f);
+
+    // 平面
+    geometry[2] = new Plane(Vector3(0, 1, 0), Vector3(0, -1, 0)); // 白い床
+    geometry[3] = new Plane(Vector3(0, -1, 0), Vector3(0, 1, 0)); // 白い天井
+    geometry[4] = new Plane(Vector3(1, 0, 0), Vector3(-1, 0, 0)); // 赤い壁
+    geometry[5] = new Plane(Vector3(-1, 0, 0), Vector3(1, 0, 0)); // 青の壁
+    geometry[6] = new Plane(Vector3(0, 0, -1), Vector3(0, 0, 5)); // 白い壁
+
+    // マテリアルセット
+    geometry[2]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[3]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+    geometry[4]->material.diffuse = FColor(1.f, 0.4f, 0.4f);
+    geometry[5]->material.diffuse = FColor(0.4f, 0.4f, 1.f);
+    geometry[6]->material.diffuse = FColor(0.7f, 0.7f, 0.7f);
+
+    // 床と奥の壁にテクスチャを貼る
+    geometry[2]->material.diffuseTexture = texture;
+    geometry[2]->material.textureScale = 0.5f;
+    geometry[6]->material.diffuseTexture = texture;
+    geometry[6]->material.textureScale = 2.f;
+
+    // 視点の位置を決める
+    Camera camera;
+    camera.position = Vector3(0, 0, -5);
+
+    // 点光源の位置を決める
+    PointLight *pointLight = new PointLight();
+    pointLight->position = Vector3(0, 0.9, 2.5);
+    pointLight->intensity = FColor(1.f, 1.f, 1.f);
+
+    Light *lights[LIGHT_NUM];
+
+    lights[0] = pointLight;
+
+    // シーン作成
+    Scene scene;
+    scene.bitmap = &bitmap;
+    scene.camera = &camera;
+    scene.geometry = geometry;
+    scene.geometryNum = GEOMETRY_NUM;
+    scene.backgroundColor = FColor(100.f / 255.f, 149.f / 255.f, 237.f / 255.f);
+    scene.light = lights;
+    scene.lightNum = LIGHT_NUM;
+    scene.ambientIntensity = FColor(0.1, 0.1, 0.1);
+    scene.samplingNum = 20;
+
+    // 視線方向で最も近い物体を探し，
+    // その物体との交点位置とその点での法線ベクトルを求める
+    for (int y = 0; y < bitmap.height; y++)
+    {
+        for (int x = 0; x < bitmap.width; x++)
+        {
+            FColor luminance = FColor(0, 0, 0);
+            for (int s = 0; s < scene.samplingNum; s++)
+            {
+                float u = (float(x) + myRand());
+                float v = (float(y) + myRand());
+                // レイを生成
+                Ray ray = createRay(camera, u, v, bitmap.width, bitmap.height);
+                luminance = luminance + RayTrace(&scene, &ray);
+            }
+            hdrBitmap.setPixel(
+                x, y,
+                luminance.r / (float)scene.samplingNum,
+                luminance.g / (float)scene.samplingNum,
+                luminance.b / (float)scene.samplingNum);
+        }
+    }
+
+    // 8bitに量子化
+    toneMapping(&hdrBitmap, &bitmap);
+
+    // HDRのまま保存
+    pfmFileWrite(&hdrBitmap, "raytracing_sample3.pfm");
+    exrFileWrite(&hdrBitmap, "raytracing_sample3.exr", EXR_COMPRESSION_RLE, EXR_PIXEL_HALF);
+    freeFloatBitmapData(&hdrBitmap);
+
+    // PNGに変換してファイル保存
+    if (pngFileEncodeWrite(&bitmap, "raytracing_sample3.png") == -1)
+    {
+        freeBitmapData(&bitmap);
+        return -1;
+    }
+
+    for (auto o : geometry)
+    {
+        delete o;
+    }
+
+    for (auto l : lights)
+    {
+        delete l;
+    }
+
+    TextureCacheStats stats = getTextureCacheStats(textureCache);
+    printf("texture cache: hit %llu, miss %llu, evict %llu, peak %zu bytes\n",
+           stats.hits, stats.misses, stats.evictions, stats.peakResidentBytes);
+    freeTexture(texture);
+    destroyTextureCache(textureCache);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "sceneFile.hpp"
+#include "sequence.hpp"
+
+// フレームごとのカメラの移動量
+static Vector3 cameraStep(0.02f, 0.f, 0.05f);
+
+// 視点(ピンホールカメラなら注視点も)をframe回分平行移動する
+static void moveCamera(Scene *scene, unsigned int frame, void *)
+{
+    Vector3 offset = (float)frame * cameraStep;
+    scene->camera->position = scene->camera->position + offset;
+    scene->camera->target = scene->camera->target + offset;
+}
+
+static void printSequenceStats(const char *label, const SequenceStats &stats)
+{
+    printf("%s: %uフレーム %.3f秒 (%.2fフレーム/秒), レイ %llu本\n", label, stats.frames,
+           stats.seconds, stats.seconds > 0.0 ? stats.frames / stats.seconds : 0.0, stats.rays);
+    for (int s = 0; s < SEQUENCE_STAGE_NUM; s++)
+    {
+        printf("  処理 %7.3f秒 (使用率 %5.1f%%), 待ち %7.3f秒  %s\n",
+               stats.stages[s].busySeconds, 100.0 * stats.stages[s].utilization,
+               stats.stages[s].waitSeconds, sequenceStageName(s));
+    }
+}
+
+// カメラを動かしながら連番画像を描画する
+// バッファ1組(更新→描画→トーンマッピング→エンコード→書き込みを順に行う)と
+// パイプライン(バッファ数組)の時間と段ごとの使用率を比べる
+// 使い方: raytracing_sequence シーン フレーム数 [スレッド数] [バッファ数] [出力PNGの接頭辞]
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s シーン フレーム数 [スレッド数] [バッファ数] [出力PNGの接頭辞]\n",
+               argv[0]);
+        return -1;
+    }
+    unsigned int frameNum = atoi(argv[2]);
+    SequenceOption option;
+    option.workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+    option.bufferNum = (argc > 4) ? atoi(argv[4]) : 2;
+    option.prefix = (argc > 5) ? argv[5] : "raytracing_sequence";
+
+    SceneFile sceneFile;
+    if (loadSceneFile(&sceneFile, argv[1]) == -1)
+        return -1;
+    Scene *scene = &sceneFile.scene;
+
+    SequenceOption sequential = option;
+    sequential.bufferNum = 1;
+    SequenceStats sequentialStats, pipelinedStats;
+    if (renderSequence(scene, frameNum, moveCamera, nullptr, sequential, &sequentialStats) == -1)
+        return -1;
+    printSequenceStats("バッファ1組", sequentialStats);
+
+    int result = renderSequence(scene, frameNum, moveCamera, nullptr, option, &pipelinedStats);
+    char label[64];
+    snprintf(label, sizeof(label), "パイプライン(バッファ%u組)", option.bufferNum);
+    printSequenceStats(label, pipelinedStats);
+    printf("短縮 %.3f秒\n", sequentialStats.seconds - pipelinedStats.seconds);
+
+    freeSceneFile(&sceneFile);
+    return result;
+}
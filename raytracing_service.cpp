@@ -0,0 +1,110 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "renderService.hpp"
+
+// 常駐レンダリングサービスとそのクライアント
+// 使い方:
+//   raytracing_service daemon アドレス [スレッド数]
+//   raytracing_service render アドレス シーン 出力PNG [サンプル数] [優先度] [カメラx y z]
+//   raytracing_service stats アドレス
+//   raytracing_service shutdown アドレス
+// アドレスは "unix:パス" または "tcp:ホスト:ポート"
+static void usage(const char *name)
+{
+    printf("usage: %s daemon アドレス [スレッド数]\n", name);
+    printf("       %s render アドレス シーン 出力PNG [サンプル数] [優先度] [カメラx y z]\n", name);
+    printf("       %s stats アドレス\n", name);
+    printf("       %s shutdown アドレス\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    const char *mode = argv[1];
+    const char *address = argv[2];
+
+    if (strcmp(mode, "daemon") == 0)
+    {
+        unsigned int workerNum = (argc > 3) ? atoi(argv[3]) : 1;
+        return runRenderService(address, workerNum);
+    }
+    if (strcmp(mode, "render") == 0)
+    {
+        if (argc < 5)
+        {
+            usage(argv[0]);
+            return -1;
+        }
+        ServiceRequest request;
+        memset(&request, 0, sizeof(request));
+        // サービスから見たパスにするため絶対パスにする
+        char path[PATH_MAX];
+        if (realpath(argv[3], path) == nullptr)
+        {
+            printf("%sは開けません\n", argv[3]);
+            return -1;
+        }
+        int length = snprintf(request.sceneFile, SERVICE_PATH_LENGTH, "%s", path);
+        int outputLength;
+        if (argv[4][0] == '/')
+            outputLength = snprintf(path, sizeof(path), "%s", argv[4]);
+        else
+        {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, sizeof(cwd)) == nullptr)
+                return -1;
+            outputLength = snprintf(path, sizeof(path), "%s/%s", cwd, argv[4]);
+        }
+        if (length >= SERVICE_PATH_LENGTH || outputLength < 0 ||
+            (size_t)outputLength >= sizeof(path) ||
+            snprintf(request.output, SERVICE_PATH_LENGTH, "%s", path) >= SERVICE_PATH_LENGTH)
+        {
+            printf("パスが長すぎます\n");
+            return -1;
+        }
+        request.samplingNum = (argc > 5) ? atoi(argv[5]) : 0;
+        request.priority = (argc > 6) ? atoi(argv[6]) : 0;
+        if (argc > 9)
+        {
+            request.overrideCamera = 1;
+            for (int i = 0; i < 3; i++)
+                request.camera[i] = (float)atof(argv[7 + i]);
+        }
+
+        ServiceJobResult result;
+        if (requestRender(address, request, &result) == -1)
+        {
+            printf("描画に失敗しました\n");
+            return -1;
+        }
+        printf("ジョブ%u: 待ち%.3f秒 準備%.3f秒%s 描画%.3f秒\n",
+               result.jobId, result.queueSeconds, result.setupSeconds,
+               result.sceneCacheHit ? "(キャッシュ)" : "", result.renderSeconds);
+        return 0;
+    }
+    if (strcmp(mode, "stats") == 0)
+    {
+        ServiceStats stats;
+        if (requestServiceStats(address, &stats) == -1)
+            return -1;
+        printf("キュー %u (処理中 %u)\n", stats.queueDepth, stats.activeJobs);
+        printf("完了 %llu, 失敗 %llu\n",
+               (unsigned long long)stats.completedJobs, (unsigned long long)stats.failedJobs);
+        printf("シーンキャッシュ %u件, ヒット %llu, ミス %llu\n", stats.cachedScenes,
+               (unsigned long long)stats.sceneCacheHits,
+               (unsigned long long)stats.sceneCacheMisses);
+        printf("待ち時間 平均%.3f秒, 応答時間 平均%.3f秒 最大%.3f秒\n",
+               stats.meanQueueSeconds, stats.meanLatencySeconds, stats.maxLatencySeconds);
+        return 0;
+    }
+    if (strcmp(mode, "shutdown") == 0)
+        return requestServiceShutdown(address);
+
+    usage(argv[0]);
+    return -1;
+}
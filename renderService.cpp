@@ -0,0 +1,602 @@
+#include "renderService.hpp"
+#include "socketUtil.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SERVICE_ACCEPT_POLL_MS 200 // 終了の確認のために待ち受けを区切る時間
+
+typedef std::chrono::steady_clock Clock;
+
+// ジョブの状態
+enum JOB_STATE
+{
+    JOB_QUEUED,    // 準備待ち
+    JOB_LOADING,   // シーンを準備中
+    JOB_RENDERING, // タイルを描画中
+};
+
+// キャッシュしたシーン
+struct CachedScene
+{
+    std::string filename;
+    long long mtime;          // 読み込んだときのファイルの更新時刻[ns]
+    long long size;           // 読み込んだときのファイルの大きさ
+    SceneFile *sceneFile;
+    unsigned int references;  // 使用中のジョブ数
+    unsigned long long lastUsed;
+    bool stale;               // ファイルが更新されたのでキャッシュから外した
+    bool loading;             // 読み込み中(sceneFileはまだ使えない)
+};
+
+// 描画ジョブ
+struct RenderJob
+{
+    unsigned int id;
+    ServiceRequest request;
+    int clientFd;
+    int state; // JOB_STATE
+    Clock::time_point submitTime;
+    Clock::time_point startTime;
+    Clock::time_point renderTime;
+
+    // ジョブごとの視点・サンプル数のシーン(ジオメトリ・光源の木などはキャッシュと共有)
+    CachedScene *cached = nullptr;
+    bool cacheHit = false;
+    Scene scene;
+    Camera camera;
+    CompiledScene compiled;
+    FloatBitMapData hdrBitmap;
+
+    unsigned int tileCountX = 0;
+    unsigned int tileNum = 0;
+    unsigned int nextTile = 0;  // 次に描画するタイル
+    unsigned int doneTiles = 0; // 描画し終えたタイル
+};
+
+// サービスの状態
+struct RenderService
+{
+    std::mutex mutex; // jobs・統計・stopping
+    std::condition_variable cond;
+    std::vector<RenderJob *> jobs;
+    unsigned int nextJobId = 1;
+    bool stopping = false;
+
+    std::mutex cacheMutex; // cache
+    std::condition_variable cacheCond; // 読み込み中のシーンの読み込みが終わった
+    std::vector<CachedScene *> cache;
+    unsigned long long cacheClock = 0;
+
+    // 要求を読んでいる接続(受信は接続ごとのスレッドで行う)
+    unsigned int connections = 0; // mutexで守る
+    std::atomic<bool> shutdownRequested{false};
+
+    // 統計
+    unsigned long long completedJobs = 0;
+    unsigned long long failedJobs = 0;
+    unsigned long long cacheHits = 0;
+    unsigned long long cacheMisses = 0;
+    double totalQueueSeconds = 0.0;
+    double totalLatencySeconds = 0.0;
+    double maxLatencySeconds = 0.0;
+};
+
+static double secondsBetween(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double>(to - from).count();
+}
+
+// ファイルの更新時刻と大きさ
+static int fileVersion(const char *filename, long long *mtime, long long *size)
+{
+    struct stat st;
+    if (stat(filename, &st) == -1)
+        return -1;
+    *mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    *size = (long long)st.st_size;
+    return 0;
+}
+
+static void freeCachedScene(CachedScene *cached)
+{
+    freeSceneFile(cached->sceneFile);
+    delete cached->sceneFile;
+    delete cached;
+}
+
+// 使っていないシーンが多すぎれば最も前に使ったものから捨てる(cacheMutexを取って呼ぶ)
+static void trimSceneCache(RenderService *service)
+{
+    while (true)
+    {
+        size_t unused = 0;
+        int oldest = -1;
+        for (size_t i = 0; i < service->cache.size(); i++)
+        {
+            if (service->cache[i]->references != 0)
+                continue;
+            unused++;
+            if (oldest == -1 || service->cache[i]->lastUsed < service->cache[oldest]->lastUsed)
+                oldest = (int)i;
+        }
+        if (unused <= SERVICE_SCENE_CACHE_SIZE)
+            break;
+        freeCachedScene(service->cache[oldest]);
+        service->cache.erase(service->cache.begin() + oldest);
+    }
+}
+
+// シーンをキャッシュから取り出す(なければ読み込む)．使い終わったらreleaseSceneを呼ぶ
+// 読み込みはロックを外して行う．同じシーンを読み込み中なら終わるのを待つ
+static CachedScene *acquireScene(RenderService *service, const char *filename, bool *hit)
+{
+    long long mtime, size;
+    if (fileVersion(filename, &mtime, &size) == -1)
+    {
+        printf("%sは開けません\n", filename);
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(service->cacheMutex);
+    bool waited = true;
+    while (waited)
+    {
+        waited = false;
+        for (size_t i = 0; i < service->cache.size(); i++)
+        {
+            CachedScene *cached = service->cache[i];
+            if (cached->filename != filename)
+                continue;
+            if (cached->mtime == mtime && cached->size == size)
+            {
+                if (cached->loading)
+                {
+                    // 読み込みが終わったら(失敗して外されていることもあるので)探し直す
+                    service->cacheCond.wait(lock);
+                    waited = true;
+                    break;
+                }
+                cached->references++;
+                cached->lastUsed = ++service->cacheClock;
+                *hit = true;
+                return cached;
+            }
+
+            // ファイルが更新されたので外す(使用中・読み込み中なら最後のジョブが解放する)
+            service->cache.erase(service->cache.begin() + i);
+            if (cached->references == 0)
+                freeCachedScene(cached);
+            else
+                cached->stale = true;
+            break;
+        }
+    }
+
+    // 読み込み中として登録してからロックを外して読み込む
+    *hit = false;
+    CachedScene *cached = new CachedScene();
+    cached->filename = filename;
+    cached->mtime = mtime;
+    cached->size = size;
+    cached->sceneFile = nullptr;
+    cached->references = 1;
+    cached->lastUsed = ++service->cacheClock;
+    cached->stale = false;
+    cached->loading = true;
+    service->cache.push_back(cached);
+    lock.unlock();
+
+    SceneFile *sceneFile = new SceneFile();
+    int result = loadSceneFile(sceneFile, filename);
+
+    lock.lock();
+    cached->loading = false;
+    if (result == -1)
+    {
+        delete sceneFile;
+        for (size_t i = 0; i < service->cache.size(); i++)
+        {
+            if (service->cache[i] == cached)
+            {
+                service->cache.erase(service->cache.begin() + i);
+                break;
+            }
+        }
+        delete cached;
+        service->cacheCond.notify_all();
+        return nullptr;
+    }
+    cached->sceneFile = sceneFile;
+    service->cacheCond.notify_all();
+    trimSceneCache(service);
+    return cached;
+}
+
+static void releaseScene(RenderService *service, CachedScene *cached)
+{
+    std::lock_guard<std::mutex> lock(service->cacheMutex);
+    cached->references--;
+    if (cached->stale && cached->references == 0)
+        freeCachedScene(cached);
+}
+
+// ジョブのシーンを準備する
+// キャッシュしたシーンを浅くコピーし，視点・サンプル数だけ置き換える
+static int prepareJob(RenderService *service, RenderJob *job)
+{
+    job->cached = acquireScene(service, job->request.sceneFile, &job->cacheHit);
+    if (job->cached == nullptr)
+        return -1;
+
+    SceneFile *sceneFile = job->cached->sceneFile;
+    job->scene = sceneFile->scene;
+    job->camera = sceneFile->camera;
+    if (job->request.overrideCamera)
+        job->camera.position =
+            Vector3(job->request.camera[0], job->request.camera[1], job->request.camera[2]);
+    job->scene.camera = &job->camera;
+    if (job->request.samplingNum != 0)
+        job->scene.samplingNum = job->request.samplingNum;
+    copyCompiledScene(&job->scene, &job->compiled);
+
+    job->hdrBitmap = FloatBitMapData(sceneFile->bitmap.width, sceneFile->bitmap.height);
+    if (job->hdrBitmap.allocation() == -1)
+        return -1;
+    job->tileCountX = (job->hdrBitmap.width + SERVICE_TILE_SIZE - 1) / SERVICE_TILE_SIZE;
+    unsigned int tileCountY = (job->hdrBitmap.height + SERVICE_TILE_SIZE - 1) / SERVICE_TILE_SIZE;
+    job->tileNum = job->tileCountX * tileCountY;
+    return 0;
+}
+
+// 結果をPNGに書き込んでクライアントに返し，ジョブを解放する
+static void finishJob(RenderService *service, RenderJob *job, bool prepared)
+{
+    int result = -1;
+    if (prepared)
+    {
+        BitMapData bitmap(job->hdrBitmap.width, job->hdrBitmap.height, 3);
+        if (bitmap.allocation() == 0)
+        {
+            toneMapping(&job->hdrBitmap, &bitmap);
+            result = pngFileEncodeWrite(&bitmap, job->request.output);
+            freeBitmapData(&bitmap);
+        }
+    }
+    freeFloatBitmapData(&job->hdrBitmap);
+    if (job->cached != nullptr)
+        releaseScene(service, job->cached);
+
+    Clock::time_point now = Clock::now();
+    ServiceJobResult reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.result = result;
+    reply.jobId = job->id;
+    reply.sceneCacheHit = job->cacheHit ? 1 : 0;
+    reply.queueSeconds = secondsBetween(job->submitTime, job->startTime);
+    if (prepared)
+    {
+        reply.setupSeconds = secondsBetween(job->startTime, job->renderTime);
+        reply.renderSeconds = secondsBetween(job->renderTime, now);
+    }
+    writeFull(job->clientFd, &reply, sizeof(reply));
+    close(job->clientFd);
+
+    double latency = secondsBetween(job->submitTime, now);
+    printf("ジョブ%u %s: %s 待ち%.3f秒 準備%.3f秒%s 描画%.3f秒\n",
+           job->id, result == 0 ? "完了" : "失敗", job->request.sceneFile, reply.queueSeconds,
+           reply.setupSeconds, job->cacheHit ? "(キャッシュ)" : "", reply.renderSeconds);
+
+    std::lock_guard<std::mutex> lock(service->mutex);
+    if (result == 0)
+        service->completedJobs++;
+    else
+        service->failedJobs++;
+    if (job->cached != nullptr)
+    {
+        if (job->cacheHit)
+            service->cacheHits++;
+        else
+            service->cacheMisses++;
+    }
+    service->totalQueueSeconds += reply.queueSeconds;
+    service->totalLatencySeconds += latency;
+    if (latency > service->maxLatencySeconds)
+        service->maxLatencySeconds = latency;
+    delete job;
+}
+
+// 次に処理するジョブ(優先度が高く，同じなら先に受け付けたもの)
+// 準備中のジョブ・タイルを配り終えたジョブは除く
+static RenderJob *selectJob(RenderService *service)
+{
+    RenderJob *best = nullptr;
+    for (auto job : service->jobs)
+    {
+        if (job->state == JOB_LOADING ||
+            (job->state == JOB_RENDERING && job->nextTile >= job->tileNum))
+            continue;
+        if (best == nullptr || job->request.priority > best->request.priority ||
+            (job->request.priority == best->request.priority && job->id < best->id))
+            best = job;
+    }
+    return best;
+}
+
+static void removeJob(RenderService *service, RenderJob *job)
+{
+    for (size_t i = 0; i < service->jobs.size(); i++)
+    {
+        if (service->jobs[i] == job)
+        {
+            service->jobs.erase(service->jobs.begin() + i);
+            return;
+        }
+    }
+}
+
+// 描画スレッド
+// 優先度の高いジョブからタイルを1つずつ取り出して描画する
+// 新しく来た優先度の高いジョブは描画中のジョブのタイルの合間に割り込む
+static void serviceWorker(RenderService *service)
+{
+    std::unique_lock<std::mutex> lock(service->mutex);
+    while (true)
+    {
+        RenderJob *job = selectJob(service);
+        if (job == nullptr)
+        {
+            if (service->stopping && service->jobs.empty())
+                break;
+            service->cond.wait(lock);
+            continue;
+        }
+
+        // 最初に選んだスレッドがシーンを準備する
+        if (job->state == JOB_QUEUED)
+        {
+            job->state = JOB_LOADING;
+            job->startTime = Clock::now();
+            lock.unlock();
+            int result = prepareJob(service, job);
+            job->renderTime = Clock::now();
+            lock.lock();
+            if (result == -1 || job->tileNum == 0)
+            {
+                removeJob(service, job);
+                lock.unlock();
+                finishJob(service, job, result == 0);
+                lock.lock();
+            }
+            else
+                job->state = JOB_RENDERING;
+            service->cond.notify_all();
+            continue;
+        }
+
+        unsigned int tileId = job->nextTile++;
+        lock.unlock();
+
+        unsigned int x = (tileId % job->tileCountX) * SERVICE_TILE_SIZE;
+        unsigned int y = (tileId / job->tileCountX) * SERVICE_TILE_SIZE;
+        unsigned int w = (x + SERVICE_TILE_SIZE > job->hdrBitmap.width)
+                             ? job->hdrBitmap.width - x : SERVICE_TILE_SIZE;
+        unsigned int h = (y + SERVICE_TILE_SIZE > job->hdrBitmap.height)
+                             ? job->hdrBitmap.height - y : SERVICE_TILE_SIZE;
+        renderTile(
+            &job->scene, x, y, w, h, job->hdrBitmap.getPixel(x, y),
+            (size_t)job->hdrBitmap.width * 3);
+
+        lock.lock();
+        job->doneTiles++;
+        if (job->doneTiles == job->tileNum)
+        {
+            // 最後のタイルを描いたスレッドが書き出す
+            removeJob(service, job);
+            lock.unlock();
+            finishJob(service, job, true);
+            lock.lock();
+            service->cond.notify_all();
+        }
+    }
+}
+
+// 統計を集める
+static void collectStats(RenderService *service, ServiceStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    {
+        std::lock_guard<std::mutex> lock(service->mutex);
+        stats->queueDepth = (uint32_t)service->jobs.size();
+        for (auto job : service->jobs)
+            if (job->state != JOB_QUEUED)
+                stats->activeJobs++;
+        stats->completedJobs = service->completedJobs;
+        stats->failedJobs = service->failedJobs;
+        stats->sceneCacheHits = service->cacheHits;
+        stats->sceneCacheMisses = service->cacheMisses;
+        unsigned long long finished = service->completedJobs + service->failedJobs;
+        if (finished > 0)
+        {
+            stats->meanQueueSeconds = service->totalQueueSeconds / finished;
+            stats->meanLatencySeconds = service->totalLatencySeconds / finished;
+        }
+        stats->maxLatencySeconds = service->maxLatencySeconds;
+    }
+    std::lock_guard<std::mutex> lock(service->cacheMutex);
+    stats->cachedScenes = (uint32_t)service->cache.size();
+}
+
+// 要求を処理する(描画ならジョブとして受け付け，結果はfdに返す)
+static void dispatchRequest(RenderService *service, int fd, const ServiceRequest &request)
+{
+    if (request.type == SERVICE_RENDER)
+    {
+        // 結果を返すまで接続は開いたままにする
+        setReceiveTimeout(fd, 0.0);
+        RenderJob *job = new RenderJob();
+        job->request = request;
+        job->clientFd = fd;
+        job->state = JOB_QUEUED;
+        job->submitTime = Clock::now();
+        std::lock_guard<std::mutex> lock(service->mutex);
+        job->id = service->nextJobId++;
+        service->jobs.push_back(job);
+        service->cond.notify_all();
+    }
+    else if (request.type == SERVICE_STATS)
+    {
+        ServiceStats stats;
+        collectStats(service, &stats);
+        writeFull(fd, &stats, sizeof(stats));
+        close(fd);
+    }
+    else if (request.type == SERVICE_SHUTDOWN)
+    {
+        uint32_t ack = 0;
+        writeFull(fd, &ack, sizeof(ack));
+        close(fd);
+        service->shutdownRequested = true;
+    }
+    else
+        close(fd);
+}
+
+// 接続から要求を1つ読んで処理する(接続ごとのスレッド)
+static void handleConnection(RenderService *service, int fd)
+{
+    ServiceRequest request;
+    setReceiveTimeout(fd, SERVICE_RECEIVE_TIMEOUT);
+    if (readFull(fd, &request, sizeof(request)) == -1)
+    {
+        close(fd);
+    }
+    else
+    {
+        request.sceneFile[SERVICE_PATH_LENGTH - 1] = '\0';
+        request.output[SERVICE_PATH_LENGTH - 1] = '\0';
+        dispatchRequest(service, fd, request);
+    }
+
+    std::lock_guard<std::mutex> lock(service->mutex);
+    service->connections--;
+    service->cond.notify_all();
+}
+
+int runRenderService(const char *address, unsigned int workerNum)
+{
+    int listenFd = listenAddress(address);
+    if (listenFd == -1)
+        return -1;
+
+    RenderService service;
+    if (workerNum == 0)
+        workerNum = 1;
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < workerNum; i++)
+        workers.emplace_back(serviceWorker, &service);
+    printf("%sで待ち受けています(描画スレッド%u)\n", address, workerNum);
+
+    while (!service.shutdownRequested.load())
+    {
+        struct pollfd pfd = {listenFd, POLLIN, 0};
+        if (poll(&pfd, 1, SERVICE_ACCEPT_POLL_MS) <= 0)
+            continue;
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd == -1)
+            continue;
+
+        // 要求の受信は別のスレッドで行い，止まったクライアントで待ち受けを止めない
+        {
+            std::lock_guard<std::mutex> lock(service.mutex);
+            service.connections++;
+        }
+        std::thread(handleConnection, &service, fd).detach();
+    }
+
+    // 受信中の接続が終わるのを待つ(その間に受け付けたジョブも描画する)
+    {
+        std::unique_lock<std::mutex> lock(service.mutex);
+        while (service.connections > 0)
+            service.cond.wait(lock);
+    }
+
+    // 受け付けたジョブを描き終えてから終了する
+    {
+        std::lock_guard<std::mutex> lock(service.mutex);
+        service.stopping = true;
+        service.cond.notify_all();
+    }
+    for (auto &t : workers)
+        t.join();
+    close(listenFd);
+    if (strncmp(address, "unix:", 5) == 0)
+        unlink(address + 5);
+
+    for (auto cached : service.cache)
+        freeCachedScene(cached);
+    return 0;
+}
+
+// 要求を送る(接続したfdを返す)
+static int sendRequest(const char *address, const ServiceRequest &request)
+{
+    int fd = connectAddress(address);
+    if (fd == -1)
+    {
+        printf("%sに接続できません\n", address);
+        return -1;
+    }
+    if (writeFull(fd, &request, sizeof(request)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int requestRender(const char *address, const ServiceRequest &request, ServiceJobResult *result)
+{
+    ServiceRequest message = request;
+    message.type = SERVICE_RENDER;
+    int fd = sendRequest(address, message);
+    if (fd == -1)
+        return -1;
+    int status = readFull(fd, result, sizeof(*result));
+    close(fd);
+    return status == -1 ? -1 : result->result;
+}
+
+int requestServiceStats(const char *address, ServiceStats *stats)
+{
+    ServiceRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = SERVICE_STATS;
+    int fd = sendRequest(address, request);
+    if (fd == -1)
+        return -1;
+    int status = readFull(fd, stats, sizeof(*stats));
+    close(fd);
+    return status;
+}
+
+int requestServiceShutdown(const char *address)
+{
+    ServiceRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = SERVICE_SHUTDOWN;
+    int fd = sendRequest(address, request);
+    if (fd == -1)
+        return -1;
+    uint32_t ack;
+    int status = readFull(fd, &ack, sizeof(ack));
+    close(fd);
+    return status;
+}
@@ -0,0 +1,70 @@
+/* 常駐レンダリングサービス(優先度付きジョブキューとシーンのキャッシュ) */
+#pragma once
+#include <stdint.h>
+#include "sceneFile.hpp"
+
+#define SERVICE_TILE_SIZE 32
+#define SERVICE_SCENE_CACHE_SIZE 4  // 使っていないシーンをキャッシュしておく数
+#define SERVICE_PATH_LENGTH 256
+#define SERVICE_RECEIVE_TIMEOUT 30.0 // 要求の受信を待つ時間
+
+// 要求の種類
+enum SERVICE_REQUEST_TYPE
+{
+    SERVICE_RENDER = 1, // 描画して結果が出たらServiceJobResultを返す
+    SERVICE_STATS,      // ServiceStatsを返す
+    SERVICE_SHUTDOWN,   // 受け付けたジョブを描画し終えたら終了する
+};
+
+// クライアント -> サービスの要求
+struct ServiceRequest
+{
+    uint32_t type;           // SERVICE_REQUEST_TYPE
+    int32_t priority;        // 大きいほど先に描画する(同じなら受け付けた順)
+    uint32_t samplingNum;    // 0ならシーンファイルの値
+    uint32_t overrideCamera; // 1ならcameraで視点を置き換える
+    float camera[3];
+    char sceneFile[SERVICE_PATH_LENGTH]; // シーンファイル(サービスから見たパス)
+    char output[SERVICE_PATH_LENGTH];    // 出力PNG
+};
+
+// サービス -> クライアント: 描画の結果
+struct ServiceJobResult
+{
+    int32_t result;         // 0なら成功，-1なら失敗
+    uint32_t jobId;
+    uint32_t sceneCacheHit; // シーンをキャッシュから使ったか
+    double queueSeconds;    // 受け付けてから準備を始めるまで
+    double setupSeconds;    // シーンの読み込み・準備
+    double renderSeconds;   // 描画とPNGの書き込み
+};
+
+// サービスの統計
+struct ServiceStats
+{
+    uint32_t queueDepth;        // 待ち・描画中のジョブ数
+    uint32_t activeJobs;        // そのうち準備・描画中のジョブ数
+    uint32_t cachedScenes;      // キャッシュ中のシーン数
+    uint64_t completedJobs;     // 成功したジョブ数
+    uint64_t failedJobs;        // 失敗したジョブ数
+    uint64_t sceneCacheHits;    // シーンをキャッシュから使った回数
+    uint64_t sceneCacheMisses;  // シーンを読み込んだ回数
+    double meanQueueSeconds;    // 受け付けてから準備を始めるまでの平均
+    double meanLatencySeconds;  // 受け付けてから結果を返すまでの平均
+    double maxLatencySeconds;   // 受け付けてから結果を返すまでの最大
+};
+
+// サービスを起動し，SERVICE_SHUTDOWNを受け取るまで要求を処理する
+// 描画はworkerNum個のスレッドで，優先度の高いジョブのタイルから行う
+// 読み込んだシーン(コンパイル済みのシーン・光源の木を含む)はファイルの更新時刻が
+// 変わるまで使い回し，使っていないものはSERVICE_SCENE_CACHE_SIZE個までLRUで残す
+int runRenderService(const char *address, unsigned int workerNum);
+
+// クライアント: 描画を依頼して結果を待つ
+int requestRender(const char *address, const ServiceRequest &request, ServiceJobResult *result);
+
+// クライアント: 統計を問い合わせる
+int requestServiceStats(const char *address, ServiceStats *stats);
+
+// クライアント: サービスを終了させる
+int requestServiceShutdown(const char *address);
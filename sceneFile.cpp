@@ -0,0 +1,279 @@
+#include <algorithm>
+#include <thread>
+#include "sceneFile.hpp"
+
+// テクスチャキャッシュの上限
+#define SCENE_TEXTURE_CACHE_BYTES (64 * 1024 * 1024)
+
+int loadSceneFile(SceneFile *sceneFile, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    // 既定値
+    sceneFile->bitmap = BitMapData(512, 512, 3);
+    sceneFile->camera.position = Vector3(0, 0, -5);
+    sceneFile->scene.samplingNum = 1;
+    sceneFile->scene.backgroundColor = FColor(0, 0, 0);
+    sceneFile->scene.ambientIntensity = FColor(0.1f, 0.1f, 0.1f);
+    sceneFile->hash = 0xcbf29ce484222325ULL;
+
+    bool useCompiledScene = true;
+
+    char line[1024];
+    int lineNum = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != nullptr)
+    {
+        lineNum++;
+
+        // FNV-1aでファイル内容のハッシュを求める
+        for (char *c = line; *c != '\0'; c++)
+            sceneFile->hash = (sceneFile->hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+
+        char *comment = strchr(line, '#');
+        if (comment != nullptr)
+            *comment = '\0';
+
+        char command[64];
+        int offset = 0;
+        if (sscanf(line, "%63s%n", command, &offset) != 1)
+            continue; // 空行
+        const char *args = line + offset;
+
+        float a, b, c, d, e, f;
+        unsigned int w, h;
+        char path[512];
+        Shape *last = sceneFile->geometry.empty() ? nullptr : sceneFile->geometry.back();
+        bool needShape = false;
+
+        if (strcmp(command, "size") == 0 && sscanf(args, "%u %u", &w, &h) == 2)
+            sceneFile->bitmap = BitMapData(w, h, 3);
+        else if (strcmp(command, "sampling") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.samplingNum = w;
+        else if (strcmp(command, "camera") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+            sceneFile->camera.position = Vector3(a, b, c);
+        else if (strcmp(command, "look_at") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+        {
+            sceneFile->camera.type = CAMERA_PINHOLE;
+            sceneFile->camera.target = Vector3(a, b, c);
+        }
+        else if (strcmp(command, "camera_up") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+            sceneFile->camera.up = Vector3(a, b, c);
+        else if (strcmp(command, "fov") == 0 && sscanf(args, "%f", &a) == 1)
+            sceneFile->camera.fov = a;
+        else if (strcmp(command, "background") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+            sceneFile->scene.backgroundColor = FColor(a, b, c);
+        else if (strcmp(command, "ambient_light") == 0 &&
+                 sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+            sceneFile->scene.ambientIntensity = FColor(a, b, c);
+        else if (strcmp(command, "refraction_index") == 0 && sscanf(args, "%f", &a) == 1)
+            sceneFile->scene.globalRefractionIndex = a;
+        else if (strcmp(command, "sorted_shading") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.sortedShading = w != 0;
+        else if (strcmp(command, "defer_secondary_rays") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.deferSecondaryRays = w != 0;
+        else if (strcmp(command, "rasterize_primary") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.rasterizePrimary = w != 0;
+        else if (strcmp(command, "clamp_luminance") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.clampLuminance = w != 0;
+        else if (strcmp(command, "compile_scene") == 0 && sscanf(args, "%u", &w) == 1)
+            useCompiledScene = w != 0;
+        else if (strcmp(command, "max_recursive_level") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->scene.maxRecursiveLevel = w;
+        else if (strcmp(command, "contribution_cutoff") == 0 && sscanf(args, "%f", &a) == 1)
+            sceneFile->scene.contributionCutoff = a;
+        else if (strcmp(command, "russian_roulette") == 0 && sscanf(args, "%u %f", &w, &a) == 2)
+        {
+            sceneFile->scene.russianRouletteLevel = w;
+            sceneFile->scene.russianRouletteThreshold = a;
+        }
+        else if (strcmp(command, "light_sampling") == 0 && sscanf(args, "%u %u", &w, &h) == 2)
+        {
+            sceneFile->scene.lightSampleNum = w;
+            sceneFile->scene.exhaustiveLightNum = h;
+        }
+        else if (strcmp(command, "denoise") == 0 && sscanf(args, "%u", &w) == 1)
+            sceneFile->denoiseIterations = w;
+        else if (strcmp(command, "light_cache") == 0 && sscanf(args, "%f", &a) == 1)
+        {
+            DirectLightCacheOption *option = &sceneFile->directLightCacheOption;
+            w = option->interpolate ? 1 : 0;
+            b = option->errorBound;
+            sscanf(args, "%f %f %u", &a, &b, &w);
+            option->cellSize = a;
+            option->errorBound = b;
+            option->interpolate = w != 0;
+            sceneFile->useDirectLightCache = true;
+        }
+        else if (strcmp(command, "uniform_grid") == 0 && sscanf(args, "%u", &w) == 1)
+        {
+            a = sceneFile->uniformGridOption.cellsPerSphere;
+            sscanf(args, "%u %f", &w, &a);
+            sceneFile->useUniformGrid = w != 0;
+            sceneFile->uniformGridOption.cellsPerSphere = a;
+        }
+        else if (strcmp(command, "sphere") == 0 &&
+                 sscanf(args, "%f %f %f %f", &a, &b, &c, &d) == 4)
+            sceneFile->geometry.push_back(new Sphere(Vector3(a, b, c), d));
+        else if (strcmp(command, "plane") == 0 &&
+                 sscanf(args, "%f %f %f %f %f %f", &a, &b, &c, &d, &e, &f) == 6)
+            sceneFile->geometry.push_back(new Plane(Vector3(a, b, c), Vector3(d, e, f)));
+        else if (strcmp(command, "pointlight") == 0 &&
+                 sscanf(args, "%f %f %f %f %f %f", &a, &b, &c, &d, &e, &f) == 6)
+            sceneFile->lights.push_back(new PointLight(Vector3(a, b, c), FColor(d, e, f)));
+        else if (strcmp(command, "directionallight") == 0 &&
+                 sscanf(args, "%f %f %f %f %f %f", &a, &b, &c, &d, &e, &f) == 6)
+            sceneFile->lights.push_back(new DirectionalLight(Vector3(a, b, c), FColor(d, e, f)));
+        // マテリアル
+        else if (strcmp(command, "ambient") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+        {
+            if (!(needShape = last == nullptr))
+                last->material.ambient = FColor(a, b, c);
+        }
+        else if (strcmp(command, "diffuse") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+        {
+            if (!(needShape = last == nullptr))
+                last->material.diffuse = FColor(a, b, c);
+        }
+        else if (strcmp(command, "specular") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+        {
+            if (!(needShape = last == nullptr))
+                last->material.specular = FColor(a, b, c);
+        }
+        else if (strcmp(command, "shininess") == 0 && sscanf(args, "%f", &a) == 1)
+        {
+            if (!(needShape = last == nullptr))
+                last->material.shininess = a;
+        }
+        else if (strcmp(command, "reflection") == 0 && sscanf(args, "%f %f %f", &a, &b, &c) == 3)
+        {
+            if (!(needShape = last == nullptr))
+            {
+                last->material.useReflection = true;
+                last->material.reflection = FColor(a, b, c);
+            }
+        }
+        else if (strcmp(command, "refraction") == 0 && sscanf(args, "%f", &a) == 1)
+        {
+            if (!(needShape = last == nullptr))
+            {
+                last->material.useRefraction = true;
+                last->material.refractionIndex = a;
+            }
+        }
+        else if (strcmp(command, "texture") == 0 && sscanf(args, "%511s %f", path, &a) == 2)
+        {
+            if (!(needShape = last == nullptr))
+            {
+                if (sceneFile->textureCache == nullptr)
+                    sceneFile->textureCache = createTextureCache(SCENE_TEXTURE_CACHE_BYTES);
+                Texture *texture = loadTexture(sceneFile->textureCache, path);
+                if (texture == nullptr)
+                    result = -1;
+                else
+                {
+                    sceneFile->textures.push_back(texture);
+                    last->material.diffuseTexture = texture;
+                    last->material.textureScale = a;
+                }
+            }
+        }
+        else
+        {
+            printf("%s:%d: 命令を解釈できません: %s\n", filename, lineNum, command);
+            result = -1;
+        }
+
+        if (needShape)
+        {
+            printf("%s:%d: マテリアルを設定するジオメトリがありません\n", filename, lineNum);
+            result = -1;
+        }
+    }
+    fclose(file);
+
+    if (result == -1)
+    {
+        freeSceneFile(sceneFile);
+        return -1;
+    }
+
+    // シーン作成
+    Scene *scene = &sceneFile->scene;
+    scene->bitmap = &sceneFile->bitmap;
+    scene->camera = &sceneFile->camera;
+    scene->geometry = sceneFile->geometry.data();
+    scene->geometryNum = (int)sceneFile->geometry.size();
+    scene->light = sceneFile->lights.data();
+    scene->lightNum = (int)sceneFile->lights.size();
+    scene->lightTree = buildLightTree(scene->light, scene->lightNum);
+    if (scene->deferSecondaryRays && scene->clampLuminance)
+    {
+        // 子レイの輝度を親でクランプできず結果が変わるので遅延させない
+        printf("%s: defer_secondary_rays はclamp_luminance 0の場合だけ使えます(遅延させずに追跡します)\n",
+               filename);
+        scene->deferSecondaryRays = false;
+    }
+    if (useCompiledScene)
+    {
+        scene->compiledScene = compileScene(scene);
+        if (sceneFile->useUniformGrid)
+        {
+            UniformGridOption option = sceneFile->uniformGridOption;
+            option.workerNum = std::max(1u, std::thread::hardware_concurrency());
+            scene->compiledScene->grid = buildUniformGrid(scene->compiledScene, option);
+        }
+    }
+    if (sceneFile->useDirectLightCache)
+    {
+        scene->directLightCache = createDirectLightCache(sceneFile->directLightCacheOption);
+        if (scene->directLightCache == nullptr)
+        {
+            freeSceneFile(sceneFile);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void freeSceneFile(SceneFile *sceneFile)
+{
+    for (auto o : sceneFile->geometry)
+    {
+        delete o;
+    }
+    for (auto l : sceneFile->lights)
+    {
+        delete l;
+    }
+    for (auto t : sceneFile->textures)
+    {
+        freeTexture(t);
+    }
+    if (sceneFile->textureCache != nullptr)
+        destroyTextureCache(sceneFile->textureCache);
+    if (sceneFile->scene.lightTree != nullptr)
+        freeLightTree(sceneFile->scene.lightTree);
+    if (sceneFile->scene.compiledScene != nullptr)
+        freeCompiledScene(sceneFile->scene.compiledScene);
+    if (sceneFile->scene.directLightCache != nullptr)
+        freeDirectLightCache(sceneFile->scene.directLightCache);
+
+    sceneFile->geometry.clear();
+    sceneFile->lights.clear();
+    sceneFile->textures.clear();
+    sceneFile->textureCache = nullptr;
+    sceneFile->scene.geometry = nullptr;
+    sceneFile->scene.geometryNum = 0;
+    sceneFile->scene.light = nullptr;
+    sceneFile->scene.lightNum = 0;
+    sceneFile->scene.lightTree = nullptr;
+    sceneFile->scene.compiledScene = nullptr;
+    sceneFile->scene.directLightCache = nullptr;
+}
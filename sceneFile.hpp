@@ -0,0 +1,68 @@
+/* シーンファイルの読み込み */
+#pragma once
+#include <vector>
+#include "raytracing_lib.hpp"
+#include "lightCache.hpp"
+#include "lightTree.hpp"
+#include "sortedShading.hpp"
+#include "uniformGrid.hpp"
+
+/*
+    シーンファイルの書式(1行1命令，#以降はコメント)
+        size 幅 高さ
+        sampling サンプリング数
+        camera x y z
+        look_at x y z                  注視点(指定するとピンホールカメラになる)
+        camera_up x y z                ピンホールカメラの上方向(既定は0 1 0)
+        fov 角度                       ピンホールカメラの縦の画角[度](既定は45)
+        background r g b
+        ambient_light r g b            環境光の強さ
+        refraction_index n             大気中の屈折率
+        compile_scene 0/1              型ごとに展開した描画経路を使うか(既定は1)
+        sorted_shading 0/1             交点をマテリアルごとにまとめてシェーディングするか
+        defer_secondary_rays 0/1       sorted_shadingで反射・屈折レイを並べ替えてから追跡するか
+        rasterize_primary 0/1          sorted_shadingで1次レイの交点をラスタライズで求めるか
+        clamp_luminance 0/1            反射のたびに輝度をクランプするか(0でHDR)
+        max_recursive_level 回数       反射・屈折の再帰回数の上限
+        contribution_cutoff 値         寄与がこれ未満のレイは追跡しない
+        russian_roulette 回数 閾値     ロシアンルーレットを始める再帰回数と寄与の閾値
+        light_sampling 選ぶ数 閾値     1交点で選ぶ点光源の数と，全光源を評価する点光源数の上限
+        denoise 段数                   描画後にノイズ除去をかける(0ならかけない)
+        light_cache セル [誤差 [補間0/1]] 拡散面の直接光をセルの大きさの格子にキャッシュする
+        uniform_grid 0/1 [セル数/球]   展開したシーンの球を一様格子で探すか(既定は0)
+        sphere x y z 半径
+        plane 法線x y z 通る点x y z
+        pointlight x y z r g b
+        directionallight 方向x y z r g b
+    以下は直前のジオメトリのマテリアルを設定する
+        ambient r g b
+        diffuse r g b
+        specular r g b
+        shininess 値
+        reflection r g b               完全鏡面反射を使う
+        refraction 屈折率              屈折を使う
+        texture PNGファイル 大きさ
+*/
+
+// シーンファイルから読み込んだシーン
+// ジオメトリ・光源・カメラ等を所有する
+struct SceneFile
+{
+    Scene scene;
+    Camera camera;
+    BitMapData bitmap;               // 画像サイズ(ピクセルデータは確保しない)
+    std::vector<Shape *> geometry;   // ジオメトリ
+    std::vector<Light *> lights;     // 光源
+    std::vector<Texture *> textures; // テクスチャ
+    TextureCache *textureCache = nullptr;
+    unsigned long long hash;         // ファイル内容のハッシュ(同じシーンかの確認用)
+    unsigned int denoiseIterations = 0; // ノイズ除去の段数(0ならかけない)
+    bool useDirectLightCache = false;   // 直接光キャッシュを作るか
+    DirectLightCacheOption directLightCacheOption;
+    bool useUniformGrid = false;        // 球の一様格子を作るか(compile_sceneが1の場合だけ)
+    UniformGridOption uniformGridOption;
+};
+
+// 読み込みに失敗したら-1を返す
+int loadSceneFile(SceneFile *sceneFile, const char *filename);
+void freeSceneFile(SceneFile *sceneFile);
@@ -0,0 +1,244 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "compiledScene.hpp"
+#include "sequence.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// 1フレーム分のバッファ
+struct SequenceFrame
+{
+    unsigned int frame;
+    Camera camera;
+    Scene scene;           // cameraと(あれば)compiledを指すコピー
+    CompiledScene compiled;
+    FloatBitMapData hdr;
+    BitMapData ldr;
+    std::vector<unsigned char> png;
+    bool encoded;          // pngにこのフレームをエンコードできたか
+};
+
+// 段の間でバッファを受け渡す列(要素はバッファの番号，-1は終わり)
+// 列に入るのはバッファの数までなので，待つのは取り出す側だけ
+struct SequenceQueue
+{
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<int> items;
+
+    void push(int item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(item);
+        }
+        ready.notify_one();
+    }
+
+    int pop(double *waitSeconds)
+    {
+        auto start = Clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&]() { return !items.empty(); });
+        int item = items.front();
+        items.pop_front();
+        *waitSeconds += secondsSince(start);
+        return item;
+    }
+};
+
+const char *sequenceStageName(int stage)
+{
+    static const char *names[SEQUENCE_STAGE_NUM] = {
+        "更新", "描画", "トーンマッピング", "エンコード", "書き込み"};
+    return (stage >= 0 && stage < SEQUENCE_STAGE_NUM) ? names[stage] : "?";
+}
+
+// フレームをworkerNum個のスレッドでタイルに分けて描画する
+static unsigned long long renderSequenceFrame(SequenceFrame *frame, unsigned int workerNum)
+{
+    unsigned int width = frame->hdr.width;
+    unsigned int height = frame->hdr.height;
+    unsigned int tileCountX = (width + SEQUENCE_TILE_SIZE - 1) / SEQUENCE_TILE_SIZE;
+    unsigned int tileCountY = (height + SEQUENCE_TILE_SIZE - 1) / SEQUENCE_TILE_SIZE;
+    unsigned int tileNum = tileCountX * tileCountY;
+    std::atomic<unsigned int> nextTile(0);
+    std::atomic<unsigned long long> totalRayCount(0);
+
+    auto worker = [&]()
+    {
+        rayCount = 0;
+        unsigned int idx;
+        while ((idx = nextTile.fetch_add(1)) < tileNum)
+        {
+            unsigned int x = (idx % tileCountX) * SEQUENCE_TILE_SIZE;
+            unsigned int y = (idx / tileCountX) * SEQUENCE_TILE_SIZE;
+            unsigned int w = (x + SEQUENCE_TILE_SIZE > width) ? width - x : SEQUENCE_TILE_SIZE;
+            unsigned int h = (y + SEQUENCE_TILE_SIZE > height) ? height - y : SEQUENCE_TILE_SIZE;
+            renderTile(&frame->scene, x, y, w, h, frame->hdr.getPixel(x, y), (size_t)width * 3);
+        }
+        totalRayCount += rayCount;
+    };
+
+    // 描画の段のスレッドも1つのワーカーとして働く
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < workerNum; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+    return totalRayCount.load();
+}
+
+int renderSequence(
+    Scene *scene, unsigned int frameNum, SequenceUpdate update, void *userData,
+    const SequenceOption &option, SequenceStats *stats)
+{
+    unsigned int width = scene->bitmap->width;
+    unsigned int height = scene->bitmap->height;
+    unsigned int bufferNum = (option.bufferNum == 0) ? 1 : option.bufferNum;
+    unsigned int workerNum = (option.workerNum == 0) ? 1 : option.workerNum;
+
+    std::vector<SequenceFrame *> frames;
+    int result = 0;
+    for (unsigned int i = 0; i < bufferNum; i++)
+    {
+        SequenceFrame *frame = new SequenceFrame();
+        frame->hdr = FloatBitMapData(width, height);
+        frame->ldr = BitMapData(width, height, 3);
+        frames.push_back(frame);
+        if (frame->hdr.allocation() == -1 || frame->ldr.allocation() == -1)
+            result = -1;
+    }
+
+    // queues[s]は段sが取り出す列(更新の段は空きバッファの列)
+    SequenceQueue queues[SEQUENCE_STAGE_NUM];
+    double busy[SEQUENCE_STAGE_NUM] = {};
+    double wait[SEQUENCE_STAGE_NUM] = {};
+    std::atomic<unsigned long long> totalRays(0);
+    std::atomic<unsigned int> written(0);
+    std::atomic<bool> failed(false);
+    if (result == -1)
+        frameNum = 0;
+    for (unsigned int i = 0; i < bufferNum; i++)
+        queues[SEQUENCE_UPDATE].push(i);
+
+    auto start = Clock::now();
+
+    // 描画以降の段sのスレッド: 列から取り出したバッファを処理して次の段に渡す
+    // 終わり(-1)を受け取ったら次の段にも伝える
+    auto runStage = [&](int s)
+    {
+        for (;;)
+        {
+            int idx = queues[s].pop(&wait[s]);
+            if (idx == -1)
+                break;
+            SequenceFrame *frame = frames[idx];
+            auto stageStart = Clock::now();
+            switch (s)
+            {
+            case SEQUENCE_RENDER:
+                totalRays += renderSequenceFrame(frame, workerNum);
+                break;
+            case SEQUENCE_TONE_MAP:
+                toneMapping(&frame->hdr, &frame->ldr);
+                break;
+            case SEQUENCE_ENCODE:
+                frame->encoded = pngEncodeMemory(&frame->ldr, &frame->png) == 0;
+                if (!frame->encoded)
+                {
+                    printf("フレーム%uをPNGにエンコードできません\n", frame->frame);
+                    failed = true;
+                }
+                break;
+            case SEQUENCE_WRITE:
+            {
+                // エンコードに失敗したフレームは書き込まない
+                if (!frame->encoded)
+                    break;
+                char filename[512];
+                snprintf(filename, sizeof(filename), "%s_%03u.png", option.prefix, frame->frame);
+                FILE *file = fopen(filename, "wb");
+                if (file == nullptr ||
+                    fwrite(frame->png.data(), 1, frame->png.size(), file) != frame->png.size())
+                {
+                    printf("%sに書き込めません\n", filename);
+                    failed = true;
+                }
+                else
+                {
+                    written++;
+                }
+                if (file != nullptr)
+                    fclose(file);
+                break;
+            }
+            }
+            busy[s] += secondsSince(stageStart);
+            // 書き込みが終わったバッファは更新の段に戻す
+            queues[(s + 1) % SEQUENCE_STAGE_NUM].push(idx);
+        }
+        if (s + 1 < SEQUENCE_STAGE_NUM)
+            queues[s + 1].push(-1);
+    };
+
+    // 更新の段: 空きバッファを待ってフレームのシーンを用意し，全フレームを送り出したら終わりを伝える
+    auto runUpdate = [&]()
+    {
+        for (unsigned int f = 0; f < frameNum; f++)
+        {
+            int idx = queues[SEQUENCE_UPDATE].pop(&wait[SEQUENCE_UPDATE]);
+            SequenceFrame *frame = frames[idx];
+            auto stageStart = Clock::now();
+            frame->frame = f;
+            frame->camera = *scene->camera;
+            frame->scene = *scene;
+            frame->scene.camera = &frame->camera;
+            copyCompiledScene(&frame->scene, &frame->compiled);
+            if (update != nullptr)
+                update(&frame->scene, f, userData);
+            busy[SEQUENCE_UPDATE] += secondsSince(stageStart);
+            queues[SEQUENCE_RENDER].push(idx);
+        }
+        queues[SEQUENCE_RENDER].push(-1);
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(runUpdate);
+    for (int s = SEQUENCE_RENDER; s < SEQUENCE_STAGE_NUM; s++)
+        threads.emplace_back(runStage, s);
+    for (auto &t : threads)
+        t.join();
+    double seconds = secondsSince(start);
+
+    if (stats != nullptr)
+    {
+        stats->frames = written;
+        stats->rays = totalRays;
+        stats->seconds = seconds;
+        for (int s = 0; s < SEQUENCE_STAGE_NUM; s++)
+        {
+            stats->stages[s].busySeconds = busy[s];
+            stats->stages[s].waitSeconds = wait[s];
+            stats->stages[s].utilization = seconds > 0.0 ? busy[s] / seconds : 0.0;
+        }
+    }
+
+    for (SequenceFrame *frame : frames)
+    {
+        freeFloatBitmapData(&frame->hdr);
+        freeBitmapData(&frame->ldr);
+        delete frame;
+    }
+    return (result == -1 || failed) ? -1 : 0;
+}
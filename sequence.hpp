@@ -0,0 +1,56 @@
+/* 連番画像のパイプライン描画(シーンの更新→描画→トーンマッピング→エンコード→書き込み) */
+#pragma once
+#include "raytracing_lib.hpp"
+
+#define SEQUENCE_TILE_SIZE 32
+
+// パイプラインの段
+enum SEQUENCE_STAGE
+{
+    SEQUENCE_UPDATE,   // シーンの更新
+    SEQUENCE_RENDER,   // 描画
+    SEQUENCE_TONE_MAP, // トーンマッピング
+    SEQUENCE_ENCODE,   // PNGのエンコード(メモリ上)
+    SEQUENCE_WRITE,    // ファイルへの書き込み
+    SEQUENCE_STAGE_NUM,
+};
+
+// frame番目のフレームのシーンを設定する(SEQUENCE_UPDATEのスレッドから呼ばれる)
+// sceneはフレームごとのコピーで，cameraと描画設定は書き換えてよい
+// ジオメトリ・光源は他のフレームの描画と共有しているので書き換えないこと
+typedef void (*SequenceUpdate)(Scene *scene, unsigned int frame, void *userData);
+
+struct SequenceOption
+{
+    unsigned int workerNum = 1; // 描画のスレッド数
+    unsigned int bufferNum = 2; // 同時に処理するフレーム数(1ならパイプラインなしと同じ順序になる)
+    const char *prefix = "raytracing_sequence"; // 出力は"接頭辞_フレーム番号.png"
+};
+
+// 段ごとの統計
+struct SequenceStageStats
+{
+    double busySeconds;  // 処理していた時間
+    double waitSeconds;  // 前の段(更新は空きバッファ)を待っていた時間
+    double utilization;  // 処理していた時間 / 全体の時間
+};
+
+struct SequenceStats
+{
+    unsigned int frames;      // 書き込んだフレーム数
+    unsigned long long rays;  // 追跡したレイの数
+    double seconds;           // 全体の時間
+    SequenceStageStats stages[SEQUENCE_STAGE_NUM];
+};
+
+// frameNum枚のフレームを描画してPNGに書き込む
+// 段ごとに1つのスレッド(描画はworkerNum個)で動かし，フレームのバッファ(HDR・8bit・PNGのバイト列)を
+// bufferNum組だけ使い回す．空きバッファがなければ更新の段が待つので，
+// 書き込みが遅くてもメモリは増えない
+// 書き込みに失敗したフレームがあれば-1を返す
+int renderSequence(
+    Scene *scene, unsigned int frameNum, SequenceUpdate update, void *userData,
+    const SequenceOption &option, SequenceStats *stats);
+
+// 段の名前
+const char *sequenceStageName(int stage);
@@ -0,0 +1,198 @@
+#include "socketUtil.hpp"
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// "tcp:ホスト:ポート" をホストとポートに分ける
+static int splitHostPort(const char *address, char *host, size_t hostSize, const char **port)
+{
+    const char *colon = strrchr(address, ':');
+    if (colon == nullptr || (size_t)(colon - address) >= hostSize)
+    {
+        printf("アドレス%sを解釈できません\n", address);
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    *port = colon + 1;
+    return 0;
+}
+
+static int unixAddress(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        printf("ソケットのパス%sが長すぎます\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// TCPのアドレスに対してsocket + bind/connectを試す
+static int tcpSocket(const char *address, bool isListen)
+{
+    char host[256];
+    const char *port;
+    if (splitHostPort(address, host, sizeof(host), &port) == -1)
+        return -1;
+
+    struct addrinfo hints;
+    struct addrinfo *list;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = isListen ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] != '\0' ? host : nullptr, port, &hints, &list) != 0)
+    {
+        printf("%sの名前解決に失敗しました\n", address);
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = list; ai != nullptr; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (isListen)
+        {
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+                break;
+        }
+        else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+int listenAddress(const char *address)
+{
+    if (strncmp(address, "tcp:", 4) == 0)
+    {
+        int fd = tcpSocket(address + 4, true);
+        if (fd == -1)
+            printf("%sで待ち受けできません\n", address);
+        return fd;
+    }
+    if (strncmp(address, "unix:", 5) != 0)
+    {
+        printf("アドレス%sを解釈できません\n", address);
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    if (unixAddress(address + 5, &addr) == -1)
+        return -1;
+    // 前回のソケットファイルが残っていたら消す
+    unlink(addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 64) == -1)
+    {
+        printf("%sで待ち受けできません: %s\n", address, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connectAddress(const char *address)
+{
+    if (strncmp(address, "tcp:", 4) == 0)
+        return tcpSocket(address + 4, false);
+    if (strncmp(address, "unix:", 5) != 0)
+    {
+        printf("アドレス%sを解釈できません\n", address);
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    if (unixAddress(address + 5, &addr) == -1)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int readFull(int fd, void *buffer, size_t size)
+{
+    char *p = (char *)buffer;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int readAvailable(int fd, std::vector<char> *buffer)
+{
+    char chunk[16 * 1024];
+    while (true)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        buffer->insert(buffer->end(), chunk, chunk + n);
+        if ((size_t)n < sizeof(chunk))
+            return 0;
+    }
+}
+
+int writeFull(int fd, const void *buffer, size_t size)
+{
+    const char *p = (const char *)buffer;
+    while (size > 0)
+    {
+        // 相手が切断していてもSIGPIPEで終了しないようにする
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+void setReceiveTimeout(int fd, double seconds)
+{
+    struct timeval tv;
+    tv.tv_sec = (time_t)seconds;
+    tv.tv_usec = (suseconds_t)((seconds - (double)tv.tv_sec) * 1e6);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
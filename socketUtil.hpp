@@ -0,0 +1,24 @@
+/* ソケット通信の補助関数 */
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// アドレスは "unix:パス" または "tcp:ホスト:ポート" で指定する
+
+// 待ち受けソケットを作る(失敗したら-1)
+int listenAddress(const char *address);
+
+// 接続する(失敗したら-1)
+int connectAddress(const char *address);
+
+// sizeバイト全て読み込む(切断・エラーなら-1)
+int readFull(int fd, void *buffer, size_t size);
+
+// 今読めるだけ読み込んでbufferの後ろに足す(待たない．切断・エラーなら-1)
+int readAvailable(int fd, std::vector<char> *buffer);
+
+// sizeバイト全て書き込む(切断・エラーなら-1)
+int writeFull(int fd, const void *buffer, size_t size);
+
+// 受信の制限時間を設定する
+void setReceiveTimeout(int fd, double seconds);
@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <math.h>
+#include "camera.hpp"
+#include "primaryVisibility.hpp"
+#include "sortedShading.hpp"
+
+#define MORTON_BITS 10 // 始点の量子化のビット数(軸ごと)
+
+// シェーディング待ちの交点
+struct HitRecord
+{
+    Ray ray;                 // 1次レイ(samplerは使う直前に設定する)
+    IntersectionPoint point; // 交点
+    Sampler sampler;         // このサンプルの乱数
+    int shapeIndex;          // 交差したジオメトリ
+    unsigned int pixel;      // タイル内のピクセル番号
+};
+
+static thread_local SortedShadingStats sortedShadingStats = {};
+
+SortedShadingStats getSortedShadingStats()
+{
+    return sortedShadingStats;
+}
+
+// 連続する交点でカーネル・ジオメトリが切り替わる回数を数える
+static void countSwitches(
+    CompiledScene *compiled, HitRecord *records, unsigned int *order, size_t count,
+    unsigned long long *kernelSwitches, unsigned long long *materialSwitches)
+{
+    for (size_t i = 1; i < count; i++)
+    {
+        int prev = records[order[i - 1]].shapeIndex;
+        int cur = records[order[i]].shapeIndex;
+        if (compiled->shapes[prev].kernel != compiled->shapes[cur].kernel)
+            (*kernelSwitches)++;
+        if (prev != cur)
+            (*materialSwitches)++;
+    }
+}
+
+// 10bitの値のビットを2つおきに広げる
+static unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// 始点の位置をboundsMin〜boundsMaxで量子化したMortonコード
+static unsigned int mortonCode(Vector3 p, Vector3 boundsMin, Vector3 scale)
+{
+    const float maxCell = (float)((1 << MORTON_BITS) - 1);
+    float fx = std::min(std::max((p.x - boundsMin.x) * scale.x, 0.f), maxCell);
+    float fy = std::min(std::max((p.y - boundsMin.y) * scale.y, 0.f), maxCell);
+    float fz = std::min(std::max((p.z - boundsMin.z) * scale.z, 0.f), maxCell);
+    return (expandBits((unsigned int)fx) << 2) | (expandBits((unsigned int)fy) << 1) |
+           expandBits((unsigned int)fz);
+}
+
+// 連続する2次レイの方向の内積と始点間の距離を足す
+static void measureCoherence(
+    std::vector<DeferredRay> &rays, std::vector<unsigned int> &order,
+    double *directionCoherence, double *originDistance)
+{
+    for (size_t i = 1; i < order.size(); i++)
+    {
+        Ray *prev = &rays[order[i - 1]].ray;
+        Ray *cur = &rays[order[i]].ray;
+        *directionCoherence += prev->direction.dot(cur->direction);
+        Vector3 d = cur->startPoint - prev->startPoint;
+        *originDistance += sqrtf(d.dot(d));
+    }
+}
+
+// 遅延させた2次レイを再帰の深さごとにまとめ，並べ替えてから追跡する
+// 追跡中に生まれた子レイは次の波で追跡する
+static void traceDeferredRays(CompiledScene *compiled, DeferredRayQueue *queue, float *sum)
+{
+    SortedShadingStats *stats = &sortedShadingStats;
+    std::vector<DeferredRay> wave;
+    std::vector<unsigned long long> keys;
+    std::vector<unsigned int> order;
+
+    while (!queue->rays.empty())
+    {
+        wave.clear();
+        wave.swap(queue->rays);
+        size_t count = wave.size();
+        stats->secondaryRays += count;
+        stats->secondaryWaves++;
+
+        // 始点の範囲
+        Vector3 boundsMin = wave[0].ray.startPoint;
+        Vector3 boundsMax = wave[0].ray.startPoint;
+        for (auto &deferred : wave)
+        {
+            Vector3 p = deferred.ray.startPoint;
+            boundsMin = Vector3(
+                std::min(boundsMin.x, p.x), std::min(boundsMin.y, p.y), std::min(boundsMin.z, p.z));
+            boundsMax = Vector3(
+                std::max(boundsMax.x, p.x), std::max(boundsMax.y, p.y), std::max(boundsMax.z, p.z));
+        }
+        const float cells = (float)(1 << MORTON_BITS);
+        Vector3 extent = boundsMax - boundsMin;
+        Vector3 scale(
+            extent.x > 0.f ? cells / extent.x : 0.f, extent.y > 0.f ? cells / extent.y : 0.f,
+            extent.z > 0.f ? cells / extent.z : 0.f);
+
+        // キー = 方向の象限(3bit) + 始点のMortonコード(30bit)
+        keys.resize(count);
+        order.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            Ray *ray = &wave[i].ray;
+            unsigned long long octant = (ray->direction.x < 0.f ? 4 : 0) |
+                                        (ray->direction.y < 0.f ? 2 : 0) |
+                                        (ray->direction.z < 0.f ? 1 : 0);
+            keys[i] = (octant << (3 * MORTON_BITS)) |
+                      mortonCode(ray->startPoint, boundsMin, scale);
+            order[i] = (unsigned int)i;
+        }
+        measureCoherence(
+            wave, order, &stats->directionCoherenceUnsorted, &stats->originDistanceUnsorted);
+        std::sort(
+            order.begin(), order.end(),
+            [&keys](unsigned int a, unsigned int b)
+            { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); });
+        measureCoherence(
+            wave, order, &stats->directionCoherenceSorted, &stats->originDistanceSorted);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            DeferredRay *deferred = &wave[order[i]];
+            queue->currentWeight = deferred->weight;
+            queue->currentPixel = deferred->pixel;
+            if (deferred->ray.sampler != nullptr)
+                deferred->ray.sampler = &deferred->sampler;
+            FColor luminance =
+                traceCompiledScene(compiled, &deferred->ray, deferred->recursiveLevel);
+            float *pixel = sum + deferred->pixel * 3;
+            pixel[0] += deferred->weight.r * luminance.r;
+            pixel[1] += deferred->weight.g * luminance.g;
+            pixel[2] += deferred->weight.b * luminance.b;
+        }
+    }
+}
+
+// たまった交点をカーネル・ジオメトリごとに並べてシェーディングし，sumに足す
+static void flushBatch(
+    CompiledScene *compiled, std::vector<HitRecord> &records, std::vector<unsigned int> &order,
+    std::vector<unsigned int> &binStart, float *sum)
+{
+    size_t count = records.size();
+    if (count == 0)
+        return;
+
+    SortedShadingStats *stats = &sortedShadingStats;
+    stats->batches++;
+    stats->hits += count;
+
+    // 生成順のまま処理した場合の切り替え回数
+    order.resize(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = (unsigned int)i;
+    countSwitches(
+        compiled, records.data(), order.data(), count,
+        &stats->kernelSwitchesUnsorted, &stats->materialSwitchesUnsorted);
+
+    // カーネル→ジオメトリ番号の順のビンに数え上げソートする
+    // ビン内は生成順(タイル内で近いピクセル順)のまま
+    size_t shapeNum = compiled->shapes.size();
+    size_t binNum = 4 * shapeNum;
+    binStart.assign(binNum + 1, 0);
+    for (auto &record : records)
+    {
+        size_t bin = compiled->shapes[record.shapeIndex].kernel * shapeNum + record.shapeIndex;
+        binStart[bin + 1]++;
+    }
+    for (size_t bin = 0; bin < binNum; bin++)
+        binStart[bin + 1] += binStart[bin];
+    for (size_t i = 0; i < count; i++)
+    {
+        HitRecord &record = records[i];
+        size_t bin = compiled->shapes[record.shapeIndex].kernel * shapeNum + record.shapeIndex;
+        order[binStart[bin]++] = (unsigned int)i;
+    }
+    countSwitches(
+        compiled, records.data(), order.data(), count,
+        &stats->kernelSwitchesSorted, &stats->materialSwitchesSorted);
+
+    // 2次レイを遅延させる場合はキューを設定する
+    // 遅延させると子レイの輝度を親でクランプできないので，クランプする場合はすぐに追跡する
+    bool defer = compiled->scene->deferSecondaryRays && !compiled->scene->clampLuminance;
+    DeferredRayQueue queue;
+    if (defer)
+        setDeferredRayQueue(&queue);
+
+    // 同じカーネル・マテリアルの交点を続けてシェーディングする
+    for (size_t i = 0; i < count; i++)
+    {
+        HitRecord &record = records[order[i]];
+        record.ray.sampler = &record.sampler;
+        queue.currentWeight = FColor(1, 1, 1);
+        queue.currentPixel = record.pixel;
+        FColor luminance =
+            compiledShade(compiled, &record.ray, &record.point, record.shapeIndex, 1);
+        float *pixel = sum + record.pixel * 3;
+        pixel[0] += luminance.r;
+        pixel[1] += luminance.g;
+        pixel[2] += luminance.b;
+    }
+
+    if (defer)
+    {
+        traceDeferredRays(compiled, &queue, sum);
+        setDeferredRayQueue(nullptr);
+    }
+    records.clear();
+}
+
+void renderTileSorted(
+    CompiledScene *compiled, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    float *out, size_t stride)
+{
+    Scene *scene = compiled->scene;
+    resetOccluderCache();
+
+    // ピクセルごとの輝度の合計
+    std::vector<float> sum((size_t)w * h * 3, 0.f);
+    std::vector<HitRecord> records;
+    std::vector<unsigned int> order;
+    std::vector<unsigned int> binStart;
+    records.reserve(SORTED_SHADING_BATCH_SIZE);
+
+    // 1次レイの可視性をラスタライズする場合は1行ずつ先に求める
+    std::vector<HitRecord> row;
+    std::vector<Ray> rowRays;
+    std::vector<float> rowU, rowV;
+    VisibilityBuffer visibility;
+    CameraFrame frame =
+        makeCameraFrame(*scene->camera, scene->bitmap->width, scene->bitmap->height);
+    size_t rowSamples = (size_t)w * scene->samplingNum;
+    if (scene->rasterizePrimary)
+    {
+        row.resize(rowSamples);
+        rowRays.resize(rowSamples);
+        rowU.resize(rowSamples);
+        rowV.resize(rowSamples);
+    }
+
+    for (unsigned int j = 0; j < h; j++)
+    {
+        if (scene->rasterizePrimary)
+        {
+            for (unsigned int i = 0; i < w; i++)
+            {
+                for (unsigned int s = 0; s < scene->samplingNum; s++)
+                {
+                    size_t idx = (size_t)i * scene->samplingNum + s;
+                    HitRecord &record = row[idx];
+                    record.sampler = Sampler(pixelSeed(x + i, y + j, s));
+                    rowU[idx] = (float(x + i) + record.sampler.next());
+                    rowV[idx] = (float(y + j) + record.sampler.next());
+                }
+            }
+            generateRays(frame, rowU.data(), rowV.data(), rowSamples, rowRays.data());
+            rasterizePrimaryVisibility(
+                compiled, x, y + j, w, 1, scene->samplingNum, rowRays.data(), rowU.data(),
+                rowV.data(), &visibility);
+        }
+
+        for (unsigned int i = 0; i < w; i++)
+        {
+            unsigned int pixel = j * w + i;
+            for (unsigned int s = 0; s < scene->samplingNum; s++)
+            {
+                HitRecord record;
+                bool hit;
+                if (scene->rasterizePrimary)
+                {
+                    // ラスタライズした交点からシェーディングを始める
+                    size_t idx = (size_t)i * scene->samplingNum + s;
+                    record = row[idx];
+                    record.ray = rowRays[idx];
+                    record.pixel = pixel;
+                    record.shapeIndex = visibility.shapeIndex[idx];
+                    record.point = visibility.points[idx];
+                    hit = record.shapeIndex != -1;
+                }
+                else
+                {
+                    // サンプルごとに独立した乱数
+                    record.sampler = Sampler(pixelSeed(x + i, y + j, s));
+                    float u = (float(x + i) + record.sampler.next());
+                    float v = (float(y + j) + record.sampler.next());
+                    record.ray = cameraFrameRay(frame, u, v);
+                    record.pixel = pixel;
+
+                    // 1次レイの交差判定だけ先に行う
+                    hit = compiledClosestHit(
+                        compiled, &record.ray, &record.point, &record.shapeIndex);
+                }
+
+                rayCount++;
+                if (!hit)
+                {
+                    recordBackgroundDependency();
+                    sum[pixel * 3 + 0] += scene->backgroundColor.r;
+                    sum[pixel * 3 + 1] += scene->backgroundColor.g;
+                    sum[pixel * 3 + 2] += scene->backgroundColor.b;
+                    continue;
+                }
+
+                records.push_back(record);
+                if (records.size() == SORTED_SHADING_BATCH_SIZE)
+                    flushBatch(compiled, records, order, binStart, sum.data());
+            }
+        }
+    }
+    flushBatch(compiled, records, order, binStart, sum.data());
+
+    // サンプリング数で割って書き込む
+    float scale = 1.f / (float)scene->samplingNum;
+    for (unsigned int j = 0; j < h; j++)
+    {
+        float *row = out + j * stride;
+        for (unsigned int i = 0; i < w; i++)
+        {
+            const float *pixel = &sum[((size_t)j * w + i) * 3];
+            row[i * 3 + 0] = pixel[0] * scale;
+            row[i * 3 + 1] = pixel[1] * scale;
+            row[i * 3 + 2] = pixel[2] * scale;
+        }
+    }
+}
@@ -0,0 +1,40 @@
+/* マテリアルごとにまとめてシェーディングする描画段 */
+#pragma once
+#include "compiledScene.hpp"
+
+#define SORTED_SHADING_BATCH_SIZE 4096 // 1度にまとめる交点の数
+
+// マテリアル別シェーディングの統計(スレッドごとの累計)
+// 「切り替え」は連続してシェーディングした交点のカーネル・ジオメトリが前と異なる回数で，
+// 分岐予測の失敗とマテリアルのキャッシュミスの目安にする
+struct SortedShadingStats
+{
+    unsigned long long hits;                     // シェーディングした交点数
+    unsigned long long batches;                  // バッチ数
+    unsigned long long kernelSwitchesUnsorted;   // 並べ替えない場合のカーネルの切り替え
+    unsigned long long kernelSwitchesSorted;     // 並べ替えた後のカーネルの切り替え
+    unsigned long long materialSwitchesUnsorted; // 並べ替えない場合のジオメトリの切り替え
+    unsigned long long materialSwitchesSorted;   // 並べ替えた後のジオメトリの切り替え
+
+    // 2次レイの遅延追跡(Scene::deferSecondaryRays)
+    // 連続して追跡した2次レイの方向の内積と始点間の距離の合計(平均すると一貫性の指標になる)
+    unsigned long long secondaryRays;   // 遅延させた2次レイの数
+    unsigned long long secondaryWaves;  // 再帰の深さごとにまとめて追跡した回数
+    double directionCoherenceUnsorted;  // 生成順での方向の内積の合計
+    double directionCoherenceSorted;    // 並べ替え後の方向の内積の合計
+    double originDistanceUnsorted;      // 生成順での始点間の距離の合計
+    double originDistanceSorted;        // 並べ替え後の始点間の距離の合計
+};
+
+// タイルの1次レイの交点を集め，カーネル・ジオメトリごとに並べ替えてからシェーディングする
+// サンプルごとに乱数の種を決めるのでrenderTileとは乱数列が異なる(描画順には依存しない)
+// scene->deferSecondaryRaysなら反射・屈折レイをバッチ内でため，始点のセルと方向の象限で
+// 並べ替えてから追跡する(結果は同じ)．子レイの輝度を親でクランプできないので
+// scene->clampLuminanceの場合は遅延させない
+// scene->rasterizePrimaryなら1次レイの交点を1行ずつラスタライズで求める(結果は同じ)
+void renderTileSorted(
+    CompiledScene *compiled, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    float *out, size_t stride);
+
+// 現在のスレッドの統計
+SortedShadingStats getSortedShadingStats();
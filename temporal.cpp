@@ -0,0 +1,351 @@
+#include <atomic>
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include <thread>
+#include "compiledScene.hpp"
+#include "temporal.hpp"
+
+// 1次レイの最も近い交点(交点がなければfalse)
+static bool primaryHit(Scene *scene, Ray *ray, int *shapeIndex, Vector3 *position)
+{
+    if (scene->compiledScene != nullptr)
+    {
+        IntersectionPoint point;
+        if (!compiledClosestHit(scene->compiledScene, ray, &point, shapeIndex))
+            return false;
+        *position = point.position;
+        return true;
+    }
+    IntersectionResult *result = intersectionWithAll(scene->geometry, scene->geometryNum, ray);
+    bool hit = result->intersectionPoint != nullptr;
+    if (hit)
+    {
+        *shapeIndex = result->shapeIndex;
+        *position = result->intersectionPoint->position;
+    }
+    delete result;
+    return hit;
+}
+
+// 前フレームの画素座標に投影する(画素(i, j)の中心が(i, j)になるようにずらす)
+// projectToScreenは画素(i, j)の中心を(i+0.5, j+0.5)として返す
+static bool projectToPixel(const CameraFrame &frame, Vector3 p, float *px, float *py)
+{
+    if (!projectToScreen(frame, p, px, py))
+        return false;
+    *px -= 0.5f;
+    *py -= 0.5f;
+    return true;
+}
+
+// 再投影の判定の結果
+enum TEMPORAL_DECISION
+{
+    TEMPORAL_REUSE,
+    TEMPORAL_RENDER_NEW,      // 前フレームがない・背景・描き直す時期
+    TEMPORAL_RENDER_DEPTH,    // 前フレームで見えていなかった
+    TEMPORAL_RENDER_MATERIAL, // 視点によって変わる面
+    TEMPORAL_RENDER_MIXED,    // 前フレームで複数の色が混ざっていた
+};
+
+// 1タイル分の再投影と描画
+struct TemporalTileContext
+{
+    Scene *scene;
+    TemporalHistory *history;
+    FloatBitMapData *out;
+    const TemporalOption *option;
+    CameraFrame frame;         // 今フレームのカメラ
+    CameraFrame previousFrame; // 前フレームのカメラ
+    std::vector<float> *depth;
+    std::vector<int> *shapeId;
+    std::vector<unsigned char> *age;
+    std::atomic<unsigned int> reused, rendered, rejectedDepth, rejectedMaterial, rejectedMixed;
+};
+
+// 2つの画素の輝度が大きく違うか
+static bool contrasting(const float *a, const float *b, float contrast)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        float bright = fmaxf(1.f, fmaxf(a[c], b[c]));
+        if (fabsf(a[c] - b[c]) > contrast * bright)
+            return true;
+    }
+    return false;
+}
+
+// 上下左右の画素と見えている面か輝度が大きく違う画素に印を付ける
+// (画素内のサンプルが輪郭・面の境目・影の輪郭をまたいで色が混ざっている)
+static void markMixedPixels(TemporalHistory *history, float contrast)
+{
+    unsigned int width = history->width;
+    unsigned int height = history->height;
+    history->mixed.assign((size_t)width * height, 0);
+    for (unsigned int y = 0; y < height; y++)
+    {
+        for (unsigned int x = 0; x < width; x++)
+        {
+            size_t pixel = (size_t)y * width + x;
+            // 右と下の画素と比べて両方に印を付ける
+            size_t neighbors[2];
+            int neighborNum = 0;
+            if (x + 1 < width)
+                neighbors[neighborNum++] = pixel + 1;
+            if (y + 1 < height)
+                neighbors[neighborNum++] = pixel + width;
+            for (int k = 0; k < neighborNum; k++)
+            {
+                size_t neighbor = neighbors[k];
+                if (history->shapeId[pixel] != history->shapeId[neighbor] ||
+                    contrasting(&history->radiance[pixel * 3], &history->radiance[neighbor * 3],
+                                contrast))
+                {
+                    history->mixed[pixel] = 1;
+                    history->mixed[neighbor] = 1;
+                }
+            }
+        }
+    }
+}
+
+static void renderTemporalTile(
+    TemporalTileContext *context, unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+    std::vector<Ray> *rays, std::vector<unsigned char> *decisions)
+{
+    Scene *scene = context->scene;
+    TemporalHistory *history = context->history;
+    FloatBitMapData *out = context->out;
+    unsigned int width = out->width;
+    unsigned int height = out->height;
+
+    rays->resize((size_t)w * h);
+    decisions->resize((size_t)w * h);
+    generatePixelCenterRays(context->frame, x, y, w, h, rays->data());
+
+    unsigned int reused = 0, rendered = 0, rejectedDepth = 0, rejectedMaterial = 0,
+                 rejectedMixed = 0;
+    for (unsigned int j = 0; j < h; j++)
+    {
+        for (unsigned int i = 0; i < w; i++)
+        {
+            size_t local = (size_t)j * w + i;
+            size_t pixel = (size_t)(y + j) * width + (x + i);
+            Ray *ray = &(*rays)[local];
+            int shapeIndex = -1;
+            Vector3 position;
+            bool hit = primaryHit(scene, ray, &shapeIndex, &position);
+            (*context->shapeId)[pixel] = hit ? shapeIndex : -1;
+            (*context->depth)[pixel] = hit ? (position - ray->startPoint).magnitude() : 0.f;
+
+            unsigned char decision = TEMPORAL_RENDER_NEW;
+            size_t source = 0;
+            float px = 0.f, py = 0.f;
+            if (history->valid && hit)
+            {
+                Material *material = &scene->geometry[shapeIndex]->material;
+                if (material->useReflection || material->useRefraction)
+                    decision = TEMPORAL_RENDER_MATERIAL;
+                else if (!projectToPixel(context->previousFrame, position, &px, &py) ||
+                         !(px > -0.5f && px < (float)width - 0.5f && py > -0.5f &&
+                           py < (float)height - 0.5f))
+                    decision = TEMPORAL_RENDER_DEPTH;
+                else
+                {
+                    // 投影先を囲む2×2画素がすべて同じ面だったか
+                    // (輪郭・面の境目の画素は複数の面の色が混ざっているので使い回さない)
+                    // 深度はその範囲と比べる(斜めから見た面では隣の画素との深度差が大きいため)
+                    source = (size_t)(unsigned int)(py + 0.5f) * width +
+                             (unsigned int)(px + 0.5f);
+                    float previousDepth = (position - history->camera.position).magnitude();
+                    float minDepth = FLT_MAX, maxDepth = 0.f;
+                    bool sameShape = true, mixed = false;
+                    int x0 = (int)floorf(px), y0 = (int)floorf(py);
+                    for (int k = 0; k < 4; k++)
+                    {
+                        int sx = x0 + (k & 1), sy = y0 + (k >> 1);
+                        if (sx < 0 || sy < 0 || sx >= (int)width || sy >= (int)height)
+                            continue;
+                        size_t neighbor = (size_t)sy * width + sx;
+                        if (history->shapeId[neighbor] != shapeIndex)
+                        {
+                            sameShape = false;
+                            break;
+                        }
+                        mixed = mixed || history->mixed[neighbor];
+                        minDepth = fminf(minDepth, history->depth[neighbor]);
+                        maxDepth = fmaxf(maxDepth, history->depth[neighbor]);
+                    }
+                    float tolerance = context->option->depthTolerance * previousDepth;
+                    if (!sameShape || history->shapeId[source] != shapeIndex ||
+                        previousDepth < minDepth - tolerance ||
+                        previousDepth > maxDepth + tolerance)
+                        decision = TEMPORAL_RENDER_DEPTH;
+                    else if (mixed)
+                        decision = TEMPORAL_RENDER_MIXED;
+                    else if (history->age[source] < context->option->maxHistoryAge)
+                        decision = TEMPORAL_REUSE;
+                }
+            }
+            (*decisions)[local] = decision;
+
+            if (decision == TEMPORAL_REUSE)
+            {
+                // 投影先を囲む2×2画素から双線形補間する
+                // (最も近い画素をそのまま使うと使い回すたびに半画素までずれが積み重なる)
+                float *dst = out->getPixel(x + i, y + j);
+                float color[3] = {0.f, 0.f, 0.f};
+                float weightSum = 0.f;
+                int x0 = (int)floorf(px), y0 = (int)floorf(py);
+                float fx = px - x0, fy = py - y0;
+                for (int k = 0; k < 4; k++)
+                {
+                    int sx = x0 + (k & 1), sy = y0 + (k >> 1);
+                    if (sx < 0 || sy < 0 || sx >= (int)width || sy >= (int)height)
+                        continue;
+                    float weight = ((k & 1) ? fx : 1.f - fx) * ((k >> 1) ? fy : 1.f - fy);
+                    const float *src = &history->radiance[((size_t)sy * width + sx) * 3];
+                    for (int c = 0; c < 3; c++)
+                        color[c] += weight * src[c];
+                    weightSum += weight;
+                }
+                for (int c = 0; c < 3; c++)
+                    dst[c] = weightSum > 0.f ? color[c] / weightSum
+                                             : history->radiance[source * 3 + c];
+                (*context->age)[pixel] = history->age[source] + 1;
+                reused++;
+            }
+            else
+            {
+                (*context->age)[pixel] = 0;
+                rendered++;
+                if (decision == TEMPORAL_RENDER_DEPTH)
+                    rejectedDepth++;
+                else if (decision == TEMPORAL_RENDER_MATERIAL)
+                    rejectedMaterial++;
+                else if (decision == TEMPORAL_RENDER_MIXED)
+                    rejectedMixed++;
+            }
+        }
+    }
+
+    // 使い回せなかった画素を横に連続する区間ごとに描画する
+    for (unsigned int j = 0; j < h; j++)
+    {
+        unsigned int i = 0;
+        while (i < w)
+        {
+            if ((*decisions)[(size_t)j * w + i] == TEMPORAL_REUSE)
+            {
+                i++;
+                continue;
+            }
+            unsigned int start = i;
+            while (i < w && (*decisions)[(size_t)j * w + i] != TEMPORAL_REUSE)
+                i++;
+            renderTile(
+                scene, x + start, y + j, i - start, 1, out->getPixel(x + start, y + j),
+                (size_t)width * 3);
+        }
+    }
+
+    context->reused += reused;
+    context->rendered += rendered;
+    context->rejectedDepth += rejectedDepth;
+    context->rejectedMaterial += rejectedMaterial;
+    context->rejectedMixed += rejectedMixed;
+}
+
+int renderTemporalFrame(
+    Scene *scene, TemporalHistory *history, FloatBitMapData *out, const TemporalOption &option,
+    TemporalStats *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    unsigned int width = out->width;
+    unsigned int height = out->height;
+    if (width != scene->bitmap->width || height != scene->bitmap->height ||
+        out->pixelsData == nullptr)
+    {
+        printf("出力の大きさが画像サイズと違います\n");
+        return -1;
+    }
+    size_t pixelNum = (size_t)width * height;
+    if (history->width != width || history->height != height)
+    {
+        history->width = width;
+        history->height = height;
+        history->valid = false;
+        history->radiance.assign(pixelNum * 3, 0.f);
+        history->depth.assign(pixelNum, 0.f);
+        history->shapeId.assign(pixelNum, -1);
+        history->age.assign(pixelNum, 0);
+    }
+
+    // 前フレームの値を読みながら今フレームの深度・ジオメトリ番号を書く
+    std::vector<float> depth(pixelNum);
+    std::vector<int> shapeId(pixelNum);
+    std::vector<unsigned char> age(pixelNum);
+
+    TemporalTileContext context;
+    context.scene = scene;
+    context.history = history;
+    context.out = out;
+    context.option = &option;
+    context.frame = makeCameraFrame(*scene->camera, width, height);
+    context.previousFrame = makeCameraFrame(history->camera, width, height);
+    context.depth = &depth;
+    context.shapeId = &shapeId;
+    context.age = &age;
+    context.reused = 0;
+    context.rendered = 0;
+    context.rejectedDepth = 0;
+    context.rejectedMaterial = 0;
+    context.rejectedMixed = 0;
+
+    unsigned int tileCountX = (width + TEMPORAL_TILE_SIZE - 1) / TEMPORAL_TILE_SIZE;
+    unsigned int tileCountY = (height + TEMPORAL_TILE_SIZE - 1) / TEMPORAL_TILE_SIZE;
+    unsigned int tileNum = tileCountX * tileCountY;
+    std::atomic<unsigned int> nextTile(0);
+    auto worker = [&]()
+    {
+        std::vector<Ray> rays;
+        std::vector<unsigned char> decisions;
+        unsigned int idx;
+        while ((idx = nextTile.fetch_add(1)) < tileNum)
+        {
+            unsigned int x = (idx % tileCountX) * TEMPORAL_TILE_SIZE;
+            unsigned int y = (idx / tileCountX) * TEMPORAL_TILE_SIZE;
+            unsigned int w = (x + TEMPORAL_TILE_SIZE > width) ? width - x : TEMPORAL_TILE_SIZE;
+            unsigned int h = (y + TEMPORAL_TILE_SIZE > height) ? height - y : TEMPORAL_TILE_SIZE;
+            renderTemporalTile(&context, x, y, w, h, &rays, &decisions);
+        }
+    };
+    unsigned int workerNum = option.workerNum == 0 ? 1 : option.workerNum;
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    // 今フレームを次のフレームの履歴にする
+    history->radiance.assign(out->pixelsData, out->pixelsData + pixelNum * 3);
+    history->depth.swap(depth);
+    history->shapeId.swap(shapeId);
+    history->age.swap(age);
+    history->camera = *scene->camera;
+    history->valid = true;
+    markMixedPixels(history, option.mixedContrast);
+
+    if (stats != nullptr)
+    {
+        stats->reusedPixels = context.reused;
+        stats->renderedPixels = context.rendered;
+        stats->rejectedDepth = context.rejectedDepth;
+        stats->rejectedMaterial = context.rejectedMaterial;
+        stats->rejectedMixed = context.rejectedMixed;
+        stats->seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* カメラアニメーションの時間方向の再投影 */
+#pragma once
+#include <vector>
+#include "camera.hpp"
+#include "framebuffer.hpp"
+
+#define TEMPORAL_TILE_SIZE 32
+
+// 前フレームの結果(画素の中心の1次レイで求めた深度・ジオメトリ番号と描画結果)
+struct TemporalHistory
+{
+    unsigned int width = 0;
+    unsigned int height = 0;
+    bool valid = false;            // 前フレームがあるか
+    Camera camera;                 // 前フレームのカメラ
+    std::vector<float> radiance;   // 輝度(RGB)
+    std::vector<float> depth;      // 視点から交点までの距離
+    std::vector<int> shapeId;      // 交わったジオメトリ番号(-1なら背景)
+    std::vector<unsigned char> age; // 描画してから再投影で使い回したフレーム数
+    std::vector<unsigned char> mixed; // 面の境目・影の輪郭など複数の色が混ざっている画素(使い回さない)
+};
+
+// 再投影の設定
+struct TemporalOption
+{
+    float depthTolerance = 0.01f;   // 前フレームの深度との差の許容量(距離に対する割合)
+    unsigned int maxHistoryAge = 8; // この回数使い回した画素は描き直す(誤差の蓄積を防ぐ)
+    float mixedContrast = 0.05f;    // 隣の画素との輝度の差(明るい方に対する割合)がこれを超えたら境界の画素
+    unsigned int workerNum = 1;     // スレッド数
+};
+
+// 1フレームの統計
+struct TemporalStats
+{
+    unsigned int reusedPixels;   // 前フレームから再投影した画素数
+    unsigned int renderedPixels; // 描画した画素数
+    unsigned int rejectedDepth;  // ジオメトリ番号・深度が合わず描画した画素数(隠れていた面など)
+    unsigned int rejectedMaterial; // 鏡面反射・屈折の面なので描画した画素数
+    unsigned int rejectedMixed;  // 前フレームで複数の色が混ざっていたので描画した画素数
+    double seconds;              // フレームの描画時間
+};
+
+// 1フレーム描画してoutに書き込み，historyを更新する
+// historyが空なら全画素を描画する．前フレームがあれば各画素の中心の1次レイの交点を
+// 前フレームのカメラに投影し，同じジオメトリで深度が合い，鏡面反射・屈折を使わない面なら
+// 投影先を囲む2×2画素から補間して前フレームの輝度を使い回す．ただしそれらの画素が面の境目・影の輪郭などで
+// 複数の色が混ざっていた(隣の画素と面か輝度が大きく違った)場合は使い回さない．
+// それ以外の画素だけを横に連続する区間ごとにrenderTileで描画する
+// 使い回した画素はmaxHistoryAgeフレームで描き直すので，
+// 視点によって変わる鏡面ハイライトの誤差もその間に限られる
+int renderTemporalFrame(
+    Scene *scene, TemporalHistory *history, FloatBitMapData *out, const TemporalOption &option,
+    TemporalStats *stats);
@@ -0,0 +1,522 @@
+#include "texture.hpp"
+#include "memory.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// タイルはRGBA8で保存する(32 * 32 * 4 = 4KB)
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 4)
+
+// キャッシュに載っているタイル
+struct TextureTile
+{
+    unsigned char *data;
+    std::list<uint64_t>::iterator lru; // LRUリスト内の位置
+    std::atomic<int> pins{0};          // 使用中の数(0になるまで追い出さない．外すときはロック不要)
+    bool loading = false;              // ファイルから読み込み中(dataはまだ使えない)
+};
+
+// キャッシュの一部(ロックとLRUを個別に持つ)
+struct TextureCacheShard
+{
+    std::mutex mutex;
+    std::condition_variable loaded; // 読み込み中のタイルが読み込まれた(または失敗した)
+    std::unordered_map<uint64_t, TextureTile> tiles;
+    std::list<uint64_t> lru; // 先頭が最近使ったタイル
+    size_t residentBytes = 0;
+};
+
+struct TextureCache
+{
+    size_t shardBudget; // 分割1つあたりの上限
+    TextureCacheShard shards[TEXTURE_CACHE_SHARD_NUM];
+    unsigned int textureNum = 0; // 読み込んだテクスチャの数
+    std::mutex mutex;
+
+    // 統計(ロックを取らずに数える)
+    std::atomic<unsigned long long> hits{0};
+    std::atomic<unsigned long long> misses{0};
+    std::atomic<unsigned long long> evictions{0};
+    std::atomic<size_t> residentBytes{0};
+    std::atomic<size_t> peakResidentBytes{0};
+};
+
+TextureCache *createTextureCache(size_t memoryBudget)
+{
+    TextureCache *cache = new TextureCache();
+    cache->shardBudget = memoryBudget / TEXTURE_CACHE_SHARD_NUM;
+    // 少なくとも1タイルは保持する
+    if (cache->shardBudget < TEXTURE_TILE_BYTES)
+        cache->shardBudget = TEXTURE_TILE_BYTES;
+    return cache;
+}
+
+void destroyTextureCache(TextureCache *cache)
+{
+    for (auto &shard : cache->shards)
+    {
+        for (auto &tile : shard.tiles)
+        {
+            free(tile.second.data);
+            recordMemoryRelease(MEMORY_SCENE, TEXTURE_TILE_BYTES);
+        }
+    }
+    delete cache;
+}
+
+// (テクスチャ, レベル, タイル座標)からキーを作る
+static inline uint64_t tileKey(unsigned int id, int level, unsigned int tx, unsigned int ty)
+{
+    return ((uint64_t)id << 48) | ((uint64_t)level << 42) | ((uint64_t)ty << 21) | tx;
+}
+
+static inline size_t tileOffset(Texture *texture, int level, unsigned int tx, unsigned int ty)
+{
+    return texture->levelOffset[level] +
+           ((size_t)ty * texture->tileCountX[level] + tx) * TEXTURE_TILE_BYTES;
+}
+
+// ミップマップ作成中の1レベル分の状態
+struct MipLevelBuilder
+{
+    unsigned char *band;    // TEXTURE_TILE_SIZE行分のバッファ
+    unsigned char *pairRow; // 縮小用に保持する偶数行
+    unsigned int rowsInBand;
+    unsigned int bandIndex; // 何番目のタイル行か
+};
+
+// 溜まった行をタイルに分けてファイルに書き込む
+static int flushBand(Texture *texture, MipLevelBuilder *builder, int level)
+{
+    unsigned int width = texture->levelWidth[level];
+    unsigned char tile[TEXTURE_TILE_BYTES];
+
+    for (unsigned int tx = 0; tx < texture->tileCountX[level]; tx++)
+    {
+        memset(tile, 0, sizeof(tile));
+        unsigned int x0 = tx * TEXTURE_TILE_SIZE;
+        unsigned int w = (x0 + TEXTURE_TILE_SIZE > width) ? width - x0 : TEXTURE_TILE_SIZE;
+        for (unsigned int row = 0; row < builder->rowsInBand; row++)
+        {
+            memcpy(tile + row * TEXTURE_TILE_SIZE * 4,
+                   builder->band + ((size_t)row * width + x0) * 4, w * 4);
+        }
+        size_t offset = tileOffset(texture, level, tx, builder->bandIndex);
+        if (pwrite(texture->fd, tile, sizeof(tile), (off_t)offset) != sizeof(tile))
+        {
+            printf("テクスチャタイルの書き込みに失敗しました\n");
+            return -1;
+        }
+    }
+
+    builder->rowsInBand = 0;
+    builder->bandIndex++;
+    return 0;
+}
+
+// levelに1行(RGBA8)を追加し，必要なら縮小して次のレベルにも追加する
+static int pushRow(
+    Texture *texture, MipLevelBuilder *builders, int level, unsigned int y, unsigned char *row)
+{
+    MipLevelBuilder *builder = &builders[level];
+    unsigned int width = texture->levelWidth[level];
+    unsigned int height = texture->levelHeight[level];
+
+    memcpy(builder->band + (size_t)builder->rowsInBand * width * 4, row, (size_t)width * 4);
+    builder->rowsInBand++;
+    if (builder->rowsInBand == TEXTURE_TILE_SIZE || y == height - 1)
+    {
+        if (flushBand(texture, builder, level) == -1)
+            return -1;
+    }
+
+    // 最後のレベル
+    if (level + 1 >= texture->levelNum)
+        return 0;
+
+    // 2x2の平均で縮小(高さ1なら同じ行を2回使う)
+    unsigned char *upper;
+    if (height == 1)
+    {
+        upper = row;
+    }
+    else if (y % 2 == 0)
+    {
+        memcpy(builder->pairRow, row, (size_t)width * 4);
+        return 0;
+    }
+    else
+    {
+        upper = builder->pairRow;
+    }
+
+    unsigned int nextY = y / 2;
+    if (nextY >= texture->levelHeight[level + 1])
+        return 0; // 高さが奇数の場合の最終行は捨てる
+
+    unsigned int nextWidth = texture->levelWidth[level + 1];
+    unsigned char *next = builders[level + 1].pairRow + (size_t)nextWidth * 4;
+    for (unsigned int x = 0; x < nextWidth; x++)
+    {
+        unsigned int x0 = 2 * x;
+        unsigned int x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+        for (int c = 0; c < 4; c++)
+        {
+            unsigned int sum = upper[x0 * 4 + c] + upper[x1 * 4 + c] +
+                               row[x0 * 4 + c] + row[x1 * 4 + c];
+            next[x * 4 + c] = (unsigned char)((sum + 2) / 4);
+        }
+    }
+    return pushRow(texture, builders, level + 1, nextY, next);
+}
+
+Texture *loadTexture(TextureCache *cache, const char *filename)
+{
+    PngRowReader reader;
+    if (pngRowReaderOpen(&reader, filename) == -1)
+        return nullptr;
+
+    Texture *texture = new Texture();
+    texture->cache = cache;
+
+    // ミップレベルの大きさを決める(1x1まで)
+    size_t offset = 0;
+    unsigned int w = reader.width;
+    unsigned int h = reader.height;
+    texture->levelNum = 0;
+    while (texture->levelNum < TEXTURE_MAX_LEVEL)
+    {
+        int level = texture->levelNum++;
+        texture->levelWidth[level] = w;
+        texture->levelHeight[level] = h;
+        texture->tileCountX[level] = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        unsigned int tileCountY = (h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        texture->levelOffset[level] = offset;
+        offset += (size_t)texture->tileCountX[level] * tileCountY * TEXTURE_TILE_BYTES;
+        if (w == 1 && h == 1)
+            break;
+        w = (w > 1) ? w / 2 : 1;
+        h = (h > 1) ? h / 2 : 1;
+    }
+
+    // タイルの退避先(閉じると削除される)
+    FILE *tileFile = tmpfile();
+    if (tileFile == nullptr)
+    {
+        printf("テクスチャの一時ファイルを作成できません\n");
+        pngRowReaderClose(&reader);
+        delete texture;
+        return nullptr;
+    }
+    texture->fd = dup(fileno(tileFile));
+    fclose(tileFile);
+
+    // 各レベルのタイル1行分のバッファ
+    // pairRowの後ろ半分は上のレベルから渡される縮小済みの行に使う
+    MipLevelBuilder builders[TEXTURE_MAX_LEVEL];
+    for (int level = 0; level < texture->levelNum; level++)
+    {
+        size_t rowBytes = (size_t)texture->levelWidth[level] * 4;
+        builders[level].band = (unsigned char *)malloc(rowBytes * TEXTURE_TILE_SIZE);
+        builders[level].pairRow = (unsigned char *)malloc(rowBytes * 2);
+        builders[level].rowsInBand = 0;
+        builders[level].bandIndex = 0;
+    }
+
+    unsigned char *source = (unsigned char *)malloc((size_t)reader.width * reader.channel);
+    unsigned char *rgba = (unsigned char *)malloc((size_t)reader.width * 4);
+
+    int result = 0;
+    for (unsigned int y = 0; y < reader.height && result == 0; y++)
+    {
+        if (pngRowReaderRead(&reader, source) == -1)
+        {
+            result = -1;
+            break;
+        }
+        for (unsigned int x = 0; x < reader.width; x++)
+        {
+            rgba[x * 4 + 0] = source[x * reader.channel + 0];
+            rgba[x * 4 + 1] = source[x * reader.channel + 1];
+            rgba[x * 4 + 2] = source[x * reader.channel + 2];
+            rgba[x * 4 + 3] = (reader.channel == COLOR_RGBA) ? source[x * 4 + 3] : 0xff;
+        }
+        result = pushRow(texture, builders, 0, y, rgba);
+    }
+
+    free(source);
+    free(rgba);
+    for (int level = 0; level < texture->levelNum; level++)
+    {
+        free(builders[level].band);
+        free(builders[level].pairRow);
+    }
+    pngRowReaderClose(&reader);
+
+    if (result == -1)
+    {
+        close(texture->fd);
+        delete texture;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    texture->id = cache->textureNum++;
+    return texture;
+}
+
+void freeTexture(Texture *texture)
+{
+    TextureCache *cache = texture->cache;
+
+    // このテクスチャのタイルをキャッシュから取り除く
+    size_t removedBytes = 0;
+    for (auto &shard : cache->shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto it = shard.tiles.begin(); it != shard.tiles.end();)
+        {
+            if ((it->first >> 48) == texture->id)
+            {
+                shard.lru.erase(it->second.lru);
+                shard.residentBytes -= TEXTURE_TILE_BYTES;
+                removedBytes += TEXTURE_TILE_BYTES;
+                free(it->second.data);
+                recordMemoryRelease(MEMORY_SCENE, TEXTURE_TILE_BYTES);
+                it = shard.tiles.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    cache->residentBytes -= removedBytes;
+
+    close(texture->fd);
+    delete texture;
+}
+
+static inline TextureCacheShard *shardOf(TextureCache *cache, uint64_t key)
+{
+    return &cache->shards[(key * 0x9e3779b97f4a7c15ULL) >> 60];
+}
+
+// タイルを取得して使用中にする(使い終わったらreleaseTileを呼ぶ．読み込めなければnullptr)
+// キャッシュになければファイルから読み込み，上限を超えたら使用中でない古いタイルを追い出す
+// ファイルの読み込みはロックを外して行い，同じタイルを求める他のスレッドは読み込みを待つ
+static TextureTile *acquireTile(Texture *texture, int level, unsigned int tx, unsigned int ty)
+{
+    TextureCache *cache = texture->cache;
+    uint64_t key = tileKey(texture->id, level, tx, ty);
+    TextureCacheShard &shard = *shardOf(cache, key);
+
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto found = shard.tiles.find(key);
+    while (found != shard.tiles.end() && found->second.loading)
+    {
+        shard.loaded.wait(lock);
+        found = shard.tiles.find(key);
+    }
+    if (found != shard.tiles.end())
+    {
+        // 最近使ったタイルとして先頭に移す
+        shard.lru.splice(shard.lru.begin(), shard.lru, found->second.lru);
+        found->second.pins.fetch_add(1, std::memory_order_relaxed);
+        lock.unlock();
+
+        cache->hits.fetch_add(1, std::memory_order_relaxed);
+        return &found->second;
+    }
+
+    // 上限を超えるなら使用中でない最も古いタイルから追い出す
+    unsigned long long evictions = 0;
+    unsigned char *data = nullptr;
+    auto it = shard.lru.end();
+    while (shard.residentBytes + TEXTURE_TILE_BYTES > cache->shardBudget &&
+           it != shard.lru.begin())
+    {
+        --it;
+        auto old = shard.tiles.find(*it);
+        // releaseTileのreleaseと対になり，外したスレッドの読み出しが終わってから再利用する
+        if (old->second.pins.load(std::memory_order_acquire) > 0)
+            continue;
+        // 追い出したバッファは再利用する
+        if (data == nullptr)
+            data = old->second.data;
+        else
+        {
+            free(old->second.data);
+            recordMemoryRelease(MEMORY_SCENE, TEXTURE_TILE_BYTES);
+        }
+        shard.tiles.erase(old);
+        it = shard.lru.erase(it);
+        shard.residentBytes -= TEXTURE_TILE_BYTES;
+        evictions++;
+    }
+    if (data == nullptr)
+    {
+        data = (unsigned char *)malloc(TEXTURE_TILE_BYTES);
+        recordMemoryAllocation(MEMORY_SCENE, TEXTURE_TILE_BYTES);
+    }
+
+    // 読み込み中として登録してからロックを外して読み込む
+    shard.lru.push_front(key);
+    TextureTile *tile = &shard.tiles[key];
+    tile->data = data;
+    tile->lru = shard.lru.begin();
+    tile->pins.store(1, std::memory_order_relaxed);
+    tile->loading = true;
+    shard.residentBytes += TEXTURE_TILE_BYTES;
+    lock.unlock();
+
+    bool readFailed = pread(texture->fd, data, TEXTURE_TILE_BYTES,
+                            (off_t)tileOffset(texture, level, tx, ty)) != TEXTURE_TILE_BYTES;
+
+    lock.lock();
+    if (readFailed)
+    {
+        // 黒いタイルをキャッシュしないように取り除く
+        shard.lru.erase(tile->lru);
+        shard.tiles.erase(key);
+        shard.residentBytes -= TEXTURE_TILE_BYTES;
+        free(data);
+        recordMemoryRelease(MEMORY_SCENE, TEXTURE_TILE_BYTES);
+        tile = nullptr;
+    }
+    else
+    {
+        tile->loading = false;
+    }
+    shard.loaded.notify_all();
+    lock.unlock();
+
+    cache->misses.fetch_add(1, std::memory_order_relaxed);
+    cache->evictions.fetch_add(evictions, std::memory_order_relaxed);
+    if (tile == nullptr)
+    {
+        cache->residentBytes -= evictions * TEXTURE_TILE_BYTES;
+        printf("テクスチャタイルの読み込みに失敗しました\n");
+        return nullptr;
+    }
+    size_t resident = (cache->residentBytes += TEXTURE_TILE_BYTES - evictions * TEXTURE_TILE_BYTES);
+    size_t peak = cache->peakResidentBytes.load();
+    while (resident > peak && !cache->peakResidentBytes.compare_exchange_weak(peak, resident))
+        ;
+    return tile;
+}
+
+// acquireTileで取得したタイルの使用を終える
+static inline void releaseTile(TextureTile *tile)
+{
+    tile->pins.fetch_sub(1, std::memory_order_release);
+}
+
+// 1つのレベルでのバイリニア補間(タイルを読み込めなければ-1)
+// 4テクセルが含まれるタイル(普通は1つ，境界をまたぐと最大4つ)を1回ずつ取得する
+static int sampleLevel(Texture *texture, int level, float u, float v, float *rgb)
+{
+    unsigned int width = texture->levelWidth[level];
+    unsigned int height = texture->levelHeight[level];
+
+    // テクセルの中心が整数座標になるようにずらす
+    float x = u * width - 0.5f;
+    float y = v * height - 0.5f;
+    float fx = floorf(x);
+    float fy = floorf(y);
+    float wx = x - fx;
+    float wy = y - fy;
+
+    // 繰り返し
+    int x0 = ((int)fx % (int)width + width) % width;
+    int y0 = ((int)fy % (int)height + height) % height;
+    int x1 = (x0 + 1) % width;
+    int y1 = (y0 + 1) % height;
+
+    int xs[2] = {x0, x1};
+    int ys[2] = {y0, y1};
+    unsigned char texels[4][4]; // t00, t10, t01, t11
+    TextureTile *tiles[4];
+    unsigned int tileX[4], tileY[4];
+    int tileNum = 0;
+    int result = 0;
+    for (int k = 0; k < 4 && result == 0; k++)
+    {
+        unsigned int tx = xs[k & 1] / TEXTURE_TILE_SIZE;
+        unsigned int ty = ys[k >> 1] / TEXTURE_TILE_SIZE;
+        int t = 0;
+        while (t < tileNum && !(tileX[t] == tx && tileY[t] == ty))
+            t++;
+        if (t == tileNum)
+        {
+            tiles[t] = acquireTile(texture, level, tx, ty);
+            if (tiles[t] == nullptr)
+            {
+                result = -1;
+                break;
+            }
+            tileX[t] = tx;
+            tileY[t] = ty;
+            tileNum++;
+        }
+        size_t texelOffset = ((ys[k >> 1] % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE +
+                              (xs[k & 1] % TEXTURE_TILE_SIZE)) * 4;
+        memcpy(texels[k], tiles[t]->data + texelOffset, 4);
+    }
+    for (int t = 0; t < tileNum; t++)
+        releaseTile(tiles[t]);
+    if (result == -1)
+        return -1;
+
+    for (int c = 0; c < 3; c++)
+    {
+        float top = texels[0][c] * (1.f - wx) + texels[1][c] * wx;
+        float bottom = texels[2][c] * (1.f - wx) + texels[3][c] * wx;
+        rgb[c] = (top * (1.f - wy) + bottom * wy) / 255.f;
+    }
+    return 0;
+}
+
+int sampleTexture(Texture *texture, float u, float v, float footprint, float *rgb)
+{
+    // 繰り返しのため0〜1に収める
+    u -= floorf(u);
+    v -= floorf(v);
+
+    // フットプリントがレベル0で何テクセルになるかでレベルを決める
+    float texels = footprint * texture->levelWidth[0];
+    float lod = (texels > 1.f) ? log2f(texels) : 0.f;
+    if (lod >= texture->levelNum - 1)
+        return sampleLevel(texture, texture->levelNum - 1, u, v, rgb);
+
+    // 隣り合う2つのレベルを線形補間(トライリニア)
+    // 両方のレベルを読めるまでrgbは書き換えない
+    int level = (int)lod;
+    float t = lod - level;
+    float fine[3];
+    float coarse[3] = {0.f, 0.f, 0.f};
+    if (sampleLevel(texture, level, u, v, fine) == -1)
+        return -1;
+    if (t > 0.f && sampleLevel(texture, level + 1, u, v, coarse) == -1)
+        return -1;
+    for (int c = 0; c < 3; c++)
+        rgb[c] = fine[c] * (1.f - t) + coarse[c] * t;
+    return 0;
+}
+
+TextureCacheStats getTextureCacheStats(TextureCache *cache)
+{
+    TextureCacheStats stats;
+    stats.hits = cache->hits.load();
+    stats.misses = cache->misses.load();
+    stats.evictions = cache->evictions.load();
+    stats.residentBytes = cache->residentBytes.load();
+    stats.peakResidentBytes = cache->peakResidentBytes.load();
+    return stats;
+}
@@ -0,0 +1,51 @@
+/* タイル化テクスチャとテクスチャキャッシュのヘッダ */
+#pragma once
+#include "myPng.hpp"
+
+#define TEXTURE_TILE_SIZE 32     // タイルの一辺(テクセル)
+#define TEXTURE_MAX_LEVEL 24     // ミップレベルの最大数
+#define TEXTURE_CACHE_SHARD_NUM 16 // ロックを分けるためのキャッシュの分割数
+
+struct TextureCache;
+
+// テクスチャ
+// 読み込み時にタイルとミップマップを作って一時ファイルに退避し，
+// 描画中は必要なタイルだけをキャッシュに読み込む
+struct Texture
+{
+    TextureCache *cache;  // 所属するキャッシュ
+    unsigned int id;      // キャッシュ内での番号
+    int fd;               // タイルを退避したファイル
+    int levelNum;         // ミップレベル数
+    unsigned int levelWidth[TEXTURE_MAX_LEVEL];  // 各レベルの幅
+    unsigned int levelHeight[TEXTURE_MAX_LEVEL]; // 各レベルの高さ
+    unsigned int tileCountX[TEXTURE_MAX_LEVEL];  // 各レベルの横方向のタイル数
+    size_t levelOffset[TEXTURE_MAX_LEVEL];       // 各レベルの先頭タイルのファイル位置
+};
+
+// キャッシュの統計
+struct TextureCacheStats
+{
+    unsigned long long hits;      // キャッシュに載っていた回数
+    unsigned long long misses;    // ファイルから読み込んだ回数
+    unsigned long long evictions; // 追い出した回数
+    size_t residentBytes;         // 現在のタイルのメモリ量
+    size_t peakResidentBytes;     // タイルのメモリ量の最大値
+};
+
+// memoryBudgetバイトまでタイルを保持するキャッシュを作る
+// 使用中のタイルは追い出さないので，多数のスレッドで描画中は一時的に超えることがある
+TextureCache *createTextureCache(size_t memoryBudget);
+void destroyTextureCache(TextureCache *);
+
+// PNGを1行ずつ読み込み，タイル・ミップマップを作る
+// 画像全体はメモリに載せない
+Texture *loadTexture(TextureCache *cache, const char *filename);
+void freeTexture(Texture *);
+
+// (u, v)の色(0〜1のRGB)を取得する(範囲外は繰り返し)
+// footprintはサンプル1つが覆うUV上の幅で，ミップレベルの選択に使う
+// タイルをファイルから読み込めなければ-1(rgbは設定しない)
+int sampleTexture(Texture *texture, float u, float v, float footprint, float *rgb);
+
+TextureCacheStats getTextureCacheStats(TextureCache *);
@@ -0,0 +1,233 @@
+#include "tiledFramebuffer.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int TiledFloatBitMapData::allocation(const char *filename)
+{
+    tileCountX = (width + tileSize - 1) / tileSize;
+    tileCountY = (height + tileSize - 1) / tileSize;
+
+    // madviseはページ単位なのでタイルをページ境界に揃える
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    tileBytes = (size_t)tileSize * tileSize * 3 * sizeof(float);
+    tileBytes = (tileBytes + pageSize - 1) / pageSize * pageSize;
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    size_t fileSize = tileBytes * tileCountX * tileCountY;
+    if (ftruncate(fd, (off_t)fileSize) == -1)
+    {
+        printf("ftruncate error\n");
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    mapping = (unsigned char *)mmap(
+        NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        printf("mmap error\n");
+        mapping = nullptr;
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    return 0; // 成功
+}
+
+float *TiledFloatBitMapData::acquireTile(unsigned int tx, unsigned int ty)
+{
+    unsigned char *tile = mapping + ((size_t)ty * tileCountX + tx) * tileBytes;
+    madvise(tile, tileBytes, MADV_WILLNEED);
+    return (float *)tile;
+}
+
+void TiledFloatBitMapData::releaseTile(unsigned int tx, unsigned int ty)
+{
+    size_t offset = ((size_t)ty * tileCountX + tx) * tileBytes;
+    unsigned char *tile = mapping + offset;
+
+    // ファイルに書き戻してからプロセスとページキャッシュの両方から追い出す
+    msync(tile, tileBytes, MS_SYNC);
+    madvise(tile, tileBytes, MADV_DONTNEED);
+    posix_fadvise(fd, (off_t)offset, (off_t)tileBytes, POSIX_FADV_DONTNEED);
+}
+
+int freeTiledFloatBitmapData(TiledFloatBitMapData *bitmap)
+{
+    if (bitmap->mapping != nullptr)
+    {
+        munmap(bitmap->mapping, bitmap->tileBytes * bitmap->tileCountX * bitmap->tileCountY);
+        bitmap->mapping = nullptr;
+    }
+    if (bitmap->fd != -1)
+    {
+        close(bitmap->fd);
+        bitmap->fd = -1;
+    }
+    return 0;
+}
+
+int renderTiledFramebuffer(Scene *scene, TiledFloatBitMapData *bitmap, unsigned int workerNum)
+{
+    if (workerNum == 0)
+        workerNum = 1;
+
+    unsigned int tileNum = bitmap->tileCountX * bitmap->tileCountY;
+    std::atomic<unsigned int> nextTile(0);
+
+    // 各スレッドは未処理のタイルを1つずつ取り出して描画する
+    auto worker = [&]()
+    {
+        unsigned int idx;
+        while ((idx = nextTile.fetch_add(1)) < tileNum)
+        {
+            unsigned int tx = idx % bitmap->tileCountX;
+            unsigned int ty = idx / bitmap->tileCountX;
+            float *tile = bitmap->acquireTile(tx, ty);
+            renderTile(
+                scene, tx * bitmap->tileSize, ty * bitmap->tileSize,
+                bitmap->tileWidth(tx), bitmap->tileHeight(ty),
+                tile, (size_t)bitmap->tileSize * 3);
+            bitmap->releaseTile(tx, ty);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    return 0;
+}
+
+// PNG書き込み中の状態
+struct TiledRowReader
+{
+    TiledFloatBitMapData *bitmap;
+    const SpanWriteOption *option;
+    float *rowBuffer;        // 1行分のfloat
+    int acquiredTileY;       // 読み込み中のタイル行
+};
+
+// タイル行を読み込み中のタイル行に切り替える
+static void switchTileRow(TiledRowReader *reader, int ty)
+{
+    TiledFloatBitMapData *bitmap = reader->bitmap;
+    if (reader->acquiredTileY == ty)
+        return;
+    if (reader->acquiredTileY != -1)
+    {
+        for (unsigned int tx = 0; tx < bitmap->tileCountX; tx++)
+            bitmap->releaseTile(tx, reader->acquiredTileY);
+    }
+    if (ty != -1)
+    {
+        for (unsigned int tx = 0; tx < bitmap->tileCountX; tx++)
+            bitmap->acquireTile(tx, ty);
+    }
+    reader->acquiredTileY = ty;
+}
+
+// タイルから1行分を集める
+static void gatherRow(TiledRowReader *reader, unsigned int y)
+{
+    TiledFloatBitMapData *bitmap = reader->bitmap;
+    unsigned int ty = y / bitmap->tileSize;
+    unsigned int localY = y % bitmap->tileSize;
+    switchTileRow(reader, ty);
+
+    for (unsigned int tx = 0; tx < bitmap->tileCountX; tx++)
+    {
+        float *tile = bitmap->acquireTile(tx, ty);
+        memcpy(reader->rowBuffer + (size_t)tx * bitmap->tileSize * 3,
+               tile + (size_t)localY * bitmap->tileSize * 3,
+               sizeof(float) * bitmap->tileWidth(tx) * 3);
+    }
+}
+
+static int tiledPngRowSource(unsigned int y, unsigned char *row, void *userData)
+{
+    TiledRowReader *reader = (TiledRowReader *)userData;
+    gatherRow(reader, y);
+
+    // 1行だけのビットマップとしてスパン書き込みを使う
+    BitMapData rowBitmap(reader->bitmap->width, 1, COLOR_RGB);
+    rowBitmap.pixelsData = row;
+    SpanWriteOption option = *reader->option;
+    option.useStreamingStore = false; // 直後にlibpngが読むのでキャッシュに残す
+    writeSpan(&rowBitmap, 0, 0, reader->rowBuffer, reader->bitmap->width, option);
+    return 0;
+}
+
+int tiledPngFileEncodeWrite(
+    TiledFloatBitMapData *bitmap, const char *filename, const SpanWriteOption &option)
+{
+    TiledRowReader reader;
+    reader.bitmap = bitmap;
+    reader.option = &option;
+    reader.acquiredTileY = -1;
+    reader.rowBuffer =
+        (float *)malloc(sizeof(float) * bitmap->tileCountX * bitmap->tileSize * 3);
+    if (reader.rowBuffer == nullptr)
+    {
+        printf("malloc error\n");
+        return -1;
+    }
+
+    int result = pngFileEncodeWriteStream(
+        filename, bitmap->width, bitmap->height, COLOR_RGB, tiledPngRowSource, &reader);
+
+    switchTileRow(&reader, -1);
+    free(reader.rowBuffer);
+    return result;
+}
+
+int tiledPfmFileWrite(TiledFloatBitMapData *bitmap, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == nullptr)
+    {
+        printf("%sは開けません\n", filename);
+        return -1;
+    }
+
+    TiledRowReader reader;
+    reader.bitmap = bitmap;
+    reader.option = nullptr;
+    reader.acquiredTileY = -1;
+    reader.rowBuffer =
+        (float *)malloc(sizeof(float) * bitmap->tileCountX * bitmap->tileSize * 3);
+    if (reader.rowBuffer == nullptr)
+    {
+        printf("malloc error\n");
+        fclose(file);
+        return -1;
+    }
+
+    fprintf(file, "PF\n%u %u\n-1.0\n", bitmap->width, bitmap->height);
+
+    // PFMは下の行から書き込む
+    for (unsigned int i = 0; i < bitmap->height; i++)
+    {
+        gatherRow(&reader, bitmap->height - 1 - i);
+        fwrite(reader.rowBuffer, sizeof(float), (size_t)bitmap->width * 3, file);
+    }
+
+    switchTileRow(&reader, -1);
+    free(reader.rowBuffer);
+    fclose(file);
+    return 0;
+}
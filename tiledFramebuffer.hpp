@@ -0,0 +1,59 @@
+/* メモリマップドファイル上のタイル化フレームバッファ(巨大画像用) */
+#pragma once
+#include "raytracing_lib.hpp"
+
+#define DEFAULT_TILE_SIZE 64
+
+// タイル化されたfloat RGBフレームバッファ
+// ピクセルデータはファイルに置き，描画中のタイルだけがメモリに載る
+struct TiledFloatBitMapData
+{
+    unsigned int width;      // 幅
+    unsigned int height;     // 高さ
+    unsigned int tileSize;   // タイルの一辺(ピクセル)
+    unsigned int tileCountX; // 横方向のタイル数
+    unsigned int tileCountY; // 縦方向のタイル数
+    size_t tileBytes;        // 1タイルのバイト数(ページ境界に揃える)
+    int fd = -1;             // 保存先ファイル
+    unsigned char *mapping = nullptr; // ファイル全体のマッピング
+
+    TiledFloatBitMapData() {}
+    TiledFloatBitMapData(unsigned int w, unsigned int h, unsigned int tile = DEFAULT_TILE_SIZE)
+        : width(w), height(h), tileSize(tile) {}
+
+    // 保存先ファイルを作成してマッピングする
+    // ファイルは疎なので書き込んだタイルの分だけディスクを使う
+    int allocation(const char *filename);
+
+    // タイル(tx, ty)の先頭を返す(1行はtileSize * 3 float)
+    float *acquireTile(unsigned int tx, unsigned int ty);
+
+    // タイルをファイルに書き戻してメモリから追い出す
+    void releaseTile(unsigned int tx, unsigned int ty);
+
+    // タイルの実際の幅・高さ(右端・下端は小さくなる)
+    unsigned int tileWidth(unsigned int tx)
+    {
+        unsigned int x = tx * tileSize;
+        return (x + tileSize > width) ? width - x : tileSize;
+    }
+    unsigned int tileHeight(unsigned int ty)
+    {
+        unsigned int y = ty * tileSize;
+        return (y + tileSize > height) ? height - y : tileSize;
+    }
+};
+
+int freeTiledFloatBitmapData(TiledFloatBitMapData *);
+
+// workerNum個のスレッドでタイルを順に描画する
+// 常駐メモリはおよそ tileBytes * workerNum に抑えられる
+int renderTiledFramebuffer(Scene *scene, TiledFloatBitMapData *bitmap, unsigned int workerNum);
+
+// 1タイル行ずつ読み出しながらPNGに書き込む
+int tiledPngFileEncodeWrite(
+    TiledFloatBitMapData *bitmap, const char *filename,
+    const SpanWriteOption &option = SpanWriteOption());
+
+// 1タイル行ずつ読み出しながらPFMに書き込む
+int tiledPfmFileWrite(TiledFloatBitMapData *bitmap, const char *filename);
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include <thread>
+#include <utility>
+#include "compiledScene.hpp"
+#include "uniformGrid.hpp"
+
+typedef std::pair<uint64_t, int> GridPair; // (セル番号, 球の添字)
+
+static inline uint64_t hashCellKey(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline int clampCell(int value, int resolution)
+{
+    return value < 0 ? 0 : (value >= resolution ? resolution - 1 : value);
+}
+
+static inline uint64_t cellNumber(UniformGrid *grid, int x, int y, int z)
+{
+    return (uint64_t)x + (uint64_t)grid->resolution[0] *
+                             ((uint64_t)y + (uint64_t)grid->resolution[1] * (uint64_t)z);
+}
+
+// 球がセル(x,y,z)と重なるか(境界の丸め誤差で取りこぼさないよう少し広げて判定する)
+static bool sphereOverlapsCell(UniformGrid *grid, CompiledSphere *sphere, int x, int y, int z)
+{
+    float margin = grid->cellSize * 1e-4f;
+    int cell[3] = {x, y, z};
+    float center[3] = {sphere->center.x, sphere->center.y, sphere->center.z};
+    float low[3] = {grid->boundsMin.x, grid->boundsMin.y, grid->boundsMin.z};
+    float distance2 = 0.f;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float cellMin = low[axis] + cell[axis] * grid->cellSize - margin;
+        float cellMax = low[axis] + (cell[axis] + 1) * grid->cellSize + margin;
+        float d = 0.f;
+        if (center[axis] < cellMin)
+            d = cellMin - center[axis];
+        else if (center[axis] > cellMax)
+            d = center[axis] - cellMax;
+        distance2 += d * d;
+    }
+    float radius = sphere->radius + margin;
+    return distance2 <= radius * radius;
+}
+
+// spheres[begin, end)の球とセルの組を作って整列する
+static void collectPairs(
+    UniformGrid *grid, CompiledScene *compiled, const std::vector<int> &slots, size_t begin,
+    size_t end, std::vector<GridPair> *pairs)
+{
+    for (size_t k = begin; k < end; k++)
+    {
+        CompiledSphere *sphere = &compiled->spheres[slots[k]];
+        int low[3], high[3];
+        float center[3] = {sphere->center.x, sphere->center.y, sphere->center.z};
+        float origin[3] = {grid->boundsMin.x, grid->boundsMin.y, grid->boundsMin.z};
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float offset = center[axis] - origin[axis];
+            low[axis] = clampCell((int)floorf((offset - sphere->radius) * grid->inverseCellSize),
+                                  grid->resolution[axis]);
+            high[axis] = clampCell((int)floorf((offset + sphere->radius) * grid->inverseCellSize),
+                                   grid->resolution[axis]);
+        }
+        for (int z = low[2]; z <= high[2]; z++)
+            for (int y = low[1]; y <= high[1]; y++)
+                for (int x = low[0]; x <= high[0]; x++)
+                {
+                    if (sphereOverlapsCell(grid, sphere, x, y, z))
+                        pairs->push_back(GridPair(cellNumber(grid, x, y, z), slots[k]));
+                }
+    }
+    std::sort(pairs->begin(), pairs->end());
+}
+
+UniformGrid *buildUniformGrid(CompiledScene *compiled, const UniformGridOption &option)
+{
+    size_t sphereNum = compiled->spheres.size();
+    if (sphereNum == 0)
+        return nullptr;
+    unsigned int workerNum = (option.workerNum == 0) ? 1 : option.workerNum;
+    float cellsPerSphere = (option.cellsPerSphere > 0.f) ? option.cellsPerSphere : 1.f;
+
+    UniformGrid *grid = new UniformGrid();
+
+    // 全球を囲む箱からセルの大きさを決め，大きすぎる球は格子に入れない
+    Vector3 low(FLT_MAX, FLT_MAX, FLT_MAX), high(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (auto &sphere : compiled->spheres)
+    {
+        low = Vector3(fminf(low.x, sphere.center.x - sphere.radius),
+                      fminf(low.y, sphere.center.y - sphere.radius),
+                      fminf(low.z, sphere.center.z - sphere.radius));
+        high = Vector3(fmaxf(high.x, sphere.center.x + sphere.radius),
+                       fmaxf(high.y, sphere.center.y + sphere.radius),
+                       fmaxf(high.z, sphere.center.z + sphere.radius));
+    }
+    float volume = fmaxf(high.x - low.x, 1e-6f) * fmaxf(high.y - low.y, 1e-6f) *
+                   fmaxf(high.z - low.z, 1e-6f);
+    float cellSize = cbrtf(volume / (cellsPerSphere * (float)sphereNum));
+
+    std::vector<int> slots;
+    low = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+    high = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (size_t slot = 0; slot < sphereNum; slot++)
+    {
+        CompiledSphere *sphere = &compiled->spheres[slot];
+        if (2.f * sphere->radius > UNIFORM_GRID_LARGE_CELLS * cellSize)
+        {
+            grid->largeSpheres.push_back((int)slot);
+            continue;
+        }
+        slots.push_back((int)slot);
+        low = Vector3(fminf(low.x, sphere->center.x - sphere->radius),
+                      fminf(low.y, sphere->center.y - sphere->radius),
+                      fminf(low.z, sphere->center.z - sphere->radius));
+        high = Vector3(fmaxf(high.x, sphere->center.x + sphere->radius),
+                       fmaxf(high.y, sphere->center.y + sphere->radius),
+                       fmaxf(high.z, sphere->center.z + sphere->radius));
+    }
+    if (slots.empty())
+    {
+        // すべて大きい球なら格子は空(毎回すべて判定する)
+        low = high = Vector3(0, 0, 0);
+    }
+
+    // 格子に入れる球を囲む箱でセルの大きさを決め直す(大きい球で箱が広がっていた場合)
+    float extent[3] = {high.x - low.x, high.y - low.y, high.z - low.z};
+    if (!slots.empty() && !grid->largeSpheres.empty())
+    {
+        volume = fmaxf(extent[0], 1e-6f) * fmaxf(extent[1], 1e-6f) * fmaxf(extent[2], 1e-6f);
+        cellSize = fminf(cellSize, cbrtf(volume / (cellsPerSphere * (float)slots.size())));
+    }
+
+    // 1軸のセル数が上限を超えないようにセルを大きくする
+    for (int axis = 0; axis < 3; axis++)
+        cellSize = fmaxf(cellSize, extent[axis] / UNIFORM_GRID_MAX_RESOLUTION);
+    if (!(cellSize > 0.f))
+        cellSize = 1.f;
+    grid->boundsMin = low;
+    grid->boundsMax = high;
+    grid->cellSize = cellSize;
+    grid->inverseCellSize = 1.f / cellSize;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int resolution = (int)ceilf(extent[axis] * grid->inverseCellSize);
+        if (resolution < 1)
+            resolution = 1;
+        if (resolution > UNIFORM_GRID_MAX_RESOLUTION)
+            resolution = UNIFORM_GRID_MAX_RESOLUTION;
+        grid->resolution[axis] = resolution;
+    }
+
+    // 球とセルの組をスレッドごとに作って整列する
+    if (workerNum > slots.size())
+        workerNum = slots.empty() ? 1 : (unsigned int)slots.size();
+    std::vector<std::vector<GridPair>> chunks(workerNum);
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < workerNum; i++)
+    {
+        size_t begin = slots.size() * i / workerNum;
+        size_t end = slots.size() * (i + 1) / workerNum;
+        threads.emplace_back(
+            collectPairs, grid, compiled, std::cref(slots), begin, end, &chunks[i]);
+    }
+    for (auto &t : threads)
+        t.join();
+
+    // 2つずつ並列にマージする
+    while (chunks.size() > 1)
+    {
+        size_t mergedNum = (chunks.size() + 1) / 2;
+        std::vector<std::vector<GridPair>> merged(mergedNum);
+        threads.clear();
+        for (size_t i = 0; i < mergedNum; i++)
+        {
+            if (2 * i + 1 == chunks.size())
+            {
+                merged[i].swap(chunks[2 * i]);
+                continue;
+            }
+            threads.emplace_back(
+                [&, i]()
+                {
+                    std::vector<GridPair> &a = chunks[2 * i];
+                    std::vector<GridPair> &b = chunks[2 * i + 1];
+                    merged[i].resize(a.size() + b.size());
+                    std::merge(a.begin(), a.end(), b.begin(), b.end(), merged[i].begin());
+                });
+        }
+        for (auto &t : threads)
+            t.join();
+        chunks.swap(merged);
+    }
+    std::vector<GridPair> &pairs = chunks[0];
+
+    // 空でないセルをハッシュ表に入れる(表の大きさは空でないセル数の2倍以上)
+    size_t occupied = 0;
+    for (size_t k = 0; k < pairs.size(); k++)
+    {
+        if (k == 0 || pairs[k].first != pairs[k - 1].first)
+            occupied++;
+    }
+    size_t tableSize = 1;
+    while (tableSize < occupied * 2)
+        tableSize <<= 1;
+    grid->cells.assign(tableSize, UniformGridCell{UNIFORM_GRID_EMPTY_KEY, 0, 0});
+    grid->cellMask = tableSize - 1;
+    grid->occupiedCells = occupied;
+    grid->items.resize(pairs.size());
+    for (size_t k = 0; k < pairs.size();)
+    {
+        size_t end = k;
+        while (end < pairs.size() && pairs[end].first == pairs[k].first)
+        {
+            grid->items[end] = pairs[end].second;
+            end++;
+        }
+        uint64_t idx = hashCellKey(pairs[k].first) & grid->cellMask;
+        while (grid->cells[idx].key != UNIFORM_GRID_EMPTY_KEY)
+            idx = (idx + 1) & grid->cellMask;
+        grid->cells[idx] = UniformGridCell{pairs[k].first, (uint32_t)k, (uint32_t)(end - k)};
+        k = end;
+    }
+
+    recordMemoryAllocation(MEMORY_SCENE, uniformGridBytes(grid));
+    return grid;
+}
+
+void freeUniformGrid(UniformGrid *grid)
+{
+    recordMemoryRelease(MEMORY_SCENE, uniformGridBytes(grid));
+    delete grid;
+}
+
+size_t uniformGridBytes(UniformGrid *grid)
+{
+    return sizeof(UniformGrid) + grid->cells.capacity() * sizeof(UniformGridCell) +
+           grid->items.capacity() * sizeof(int) + grid->largeSpheres.capacity() * sizeof(int);
+}
+
+bool beginUniformGridWalk(UniformGrid *grid, Ray *ray, UniformGridWalk *walk)
+{
+    if (grid->items.empty())
+        return false;
+
+    // レイと箱の交差区間(スラブ法)
+    float origin[3] = {ray->startPoint.x, ray->startPoint.y, ray->startPoint.z};
+    float direction[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+    float low[3] = {grid->boundsMin.x, grid->boundsMin.y, grid->boundsMin.z};
+    float high[3] = {grid->boundsMax.x, grid->boundsMax.y, grid->boundsMax.z};
+    float tNear = 0.f, tFar = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (direction[axis] == 0.f)
+        {
+            if (origin[axis] < low[axis] || origin[axis] > high[axis])
+                return false;
+            continue;
+        }
+        float inverse = 1.f / direction[axis];
+        float t0 = (low[axis] - origin[axis]) * inverse;
+        float t1 = (high[axis] - origin[axis]) * inverse;
+        if (t0 > t1)
+            std::swap(t0, t1);
+        tNear = fmaxf(tNear, t0);
+        tFar = fminf(tFar, t1);
+    }
+    if (tNear > tFar)
+        return false;
+
+    // 箱に入るセルと各軸の次の境界
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float p = origin[axis] + tNear * direction[axis];
+        walk->cell[axis] = clampCell(
+            (int)floorf((p - low[axis]) * grid->inverseCellSize), grid->resolution[axis]);
+        if (direction[axis] > 0.f)
+        {
+            walk->step[axis] = 1;
+            float boundary = low[axis] + (walk->cell[axis] + 1) * grid->cellSize;
+            walk->tMax[axis] = (boundary - origin[axis]) / direction[axis];
+            walk->tDelta[axis] = grid->cellSize / direction[axis];
+        }
+        else if (direction[axis] < 0.f)
+        {
+            walk->step[axis] = -1;
+            float boundary = low[axis] + walk->cell[axis] * grid->cellSize;
+            walk->tMax[axis] = (boundary - origin[axis]) / direction[axis];
+            walk->tDelta[axis] = -grid->cellSize / direction[axis];
+        }
+        else
+        {
+            walk->step[axis] = 0;
+            walk->tMax[axis] = FLT_MAX;
+            walk->tDelta[axis] = FLT_MAX;
+        }
+    }
+    walk->tEntry = tNear;
+    walk->directionLength = sqrtf(
+        direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+    walk->done = false;
+    return true;
+}
+
+bool nextUniformGridCell(
+    UniformGrid *grid, UniformGridWalk *walk, const int **items, uint32_t *count,
+    float *entryDistance, float *exitDistance)
+{
+    if (walk->done)
+        return false;
+
+    // 現在のセルの球
+    uint64_t key = cellNumber(grid, walk->cell[0], walk->cell[1], walk->cell[2]);
+    uint64_t idx = hashCellKey(key) & grid->cellMask;
+    *count = 0;
+    for (;;)
+    {
+        UniformGridCell *cell = &grid->cells[idx];
+        if (cell->key == key)
+        {
+            *items = grid->items.data() + cell->begin;
+            *count = cell->count;
+            break;
+        }
+        if (cell->key == UNIFORM_GRID_EMPTY_KEY)
+            break;
+        idx = (idx + 1) & grid->cellMask;
+    }
+
+    // 次のセルへ進む(最も近い境界の軸)
+    int axis = 0;
+    if (walk->tMax[1] < walk->tMax[axis])
+        axis = 1;
+    if (walk->tMax[2] < walk->tMax[axis])
+        axis = 2;
+    float tExit = walk->tMax[axis];
+    *entryDistance = walk->tEntry * walk->directionLength;
+    *exitDistance = tExit * walk->directionLength;
+
+    walk->cell[axis] += walk->step[axis];
+    if (walk->cell[axis] < 0 || walk->cell[axis] >= grid->resolution[axis])
+        walk->done = true;
+    walk->tEntry = tExit;
+    walk->tMax[axis] += walk->tDelta[axis];
+    return true;
+}
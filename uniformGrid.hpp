@@ -0,0 +1,68 @@
+/* 球をまとめる一様格子(空でないセルだけをハッシュ表に持つ)と3D-DDAによる走査 */
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "raytracing_lib.hpp"
+
+struct CompiledScene;
+
+#define UNIFORM_GRID_MAX_RESOLUTION 1024 // 1軸あたりのセル数の上限
+#define UNIFORM_GRID_LARGE_CELLS 8       // 直径がこのセル数を超える球は格子に入れずに毎回判定する
+#define UNIFORM_GRID_EMPTY_KEY UINT64_MAX
+
+struct UniformGridOption
+{
+    float cellsPerSphere = 2.f; // 格子の範囲のセル数/球の数(セルの大きさを決める)
+    unsigned int workerNum = 1; // 構築に使うスレッド数
+};
+
+// 空でないセル
+struct UniformGridCell
+{
+    uint64_t key;   // セル番号(x + rx*(y + ry*z))．UNIFORM_GRID_EMPTY_KEYなら空き
+    uint32_t begin; // itemsの先頭
+    uint32_t count; // 球の数
+};
+
+struct UniformGrid
+{
+    Vector3 boundsMin, boundsMax; // 格子に入れた球を囲む箱
+    float cellSize;
+    float inverseCellSize;
+    int resolution[3];
+
+    std::vector<UniformGridCell> cells; // 開番地法のハッシュ表(大きさは2の累乗)
+    uint64_t cellMask;
+    std::vector<int> items;             // セルごとに並べた球(CompiledScene::spheresの添字)
+    std::vector<int> largeSpheres;      // 格子に入れなかった球
+    size_t occupiedCells;               // 空でないセルの数
+};
+
+// compiled->spheresから格子を作る(球がなければnullptr)
+// 球とセルの組をスレッドごとに作って整列し，並列にマージしてからハッシュ表に入れる
+UniformGrid *buildUniformGrid(CompiledScene *compiled, const UniformGridOption &option);
+void freeUniformGrid(UniformGrid *grid);
+
+// 格子のメモリ使用量(バイト)
+size_t uniformGridBytes(UniformGrid *grid);
+
+// レイが通るセルを始点に近い順にたどる状態
+struct UniformGridWalk
+{
+    int cell[3];      // 現在のセル
+    int step[3];      // 各軸の進む向き(±1)
+    float tMax[3];    // 各軸で次のセル境界に着くレイのパラメータ
+    float tDelta[3];  // 各軸でセル1つ分進むパラメータ
+    float tEntry;     // 現在のセルに入ったパラメータ
+    float directionLength; // レイの方向ベクトルの長さ(パラメータから距離への換算)
+    bool done;
+};
+
+// 走査を始める(レイが格子の箱を通らなければfalse)
+bool beginUniformGridWalk(UniformGrid *grid, Ray *ray, UniformGridWalk *walk);
+
+// 次のセルに進み，そのセルの球と，レイの始点からセルに入る/出るまでの距離を返す
+// 箱を出たらfalse．球のないセルはcount=0で返す
+bool nextUniformGridCell(
+    UniformGrid *grid, UniformGridWalk *walk, const int **items, uint32_t *count,
+    float *entryDistance, float *exitDistance);